@@ -3,23 +3,97 @@
 //
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "rnnoise.h"
 
 #define FRAME_SIZE 480
 
+/*
+    整个文件读入内存后分段并行处理 (rnnoise_process_chunks), 每段先用前面 warmup_frames 帧预热
+    与逐帧处理一样, 第一帧的输出不保存
+*/
+static int denoise_parallel(FILE *f1, FILE *fout, int nchunks, int warmup_frames) {
+    size_t i, nsamples;
+    int ret = 0;
+    int nframes = 0, capacity = 0;
+    short *pcm = NULL;
+    float *in, *out;
+    while (1) {
+        if (nframes == capacity) {
+            short *tmp;
+            capacity = capacity ? 2 * capacity : 1024;
+            tmp = realloc(pcm, (size_t) capacity * FRAME_SIZE * sizeof(short));
+            if (!tmp) {
+                fprintf(stderr, "out of memory\n");
+                free(pcm);
+                return 1;
+            }
+            pcm = tmp;
+        }
+        if (fread(&pcm[(size_t) nframes * FRAME_SIZE], sizeof(short), FRAME_SIZE, f1) != FRAME_SIZE) break;
+        nframes++;
+    }
+    in = malloc((size_t) nframes * FRAME_SIZE * sizeof(float));
+    out = malloc((size_t) nframes * FRAME_SIZE * sizeof(float));
+    if (!in || !out) {
+        fprintf(stderr, "out of memory\n");
+        free(pcm);
+        free(in);
+        free(out);
+        return 1;
+    }
+    nsamples = (size_t) nframes * FRAME_SIZE;
+    for (i = 0; i < nsamples; i++) in[i] = pcm[i];
+    if (rnnoise_process_chunks(NULL, out, in, nframes, nchunks, warmup_frames) == 0) {
+        for (i = 0; i < nsamples; i++) pcm[i] = out[i];
+        if (nframes > 1)
+            fwrite(&pcm[FRAME_SIZE], sizeof(short), (size_t) (nframes - 1) * FRAME_SIZE, fout);
+    } else {
+        fprintf(stderr, "denoising failed (out of memory)\n");
+        ret = 1;
+    }
+    free(pcm);
+    free(in);
+    free(out);
+    return ret;
+}
+
 int main(int argc, char **argv) {
     int i;
     int first = 1; // 标记是否是第一帧pcm
+    int nchunks = -1; // 分段并行处理的段数, -1 表示逐帧处理, 0 表示每个线程一段
+    int warmup_ms = 2000; // 每段的预热时长
     float x[FRAME_SIZE];
     FILE *f1, *fout;
     DenoiseState *st;
-    st = rnnoise_create(NULL);
+    while (argc > 3 && argv[1][0] == '-') {
+        if (strcmp(argv[1], "-j") == 0) nchunks = atoi(argv[2]);
+        else if (strcmp(argv[1], "-w") == 0) warmup_ms = atoi(argv[2]);
+        else break;
+        argc -= 2;
+        argv += 2;
+    }
     if (argc != 3) {
-        fprintf(stderr, "usage: %s <noisy speech> <output denoised>\n", argv[0]);
+        fprintf(stderr, "usage: %s [-j <chunks>] [-w <warmup ms>] <noisy speech> <output denoised>\n", argv[0]);
+        fprintf(stderr, "  -j  split the file into chunks processed in parallel (0: one per thread)\n");
+        fprintf(stderr, "  -w  warm-up before each chunk in milliseconds (default 2000)\n");
         return 1;
     }
     f1 = fopen(argv[1], "rb");
     fout = fopen(argv[2], "wb");
+    if (!f1 || !fout) {
+        fprintf(stderr, "cannot open %s\n", f1 ? argv[2] : argv[1]);
+        return 1;
+    }
+    if (nchunks >= 0) {
+        // 一帧10ms
+        int ret = denoise_parallel(f1, fout, nchunks, warmup_ms / 10);
+        fclose(f1);
+        fclose(fout);
+        return ret;
+    }
+    st = rnnoise_create(NULL);
     while (1) {
         short tmp[FRAME_SIZE];
         fread(tmp, sizeof(short), FRAME_SIZE, f1); // 从文件流中读数据
@@ -63,6 +63,19 @@ RNNOISE_EXPORT DenoiseState *rnnoise_create(RNNModel *model);
  */
 RNNOISE_EXPORT void rnnoise_destroy(DenoiseState *st);
 
+/**
+ * Switch a DenoiseState to another model at the next frame boundary
+ *
+ * May be called from any thread while another thread is processing st. The
+ * state for the new model is allocated here; the processing thread only
+ * swaps a pointer before its next frame (or at the start of the next
+ * rnnoise_process_buffer() call). The GRU states carry over when both models
+ * have the same layer sizes, otherwise they start from zero. The previous
+ * state is freed by the next call or by rnnoise_destroy(). If model is NULL
+ * the default model is used. Returns 0 on success, -1 if out of memory.
+ */
+RNNOISE_EXPORT int rnnoise_set_model(DenoiseState *st, RNNModel *model);
+
 /**
  * Denoise a frame of samples
  *
@@ -70,17 +83,408 @@ RNNOISE_EXPORT void rnnoise_destroy(DenoiseState *st);
  */
 RNNOISE_EXPORT float rnnoise_process_frame(DenoiseState *st, float *out, const float *in);
 
+/** Quality tiers of a DenoiseState, from the best and most expensive down */
+#define RNNOISE_TIER_FULL      0 /**< Full processing (the default) */
+#define RNNOISE_TIER_NO_PITCH  1 /**< Reuse the previous pitch period instead of searching */
+#define RNNOISE_TIER_HALF_RATE 2 /**< As NO_PITCH, and run the network every other frame */
+#define RNNOISE_TIER_VAD_ONLY  3 /**< As HALF_RATE, but pass the audio through undenoised */
+#define RNNOISE_TIER_BYPASS    4 /**< Pass the audio through, no analysis; returns the last VAD */
+#define RNNOISE_TIERS          5
+
+/**
+ * Trade quality for speed on a DenoiseState
+ *
+ * Takes effect from the next frame. The output keeps the same one-frame
+ * delay in every tier and switching between tiers does not cause
+ * discontinuities. Returns 0 on success, -1 if tier is not a RNNOISE_TIER_*.
+ */
+RNNOISE_EXPORT int rnnoise_set_tier(DenoiseState *st, int tier);
+
+/**
+ * Return the quality tier of a DenoiseState
+ */
+RNNOISE_EXPORT int rnnoise_get_tier(DenoiseState *st);
+
+/**
+ * Skip the network on stationary input
+ *
+ * When the mean squared difference between the features of a frame and
+ * those of the last frame the network was run on is below threshold, the
+ * gains and VAD of that frame are reused instead of running the network, for
+ * at most max_skip frames in a row. threshold = 0 (the default) always runs
+ * the network. Returns 0 on success, -1 on invalid arguments.
+ */
+RNNOISE_EXPORT int rnnoise_set_skipping(DenoiseState *st, float threshold, int max_skip);
+
+/**
+ * Denoise nframes consecutive frames of samples at once
+ *
+ * in and out must be at least nframes * rnnoise_get_frame_size() large and
+ * may point to the same buffer. The output is identical to calling
+ * rnnoise_process_frame() on each frame in turn, and st can be used with
+ * either function afterwards. The parts of the computation that do not
+ * depend on the previous frame (FFTs, pitch search, the layers that do not
+ * depend on GRU state) are done for many frames together, and in parallel
+ * when built with OpenMP.
+ *
+ * Returns 0 on success, -1 if the temporary buffers cannot be allocated.
+ */
+RNNOISE_EXPORT int rnnoise_process_buffer(DenoiseState *st, float *out, const float *in, int nframes);
+
+/**
+ * Denoise a whole recording by splitting it into chunks processed in parallel
+ *
+ * Each of the nchunks chunks gets a fresh DenoiseState using model (NULL for
+ * the default model). Before its chunk, each state is first run over the
+ * warmup_frames frames that precede the chunk and that output is discarded.
+ * The chunks join without seams, but the output only approximates a serial
+ * run; the difference shrinks as warmup_frames grows. The first chunk is
+ * always exact.
+ *
+ * in and out must be at least nframes * rnnoise_get_frame_size() large and
+ * must not overlap. If nchunks <= 0 one chunk per OpenMP thread is used.
+ * Without OpenMP the chunks are processed one after another.
+ *
+ * Returns 0 on success, -1 on allocation failure.
+ */
+RNNOISE_EXPORT int rnnoise_process_chunks(RNNModel *model, float *out, const float *in, int nframes, int nchunks,
+                                          int warmup_frames);
+
+typedef struct RNNoiseBatch RNNoiseBatch;
+
+/**
+ * Allocate the scratch memory to denoise up to max_frames streams at once
+ *
+ * The returned pointer MUST be freed with rnnoise_batch_destroy().
+ */
+RNNOISE_EXPORT RNNoiseBatch *rnnoise_batch_create(int max_frames);
+
+/**
+ * Free scratch memory produced by rnnoise_batch_create
+ */
+RNNOISE_EXPORT void rnnoise_batch_destroy(RNNoiseBatch *batch);
+
+/**
+ * Make room in batch for streams that use model (NULL for the built-in one)
+ *
+ * Call it before such streams go through rnnoise_process_batch(), and not
+ * concurrently with it on the same batch. Returns 0 on success, -1 on
+ * allocation failure.
+ */
+RNNOISE_EXPORT int rnnoise_batch_reserve(RNNoiseBatch *batch, RNNModel *model);
+
+/**
+ * Denoise one frame of each of n different streams
+ *
+ * st[i] must all be distinct. out[i] and in[i] are frames of
+ * rnnoise_get_frame_size() samples and vad[i] receives the voice activity
+ * probability. The output is identical to calling rnnoise_process_frame() on
+ * each stream. Streams that share a model loaded from a file evaluate the
+ * layers that do not depend on GRU state together, if rnnoise_batch_reserve()
+ * made room for their model; otherwise they are evaluated one by one, with
+ * the same result. This function never allocates.
+ *
+ * Returns 0 on success, -1 if n exceeds the size given to rnnoise_batch_create().
+ */
+RNNOISE_EXPORT int rnnoise_process_batch(RNNoiseBatch *batch, DenoiseState **st, float **out, const float **in,
+                                         float *vad, int n);
+
+typedef struct RNNoiseRing RNNoiseRing;
+
+/** Sample formats of an RNNoiseRing */
+#define RNNOISE_RING_FLOAT 0
+#define RNNOISE_RING_INT16 1
+
+/**
+ * Create a lock-free single-producer/single-consumer ring of samples
+ *
+ * format is RNNOISE_RING_FLOAT or RNNOISE_RING_INT16 and the capacity is
+ * nframes * rnnoise_get_frame_size() samples. One thread may write and
+ * another read concurrently without locking. The consumer always takes whole
+ * frames, so a readable frame is contiguous in memory and a float ring can be
+ * passed directly to rnnoise_process_frame().
+ *
+ * The returned pointer MUST be freed with rnnoise_ring_destroy().
+ */
+RNNOISE_EXPORT RNNoiseRing *rnnoise_ring_create(int format, int nframes);
+
+/**
+ * Free a ring. Neither side may use it any more.
+ */
+RNNOISE_EXPORT void rnnoise_ring_destroy(RNNoiseRing *ring);
+
+/**
+ * Return the number of samples that can currently be read
+ */
+RNNOISE_EXPORT int rnnoise_ring_available(RNNoiseRing *ring);
+
+/**
+ * Producer: copy up to n samples into the ring
+ *
+ * Returns the number of samples written, which is less than n if the ring is
+ * full.
+ */
+RNNOISE_EXPORT int rnnoise_ring_write(RNNoiseRing *ring, const void *samples, int n);
+
+/**
+ * Producer: return the contiguous free space at the write position
+ *
+ * *n is set to the number of samples that can be written there (NULL is
+ * returned when the ring is full). Fill up to *n samples in place, then call
+ * rnnoise_ring_write_commit().
+ */
+RNNOISE_EXPORT void *rnnoise_ring_write_peek(RNNoiseRing *ring, int *n);
+
+/**
+ * Producer: publish n samples written in place after rnnoise_ring_write_peek()
+ */
+RNNOISE_EXPORT void rnnoise_ring_write_commit(RNNoiseRing *ring, int n);
+
+/**
+ * Consumer: return the oldest frame of rnnoise_get_frame_size() samples
+ *
+ * The frame is contiguous and stays valid until rnnoise_ring_read_commit().
+ * Returns NULL if less than a frame is available.
+ */
+RNNOISE_EXPORT const void *rnnoise_ring_read_peek(RNNoiseRing *ring);
+
+/**
+ * Consumer: release the frame returned by rnnoise_ring_read_peek()
+ */
+RNNOISE_EXPORT void rnnoise_ring_read_commit(RNNoiseRing *ring);
+
+typedef struct RNNoiseEngine RNNoiseEngine;
+
+/**
+ * Called by an engine worker thread for every denoised frame
+ *
+ * out holds rnnoise_get_frame_size() samples and is only valid during the
+ * call. Frames of one stream are delivered in the order they were pushed,
+ * never concurrently, but possibly from different worker threads.
+ */
+typedef void (*rnnoise_engine_callback)(void *user, int stream, const float *out, float vad);
+
+/**
+ * Create a multi-stream engine with a pool of worker threads
+ *
+ * nthreads workers are started (one per online CPU if nthreads <= 0) and, on
+ * Linux, worker i is pinned to CPU i modulo the CPU count. Up to max_streams
+ * streams can be registered, each buffering up to queue_frames frames
+ * (rounded up to a power of two). A stream is scheduled on its home worker
+ * when a frame is pushed and idle workers steal streams from busy ones.
+ *
+ * If callback is NULL, denoised frames are queued per stream and must be
+ * collected with rnnoise_engine_pull(); otherwise callback is invoked for
+ * every frame.
+ *
+ * The returned pointer MUST be freed with rnnoise_engine_destroy().
+ */
+RNNOISE_EXPORT RNNoiseEngine *rnnoise_engine_create(int nthreads, int max_streams, int queue_frames,
+                                                    rnnoise_engine_callback callback, void *user);
+
+/**
+ * Stop the workers and free the engine and all streams still registered
+ *
+ * Frames not yet processed are dropped.
+ */
+RNNOISE_EXPORT void rnnoise_engine_destroy(RNNoiseEngine *engine);
+
+/**
+ * Register a stream with its own DenoiseState
+ *
+ * If model is NULL the default model is used. All memory for the stream is
+ * allocated here, none when pushing or pulling frames.
+ *
+ * Returns the stream id, or -1 if there is no free slot or no memory.
+ */
+RNNOISE_EXPORT int rnnoise_engine_add_stream(RNNoiseEngine *engine, RNNModel *model);
+
+/**
+ * Unregister a stream, dropping its pending frames
+ *
+ * Blocks until no worker uses the stream any more. The stream must not be
+ * pushed to or pulled from during or after the call.
+ */
+RNNOISE_EXPORT void rnnoise_engine_remove_stream(RNNoiseEngine *engine, int stream);
+
+/**
+ * Queue one frame of rnnoise_get_frame_size() samples for a stream
+ *
+ * The samples are copied. Only one thread at a time may push to a given
+ * stream. Returns 0 on success, -1 if the stream's queue is full.
+ */
+RNNOISE_EXPORT int rnnoise_engine_push(RNNoiseEngine *engine, int stream, const float *in);
+
+/**
+ * Take the oldest denoised frame of a stream (engines without a callback)
+ *
+ * Only one thread at a time may pull from a given stream. A stream whose
+ * output queue is full is not processed until frames are pulled. vad may be
+ * NULL. Returns 1 if a frame was written to out, 0 if none is ready.
+ */
+RNNOISE_EXPORT int rnnoise_engine_pull(RNNoiseEngine *engine, int stream, float *out, float *vad);
+
+/**
+ * Wait until every frame pushed so far has been processed
+ *
+ * Without a callback, a frame counts as processed once it is in the output
+ * queue, so the output queues must have room for all pending frames.
+ */
+RNNOISE_EXPORT void rnnoise_engine_flush(RNNoiseEngine *engine);
+
+/**
+ * Gather frames of different streams into batches
+ *
+ * A worker collects ready streams (one frame each) for up to window_us
+ * microseconds after the first one, or until it has max_batch of them, and
+ * then denoises them with rnnoise_process_batch(). The batch is dispatched
+ * early if waiting longer would make its oldest frame miss deadline_us,
+ * counted from rnnoise_engine_push(), given the measured processing time.
+ * max_batch = 1 (the default) processes streams frame by frame; deadline_us
+ * (10000 by default) is then only used for the statistics.
+ *
+ * Must be called before any stream is added. Returns 0 on success, -1 on
+ * invalid arguments, if streams have already been added, or on allocation
+ * failure (the engine then keeps processing frame by frame).
+ */
+RNNOISE_EXPORT int rnnoise_engine_set_batching(RNNoiseEngine *engine, int max_batch, int window_us, int deadline_us);
+
+/** Scheduling statistics of an engine since it was created */
+typedef struct {
+    long batches;          /**< Batches processed (single frames count as batches of one) */
+    long frames;           /**< Frames processed */
+    float occupancy;       /**< Mean batch size divided by the maximum batch size */
+    long early_flushes;    /**< Batches dispatched before the window ended to meet a deadline */
+    long deadline_misses;  /**< Frames finished after their deadline */
+    float mean_slack_ms;   /**< Mean time left before the deadline when a frame finished */
+    float min_slack_ms;    /**< Smallest such time, negative if a deadline was missed */
+    float mean_frame_us;   /**< Mean processing time per frame */
+    float load;            /**< Share of the workers' time needed by the frames pushed in the last governor period */
+    long tier_changes;     /**< Tier steps made by the governor */
+    int tier_streams[RNNOISE_TIERS]; /**< Streams currently in each quality tier */
+} RNNoiseEngineStats;
+
+/**
+ * Read the scheduling statistics, summed over all workers
+ */
+RNNOISE_EXPORT void rnnoise_engine_get_stats(RNNoiseEngine *engine, RNNoiseEngineStats *stats);
+
+/**
+ * Keep the processing time of the engine under a CPU budget
+ *
+ * budget is the fraction of the worker threads' time that may be spent
+ * processing (e.g. 0.8 for 80%), measured every period_ms. When the load goes
+ * over the budget the governor steps streams down through the RNNOISE_TIER_*
+ * quality tiers, lowest priority first, instead of letting frames miss their
+ * deadlines. Once the load has stayed below budget - hysteresis for several
+ * periods it steps them back up, highest priority first.
+ *
+ * budget = 0 (the default) turns the governor off and restores every stream
+ * to RNNOISE_TIER_FULL. Returns 0 on success, -1 on invalid arguments.
+ */
+RNNOISE_EXPORT int rnnoise_engine_set_governor(RNNoiseEngine *engine, float budget, float hysteresis, int period_ms);
+
+/**
+ * Set the priority of a stream for the governor (0 by default)
+ *
+ * Streams with a lower priority are degraded first and restored last.
+ */
+RNNOISE_EXPORT void rnnoise_engine_set_priority(RNNoiseEngine *engine, int stream, int priority);
+
+/**
+ * Return the quality tier the governor has currently given a stream
+ */
+RNNOISE_EXPORT int rnnoise_engine_get_tier(RNNoiseEngine *engine, int stream);
+
+/**
+ * Switch a stream, or all streams if stream < 0, to another model
+ *
+ * See rnnoise_set_model(); the streams keep running and change model before
+ * their next frame. Returns 0 on success, -1 if out of memory.
+ */
+RNNOISE_EXPORT int rnnoise_engine_set_model(RNNoiseEngine *engine, int stream, RNNModel *model);
+
+typedef struct RNNoisePipeline RNNoisePipeline;
+
+/**
+ * Pipeline one stream across two cores
+ *
+ * A dedicated thread (pinned to cpu unless cpu < 0) runs the high-pass
+ * filter and feature extraction of the next frame while the thread calling
+ * rnnoise_pipeline_pull() runs the network, gains and synthesis of the
+ * current one. When frames are pushed ahead of pulling, each frame takes
+ * about the longer of the two stages instead of their sum. The output is
+ * identical to calling rnnoise_process_frame() on st, with no extra delay.
+ *
+ * st is used by the pipeline until rnnoise_pipeline_destroy(); it must not be
+ * processed or have its tier or skipping changed in the meantime. Up to
+ * queue_frames frames may be pushed and not yet pulled. The returned pointer
+ * MUST be freed with rnnoise_pipeline_destroy(), which does not free st.
+ */
+RNNOISE_EXPORT RNNoisePipeline *rnnoise_pipeline_create(DenoiseState *st, int queue_frames, int cpu);
+
+/**
+ * Stop the feature thread and free a pipeline; frames not pulled are dropped
+ */
+RNNOISE_EXPORT void rnnoise_pipeline_destroy(RNNoisePipeline *pipeline);
+
+/**
+ * Queue a frame of rnnoise_get_frame_size() samples
+ *
+ * One thread may push while another pulls. Returns 0 on success, -1 if
+ * queue_frames frames are already waiting.
+ */
+RNNOISE_EXPORT int rnnoise_pipeline_push(RNNoisePipeline *pipeline, const float *in);
+
+/**
+ * Finish the oldest pushed frame on the calling thread
+ *
+ * Waits for its features if the feature thread is not done with them yet.
+ * Returns 1 with the frame in out (and the voice activity probability in
+ * vad if not NULL), or 0 if no pushed frame is pending.
+ */
+RNNOISE_EXPORT int rnnoise_pipeline_pull(RNNoisePipeline *pipeline, float *out, float *vad);
+
 /**
  * Load a model from a file
  *
- * It must be deallocated with rnnoise_model_free()
+ * Both the text format and the binary format of rnnoise_model_write_binary()
+ * are accepted. It must be deallocated with rnnoise_model_free()
  */
 RNNOISE_EXPORT RNNModel *rnnoise_model_from_file(FILE *f);
 
+/**
+ * Use a binary model held in memory
+ *
+ * The weights are used in place: the buffer must be 16-byte aligned and stay
+ * valid, unmodified, until the model is released (see rnnoise_model_free()),
+ * which does not free the buffer. Returns NULL if the header, the tensor table or the
+ * checksum is invalid, or on big-endian hosts.
+ */
+RNNOISE_EXPORT RNNModel *rnnoise_model_from_buffer(const void *data, size_t size);
+
+/**
+ * Map a binary model file read-only and use its weights in place
+ *
+ * Processes mapping the same file share one physical copy of the weights.
+ * The mapping is released by rnnoise_model_free().
+ */
+RNNOISE_EXPORT RNNModel *rnnoise_model_mmap(const char *path);
+
+/**
+ * Write a model in the binary format
+ *
+ * Tensors are 64-byte aligned in the file. If model is NULL the default model
+ * is written. Returns 0 on success, -1 on error.
+ */
+RNNOISE_EXPORT int rnnoise_model_write_binary(const RNNModel *model, FILE *f);
+
 /**
  * Free a custom model
  *
- * It must be called after all the DenoiseStates referring to it are freed.
+ * Models loaded by rnnoise_model_from_file(), rnnoise_model_from_buffer() or
+ * rnnoise_model_mmap() are reference counted: they may be freed while
+ * DenoiseStates still use them, and are released with the last of them.
  */
 RNNOISE_EXPORT void rnnoise_model_free(RNNModel *model);
 
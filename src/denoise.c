@@ -14,6 +14,11 @@
 #include "rnn.h"
 #include "rnnoise.h"
 #include "rnn_data.h"
+#include "denoise.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #define FRAME_SIZE_SHIFT 2
 #define FRAME_SIZE (120<<FRAME_SIZE_SHIFT) /* FRAME_SIZE = 480 */
@@ -27,6 +32,9 @@
 
 #define SQUARE(x) ((x)*(x))
 
+/* 省掉基音搜索的档位下仍然每隔这么多帧搜索一次, 基音周期不会一直停在旧的值 */
+#define PITCH_REFRESH 4
+
 #define NB_BANDS 22
 
 #define CEPS_MEM 8
@@ -73,7 +81,18 @@ struct DenoiseState {
     int last_period;
     float mem_hp_x[2]; // 计算biquad的中间过程
     float lastg[NB_BANDS];
-    RNNState rnn;
+    int tier;                   // 质量档位 RNNOISE_TIER_*
+    int reuse_gains;            // 隔帧算网络的档位下, 这一帧沿用上一次网络的输出
+    int pitch_skip;             // 省掉基音搜索的档位下, 距上一次搜索的帧数
+    float last_rnn_g[NB_BANDS]; // 上一次网络输出的增益
+    float last_vad;
+    float skip_threshold;       // 平稳输入时跳过网络的门限, 0 表示不跳过
+    int skip_max;               // 最多连续跳过的帧数
+    int skipped;                // 已经连续跳过的帧数
+    float skip_ref[NB_FEATURES]; // 上一次算网络的帧的特征
+    RNNState *rnn;
+    _Atomic(RNNState *) next_rnn;    // rnnoise_set_model 准备好的新模型的状态, 在帧的边界换上
+    _Atomic(RNNState *) retired_rnn; // 换下来的状态的链表, 由下一次 rnnoise_set_model 或 rnnoise_destroy 释放
 };
 
 /*!
@@ -271,50 +290,89 @@ int rnnoise_get_frame_size() {
 
 int rnnoise_init(DenoiseState *st, RNNModel *model) {
     memset(st, 0, sizeof(*st));
-    if (model)
-        st->rnn.model = model;
-    else
-        st->rnn.model = &rnnoise_model_orig;
-    st->rnn.vad_gru_state = calloc(sizeof(float), st->rnn.model->vad_gru_size);
-    st->rnn.noise_gru_state = calloc(sizeof(float), st->rnn.model->noise_gru_size);
-    st->rnn.denoise_gru_state = calloc(sizeof(float), st->rnn.model->denoise_gru_size);
-    return 0;
+    check_init(); // 在创建状态时初始化, 多个线程同时处理不同的状态时不会同时初始化
+    // 各层的激活值和GRU状态按模型的大小一次性分配
+    st->rnn = rnn_state_create(model ? model : &rnnoise_model_orig);
+    return st->rnn ? 0 : -1;
 }
 
 DenoiseState *rnnoise_create(RNNModel *model) {
     DenoiseState *st;
     st = malloc(rnnoise_get_size());
-    rnnoise_init(st, model);
+    if (st && rnnoise_init(st, model) != 0) {
+        free(st);
+        return NULL;
+    }
     return st;
 }
 
+/* 释放 retired_rnn 链表上所有换下来的状态 */
+static void free_retired(DenoiseState *st) {
+    RNNState *rnn = atomic_exchange(&st->retired_rnn, NULL);
+    while (rnn) {
+        RNNState *next = rnn->retired_next;
+        rnn_state_destroy(rnn);
+        rnn = next;
+    }
+}
+
 void rnnoise_destroy(DenoiseState *st) {
-    free(st->rnn.vad_gru_state);
-    free(st->rnn.noise_gru_state);
-    free(st->rnn.denoise_gru_state);
+    rnn_state_destroy(st->rnn);
+    rnn_state_destroy(atomic_load(&st->next_rnn));
+    free_retired(st);
     free(st);
 }
 
+/*
+    换模型按 RCU 的方式进行: rnnoise_set_model 在调用者的线程里为新模型分配好状态, 原子地放到 next_rnn;
+    处理的线程在帧的边界 (adopt_model) 取走它换上, 把旧的状态挂到 retired_rnn 链表上, 此后处理的线程不再访问旧状态,
+    下一次 rnnoise_set_model 或 rnnoise_destroy 再释放. 处理的线程不分配也不释放内存, 也不等待
+*/
+int rnnoise_set_model(DenoiseState *st, RNNModel *model) {
+    RNNState *next = rnn_state_create(model ? model : &rnnoise_model_orig);
+    if (!next)
+        return -1;
+    free_retired(st);
+    // 上一次设置的模型还没换上时直接被这一次取代
+    rnn_state_destroy(atomic_exchange(&st->next_rnn, next));
+    return 0;
+}
+
+static void adopt_model(DenoiseState *st) {
+    RNNState *next, *old, *head;
+    if (!atomic_load_explicit(&st->next_rnn, memory_order_relaxed))
+        return;
+    next = atomic_exchange(&st->next_rnn, NULL);
+    if (!next)
+        return;
+    old = st->rnn;
+    rnn_state_carry(next, old);
+    st->rnn = next;
+    // 释放状态可能释放或 munmap 模型, 不在处理的线程里做; 只有这里往链表里加, 其它地方整个取走
+    head = atomic_load(&st->retired_rnn);
+    do {
+        old->retired_next = head;
+    } while (!atomic_compare_exchange_weak(&st->retired_rnn, &head, old));
+}
+
 #if TRAINING
-int lowpass = FREQ_SIZE;
-int band_lp = NB_BANDS;
+/* 生成训练数据时模拟的低通截止频率, 每个生成线程各自随机, 所以是线程局部的 */
+static _Thread_local int lowpass = FREQ_SIZE;
 #endif
 
 /*!
- * 得到信号傅里叶系数及频带能量
- * @param st DenoiseState结构体
+ * 对上一帧和这一帧加窗后做FFT, 得到傅里叶系数及频带能量
  * @param X 输入信号傅里叶变换得到的复数 数组长度 FREQ_SIZE = 481
  * @param Ex 此帧各频带能量 数组长度 NB_BANDS = 22
- * @param in 抑制电源干扰后的信号帧 数组长度 FRAME_SIZE = 480
+ * @param prev 上一帧 数组长度 FRAME_SIZE = 480
+ * @param in 这一帧 数组长度 FRAME_SIZE = 480
  */
-static void frame_analysis(DenoiseState *st, kiss_fft_cpx *X, float *Ex, const float *in) {
+static void spectrum_analysis(kiss_fft_cpx *X, float *Ex, const float *prev, const float *in) {
     int i;
     float x[WINDOW_SIZE]; // 两帧 size=960
 
-    // 两个RNN_COPY实现了滑动窗口
-    RNN_COPY(x, st->analysis_mem, FRAME_SIZE);// 从 analysis_mem拷贝FRAME_SIZE个数据赋给x的前半段，analysis_mem是上一次的输入
+    RNN_COPY(x, prev, FRAME_SIZE);
     for (i = 0; i < FRAME_SIZE; i++) x[FRAME_SIZE + i] = in[i]; // 将输入数据赋给x的后半段
-    RNN_COPY(st->analysis_mem, in, FRAME_SIZE);  // 然后再将in拷贝给 analysis_mem
 
     apply_window(x); // 加窗后的x
     forward_transform(X, x); // X是x傅里叶变换后的系数
@@ -326,52 +384,73 @@ static void frame_analysis(DenoiseState *st, kiss_fft_cpx *X, float *Ex, const f
 }
 
 /*!
- * 计算单帧的特征
+ * 得到信号傅里叶系数及频带能量
  * @param st DenoiseState结构体
- * @param X 输入信号x傅里叶变换后的系数
- * @param P 基音周期pitch傅里叶变换系数
+ * @param X 输入信号傅里叶变换得到的复数 数组长度 FREQ_SIZE = 481
  * @param Ex 此帧各频带能量 数组长度 NB_BANDS = 22
- * @param Ep 基音周期pitch的频带能量计算
- * @param Exp 计算pitch时的相关系数
- * @param features 各特征系数
- * @param in 输入的单帧信号 数组长度 FRAME_SIZE=480
- * @return 是否静音帧
+ * @param in 抑制电源干扰后的信号帧 数组长度 FRAME_SIZE = 480
  */
-static int compute_frame_features(DenoiseState *st, kiss_fft_cpx *X, kiss_fft_cpx *P,
-                                  float *Ex, float *Ep, float *Exp, float *features, const float *in) {
-    int i;
-    float E = 0;
-    float *ceps_0, *ceps_1, *ceps_2;
-    float spec_variability = 0;
-    float Ly[NB_BANDS];
-    float p[WINDOW_SIZE];
-    float pitch_buf[PITCH_BUF_SIZE >> 1];
-    int pitch_index;
-    float gain;
+static void frame_analysis(DenoiseState *st, kiss_fft_cpx *X, float *Ex, const float *in) {
+    // analysis_mem是上一次的输入, 与这一帧一起实现了滑动窗口
+    spectrum_analysis(X, Ex, st->analysis_mem, in);
+    RNN_COPY(st->analysis_mem, in, FRAME_SIZE);  // 然后再将in拷贝给 analysis_mem
+}
+
+/*!
+ * 基音分析中只依赖这一段信号的部分: 降采样, 求自相关, 寻找基音周期
+ * @param pitch_ds 输出降采样后的信号 数组长度 PITCH_BUF_SIZE/2, 之后交给 remove_doubling
+ * @param pitch_index 输出基音周期
+ * @param pitch_buf 截止到这一帧的 PITCH_BUF_SIZE 个样点
+ */
+static void pitch_analysis(float *pitch_ds, int *pitch_index, const float *pitch_buf) {
     float *(pre[1]);
-    float tmp[NB_BANDS];
-    float follow, logMax;
-    frame_analysis(st, X, Ex, in); // 得到该帧in的傅里叶系数X和各频带能量Ex
-    RNN_MOVE(st->pitch_buf, &st->pitch_buf[FRAME_SIZE], PITCH_BUF_SIZE - FRAME_SIZE); // 也是从源src拷贝给dst n个字节数，不同的是，若src和dst内存有重叠，也能顺利拷贝
-    // pitch_buffer长度是1728，这里的意思是将其后面(1728 - 480)个数据放到最前面
-    RNN_COPY(&st->pitch_buf[PITCH_BUF_SIZE - FRAME_SIZE], in, FRAME_SIZE);
-    pre[0] = &st->pitch_buf[0];
+    pre[0] = (float *) pitch_buf;
     // pitch估计方法来自opus 中的 pitch.c
     /*
      * 降采样，对pitch_buf平滑降采样，求自相关，利用自相关求lpc系数，然后进行lpc滤波，即得到lpc残差
      */
-    pitch_downsample(pre, pitch_buf, PITCH_BUF_SIZE, 1);
-    // 寻找基音周期   存入pitch_index 
-    pitch_search(pitch_buf + (PITCH_MAX_PERIOD >> 1), pitch_buf, PITCH_FRAME_SIZE,
-                 PITCH_MAX_PERIOD - 3 * PITCH_MIN_PERIOD, &pitch_index);
-    pitch_index = PITCH_MAX_PERIOD - pitch_index;
+    pitch_downsample(pre, pitch_ds, PITCH_BUF_SIZE, 1);
+    // 寻找基音周期   存入pitch_index
+    pitch_search(pitch_ds + (PITCH_MAX_PERIOD >> 1), pitch_ds, PITCH_FRAME_SIZE,
+                 PITCH_MAX_PERIOD - 3 * PITCH_MIN_PERIOD, pitch_index);
+    *pitch_index = PITCH_MAX_PERIOD - *pitch_index;
+}
 
-    gain = remove_doubling(pitch_buf, PITCH_MAX_PERIOD, PITCH_MIN_PERIOD,
+/*!
+ * 去除高阶谐波影响, 依赖上一帧的基音周期和增益, 只能逐帧计算
+ */
+static int pitch_refine(DenoiseState *st, float *pitch_ds, int pitch_index) {
+    float gain;
+    gain = remove_doubling(pitch_ds, PITCH_MAX_PERIOD, PITCH_MIN_PERIOD,
                            PITCH_FRAME_SIZE, &pitch_index, st->last_period, st->last_gain);// 去除高阶谐波影响
     st->last_period = pitch_index;
-    st->last_gain = gain; // 根据index得到p[i]
+    st->last_gain = gain;
+    return pitch_index;
+}
+
+/*!
+ * 确定基音周期之后, 单帧特征中与前后帧无关的部分
+ * @param X 输入信号x傅里叶变换后的系数
+ * @param P 输出 基音周期pitch傅里叶变换系数
+ * @param Ex 此帧各频带能量
+ * @param Ep 输出 基音周期pitch的频带能量
+ * @param Exp 输出 计算pitch时的相关系数
+ * @param features 输出 除倒谱差分和谱稳度以外的特征
+ * @param pitch_buf 截止到这一帧的 PITCH_BUF_SIZE 个样点
+ * @param pitch_index 基音周期
+ * @return 此帧的总能量
+ */
+static float frame_pitch_features(const kiss_fft_cpx *X, kiss_fft_cpx *P, const float *Ex, float *Ep, float *Exp,
+                                  float *features, const float *pitch_buf, int pitch_index) {
+    int i;
+    float E = 0;
+    float Ly[NB_BANDS];
+    float p[WINDOW_SIZE];
+    float tmp[NB_BANDS];
+    float follow, logMax;
+    // 根据index得到p[i]
     for (i = 0; i < WINDOW_SIZE; i++)
-        p[i] = st->pitch_buf[PITCH_BUF_SIZE - WINDOW_SIZE - pitch_index + i];
+        p[i] = pitch_buf[PITCH_BUF_SIZE - WINDOW_SIZE - pitch_index + i];
     apply_window(p); // pitch数据应用window
     forward_transform(P, p); // 对pitch数据进行傅里叶变换
     compute_band_energy(Ep, P); // 计算pitch部分band能量
@@ -391,18 +470,25 @@ static int compute_frame_features(DenoiseState *st, kiss_fft_cpx *X, kiss_fft_cp
         follow = MAX16(follow - 1.5, Ly[i]);
         E += Ex[i];
     }
-    if (!TRAINING && E < 0.04) {
-        /* If there's no audio, avoid messing up the state. */
-        RNN_CLEAR(features, NB_FEATURES);
-        return 1;
-    }
     dct(features, Ly);      // 计算features
-     /*
+    features[0] -= 12;
+    features[1] -= 4;
+    return E;
+}
+
+/*!
+ * 倒谱的一阶/二阶差分和谱稳度, 依赖前几帧的倒谱(cepstral_mem), 只能逐帧计算
+ * @param st DenoiseState结构体
+ * @param features 输入 frame_pitch_features 的结果, 输出完整的特征
+ */
+static void frame_cepstral_features(DenoiseState *st, float *features) {
+    int i;
+    float *ceps_0, *ceps_1, *ceps_2;
+    float spec_variability = 0;
+    /*
      * cepstral_mem是一个8*22的数组，每一次feature里的值填充到ceps_0,然后这个数组会往下再做一次。
      * ceps_0是float指针，它指向的是ceptral_mem第一个NB_BANDS数组，然后每次与相邻的band数组相见，做出一个delta差值。
      */
-    features[0] -= 12;
-    features[1] -= 4;
     ceps_0 = st->cepstral_mem[st->memid];
     ceps_1 = (st->memid < 1) ? st->cepstral_mem[CEPS_MEM + st->memid - 1] : st->cepstral_mem[st->memid - 1];
     ceps_2 = (st->memid < 2) ? st->cepstral_mem[CEPS_MEM + st->memid - 2] : st->cepstral_mem[st->memid - 2];
@@ -435,10 +521,86 @@ static int compute_frame_features(DenoiseState *st, kiss_fft_cpx *X, kiss_fft_cp
     }
     //应该是最后一个特征谱稳度
     features[NB_BANDS + 3 * NB_DELTA_CEPS + 1] = spec_variability / CEPS_MEM - 2.1; // features[41] 特殊的非平稳值,用于检测语音
+}
 
+/*!
+ * 静音帧不更新倒谱的状态, 非静音帧补上倒谱差分和谱稳度
+ * @param st DenoiseState结构体
+ * @param features frame_pitch_features 的结果, 输出完整的特征
+ * @param E 此帧的总能量
+ * @return 是否静音帧
+ */
+static int finish_frame_features(DenoiseState *st, float *features, float E) {
+    if (!TRAINING && E < 0.04) {
+        /* If there's no audio, avoid messing up the state. */
+        RNN_CLEAR(features, NB_FEATURES);
+        return 1;
+    }
+    frame_cepstral_features(st, features);
     return TRAINING && E < 0.1;
 }
 
+/*!
+ * 已经得到这一帧的频谱之后的特征计算: 更新基音缓冲, 基音分析, 单帧特征和倒谱差分
+ * 参数同 compute_frame_features, X 和 Ex 为输入
+ */
+static int spectrum_frame_features(DenoiseState *st, const kiss_fft_cpx *X, kiss_fft_cpx *P,
+                                   const float *Ex, float *Ep, float *Exp, float *features, const float *in) {
+    float E;
+    float pitch_ds[PITCH_BUF_SIZE >> 1];
+    int pitch_index;
+    RNN_MOVE(st->pitch_buf, &st->pitch_buf[FRAME_SIZE], PITCH_BUF_SIZE - FRAME_SIZE); // 也是从源src拷贝给dst n个字节数，不同的是，若src和dst内存有重叠，也能顺利拷贝
+    // pitch_buffer长度是1728，这里的意思是将其后面(1728 - 480)个数据放到最前面
+    RNN_COPY(&st->pitch_buf[PITCH_BUF_SIZE - FRAME_SIZE], in, FRAME_SIZE);
+    if (st->tier >= RNNOISE_TIER_NO_PITCH && (st->pitch_skip = (st->pitch_skip + 1) % PITCH_REFRESH) != 0) {
+        pitch_index = st->last_period; // 省掉基音搜索, 沿用上一次的基音周期
+    } else {
+        pitch_analysis(pitch_ds, &pitch_index, st->pitch_buf);
+        pitch_index = pitch_refine(st, pitch_ds, pitch_index);
+    }
+    E = frame_pitch_features(X, P, Ex, Ep, Exp, features, st->pitch_buf, pitch_index);
+    return finish_frame_features(st, features, E);
+}
+
+/*!
+ * 计算单帧的特征
+ * @param st DenoiseState结构体
+ * @param X 输入信号x傅里叶变换后的系数
+ * @param P 基音周期pitch傅里叶变换系数
+ * @param Ex 此帧各频带能量 数组长度 NB_BANDS = 22
+ * @param Ep 基音周期pitch的频带能量计算
+ * @param Exp 计算pitch时的相关系数
+ * @param features 各特征系数
+ * @param in 输入的单帧信号 数组长度 FRAME_SIZE=480
+ * @return 是否静音帧
+ */
+static int compute_frame_features(DenoiseState *st, kiss_fft_cpx *X, kiss_fft_cpx *P,
+                                  float *Ex, float *Ep, float *Exp, float *features, const float *in) {
+    frame_analysis(st, X, Ex, in); // 得到该帧in的傅里叶系数X和各频带能量Ex
+    return spectrum_frame_features(st, X, P, Ex, Ep, Exp, features, in);
+}
+
+#if TRAINING
+/*!
+ * 训练时带噪信号 x + n 的特征: 加窗和FFT都是线性的, 带噪信号的频谱直接由 x 和 n 的频谱相加, 省掉一次FFT.
+ * 两者在 lowpass 以上都已清零, 相加后也一样; analysis_mem 照常更新, 与 compute_frame_features 只差浮点舍入
+ * @param Y 干净信号的傅里叶系数
+ * @param N 噪声的傅里叶系数
+ * @param in 带噪信号 x + n 数组长度 FRAME_SIZE=480
+ */
+static int compute_mixture_features(DenoiseState *st, kiss_fft_cpx *X, kiss_fft_cpx *P, float *Ex, float *Ep, float *Exp,
+                                    float *features, const kiss_fft_cpx *Y, const kiss_fft_cpx *N, const float *in) {
+    int i;
+    for (i = 0; i < FREQ_SIZE; i++) {
+        X[i].r = Y[i].r + N[i].r;
+        X[i].i = Y[i].i + N[i].i;
+    }
+    compute_band_energy(Ex, X);
+    RNN_COPY(st->analysis_mem, in, FRAME_SIZE);
+    return spectrum_frame_features(st, X, P, Ex, Ep, Exp, features, in);
+}
+#endif
+
 /*!
  * 语音帧合成
  * @param st DenoiseState结构体
@@ -523,6 +685,146 @@ void pitch_filter(kiss_fft_cpx *X, const kiss_fft_cpx *P, const float *Ex, const
     }
 }
 
+/*!
+ * 增益与上一帧的增益做平滑, 只能逐帧计算
+ * @param st DenoiseState结构体
+ * @param gs 输出 平滑后的增益
+ * @param g RNN输出的增益
+ */
+static void smooth_gains(DenoiseState *st, float *gs, const float *g) {
+    int i;
+    for (i = 0; i < NB_BANDS; i++) {
+        float alpha = .6f;
+        gs[i] = MAX16(g[i], alpha * st->lastg[i]);
+        st->lastg[i] = gs[i];
+    }
+}
+
+/*!
+ * 基音滤波后对每个频点施加增益
+ * @param g RNN输出的增益, 用于基音滤波
+ * @param gs 平滑后的增益
+ */
+static void apply_gains(kiss_fft_cpx *X, const kiss_fft_cpx *P, const float *Ex, const float *Ep, const float *Exp,
+                        const float *g, const float *gs) {
+    int i;
+    float gf[FREQ_SIZE] = {1};
+    pitch_filter(X, P, Ex, Ep, Exp, g);
+    interp_band_gain(gf, gs);
+#if 1
+    for (i = 0; i < FREQ_SIZE; i++) {
+        X[i].r *= gf[i];
+        X[i].i *= gf[i];
+    }
+#endif
+}
+
+static const float a_hp[2] = {-1.99599, 0.99600};
+static const float b_hp[2] = {-2, 1};
+
+/*!
+ * 输入平稳时跳过网络: 特征与上一次算网络的帧的均方差小于门限时沿用上一次网络的输出,
+ * 最多连续跳过 skip_max 帧, 之后强制重新计算
+ * @return 是否跳过这一帧
+ */
+static int skip_stationary(DenoiseState *st, const float *features) {
+    int i;
+    float dist = 0;
+    if (st->skip_threshold <= 0)
+        return 0;
+    for (i = 0; i < NB_FEATURES; i++)
+        dist += SQUARE(features[i] - st->skip_ref[i]);
+    if (st->skipped < st->skip_max && dist < st->skip_threshold * NB_FEATURES) {
+        st->skipped++;
+        return 1;
+    }
+    st->skipped = 0;
+    RNN_COPY(st->skip_ref, features, NB_FEATURES);
+    return 0;
+}
+
+/* 降档或者跳过网络时每帧的计算依赖上一帧的结果, 多帧一起处理的函数改为逐帧处理 */
+static int frame_by_frame(const DenoiseState *st) {
+    return st->tier != RNNOISE_TIER_FULL || st->skip_threshold > 0;
+}
+
+/* 一帧的中间结果, 逐帧处理时在栈上, 多帧一起处理时每帧一个 */
+typedef struct {
+    kiss_fft_cpx X[FREQ_SIZE];
+    kiss_fft_cpx P[FREQ_SIZE];
+    float Ex[NB_BANDS], Ep[NB_BANDS], Exp[NB_BANDS];
+    float pitch_ds[PITCH_BUF_SIZE >> 1];
+    int pitch_index;
+    float E;
+    int silence;
+    int bypass;       /* 直通档位, y 的前后两半是上一帧和这一帧高通滤波后的信号 */
+    float features[NB_FEATURES];
+    float g[NB_BANDS], gs[NB_BANDS];
+    float y[WINDOW_SIZE];
+} FrameState;
+
+/*!
+ * 单帧处理的前一段: 高通滤波和特征提取. 只读写分析部分的状态 (高通滤波, analysis_mem, pitch_buf, 倒谱, 基音周期)
+ * @param st DenoiseState结构体
+ * @param frame 输出 这一帧的中间结果
+ * @param in 输入帧数据
+ */
+void denoise_frame_front(DenoiseState *st, void *frame, const float *in) {
+    FrameState *fr = frame;
+    float x[FRAME_SIZE];
+    biquad(x, st->mem_hp_x, in, b_hp, a_hp, FRAME_SIZE); // high pass 高通滤波 抑制50Hz或60Hz的电源干扰
+    fr->bypass = st->tier >= RNNOISE_TIER_BYPASS;
+    if (fr->bypass) {
+        RNN_COPY(fr->y, st->analysis_mem, FRAME_SIZE);
+        RNN_COPY(&fr->y[FRAME_SIZE], x, FRAME_SIZE);
+        RNN_COPY(st->analysis_mem, x, FRAME_SIZE);
+        RNN_MOVE(st->pitch_buf, &st->pitch_buf[FRAME_SIZE], PITCH_BUF_SIZE - FRAME_SIZE);
+        RNN_COPY(&st->pitch_buf[PITCH_BUF_SIZE - FRAME_SIZE], x, FRAME_SIZE);
+        return;
+    }
+    fr->silence = compute_frame_features(st, fr->X, fr->P, fr->Ex, fr->Ep, fr->Exp, fr->features, x);
+}
+
+/*!
+ * 单帧处理的后一段: 网络, 增益和合成. 只读写网络和合成部分的状态, 与 denoise_frame_front 不重叠
+ * 直通档位的输出与增益为1时的分析/合成相同, 即延迟一帧的输入, 但不做FFT: 窗函数满足 w[i]^2 + w[N-1-i]^2 = 1,
+ * 重叠相加在时域直接算, 与其它档位之间切换时没有跳变
+ * @param st DenoiseState结构体
+ * @param frame denoise_frame_front 得到的中间结果
+ * @param out 输出帧数据
+ * @return vad_prob 语音活动检测范围(0,1), 0表示无话音
+ */
+float denoise_frame_back(DenoiseState *st, void *frame, float *out) {
+    FrameState *fr = frame;
+    int i;
+    float vad_prob = 0;
+    adopt_model(st);
+    if (fr->bypass) {
+        for (i = 0; i < FRAME_SIZE; i++)
+            out[i] = fr->y[i] * SQUARE(common.half_window[i]) + st->synthesis_mem[i];
+        for (i = 0; i < FRAME_SIZE; i++)
+            st->synthesis_mem[i] = fr->y[FRAME_SIZE + i] * SQUARE(common.half_window[FRAME_SIZE - 1 - i]);
+        return st->last_vad;
+    }
+    if (!fr->silence) { // 非静音帧
+        if ((st->tier >= RNNOISE_TIER_HALF_RATE && st->reuse_gains) || skip_stationary(st, fr->features)) {
+            RNN_COPY(fr->g, st->last_rnn_g, NB_BANDS);
+            vad_prob = st->last_vad;
+        } else {
+            compute_rnn(st->rnn, fr->g, &vad_prob, fr->features);
+            RNN_COPY(st->last_rnn_g, fr->g, NB_BANDS);
+        }
+        st->reuse_gains = st->tier >= RNNOISE_TIER_HALF_RATE && !st->reuse_gains;
+        if (st->tier < RNNOISE_TIER_VAD_ONLY) { // 只要VAD的档位不改变信号
+            smooth_gains(st, fr->gs, fr->g);
+            apply_gains(fr->X, fr->P, fr->Ex, fr->Ep, fr->Exp, fr->g, fr->gs);
+        }
+    }
+    frame_synthesis(st, out, fr->X);
+    st->last_vad = vad_prob;
+    return vad_prob;
+}
+
 /*!
  *
  * @param st DenoiseState结构体
@@ -531,190 +833,1192 @@ void pitch_filter(kiss_fft_cpx *X, const kiss_fft_cpx *P, const float *Ex, const
  * @return vad_prob 语音活动检测范围(0,1), 0表示无话音
  */
 float rnnoise_process_frame(DenoiseState *st, float *out, const float *in) {
-    int i;
-    kiss_fft_cpx X[FREQ_SIZE];
-    kiss_fft_cpx P[WINDOW_SIZE];
-    float x[FRAME_SIZE];
-    float Ex[NB_BANDS], Ep[NB_BANDS];
-    float Exp[NB_BANDS];
-    float features[NB_FEATURES];
-    float g[NB_BANDS];
-    float gf[FREQ_SIZE] = {1};
-    float vad_prob = 0;
-    int silence;
-    static const float a_hp[2] = {-1.99599, 0.99600};
-    static const float b_hp[2] = {-2, 1};
-    biquad(x, st->mem_hp_x, in, b_hp, a_hp, FRAME_SIZE); // high pass 高通滤波 抑制50Hz或60Hz的电源干扰
-    silence = compute_frame_features(st, X, P, Ex, Ep, Exp, features, x);
-
-    if (!silence) { // 非静音帧
-        compute_rnn(&st->rnn, g, &vad_prob, features);
-        pitch_filter(X, P, Ex, Ep, Exp, g);
-        for (i = 0; i < NB_BANDS; i++) {
-            float alpha = .6f;
-            g[i] = MAX16(g[i], alpha * st->lastg[i]);
-            st->lastg[i] = g[i];
+    FrameState fr;
+    denoise_frame_front(st, &fr, in);
+    return denoise_frame_back(st, &fr, out);
+}
+
+int denoise_frame_size(void) {
+    return sizeof(FrameState);
+}
+
+int rnnoise_set_tier(DenoiseState *st, int tier) {
+    if (tier < RNNOISE_TIER_FULL || tier > RNNOISE_TIER_BYPASS)
+        return -1;
+    st->tier = tier;
+    return 0;
+}
+
+int rnnoise_get_tier(DenoiseState *st) {
+    return st->tier;
+}
+
+int rnnoise_set_skipping(DenoiseState *st, float threshold, int max_skip) {
+    if (!(threshold >= 0) || max_skip < 0)
+        return -1;
+    st->skip_threshold = threshold;
+    st->skip_max = max_skip;
+    st->skipped = max_skip; // 下一帧一定计算网络, 作为比较的基准
+    return 0;
+}
+
+#ifdef _OPENMP
+#define PARALLEL_FOR _Pragma("omp parallel for")
+#else
+#define PARALLEL_FOR
+#endif
+
+/* rnnoise_process_buffer 每次最多处理的帧数, 限制中间结果占用的内存 */
+#define BUFFER_BLOCK_FRAMES 64
+
+typedef struct {
+    FrameState *frames;
+    float *x;         /* pitch_buf 加上这一段高通滤波后的信号 */
+    float *features;  /* 非静音帧的特征 */
+    float *batch;     /* compute_rnn_batch 的输出 */
+    int *active;      /* 非静音帧的序号 */
+} BufferState;
+
+/*!
+ * 多帧一起处理, 每一步的计算与 rnnoise_process_frame 完全相同, 只是顺序不同:
+ * 与前后帧无关的部分(FFT, 基音搜索, 特征, 与GRU状态无关的网络层, 增益和IFFT)对所有帧一起算(可以并行),
+ * 依赖上一帧的部分(高通滤波, 去倍频, 倒谱差分, GRU, 增益平滑, 重叠相加)逐帧计算
+ */
+static void process_block(DenoiseState *st, BufferState *buf, float *out, const float *in, int nframes) {
+    int t, k;
+    int nactive = 0;
+    float vad_prob;
+    float *x = buf->x;
+
+    // x 的前 PITCH_BUF_SIZE 个样点是之前的信号, 第 t 帧在 &x[PITCH_BUF_SIZE + t * FRAME_SIZE]
+    RNN_COPY(x, st->pitch_buf, PITCH_BUF_SIZE);
+    biquad(&x[PITCH_BUF_SIZE], st->mem_hp_x, in, b_hp, a_hp, nframes * FRAME_SIZE);
+
+    PARALLEL_FOR
+    for (t = 0; t < nframes; t++) {
+        FrameState *fr = &buf->frames[t];
+        const float *cur = &x[PITCH_BUF_SIZE + t * FRAME_SIZE];
+        // 上一帧就是 analysis_mem, 截止到这一帧的 PITCH_BUF_SIZE 个样点就是 pitch_buf
+        spectrum_analysis(fr->X, fr->Ex, cur - FRAME_SIZE, cur);
+        pitch_analysis(fr->pitch_ds, &fr->pitch_index, &x[(t + 1) * FRAME_SIZE]);
+    }
+    for (t = 0; t < nframes; t++) {
+        FrameState *fr = &buf->frames[t];
+        fr->pitch_index = pitch_refine(st, fr->pitch_ds, fr->pitch_index);
+    }
+    PARALLEL_FOR
+    for (t = 0; t < nframes; t++) {
+        FrameState *fr = &buf->frames[t];
+        fr->E = frame_pitch_features(fr->X, fr->P, fr->Ex, fr->Ep, fr->Exp, fr->features,
+                                     &x[(t + 1) * FRAME_SIZE], fr->pitch_index);
+    }
+    for (t = 0; t < nframes; t++) {
+        FrameState *fr = &buf->frames[t];
+        fr->silence = finish_frame_features(st, fr->features, fr->E);
+        if (!fr->silence) {
+            RNN_COPY(&buf->features[nactive * NB_FEATURES], fr->features, NB_FEATURES);
+            buf->active[nactive++] = t;
         }
-        interp_band_gain(gf, g);
-#if 1
-        for (i = 0; i < FREQ_SIZE; i++) {
-            X[i].r *= gf[i];
-            X[i].i *= gf[i];
+    }
+
+    // 与GRU状态无关的层对所有非静音帧一起算; 内置模型的特化代码本身更快, 累加顺序与之相同, 直接逐帧调用
+    if (!st->rnn->model->compute)
+        compute_rnn_batch(st->rnn, buf->batch, buf->features, nactive);
+    for (k = 0; k < nactive; k++) {
+        FrameState *fr = &buf->frames[buf->active[k]];
+        if (st->rnn->model->compute)
+            compute_rnn(st->rnn, fr->g, &vad_prob, fr->features);
+        else
+            compute_rnn_frame(st->rnn, fr->g, &vad_prob, &buf->batch[k * st->rnn->batch_size]);
+        // 与 denoise_frame_back 相同地记下网络的输出, 之后换到隔帧计算或直通的档位时接着用 (这里的档位一定是 FULL)
+        RNN_COPY(st->last_rnn_g, fr->g, NB_BANDS);
+        st->reuse_gains = 0;
+        st->last_vad = vad_prob;
+        smooth_gains(st, fr->gs, fr->g);
+    }
+    if (buf->frames[nframes - 1].silence)
+        st->last_vad = 0;
+
+    PARALLEL_FOR
+    for (t = 0; t < nframes; t++) {
+        FrameState *fr = &buf->frames[t];
+        if (!fr->silence)
+            apply_gains(fr->X, fr->P, fr->Ex, fr->Ep, fr->Exp, fr->g, fr->gs);
+        inverse_transform(fr->y, fr->X);
+        apply_window(fr->y);
+    }
+    for (t = 0; t < nframes; t++) {
+        FrameState *fr = &buf->frames[t];
+        int i;
+        for (i = 0; i < FRAME_SIZE; i++) out[t * FRAME_SIZE + i] = fr->y[i] + st->synthesis_mem[i];
+        RNN_COPY(st->synthesis_mem, &fr->y[FRAME_SIZE], FRAME_SIZE);
+    }
+
+    RNN_COPY(st->pitch_buf, &x[nframes * FRAME_SIZE], PITCH_BUF_SIZE);
+    RNN_COPY(st->analysis_mem, &x[PITCH_BUF_SIZE + (nframes - 1) * FRAME_SIZE], FRAME_SIZE);
+}
+
+int rnnoise_process_buffer(DenoiseState *st, float *out, const float *in, int nframes) {
+    int n;
+    int block = IMIN(nframes, BUFFER_BLOCK_FRAMES);
+    int ret = 0;
+    BufferState buf;
+    if (nframes <= 0)
+        return 0;
+    if (frame_by_frame(st)) {
+        for (n = 0; n < nframes; n++)
+            rnnoise_process_frame(st, &out[(size_t) n * FRAME_SIZE], &in[(size_t) n * FRAME_SIZE]);
+        return 0;
+    }
+    adopt_model(st); // 多帧一起处理时只在开始时换模型
+    check_init(); // 并行计算之前先初始化
+    buf.frames = malloc(block * sizeof(FrameState));
+    buf.x = malloc((PITCH_BUF_SIZE + block * FRAME_SIZE) * sizeof(float));
+    buf.features = malloc(block * NB_FEATURES * sizeof(float));
+    buf.batch = malloc(block * st->rnn->batch_size * sizeof(float));
+    buf.active = malloc(block * sizeof(int));
+    if (buf.frames && buf.x && buf.features && buf.batch && buf.active) {
+        for (n = 0; n < nframes; n += block)
+            process_block(st, &buf, &out[(size_t) n * FRAME_SIZE], &in[(size_t) n * FRAME_SIZE],
+                          IMIN(block, nframes - n));
+    } else {
+        ret = -1;
+    }
+    free(buf.frames);
+    free(buf.x);
+    free(buf.features);
+    free(buf.batch);
+    free(buf.active);
+    return ret;
+}
+
+/* rnnoise_process_batch 的中间结果, 每路流一帧 */
+struct RNNoiseBatch {
+    int max_frames;
+    FrameState *frames;
+    float *features;  /* 同一个模型的非静音帧的特征 */
+    float *batch;     /* compute_rnn_batch 的输出 */
+    int batch_size;   /* batch 中每帧能放下的数, 由 rnnoise_batch_reserve 扩大, 处理时不分配 */
+    int *active;      /* 非静音帧的序号, 算完网络后置为 -1 */
+    int *group;       /* 同一个模型的帧的序号 */
+};
+
+RNNoiseBatch *rnnoise_batch_create(int max_frames) {
+    RNNoiseBatch *b;
+    if (max_frames <= 0)
+        return NULL;
+    b = calloc(1, sizeof(*b));
+    if (!b)
+        return NULL;
+    b->max_frames = max_frames;
+    b->frames = malloc(max_frames * sizeof(FrameState));
+    b->features = malloc(max_frames * NB_FEATURES * sizeof(float));
+    b->active = malloc(max_frames * sizeof(int));
+    b->group = malloc(max_frames * sizeof(int));
+    if (!b->frames || !b->features || !b->active || !b->group) {
+        rnnoise_batch_destroy(b);
+        return NULL;
+    }
+    check_init();
+    return b;
+}
+
+void rnnoise_batch_destroy(RNNoiseBatch *b) {
+    free(b->frames);
+    free(b->features);
+    free(b->batch);
+    free(b->active);
+    free(b->group);
+    free(b);
+}
+
+int rnnoise_batch_reserve(RNNoiseBatch *b, RNNModel *model) {
+    const RNNModel *m = model ? model : &rnnoise_model_orig;
+    int size;
+    float *batch;
+    // 特化代码逐帧计算, 不用 batch
+    if (m->compute)
+        return 0;
+    size = rnn_model_batch_size(m);
+    if (size <= b->batch_size)
+        return 0;
+    batch = realloc(b->batch, b->max_frames * size * sizeof(float));
+    if (!batch)
+        return -1;
+    b->batch = batch;
+    b->batch_size = size;
+    return 0;
+}
+
+/*!
+ * 同一个模型的一组帧一起算与GRU状态无关的层, 再分别用各自的状态逐帧算完网络
+ * @return 0 成功, -1 没有用 rnnoise_batch_reserve 为这个模型留出空间 (调用者改为逐帧计算, 结果相同)
+ */
+static int batch_compute_rnn(RNNoiseBatch *b, DenoiseState **st, float *vad, int ngroup) {
+    int j;
+    RNNState *rnn = st[b->group[0]]->rnn;
+    if (b->batch_size < rnn->batch_size)
+        return -1;
+    compute_rnn_batch(rnn, b->batch, b->features, ngroup);
+    for (j = 0; j < ngroup; j++) {
+        int t = b->group[j];
+        compute_rnn_frame(st[t]->rnn, b->frames[t].g, &vad[t], &b->batch[j * rnn->batch_size]);
+    }
+    return 0;
+}
+
+int rnnoise_process_batch(RNNoiseBatch *b, DenoiseState **st, float **out, const float **in, float *vad, int n) {
+    int t, k, j;
+    int nactive = 0;
+    if (n > b->max_frames)
+        return -1;
+    // 特征提取: 每路流用自己的状态, 与 rnnoise_process_frame 完全相同
+    for (t = 0; t < n; t++) {
+        FrameState *fr = &b->frames[t];
+        float x[FRAME_SIZE];
+        if (frame_by_frame(st[t])) {
+            // 逐帧处理的流, silence = -1 表示这一帧已经处理完
+            vad[t] = rnnoise_process_frame(st[t], out[t], in[t]);
+            fr->silence = -1;
+            continue;
         }
+        adopt_model(st[t]);
+        biquad(x, st[t]->mem_hp_x, in[t], b_hp, a_hp, FRAME_SIZE);
+        fr->silence = compute_frame_features(st[t], fr->X, fr->P, fr->Ex, fr->Ep, fr->Exp, fr->features, x);
+        vad[t] = 0;
+        if (!fr->silence)
+            b->active[nactive++] = t;
+    }
+
+    // 网络: 模型相同的帧一起算与GRU状态无关的层; 内置模型的特化代码本身更快, 逐帧调用
+    for (k = 0; k < nactive; k++) {
+        const RNNModel *model;
+        int ngroup = 0;
+        t = b->active[k];
+        if (t < 0)
+            continue;
+        model = st[t]->rnn->model;
+        if (model->compute) {
+            compute_rnn(st[t]->rnn, b->frames[t].g, &vad[t], b->frames[t].features);
+            continue;
+        }
+        for (j = k; j < nactive; j++) {
+            int u = b->active[j];
+            if (u >= 0 && st[u]->rnn->model == model) {
+                RNN_COPY(&b->features[ngroup * NB_FEATURES], b->frames[u].features, NB_FEATURES);
+                b->group[ngroup++] = u;
+                b->active[j] = -1;
+            }
+        }
+        if (batch_compute_rnn(b, st, vad, ngroup) != 0) {
+            for (j = 0; j < ngroup; j++) {
+                int u = b->group[j];
+                compute_rnn(st[u]->rnn, b->frames[u].g, &vad[u], b->frames[u].features);
+            }
+        }
+    }
+
+    for (t = 0; t < n; t++) {
+        FrameState *fr = &b->frames[t];
+        if (fr->silence < 0)
+            continue;
+        if (!fr->silence) {
+            // 与 denoise_frame_back 相同地记下网络的输出 (一起处理的流的档位都是 FULL)
+            RNN_COPY(st[t]->last_rnn_g, fr->g, NB_BANDS);
+            st[t]->reuse_gains = 0;
+            smooth_gains(st[t], fr->gs, fr->g);
+            apply_gains(fr->X, fr->P, fr->Ex, fr->Ep, fr->Exp, fr->g, fr->gs);
+        }
+        frame_synthesis(st[t], out[t], fr->X);
+        st[t]->last_vad = vad[t];
+    }
+    return 0;
+}
+
+/*!
+ * 处理一段 [start, end) 的帧, 先用 [start - warmup, start) 的帧预热一个新的状态, 预热部分的输出丢弃
+ */
+static int process_chunk(RNNModel *model, float *out, const float *in, int start, int end, int warmup) {
+    int t;
+    int ret;
+    float tmp[FRAME_SIZE];
+    DenoiseState *st = rnnoise_create(model);
+    if (!st)
+        return -1;
+    for (t = IMAX(0, start - warmup); t < start; t++)
+        rnnoise_process_frame(st, tmp, &in[(size_t) t * FRAME_SIZE]);
+    // 整个输入可以超过 2^31 个样点, 样点的下标用 size_t 计算
+    ret = rnnoise_process_buffer(st, &out[(size_t) start * FRAME_SIZE], &in[(size_t) start * FRAME_SIZE], end - start);
+    rnnoise_destroy(st);
+    return ret;
+}
+
+int rnnoise_process_chunks(RNNModel *model, float *out, const float *in, int nframes, int nchunks,
+                           int warmup_frames) {
+    int c;
+    int ret = 0;
+    if (nchunks <= 0) {
+#ifdef _OPENMP
+        nchunks = omp_get_max_threads();
+#else
+        nchunks = 1;
 #endif
     }
-    frame_synthesis(st, out, X);
-    return vad_prob;
+    nchunks = IMAX(1, IMIN(nchunks, nframes));
+    check_init(); // 并行计算之前先初始化
+    // 每一段由一个线程用独立的 DenoiseState 处理, 第一段之前没有信号, 不需要预热
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 1) reduction(|:ret)
+#endif
+    for (c = 0; c < nchunks; c++) {
+        int start = (int) ((long long) nframes * c / nchunks);
+        int end = (int) ((long long) nframes * (c + 1) / nchunks);
+        ret |= process_chunk(model, out, in, start, end, warmup_frames);
+    }
+    return ret ? -1 : 0;
 }
 
 #if TRAINING
 
-static float uni_rand() {
-  return rand()/(double)RAND_MAX-.5;
+#include <stdio.h>
+#include <ctype.h>
+#include "vec.h"
+#include <strings.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+    语音和噪声各是一个语料库: 单个 raw/wav 文件, 一个目录 (递归收集其中的 .raw/.pcm/.wav), 或者一个列表文件
+    (.txt/.list, 每行一个路径, 后面可以跟一个权重). 每个文件都 mmap 进来, 由所有分片只读共享, 不需要事先拼接成大文件.
+    每个分片顺序读一个文件, 读完后按权重随机挑下一个文件从头读; 权重为 w 的文件里每个样本被用到的机会是默认的 w 倍
+*/
+typedef struct {
+  const short *pcm;   /* 第一个声道的第一个样本 */
+  long frames;
+  int stride;         /* 声道数, 多声道只用第一个声道 */
+  double weight;
+  void *map;
+  size_t map_size;
+} CorpusFile;
+
+struct Corpus {
+  CorpusFile *files;
+  int nb_files;
+  double *cdf;        /* 权重的累积和, 用于按权重挑文件 */
+  long frames;
+};
+
+typedef struct {
+  const Corpus *c;
+  int file;
+  long pos;
+} CorpusReader;
+
+/*
+    训练数据可以分成多个分片同时生成, 每个分片一个 TrainGenerator, 有自己的随机数发生器, 语音/噪声文件的读取位置和三个 DenoiseState.
+    每个分片的内容只取决于种子, 分片数和分片序号, 与线程的调度无关, 同样的参数重新生成逐位相同
+*/
+#define TRAIN_RAND_MAX 0x7fffffff
+
+/* 与 rand() 一样返回 [0, TRAIN_RAND_MAX] 的整数, rng 为 xorshift64* 的状态 */
+static int train_rand(unsigned long long *rng) {
+  *rng ^= *rng >> 12;
+  *rng ^= *rng << 25;
+  *rng ^= *rng >> 27;
+  return (int)((*rng * 2685821657736338717ULL) >> 33);
 }
 
-static void rand_resp(float *a, float *b) {
-  a[0] = .75*uni_rand();
-  a[1] = .75*uni_rand();
-  b[0] = .75*uni_rand();
-  b[1] = .75*uni_rand();
+/* splitmix64: 由种子和分片序号得到互不相关的初始状态 */
+static unsigned long long train_seed(unsigned long long seed, int shard) {
+  unsigned long long z = seed + (shard + 1) * 0x9e3779b97f4a7c15ULL;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  z ^= z >> 31;
+  return z ? z : 1;
 }
 
-int main(int argc, char **argv) {
+static float uni_rand(unsigned long long *rng) {
+  return train_rand(rng)/(double)TRAIN_RAND_MAX-.5;
+}
+
+static void rand_resp(unsigned long long *rng, float *a, float *b) {
+  a[0] = .75*uni_rand(rng);
+  a[1] = .75*uni_rand(rng);
+  b[0] = .75*uni_rand(rng);
+  b[1] = .75*uni_rand(rng);
+}
+
+static unsigned read_le16(const unsigned char *p) {
+  return p[0] | p[1]<<8;
+}
+
+static unsigned read_le32(const unsigned char *p) {
+  return p[0] | p[1]<<8 | p[2]<<16 | (unsigned)p[3]<<24;
+}
+
+/* 在 mmap 的 WAV 文件中找到 16 位 PCM 的 data 块, 不支持的格式返回 -1 */
+static int parse_wav(const char *path, CorpusFile *cf) {
+  const unsigned char *data = cf->map;
+  size_t pos = 12;
+  int channels = 0;
+  if (cf->map_size < 12 || memcmp(data + 8, "WAVE", 4) != 0) goto bad;
+  while (pos + 8 <= cf->map_size) {
+    const unsigned char *chunk = data + pos;
+    size_t len = read_le32(chunk + 4);
+    pos += 8;
+    if (len > cf->map_size - pos) len = cf->map_size - pos;
+    if (memcmp(chunk, "fmt ", 4) == 0 && len >= 16) {
+      unsigned format = read_le16(chunk + 8);
+      if (format == 0xFFFE && len >= 26) format = read_le16(chunk + 32);
+      channels = read_le16(chunk + 10);
+      if (format != 1 || read_le16(chunk + 22) != 16 || channels == 0) goto bad;
+      if (read_le32(chunk + 12) != 48000)
+        fprintf(stderr, "warning: %s is %u Hz, not 48000 Hz\n", path, read_le32(chunk + 12));
+    } else if (memcmp(chunk, "data", 4) == 0 && channels) {
+      if (pos & 1) goto bad;
+      cf->pcm = (const short *)(data + pos);
+      cf->stride = channels;
+      cf->frames = (long)(len / (2 * channels) / FRAME_SIZE);
+      return 0;
+    }
+    pos += len + (len & 1);
+  }
+bad:
+  fprintf(stderr, "%s: only 16-bit PCM WAV files are supported\n", path);
+  return -1;
+}
+
+static int corpus_add_file(Corpus *c, const char *path, double weight) {
+  CorpusFile *cf;
+  struct stat sb;
+  int fd;
+  void *map;
+  if (!(weight > 0)) return 0;
+  fd = open(path, O_RDONLY);
+  if (fd < 0 || fstat(fd, &sb) != 0) {
+    fprintf(stderr, "cannot open %s\n", path);
+    if (fd >= 0) close(fd);
+    return -1;
+  }
+  if (sb.st_size == 0) {
+    close(fd);
+    return 0;
+  }
+  map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "cannot map %s\n", path);
+    return -1;
+  }
+  posix_madvise(map, sb.st_size, POSIX_MADV_SEQUENTIAL);
+  cf = realloc(c->files, (c->nb_files + 1) * sizeof(*cf));
+  if (!cf) {
+    munmap(map, sb.st_size);
+    return -1;
+  }
+  c->files = cf;
+  cf = &c->files[c->nb_files];
+  cf->map = map;
+  cf->map_size = sb.st_size;
+  cf->weight = weight;
+  if (sb.st_size >= 4 && memcmp(map, "RIFF", 4) == 0) {
+    if (parse_wav(path, cf) != 0) {
+      munmap(map, sb.st_size);
+      return -1;
+    }
+  } else {
+    cf->pcm = map;
+    cf->stride = 1;
+    cf->frames = (long)(sb.st_size / (FRAME_SIZE * sizeof(short)));
+  }
+  if (cf->frames == 0) {
+    munmap(map, sb.st_size);
+    return 0;
+  }
+  c->frames += cf->frames;
+  c->nb_files++;
+  return 0;
+}
+
+static int has_suffix(const char *name, const char *suffix) {
+  size_t n = strlen(name), m = strlen(suffix);
+  return n >= m && strcasecmp(name + n - m, suffix) == 0;
+}
+
+static int compare_names(const void *a, const void *b) {
+  return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* 文件按名字排序后加入, 同样的目录每次得到同样的顺序 */
+static int corpus_add_dir(Corpus *c, const char *path) {
+  DIR *dir;
+  struct dirent *ent;
+  char **names = NULL;
+  int nb_names = 0;
+  int i, ret = 0;
+  dir = opendir(path);
+  if (!dir) {
+    fprintf(stderr, "cannot open %s\n", path);
+    return -1;
+  }
+  while ((ent = readdir(dir)) != NULL) {
+    char **tmp;
+    if (ent->d_name[0] == '.') continue;
+    tmp = realloc(names, (nb_names + 1) * sizeof(*names));
+    if (tmp) {
+      names = tmp;
+      names[nb_names] = malloc(strlen(path) + strlen(ent->d_name) + 2);
+    }
+    if (!tmp || !names[nb_names]) {
+      // 只收集到一部分文件时不能当作成功, 下面的循环只释放已收集的名字
+      fprintf(stderr, "%s: out of memory\n", path);
+      ret = -1;
+      break;
+    }
+    sprintf(names[nb_names++], "%s/%s", path, ent->d_name);
+  }
+  closedir(dir);
+  qsort(names, nb_names, sizeof(*names), compare_names);
+  for (i = 0; i < nb_names; i++) {
+    struct stat sb;
+    if (ret == 0 && stat(names[i], &sb) == 0) {
+      if (S_ISDIR(sb.st_mode))
+        ret = corpus_add_dir(c, names[i]);
+      else if (has_suffix(names[i], ".raw") || has_suffix(names[i], ".pcm") || has_suffix(names[i], ".wav"))
+        ret = corpus_add_file(c, names[i], 1);
+    }
+    free(names[i]);
+  }
+  free(names);
+  return ret;
+}
+
+/* 每行 "路径 [权重]", 空行和 # 开头的行忽略; 相对路径相对于列表文件所在的目录 */
+static int corpus_add_list(Corpus *c, const char *path) {
+  char line[4096];
+  char full[8192];
+  const char *slash = strrchr(path, '/');
+  int dirlen = slash ? (int)(slash - path) + 1 : 0;
+  int ret = 0;
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    fprintf(stderr, "cannot open %s\n", path);
+    return -1;
+  }
+  while (ret == 0 && fgets(line, sizeof(line), f)) {
+    char *end = line + strlen(line);
+    char *sep;
+    double weight = 1;
+    while (end > line && isspace((unsigned char)end[-1])) *--end = 0;
+    if (line[0] == 0 || line[0] == '#') continue;
+    sep = strrchr(line, ' ');
+    if (!sep) sep = strrchr(line, '\t');
+    if (sep) {
+      char *num_end;
+      double w = strtod(sep + 1, &num_end);
+      if (*num_end == 0 && num_end != sep + 1) {
+        weight = w;
+        while (sep > line && isspace((unsigned char)sep[-1])) sep--;
+        *sep = 0;
+      }
+    }
+    if (line[0] == '/')
+      snprintf(full, sizeof(full), "%s", line);
+    else
+      snprintf(full, sizeof(full), "%.*s%s", dirlen, path, line);
+    ret = corpus_add_file(c, full, weight);
+  }
+  fclose(f);
+  return ret;
+}
+
+void train_corpus_free(Corpus *c) {
   int i;
-  int count=0;
-  static const float a_hp[2] = {-1.99599, 0.99600};
-  static const float b_hp[2] = {-2, 1};
-  float a_noise[2] = {0};
-  float b_noise[2] = {0};
-  float a_sig[2] = {0};
-  float b_sig[2] = {0};
-  float mem_hp_x[2]={0};
-  float mem_hp_n[2]={0};
-  float mem_resp_x[2]={0};
-  float mem_resp_n[2]={0};
-  float x[FRAME_SIZE];
-  float n[FRAME_SIZE];
-  float xn[FRAME_SIZE];
-  int vad_cnt=0;
-  int gain_change_count=0;
-  float speech_gain = 1, noise_gain = 1;
-  FILE *f1, *f2;
-  int maxCount;
-  DenoiseState *st;
+  for (i = 0; i < c->nb_files; i++) munmap(c->files[i].map, c->files[i].map_size);
+  free(c->files);
+  free(c->cdf);
+  free(c);
+}
+
+Corpus *train_corpus_open(const char *path) {
+  struct stat sb;
+  int i, ret;
+  Corpus *c = calloc(1, sizeof(*c));
+  if (!c) return NULL;
+  if (stat(path, &sb) == 0 && S_ISDIR(sb.st_mode))
+    ret = corpus_add_dir(c, path);
+  else if (has_suffix(path, ".txt") || has_suffix(path, ".list"))
+    ret = corpus_add_list(c, path);
+  else
+    ret = corpus_add_file(c, path, 1);
+  if (ret == 0 && c->nb_files == 0) {
+    fprintf(stderr, "%s: no audio\n", path);
+    ret = -1;
+  }
+  if (ret == 0) {
+    c->cdf = malloc(c->nb_files * sizeof(double));
+    if (!c->cdf) ret = -1;
+  }
+  if (ret != 0) {
+    train_corpus_free(c);
+    return NULL;
+  }
+  for (i = 0; i < c->nb_files; i++) c->cdf[i] = (i ? c->cdf[i-1] : 0) + c->files[i].weight;
+  return c;
+}
+
+/* 起始位置: 把所有文件按顺序首尾相接, 第 shard 个分片从第 shard/nshards 处开始 */
+static void corpus_reader_init(CorpusReader *r, const Corpus *c, int shard, int nshards) {
+  long start = (long)((long long)c->frames * shard / nshards);
+  r->c = c;
+  r->file = 0;
+  while (start >= c->files[r->file].frames) start -= c->files[r->file++].frames;
+  r->pos = start;
+}
+
+/* 按权重随机挑一个文件 */
+static int corpus_pick(unsigned long long *rng, const Corpus *c) {
+  double u = train_rand(rng) / (TRAIN_RAND_MAX + 1.0) * c->cdf[c->nb_files - 1];
+  int lo = 0, hi = c->nb_files - 1;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (c->cdf[mid] > u) hi = mid;
+    else lo = mid + 1;
+  }
+  return lo;
+}
+
+static void read_frame(unsigned long long *rng, CorpusReader *r, short *tmp) {
+  const CorpusFile *cf;
+  const short *src;
+  int i;
+  if (r->pos == r->c->files[r->file].frames) {
+    /* 只有一个文件时不用随机数, 与原来读到结尾后 rewind 相同 */
+    r->file = r->c->nb_files == 1 ? 0 : corpus_pick(rng, r->c);
+    r->pos = 0;
+  }
+  cf = &r->c->files[r->file];
+  src = cf->pcm + (size_t)r->pos * FRAME_SIZE * cf->stride;
+  for (i=0;i<FRAME_SIZE;i++) tmp[i] = src[i*cf->stride];
+  r->pos++;
+}
+
+/*
+    混响: 语音与随机挑选的房间冲激响应 (RIR) 做卷积. 用均匀分段的 overlap-save: RIR 按 FRAME_SIZE 分段,
+    每段补零后做 WINDOW_SIZE 点的FFT; 每帧只对输入做一次FFT, 存入频域延迟线, 与各段频谱相乘累加后一次IFFT.
+    带噪的输入用完整的混响, 训练目标只保留直达声和 RIR_EARLY 以内的早期反射, 两者共用同一条延迟线:
+    早期部分的前几段与完整 RIR 相同, 只有最后一段需要单独的频谱. 能量衰减到 -60 dB 之后的尾部不参与计算
+*/
+#define RIR_MAX_PARTS 100               /* RIR 最长 1 秒, 更长的截断 */
+#define RIR_EARLY (48000*50/1000)       /* 直达声之后 50 ms 内为早期反射 */
+#define MAX_NOISES 4
+
+typedef struct {
+  int parts;
+  int early_parts;
+  kiss_fft_cpx H[RIR_MAX_PARTS][FREQ_SIZE];     /* 完整 RIR 各段的频谱 */
+  kiss_fft_cpx He[FREQ_SIZE];                   /* 早期部分最后一段的频谱 */
+  kiss_fft_cpx fdl[RIR_MAX_PARTS][FREQ_SIZE];   /* 最近 RIR_MAX_PARTS 帧输入的频谱 */
+  int pos;
+  float mem[FRAME_SIZE];
+  float h[RIR_MAX_PARTS*FRAME_SIZE];
+} Reverb;
+
+static void rir_partition(kiss_fft_cpx *H, const float *h, int len) {
+  float buf[WINDOW_SIZE] = {0};
+  int i;
+  RNN_COPY(buf, h, len);
+  forward_transform(H, buf);
+  /* 输入和 RIR 的频谱都带 1/WINDOW_SIZE, 乘积再做逆变换时补回一次 */
+  for (i=0;i<FREQ_SIZE;i++) {
+    H[i].r *= WINDOW_SIZE;
+    H[i].i *= WINDOW_SIZE;
+  }
+}
+
+/* 换成 cf 中的 RIR, 以峰值 (直达声) 归一化, 并清空延迟线 */
+static void reverb_set(Reverb *r, const CorpusFile *cf) {
+  float *h = r->h;
+  float peak = 0;
+  double energy = 0, tail = 0;
+  int i, len, early, peak_pos = 0;
+  len = IMIN(cf->frames, RIR_MAX_PARTS) * FRAME_SIZE;
+  for (i=0;i<len;i++) {
+    h[i] = cf->pcm[(size_t)i*cf->stride];
+    energy += h[i]*h[i];
+    if (fabs(h[i]) > peak) {
+      peak = fabs(h[i]);
+      peak_pos = i;
+    }
+  }
+  if (peak == 0) peak = 1;
+  for (i=0;i<len;i++) h[i] /= peak;
+  energy /= peak*peak;
+  /* 去掉能量低于 -60 dB 的尾部 */
+  while (len > FRAME_SIZE && tail + h[len-1]*h[len-1] < 1e-6*energy) {
+    len--;
+    tail += h[len]*h[len];
+  }
+  early = IMIN(len, peak_pos + RIR_EARLY);
+  r->parts = (len + FRAME_SIZE - 1) / FRAME_SIZE;
+  r->early_parts = (early + FRAME_SIZE - 1) / FRAME_SIZE;
+  for (i=0;i<r->parts;i++) rir_partition(r->H[i], h + i*FRAME_SIZE, IMIN(FRAME_SIZE, len - i*FRAME_SIZE));
+  i = r->early_parts - 1;
+  rir_partition(r->He, h + i*FRAME_SIZE, early - i*FRAME_SIZE);
+  RNN_CLEAR(&r->fdl[0][0], RIR_MAX_PARTS*FREQ_SIZE);
+  RNN_CLEAR(r->mem, FRAME_SIZE);
+  r->pos = 0;
+}
+
+static void spectrum_mac(kiss_fft_cpx *Y, const kiss_fft_cpx *X, const kiss_fft_cpx *H) {
+  int i;
+  for (i=0;i<FREQ_SIZE;i++) {
+    Y[i].r += X[i].r*H[i].r - X[i].i*H[i].i;
+    Y[i].i += X[i].r*H[i].i + X[i].i*H[i].r;
+  }
+}
+
+static void reverb_process(Reverb *r, float *full, float *early, const float *in) {
+  kiss_fft_cpx Y[FREQ_SIZE] = {{0}}, Ye[FREQ_SIZE];
+  float buf[WINDOW_SIZE];
+  int p;
+  RNN_COPY(buf, r->mem, FRAME_SIZE);
+  RNN_COPY(buf + FRAME_SIZE, in, FRAME_SIZE);
+  RNN_COPY(r->mem, in, FRAME_SIZE);
+  forward_transform(r->fdl[r->pos], buf);
+  for (p=0;p<r->parts;p++) {
+    const kiss_fft_cpx *X = r->fdl[(r->pos - p + RIR_MAX_PARTS) % RIR_MAX_PARTS];
+    if (p == r->early_parts - 1) {
+      RNN_COPY(Ye, Y, FREQ_SIZE);
+      spectrum_mac(Ye, X, r->He);
+    }
+    spectrum_mac(Y, X, r->H[p]);
+  }
+  r->pos = (r->pos + 1) % RIR_MAX_PARTS;
+  /* overlap-save: 循环卷积的后半段就是线性卷积 */
+  inverse_transform(buf, Y);
+  RNN_COPY(full, buf + FRAME_SIZE, FRAME_SIZE);
+  inverse_transform(buf, Ye);
+  RNN_COPY(early, buf + FRAME_SIZE, FRAME_SIZE);
+}
+
+struct TrainGenerator {
+  const Corpus *speech;
+  const Corpus *noise;
+  const Corpus *rirs;       /* 房间冲激响应, NULL 表示不加混响 */
+  int max_noises;           /* 同时叠加的噪声源数的上限 */
+  unsigned long long rng;
+  CorpusReader speech_reader;
+  CorpusReader noise_reader[MAX_NOISES];
+  DenoiseState *st;         /* 干净语音的分析 */
   DenoiseState *noise_state;
   DenoiseState *noisy;
-  st = rnnoise_create(NULL);
-  noise_state = rnnoise_create(NULL);
-  noisy = rnnoise_create(NULL);
-  if (argc!=4) {
-    fprintf(stderr, "usage: %s <speech> <noise> <count>\n", argv[0]);
-    return 1;
+  Reverb *reverb;
+  int reverb_on;
+  float rev_analysis_mem[FRAME_SIZE];
+  float a_noise[2], b_noise[2], a_sig[2], b_sig[2];
+  float mem_hp_x[2], mem_hp_n[2], mem_resp_x[2], mem_resp_n[2];
+  float noise_gains[MAX_NOISES];
+  int nb_noises;
+  int vad_cnt;
+  int gain_change_count;
+  int lowpass;
+  int band_lp;
+  float speech_gain, noise_gain;
+};
+
+TrainGenerator *train_generator_create(const Corpus *speech, const Corpus *noise, const Corpus *rirs, int max_noises,
+                                       int shard, int nshards, unsigned long long seed) {
+  int i;
+  TrainGenerator *gen;
+  if (max_noises < 1 || max_noises > MAX_NOISES) return NULL;
+  gen = calloc(1, sizeof(*gen));
+  if (!gen) return NULL;
+  gen->speech = speech;
+  gen->noise = noise;
+  gen->rirs = rirs;
+  gen->max_noises = max_noises;
+  gen->rng = train_seed(seed, shard);
+  gen->st = rnnoise_create(NULL);
+  gen->noise_state = rnnoise_create(NULL);
+  gen->noisy = rnnoise_create(NULL);
+  if (rirs) gen->reverb = malloc(sizeof(*gen->reverb));
+  if (!gen->st || !gen->noise_state || !gen->noisy || (rirs && !gen->reverb)) {
+    train_generator_destroy(gen);
+    return NULL;
   }
-  f1 = fopen(argv[1], "r");
-  f2 = fopen(argv[2], "r");
-  maxCount = atoi(argv[3]);
+  gen->noise_gains[0] = 1;
+  gen->nb_noises = 1;
+  gen->lowpass = FREQ_SIZE;
+  gen->band_lp = NB_BANDS;
+  gen->speech_gain = gen->noise_gain = 1;
+  corpus_reader_init(&gen->speech_reader, speech, shard, nshards);
+  /* 各噪声源从不同的位置开始读; 只有一个噪声源时与原来相同 */
+  for (i=0;i<max_noises;i++)
+    corpus_reader_init(&gen->noise_reader[i], noise, shard*max_noises + i, nshards*max_noises);
   for(i=0;i<150;i++) {
     short tmp[FRAME_SIZE];
-    fread(tmp, sizeof(short), FRAME_SIZE, f2);
+    read_frame(&gen->rng, &gen->noise_reader[0], tmp);
   }
-  while (1) {
-    kiss_fft_cpx X[FREQ_SIZE], Y[FREQ_SIZE], N[FREQ_SIZE], P[WINDOW_SIZE];
-    float Ex[NB_BANDS], Ey[NB_BANDS], En[NB_BANDS], Ep[NB_BANDS];
-    float Exp[NB_BANDS];
-    float Ln[NB_BANDS];
-    float features[NB_FEATURES];
-    float g[NB_BANDS];
-    short tmp[FRAME_SIZE];
-    float vad=0;
-    float E=0;
-    if (count==maxCount) break;
-    if ((count%1000)==0) fprintf(stderr, "%d\r", count);
-    if (++gain_change_count > 2821) {
-      speech_gain = pow(10., (-40+(rand()%60))/20.);
-      noise_gain = pow(10., (-30+(rand()%50))/20.);
-      if (rand()%10==0) noise_gain = 0;
-      noise_gain *= speech_gain;
-      if (rand()%10==0) speech_gain = 0;
-      gain_change_count = 0;
-      rand_resp(a_noise, b_noise);
-      rand_resp(a_sig, b_sig);
-      lowpass = FREQ_SIZE * 3000./24000. * pow(50., rand()/(double)RAND_MAX);
-      for (i=0;i<NB_BANDS;i++) {
-        if (eband5ms[i]<<FRAME_SIZE_SHIFT > lowpass) {
-          band_lp = i;
-          break;
-        }
+  return gen;
+}
+
+void train_generator_destroy(TrainGenerator *gen) {
+  free(gen->reverb);
+  if (gen->st) rnnoise_destroy(gen->st);
+  if (gen->noise_state) rnnoise_destroy(gen->noise_state);
+  if (gen->noisy) rnnoise_destroy(gen->noisy);
+  free(gen);
+}
+
+void train_generator_next(TrainGenerator *gen, float *row) {
+  static const float a_hp[2] = {-1.99599, 0.99600};
+  static const float b_hp[2] = {-2, 1};
+  unsigned long long *rng = &gen->rng;
+  int i;
+  float x[FRAME_SIZE];
+  float n[FRAME_SIZE];
+  float xn[FRAME_SIZE];
+  float x_rev[FRAME_SIZE];
+  kiss_fft_cpx X[FREQ_SIZE], Y[FREQ_SIZE], Yr[FREQ_SIZE], N[FREQ_SIZE], P[WINDOW_SIZE];
+  float Ex[NB_BANDS], Ey[NB_BANDS], Er[NB_BANDS], En[NB_BANDS], Ep[NB_BANDS];
+  float Exp[NB_BANDS];
+  float Ln[NB_BANDS];
+  float features[NB_FEATURES];
+  float g[NB_BANDS];
+  short tmp[FRAME_SIZE];
+  float vad=0;
+  float E=0;
+  if (++gen->gain_change_count > 2821) {
+    gen->speech_gain = pow(10., (-40+(train_rand(rng)%60))/20.);
+    gen->noise_gain = pow(10., (-30+(train_rand(rng)%50))/20.);
+    if (train_rand(rng)%10==0) gen->noise_gain = 0;
+    gen->noise_gain *= gen->speech_gain;
+    if (train_rand(rng)%10==0) gen->speech_gain = 0;
+    gen->gain_change_count = 0;
+    rand_resp(rng, gen->a_noise, gen->b_noise);
+    rand_resp(rng, gen->a_sig, gen->b_sig);
+    gen->lowpass = FREQ_SIZE * 3000./24000. * pow(50., train_rand(rng)/(double)TRAIN_RAND_MAX);
+    for (i=0;i<NB_BANDS;i++) {
+      if (eband5ms[i]<<FRAME_SIZE_SHIFT > gen->lowpass) {
+        gen->band_lp = i;
+        break;
       }
     }
-    if (speech_gain != 0) {
-      fread(tmp, sizeof(short), FRAME_SIZE, f1);
-      if (feof(f1)) {
-        rewind(f1);
-        fread(tmp, sizeof(short), FRAME_SIZE, f1);
-      }
-      for (i=0;i<FRAME_SIZE;i++) x[i] = speech_gain*tmp[i];
-      for (i=0;i<FRAME_SIZE;i++) E += tmp[i]*(float)tmp[i];
-    } else {
-      for (i=0;i<FRAME_SIZE;i++) x[i] = 0;
-      E = 0;
-    }
-    if (noise_gain!=0) {
-      fread(tmp, sizeof(short), FRAME_SIZE, f2);
-      if (feof(f2)) {
-        rewind(f2);
-        fread(tmp, sizeof(short), FRAME_SIZE, f2);
-      }
-      for (i=0;i<FRAME_SIZE;i++) n[i] = noise_gain*tmp[i];
-    } else {
-      for (i=0;i<FRAME_SIZE;i++) n[i] = 0;
-    }
-    biquad(x, mem_hp_x, x, b_hp, a_hp, FRAME_SIZE);
-    biquad(x, mem_resp_x, x, b_sig, a_sig, FRAME_SIZE);
-    biquad(n, mem_hp_n, n, b_hp, a_hp, FRAME_SIZE);
-    biquad(n, mem_resp_n, n, b_noise, a_noise, FRAME_SIZE);
-    for (i=0;i<FRAME_SIZE;i++) xn[i] = x[i] + n[i];
-    if (E > 1e9f) {
-      vad_cnt=0;
-    } else if (E > 1e8f) {
-      vad_cnt -= 5;
-    } else if (E > 1e7f) {
-      vad_cnt++;
-    } else {
-      vad_cnt+=2;
+    /* 以下的增强只在打开时才用随机数, 不打开时输出与原来相同 */
+    if (gen->max_noises > 1) {
+      gen->nb_noises = 1 + train_rand(rng)%gen->max_noises;
+      for (i=1;i<gen->nb_noises;i++) gen->noise_gains[i] = pow(10., -(train_rand(rng)%20)/20.);
     }
-    if (vad_cnt < 0) vad_cnt = 0;
-    if (vad_cnt > 15) vad_cnt = 15;
+    if (gen->reverb) {
+      gen->reverb_on = train_rand(rng)%2;
+      if (gen->reverb_on) reverb_set(gen->reverb, &gen->rirs->files[corpus_pick(rng, gen->rirs)]);
+    }
+  }
+  /* 同一个线程可能轮流使用几个生成器 */
+  lowpass = gen->lowpass;
+  if (gen->speech_gain != 0) {
+    read_frame(rng, &gen->speech_reader, tmp);
+    for (i=0;i<FRAME_SIZE;i++) x[i] = gen->speech_gain*tmp[i];
+    for (i=0;i<FRAME_SIZE;i++) E += tmp[i]*(float)tmp[i];
+  } else {
+    for (i=0;i<FRAME_SIZE;i++) x[i] = 0;
+    E = 0;
+  }
+  if (gen->noise_gain!=0) {
+    int k;
+    RNN_CLEAR(n, FRAME_SIZE);
+    for (k=0;k<gen->nb_noises;k++) {
+      read_frame(rng, &gen->noise_reader[k], tmp);
+      for (i=0;i<FRAME_SIZE;i++) n[i] += gen->noise_gains[k]*tmp[i];
+    }
+    for (i=0;i<FRAME_SIZE;i++) n[i] *= gen->noise_gain;
+  } else {
+    for (i=0;i<FRAME_SIZE;i++) n[i] = 0;
+  }
+  biquad(x, gen->mem_hp_x, x, b_hp, a_hp, FRAME_SIZE);
+  biquad(x, gen->mem_resp_x, x, gen->b_sig, gen->a_sig, FRAME_SIZE);
+  biquad(n, gen->mem_hp_n, n, b_hp, a_hp, FRAME_SIZE);
+  biquad(n, gen->mem_resp_n, n, gen->b_noise, gen->a_noise, FRAME_SIZE);
+  /* 加混响时带噪的输入用完整的混响, 训练目标 x 只保留早期反射 */
+  if (gen->reverb_on) reverb_process(gen->reverb, x_rev, x, x);
+  else RNN_COPY(x_rev, x, FRAME_SIZE);
+  for (i=0;i<FRAME_SIZE;i++) xn[i] = x_rev[i] + n[i];
+  if (E > 1e9f) {
+    gen->vad_cnt=0;
+  } else if (E > 1e8f) {
+    gen->vad_cnt -= 5;
+  } else if (E > 1e7f) {
+    gen->vad_cnt++;
+  } else {
+    gen->vad_cnt+=2;
+  }
+  if (gen->vad_cnt < 0) gen->vad_cnt = 0;
+  if (gen->vad_cnt > 15) gen->vad_cnt = 15;
 
-    if (vad_cnt >= 10) vad = 0;
-    else if (vad_cnt > 0) vad = 0.5f;
-    else vad = 1.f;
+  if (gen->vad_cnt >= 10) vad = 0;
+  else if (gen->vad_cnt > 0) vad = 0.5f;
+  else vad = 1.f;
 
-    frame_analysis(st, Y, Ey, x);
-    frame_analysis(noise_state, N, En, n);
-    for (i=0;i<NB_BANDS;i++) Ln[i] = log10(1e-2+En[i]);
-    int silence = compute_frame_features(noisy, X, P, Ex, Ep, Exp, features, xn);
-    pitch_filter(X, P, Ex, Ep, Exp, g);
-    //printf("%f %d\n", noisy->last_gain, noisy->last_period);
-    for (i=0;i<NB_BANDS;i++) {
-      g[i] = sqrt((Ey[i]+1e-3)/(Ex[i]+1e-3));
-      if (g[i] > 1) g[i] = 1;
-      if (silence || i > band_lp) g[i] = -1;
-      if (Ey[i] < 5e-2 && Ex[i] < 5e-2) g[i] = -1;
-      if (vad==0 && noise_gain==0) g[i] = -1;
-    }
-    count++;
-#if 1
-    fwrite(features, sizeof(float), NB_FEATURES, stdout);
-    fwrite(g, sizeof(float), NB_BANDS, stdout);
-    fwrite(Ln, sizeof(float), NB_BANDS, stdout);
-    fwrite(&vad, sizeof(float), 1, stdout);
-#endif
+  frame_analysis(gen->st, Y, Ey, x);
+  frame_analysis(gen->noise_state, N, En, n);
+  if (gen->reverb_on) spectrum_analysis(Yr, Er, gen->rev_analysis_mem, x_rev);
+  else RNN_COPY(Yr, Y, FREQ_SIZE);
+  RNN_COPY(gen->rev_analysis_mem, x_rev, FRAME_SIZE);
+  for (i=0;i<NB_BANDS;i++) Ln[i] = log10(1e-2+En[i]);
+  int silence = compute_mixture_features(gen->noisy, X, P, Ex, Ep, Exp, features, Yr, N, xn);
+  pitch_filter(X, P, Ex, Ep, Exp, g);
+  //printf("%f %d\n", noisy->last_gain, noisy->last_period);
+  for (i=0;i<NB_BANDS;i++) {
+    g[i] = sqrt((Ey[i]+1e-3)/(Ex[i]+1e-3));
+    if (g[i] > 1) g[i] = 1;
+    if (silence || i > gen->band_lp) g[i] = -1;
+    if (Ey[i] < 5e-2 && Ex[i] < 5e-2) g[i] = -1;
+    if (vad==0 && gen->noise_gain==0) g[i] = -1;
+  }
+  RNN_COPY(row, features, NB_FEATURES);
+  RNN_COPY(row + NB_FEATURES, g, NB_BANDS);
+  RNN_COPY(row + NB_FEATURES + NB_BANDS, Ln, NB_BANDS);
+  row[NB_TRAIN - 1] = vad;
+}
+
+#ifndef RNNOISE_TRAINING_MODULE
+
+/*
+    训练数据的输出: 默认与原来一样每帧 NB_TRAIN 个 float 首尾相接 (.f32); 也可以写成分块带索引的数据集 (.rnnd),
+    可以直接 mmap, 不必整个读进内存. 各字段均为小端:
+        0     "RNNOISED"
+        8     u32 版本 (1)
+        12    u32 数据类型: 0 float32, 1 float16
+        16    u32 每帧的值数 (NB_TRAIN), u32 特征数 (NB_FEATURES), u32 频带数 (NB_BANDS)
+        28    u32 每块的帧数 (DATASET_CHUNK)
+        32    u64 总帧数, u64 块数, u64 索引的偏移
+        4096  各块依次存放, 每块 DATASET_CHUNK 帧, 最后一块不足的部分补0; 每块的字节数是 4096 的倍数, 各块都按页对齐
+        索引  每块 {u64 偏移, u64 帧数}
+    每帧依次为特征, 增益, 噪声能量和 VAD. 头部在写完所有块后才填上, 没有正常结束的文件总帧数为0
+*/
+#define DATASET_HEADER 4096
+#define DATASET_CHUNK 8192
+
+enum {TRAIN_F32, TRAIN_RNND, TRAIN_RNND16};
+
+typedef struct {
+  FILE *f;
+  int format;
+  unsigned char *chunk;     /* 正在填的块 */
+  int fill;                 /* 块中已有的帧数 */
+  long long frames;
+  unsigned long long *index;
+  int nb_chunks;
+} TrainWriter;
+
+static void put_le32(unsigned char *p, unsigned v) {
+  p[0] = v; p[1] = v>>8; p[2] = v>>16; p[3] = v>>24;
+}
+
+static void put_le64(unsigned char *p, unsigned long long v) {
+  put_le32(p, (unsigned)v);
+  put_le32(p + 4, (unsigned)(v>>32));
+}
+
+static size_t dataset_value_bytes(int format) {
+  return format == TRAIN_RNND16 ? sizeof(rnn_weight16) : sizeof(float);
+}
+
+static int writer_open(TrainWriter *w, FILE *f, int format) {
+  memset(w, 0, sizeof(*w));
+  w->f = f;
+  w->format = format;
+  if (format == TRAIN_F32) return 0;
+  w->chunk = calloc(DATASET_CHUNK, NB_TRAIN * dataset_value_bytes(format));
+  if (!w->chunk) return -1;
+  /* 先占住头部的位置, 结束时再写 */
+  return fseek(f, DATASET_HEADER, SEEK_SET);
+}
+
+static int writer_flush_chunk(TrainWriter *w) {
+  size_t bytes = (size_t)DATASET_CHUNK * NB_TRAIN * dataset_value_bytes(w->format);
+  unsigned long long *index = realloc(w->index, 2 * (w->nb_chunks + 1) * sizeof(*index));
+  if (!index) return -1;
+  w->index = index;
+  index[2*w->nb_chunks] = DATASET_HEADER + (unsigned long long)w->nb_chunks * bytes;
+  index[2*w->nb_chunks + 1] = w->fill;
+  w->nb_chunks++;
+  memset(w->chunk + (size_t)w->fill * NB_TRAIN * dataset_value_bytes(w->format), 0,
+         (size_t)(DATASET_CHUNK - w->fill) * NB_TRAIN * dataset_value_bytes(w->format));
+  w->fill = 0;
+  return fwrite(w->chunk, 1, bytes, w->f) == bytes ? 0 : -1;
+}
+
+static int writer_frame(TrainWriter *w, const float *row) {
+  int i;
+  w->frames++;
+  if (w->format == TRAIN_F32)
+    return fwrite(row, sizeof(float), NB_TRAIN, w->f) == NB_TRAIN ? 0 : -1;
+  if (w->format == TRAIN_RNND16) {
+    rnn_weight16 *dst = (rnn_weight16 *)w->chunk + (size_t)w->fill * NB_TRAIN;
+    for (i=0;i<NB_TRAIN;i++) dst[i] = float_to_half(row[i]);
+  } else {
+    RNN_COPY((float *)w->chunk + (size_t)w->fill * NB_TRAIN, row, NB_TRAIN);
   }
-  fprintf(stderr, "matrix size: %d x %d\n", count, NB_FEATURES + 2*NB_BANDS + 1);
-  fclose(f1);
-  fclose(f2);
+  if (++w->fill == DATASET_CHUNK) return writer_flush_chunk(w);
   return 0;
 }
 
+static int writer_close(TrainWriter *w) {
+  int i, ret = 0;
+  if (w->format != TRAIN_F32) {
+    unsigned char header[64] = "RNNOISED";
+    unsigned char entry[16];
+    unsigned long long index_offset;
+    if (w->fill > 0) ret |= writer_flush_chunk(w);
+    index_offset = DATASET_HEADER + (unsigned long long)w->nb_chunks * DATASET_CHUNK * NB_TRAIN * dataset_value_bytes(w->format);
+    for (i=0;i<w->nb_chunks;i++) {
+      put_le64(entry, w->index[2*i]);
+      put_le64(entry + 8, w->index[2*i + 1]);
+      ret |= fwrite(entry, 1, sizeof(entry), w->f) != sizeof(entry);
+    }
+    put_le32(header + 8, 1);
+    put_le32(header + 12, w->format == TRAIN_RNND16);
+    put_le32(header + 16, NB_TRAIN);
+    put_le32(header + 20, NB_FEATURES);
+    put_le32(header + 24, NB_BANDS);
+    put_le32(header + 28, DATASET_CHUNK);
+    put_le64(header + 32, w->frames);
+    put_le64(header + 40, w->nb_chunks);
+    put_le64(header + 48, index_offset);
+    ret |= fseek(w->f, 0, SEEK_SET) != 0;
+    ret |= fwrite(header, 1, sizeof(header), w->f) != sizeof(header);
+    free(w->chunk);
+    free(w->index);
+  }
+  if (w->f != stdout) ret |= fclose(w->f) != 0;
+  return ret ? -1 : 0;
+}
+
+typedef struct {
+  TrainGenerator *gen;
+  TrainWriter out;
+  int count;                /* 这个分片的帧数 */
+  int shard;
+  int ret;
+  int started;              /* 线程创建成功, 需要 join; pthread_t 没有表示"未创建"的值 */
+} TrainShard;
+
+static void *generate_shard(void *arg) {
+  TrainShard *sh = arg;
+  float row[NB_TRAIN];
+  int count;
+  for (count=0;count<sh->count;count++) {
+    if (sh->shard==0 && (count%1000)==0) fprintf(stderr, "%d\r", count);
+    train_generator_next(sh->gen, row);
+    if (writer_frame(&sh->out, row) != 0) {
+      fprintf(stderr, "write error\n");
+      sh->ret = 1;
+      break;
+    }
+  }
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  int k;
+  int nshards = 1;
+  unsigned long long seed = 0;
+  const char *prefix = NULL;
+  int format = TRAIN_F32;
+  const char *rir_path = NULL;
+  int max_noises = 1;
+  int maxCount, ret = 0;
+  Corpus *speech, *noise, *rirs = NULL;
+  TrainShard *shards;
+  pthread_t *threads;
+  while (argc > 4 && argv[1][0] == '-') {
+    if (strcmp(argv[1], "-j") == 0) nshards = atoi(argv[2]);
+    else if (strcmp(argv[1], "-s") == 0) seed = strtoull(argv[2], NULL, 10);
+    else if (strcmp(argv[1], "-o") == 0) prefix = argv[2];
+    else if (strcmp(argv[1], "-r") == 0) rir_path = argv[2];
+    else if (strcmp(argv[1], "-n") == 0) max_noises = atoi(argv[2]);
+    else if (strcmp(argv[1], "-f") == 0) {
+      if (strcmp(argv[2], "f32") == 0) format = TRAIN_F32;
+      else if (strcmp(argv[2], "rnnd") == 0) format = TRAIN_RNND;
+      else if (strcmp(argv[2], "rnnd16") == 0) format = TRAIN_RNND16;
+      else break;
+    }
+    else break;
+    argc -= 2;
+    argv += 2;
+  }
+  if (argc!=4 || nshards < 1 || max_noises < 1 || max_noises > MAX_NOISES || ((nshards > 1 || format != TRAIN_F32) && !prefix)) {
+    fprintf(stderr, "usage: %s [-j <shards>] [-o <prefix>] [-f f32|rnnd|rnnd16] [-s <seed>] [-r <rirs>] [-n <noises>] <speech> <noise> <count>\n", argv[0]);
+    fprintf(stderr, "  <speech> and <noise> are each a raw 16-bit or WAV file, a directory of .raw/.pcm/.wav files,\n");
+    fprintf(stderr, "  or a .txt/.list file with one \"path [weight]\" per line\n");
+    fprintf(stderr, "  -j  generate in parallel, one thread per shard, shard k is written to <prefix>-<k>.<format>\n");
+    fprintf(stderr, "  -o  output prefix (default: a single f32 shard on stdout)\n");
+    fprintf(stderr, "  -f  f32: raw float rows (default); rnnd: chunked, indexed dataset; rnnd16: the same in fp16\n");
+    fprintf(stderr, "  -s  random seed; the same seed and shard count give the same output\n");
+    fprintf(stderr, "  -r  room impulse responses (same forms as <speech>), applied to half of the segments\n");
+    fprintf(stderr, "  -n  mix up to this many noise sources at once (1-%d, default 1)\n", MAX_NOISES);
+    return 1;
+  }
+  maxCount = atoi(argv[3]);
+  speech = train_corpus_open(argv[1]);
+  noise = train_corpus_open(argv[2]);
+  if (rir_path) rirs = train_corpus_open(rir_path);
+  if (!speech || !noise || (rir_path && !rirs)) return 1;
+  fprintf(stderr, "speech: %d files, %ld frames; noise: %d files, %ld frames\n",
+          speech->nb_files, speech->frames, noise->nb_files, noise->frames);
+  check_init(); // 在各个线程创建 DenoiseState 之前初始化
+  shards = calloc(nshards, sizeof(TrainShard));
+  threads = calloc(nshards, sizeof(pthread_t));
+  if (!shards || !threads) return 1;
+  for (k = 0; k < nshards; k++) {
+    TrainShard *sh = &shards[k];
+    sh->gen = train_generator_create(speech, noise, rirs, max_noises, k, nshards, seed);
+    if (!sh->gen) return 1;
+    sh->count = (int)((long long)maxCount * (k + 1) / nshards - (long long)maxCount * k / nshards);
+    sh->shard = k;
+    if (prefix) {
+      char name[4096];
+      FILE *f;
+      snprintf(name, sizeof(name), "%s-%d.%s", prefix, k, format == TRAIN_F32 ? "f32" : "rnnd");
+      f = fopen(name, "wb");
+      if (!f || writer_open(&sh->out, f, format) != 0) {
+        fprintf(stderr, "cannot open %s\n", name);
+        return 1;
+      }
+    } else {
+      writer_open(&sh->out, stdout, TRAIN_F32);
+    }
+  }
+  for (k = 0; k < nshards; k++) {
+    if (pthread_create(&threads[k], NULL, generate_shard, &shards[k]) != 0)
+      shards[k].ret = 1;
+    else
+      shards[k].started = 1;
+  }
+  for (k = 0; k < nshards; k++) {
+    if (shards[k].started) pthread_join(threads[k], NULL);
+    if (writer_close(&shards[k].out) != 0) {
+      fprintf(stderr, "write error\n");
+      ret = 1;
+    }
+    ret |= shards[k].ret;
+    train_generator_destroy(shards[k].gen);
+  }
+  fprintf(stderr, "matrix size: %d x %d\n", maxCount, NB_FEATURES + 2*NB_BANDS + 1);
+  free(shards);
+  free(threads);
+  train_corpus_free(speech);
+  train_corpus_free(noise);
+  if (rirs) train_corpus_free(rirs);
+  return ret;
+}
+
+#endif /* RNNOISE_TRAINING_MODULE */
+
 #endif
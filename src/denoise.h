@@ -0,0 +1,44 @@
+//
+// denoise.c 给库内其它模块用的接口
+//
+
+#ifndef RNNOISE_TOYS_DENOISE_H
+#define RNNOISE_TOYS_DENOISE_H
+
+#include "rnnoise.h"
+
+/*
+    rnnoise_process_frame 拆成前后两段: 前一段是高通滤波和特征提取, 后一段是网络, 增益和合成.
+    两段读写 DenoiseState 中不重叠的部分, 可以在两个线程上同时处理相邻的两帧 (前一段处理第 t+1 帧时后一段处理第 t 帧);
+    两段之间的中间结果放在 denoise_frame_size() 字节的缓冲里
+*/
+int denoise_frame_size(void);
+
+void denoise_frame_front(DenoiseState *st, void *frame, const float *in);
+
+float denoise_frame_back(DenoiseState *st, void *frame, float *out);
+
+#if TRAINING
+/*
+    训练数据的生成 (只在 TRAINING 下编译): 语料库是 mmap 的一组语音/噪声/RIR 文件, 可以由多个生成器共享;
+    每个生成器是一个确定的分片, 每次 train_generator_next 得到一帧 NB_TRAIN 个值: 特征, 增益, 噪声能量和 VAD.
+    一个生成器同一时刻只能在一个线程中使用. denoise_training 和 Python 扩展 (training/rnnoise_features.c) 都用这组接口
+*/
+#define NB_TRAIN (42 + 2*22 + 1)    /* NB_FEATURES + 2*NB_BANDS + 1 */
+
+typedef struct Corpus Corpus;
+typedef struct TrainGenerator TrainGenerator;
+
+Corpus *train_corpus_open(const char *path);
+
+void train_corpus_free(Corpus *c);
+
+TrainGenerator *train_generator_create(const Corpus *speech, const Corpus *noise, const Corpus *rirs, int max_noises,
+                                       int shard, int nshards, unsigned long long seed);
+
+void train_generator_next(TrainGenerator *gen, float *row);
+
+void train_generator_destroy(TrainGenerator *gen);
+#endif
+
+#endif //RNNOISE_TOYS_DENOISE_H
@@ -0,0 +1,902 @@
+//
+// 多路流的降噪引擎: 每路流一个 DenoiseState, 一组 worker 线程通过 work-stealing 队列处理各路流的帧
+//
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // pthread_setaffinity_np
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include "arch.h"
+#include "rnnoise.h"
+
+#define FRAME_SIZE 480
+
+/* worker 一次最多连续处理同一路流的帧数, 之后把流放回队尾, 避免一路积压的流让其它流等太久 */
+#define ENGINE_MAX_RUN 4
+
+/* 默认每帧的期限: 一帧 10ms */
+#define ENGINE_DEFAULT_DEADLINE 10000000LL
+
+/* 负载连续这么多个周期低于下限才升档, 降档则立即进行 */
+#define GOVERNOR_HOLD 5
+
+/* 降一档只省下一路流的一部分时间, 每个周期调整的流数按超出的比例放大 */
+#define GOVERNOR_GAIN 2
+
+/*
+    每路流的输入是单生产者单消费者的 RNNoiseRing, worker 直接在环形缓冲上处理;
+    pull 模式下的输出队列同样是单生产者单消费者的: out_head 只由 worker 写, out_tail 只由 pull 的线程写.
+    scheduled 保证同一时刻一路流最多在一个 worker 的队列里或正在被处理, 所以同一路流的帧按顺序处理
+*/
+typedef struct {
+    DenoiseState *st;
+    RNNoiseRing *in;
+    float *out;
+    float *vad;
+    long long *arrival; // 每帧 push 的时间(ns), 下标为 pushed/popped 对 queue_frames 取余
+    unsigned pushed;    // 只由 push 的线程修改
+    unsigned popped;    // 只由当前处理这路流的 worker 修改
+    atomic_uint out_head;
+    atomic_uint out_tail;
+    atomic_int scheduled;
+    atomic_int closing;
+    atomic_int retired;
+    atomic_int tier;     // 调控器给这路流的质量档位, worker 处理前设置到 st 上
+    atomic_int priority;
+    int used;
+    int ready; // 已经创建好且没有在移除, 由 lock 保护; rnnoise_engine_set_model 只对这些流换模型
+    int home; // 有新帧时放入这个 worker 的队列, 同一路流尽量在同一个核上处理
+} EngineStream;
+
+/* 流 id 的双端队列, 所有者从队头取, 其它 worker 从队尾偷; 每路流最多在一个队列里, 容量为 max_streams */
+typedef struct {
+    pthread_mutex_t lock;
+    int *ids;
+    int head;
+    atomic_int count;
+} WorkDeque;
+
+typedef struct {
+    RNNoiseEngine *engine;
+    int index;
+    float out[FRAME_SIZE]; // callback 模式下的输出帧
+    /* 批处理: 收集中的流和 rnnoise_process_batch 的参数 */
+    RNNoiseBatch *batch;
+    pthread_mutex_t batch_lock; // 处理 batch 时持有, 加流和换模型时为 batch 预留空间要等它
+    int *ids;
+    DenoiseState **sts;
+    const float **ins;
+    float **outs;
+    float *vads;
+    float *batch_out; // callback 模式下的输出帧
+    int nbatch;
+    long long collect_start; // 收集到第一路流的时间
+    long long oldest;        // 已收集的帧中最早的 push 时间
+    long long frame_cost;    // 每帧处理时间的滑动平均
+    long long frame_dev;     // 每帧处理时间的平均偏差, 与 frame_cost 一起估计还来得及开始处理的最晚时间
+    /* 统计, 只由这个 worker 修改 */
+    atomic_llong batches;
+    atomic_llong frames;
+    atomic_llong early_flushes;
+    atomic_llong misses;
+    atomic_llong slack_sum;
+    atomic_llong min_slack;
+    atomic_llong busy; // 处理帧所用的时间(ns)
+} EngineWorker;
+
+struct RNNoiseEngine {
+    int nworkers;
+    int max_streams;
+    int queue_frames; // 2 的幂
+    rnnoise_engine_callback callback;
+    void *user;
+    int max_batch;       // 1 表示不做批处理
+    long long window;    // 收集一批的时间窗口(ns)
+    long long deadline;  // 每帧从 push 到处理完的期限(ns)
+    EngineStream *streams;
+    WorkDeque *deques;
+    EngineWorker *workers;
+    pthread_t *threads;
+    int nthreads; // 已启动的线程数
+    pthread_mutex_t lock;
+    pthread_cond_t wake; // 有新的工作
+    pthread_cond_t idle; // 帧处理完 / 流已移除
+    atomic_int sleepers;
+    atomic_int waiters;
+    atomic_int quit;
+    atomic_long queued; // 已 push 还没处理完的帧数
+    atomic_long arrived; // 已 push 的帧数
+    /* CPU 调控器, 由到期后第一个拿到 gov_lock 的 worker 运行 */
+    pthread_mutex_t gov_lock;
+    atomic_llong gov_next; // 下一次调控的时间, 关闭时为 LLONG_MAX
+    float budget;
+    float hysteresis;
+    long long period;
+    long long gov_last;      // 上一次调控的时间
+    long long gov_busy;      // 上一次调控时所有 worker 的 busy 之和
+    long long gov_frames;    // 上一次调控时已处理的帧数
+    long gov_arrived;        // 上一次调控时已 push 的帧数
+    float gov_cost;          // 最近测得的每帧处理时间(ns)
+    int gov_calm;            // 负载连续低于下限的周期数
+    atomic_int load;         // 上一个周期的负载, 千分比
+    atomic_long tier_changes;
+};
+
+static void deque_push(WorkDeque *q, int cap, int id) {
+    int n;
+    pthread_mutex_lock(&q->lock);
+    n = atomic_load_explicit(&q->count, memory_order_relaxed);
+    q->ids[(q->head + n) % cap] = id;
+    atomic_store(&q->count, n + 1);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static int deque_pop(WorkDeque *q, int cap, int steal) {
+    int id = -1;
+    int n;
+    if (atomic_load(&q->count) == 0)
+        return -1;
+    pthread_mutex_lock(&q->lock);
+    n = atomic_load_explicit(&q->count, memory_order_relaxed);
+    if (n > 0) {
+        if (steal) {
+            id = q->ids[(q->head + n - 1) % cap];
+        } else {
+            id = q->ids[q->head];
+            q->head = (q->head + 1) % cap;
+        }
+        atomic_store(&q->count, n - 1);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return id;
+}
+
+/*
+    判断一路流是否还有可以处理的帧. 写入新帧/取走输出后再尝试调度, 与 worker 清除 scheduled 后再检查,
+    两边都用 seq_cst, 至少有一边能看到对方, 不会出现有帧但没有被调度的流
+*/
+static int stream_ready(const RNNoiseEngine *e, EngineStream *s) {
+    if (atomic_load(&s->closing))
+        return 1;
+    if (rnnoise_ring_available(s->in) < FRAME_SIZE)
+        return 0;
+    // pull 模式下输出队列满了就等 rnnoise_engine_pull 取走后再调度
+    return e->callback || atomic_load(&s->out_head) - atomic_load(&s->out_tail) < (unsigned) e->queue_frames;
+}
+
+static void schedule_stream(RNNoiseEngine *e, int id, int worker) {
+    if (atomic_exchange(&e->streams[id].scheduled, 1))
+        return;
+    deque_push(&e->deques[worker], e->max_streams, id);
+    // 与 worker 睡眠前先增加 sleepers 再检查队列相对应, 两边都是 seq_cst, 不会漏掉唤醒
+    if (atomic_load(&e->sleepers)) {
+        pthread_mutex_lock(&e->lock);
+        pthread_cond_signal(&e->wake);
+        pthread_mutex_unlock(&e->lock);
+    }
+}
+
+static void frames_done(RNNoiseEngine *e, long n) {
+    if (atomic_fetch_sub(&e->queued, n) == n && atomic_load(&e->waiters)) {
+        pthread_mutex_lock(&e->lock);
+        pthread_cond_broadcast(&e->idle);
+        pthread_mutex_unlock(&e->lock);
+    }
+}
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* 一帧处理完, 统计离期限还剩多少时间; 必须在 rnnoise_ring_read_commit 之前调用 */
+static void frame_finished(EngineWorker *w, EngineStream *s, long long now) {
+    RNNoiseEngine *e = w->engine;
+    long long slack = s->arrival[s->popped++ & (e->queue_frames - 1)] + e->deadline - now;
+    atomic_fetch_add_explicit(&w->frames, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&w->slack_sum, slack, memory_order_relaxed);
+    if (slack < 0)
+        atomic_fetch_add_explicit(&w->misses, 1, memory_order_relaxed);
+    if (slack < atomic_load_explicit(&w->min_slack, memory_order_relaxed))
+        atomic_store_explicit(&w->min_slack, slack, memory_order_relaxed);
+}
+
+static void run_stream(EngineWorker *w, int id) {
+    RNNoiseEngine *e = w->engine;
+    EngineStream *s = &e->streams[id];
+    int mask = e->queue_frames - 1;
+    int n;
+    int closing = atomic_load(&s->closing);
+    rnnoise_set_tier(s->st, atomic_load_explicit(&s->tier, memory_order_relaxed));
+    for (n = 0; closing || n < ENGINE_MAX_RUN; n++) {
+        const float *in = rnnoise_ring_read_peek(s->in);
+        if (!in)
+            break;
+        if (closing) {
+            // 移除中的流, 剩下的帧直接丢弃
+            s->popped++;
+        } else if (e->callback) {
+            float vad = rnnoise_process_frame(s->st, w->out, in);
+            e->callback(e->user, id, w->out, vad);
+        } else {
+            unsigned head = atomic_load_explicit(&s->out_head, memory_order_relaxed);
+            if (head - atomic_load_explicit(&s->out_tail, memory_order_acquire) >= (unsigned) e->queue_frames)
+                break;
+            s->vad[head & mask] = rnnoise_process_frame(s->st, &s->out[(head & mask) * FRAME_SIZE], in);
+            atomic_store_explicit(&s->out_head, head + 1, memory_order_release);
+        }
+        if (!closing) {
+            // 逐帧处理时每帧算作一批
+            atomic_fetch_add_explicit(&w->batches, 1, memory_order_relaxed);
+            frame_finished(w, s, now_ns());
+        }
+        rnnoise_ring_read_commit(s->in);
+    }
+    if (n)
+        frames_done(e, n);
+    if (closing) {
+        // 这是 worker 最后一次访问这路流, 之后由 rnnoise_engine_remove_stream 释放
+        pthread_mutex_lock(&e->lock);
+        atomic_store(&s->retired, 1);
+        pthread_cond_broadcast(&e->idle);
+        pthread_mutex_unlock(&e->lock);
+        return;
+    }
+    atomic_store(&s->scheduled, 0);
+    if (stream_ready(e, s))
+        schedule_stream(e, id, w->index);
+}
+
+/*
+    处理收集到的一批流, 每路流一帧. 移除中的流交给 run_stream 丢弃剩下的帧
+*/
+static void run_batch(EngineWorker *w) {
+    RNNoiseEngine *e = w->engine;
+    int mask = e->queue_frames - 1;
+    int j;
+    int n = 0;
+    long long now;
+    for (j = 0; j < w->nbatch; j++) {
+        int id = w->ids[j];
+        EngineStream *s = &e->streams[id];
+        if (atomic_load(&s->closing)) {
+            run_stream(w, id);
+            continue;
+        }
+        if (!e->callback && atomic_load_explicit(&s->out_head, memory_order_relaxed) -
+                atomic_load_explicit(&s->out_tail, memory_order_acquire) >= (unsigned) e->queue_frames) {
+            // 输出队列满了, 这一帧留在输入里, 等 rnnoise_engine_pull 取走输出后重新调度
+            atomic_store(&s->scheduled, 0);
+            if (stream_ready(e, s))
+                schedule_stream(e, id, w->index);
+            continue;
+        }
+        w->ids[n] = id;
+        w->sts[n] = s->st;
+        rnnoise_set_tier(s->st, atomic_load_explicit(&s->tier, memory_order_relaxed));
+        w->ins[n] = rnnoise_ring_read_peek(s->in);
+        if (e->callback)
+            w->outs[n] = &w->batch_out[n * FRAME_SIZE];
+        else
+            w->outs[n] = &s->out[(atomic_load_explicit(&s->out_head, memory_order_relaxed) & mask) * FRAME_SIZE];
+        n++;
+    }
+    w->nbatch = 0;
+    if (n == 0)
+        return;
+    pthread_mutex_lock(&w->batch_lock);
+    rnnoise_process_batch(w->batch, w->sts, w->outs, w->ins, w->vads, n);
+    pthread_mutex_unlock(&w->batch_lock);
+    now = now_ns();
+    atomic_fetch_add_explicit(&w->batches, 1, memory_order_relaxed);
+    for (j = 0; j < n; j++) {
+        int id = w->ids[j];
+        EngineStream *s = &e->streams[id];
+        if (e->callback) {
+            e->callback(e->user, id, w->outs[j], w->vads[j]);
+        } else {
+            unsigned head = atomic_load_explicit(&s->out_head, memory_order_relaxed);
+            s->vad[head & mask] = w->vads[j];
+            atomic_store_explicit(&s->out_head, head + 1, memory_order_release);
+        }
+        // 先读到达时间再释放这一帧, 之后 push 的线程可能覆盖它
+        frame_finished(w, s, now);
+        rnnoise_ring_read_commit(s->in);
+    }
+    frames_done(e, n);
+    for (j = 0; j < n; j++) {
+        int id = w->ids[j];
+        atomic_store(&e->streams[id].scheduled, 0);
+        if (stream_ready(e, &e->streams[id]))
+            schedule_stream(e, id, w->index);
+    }
+}
+
+static int has_work(RNNoiseEngine *e) {
+    int i;
+    for (i = 0; i < e->nworkers; i++)
+        if (atomic_load(&e->deques[i].count))
+            return 1;
+    return 0;
+}
+
+static void pin_worker(int index) {
+#ifdef __linux__
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t set;
+    if (ncpu <= 0)
+        return;
+    CPU_ZERO(&set);
+    CPU_SET(index % ncpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+    (void) index;
+#endif
+}
+
+/* 自己的队列空了就从其它 worker 的队尾偷 */
+static int next_stream(RNNoiseEngine *e, int index) {
+    int i;
+    int id = deque_pop(&e->deques[index], e->max_streams, 0);
+    for (i = 1; id < 0 && i < e->nworkers; i++)
+        id = deque_pop(&e->deques[(index + i) % e->nworkers], e->max_streams, 1);
+    return id;
+}
+
+/* 没有工作时睡眠, 直到有新的工作, 或者到了 until(ns, 0 表示不限时) */
+static void worker_sleep(RNNoiseEngine *e, long long until) {
+    pthread_mutex_lock(&e->lock);
+    atomic_fetch_add(&e->sleepers, 1);
+    while (!atomic_load(&e->quit) && !has_work(e)) {
+        if (until) {
+            // 条件变量用的是 CLOCK_REALTIME, 换算成绝对时间
+            struct timespec ts;
+            long long left = until - now_ns();
+            if (left <= 0)
+                break;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            left += ts.tv_nsec;
+            ts.tv_sec += left / 1000000000LL;
+            ts.tv_nsec = left % 1000000000LL;
+            if (pthread_cond_timedwait(&e->wake, &e->lock, &ts) == ETIMEDOUT)
+                break;
+        } else {
+            pthread_cond_wait(&e->wake, &e->lock);
+        }
+    }
+    atomic_fetch_sub(&e->sleepers, 1);
+    pthread_mutex_unlock(&e->lock);
+}
+
+/* 把一路流加入正在收集的一批 */
+static void batch_add(EngineWorker *w, int id) {
+    EngineStream *s = &w->engine->streams[id];
+    long long arrival = s->arrival[s->popped & (w->engine->queue_frames - 1)];
+    if (w->nbatch == 0) {
+        w->collect_start = now_ns();
+        w->oldest = arrival;
+    } else if (arrival < w->oldest) {
+        w->oldest = arrival;
+    }
+    w->ids[w->nbatch++] = id;
+}
+
+/*
+    选一路流调整档位: 降档选优先级最低的流中质量最好的, 升档选优先级最高的流中质量最差的,
+    同一优先级的流轮流调整, 质量差别不会太大. 调用时持有 e->lock
+*/
+static int pick_stream(RNNoiseEngine *e, int down) {
+    int i;
+    int best = -1, best_prio = 0, best_tier = 0;
+    for (i = 0; i < e->max_streams; i++) {
+        EngineStream *s = &e->streams[i];
+        int tier, prio;
+        if (!s->used || atomic_load(&s->closing))
+            continue;
+        tier = atomic_load_explicit(&s->tier, memory_order_relaxed);
+        prio = atomic_load_explicit(&s->priority, memory_order_relaxed);
+        if (down ? tier == RNNOISE_TIER_BYPASS : tier == RNNOISE_TIER_FULL)
+            continue;
+        if (best < 0 || (down ? prio < best_prio || (prio == best_prio && tier < best_tier)
+                              : prio > best_prio || (prio == best_prio && tier > best_tier))) {
+            best = i;
+            best_prio = prio;
+            best_tier = tier;
+        }
+    }
+    return best;
+}
+
+/*
+    每个周期用这个周期里测得的每帧处理时间乘以 push 进来的帧数, 估计处理这些帧需要 worker 总时间的比例.
+    不直接用 worker 忙碌的比例: 积压时它一直是 1, 看不出超了多少, 也看不出降档的效果.
+    超过预算时按超出的比例给一部分流降一档,
+    连续 GOVERNOR_HOLD 个周期低于 budget - hysteresis 时按余量给一部分流升一档;
+    降档快升档慢, 中间留出滞回区间, 负载不会在两个档位之间来回振荡
+*/
+static void govern(RNNoiseEngine *e, long long now) {
+    int i;
+    int nstreams = 0;
+    int steps = 0;
+    int down = 0;
+    long long busy = 0;
+    long long frames = 0;
+    long arrived = atomic_load(&e->arrived);
+    float load, low;
+    if (pthread_mutex_trylock(&e->gov_lock) != 0)
+        return;
+    if (now < atomic_load(&e->gov_next)) {
+        pthread_mutex_unlock(&e->gov_lock);
+        return;
+    }
+    for (i = 0; i < e->nworkers; i++) {
+        busy += atomic_load_explicit(&e->workers[i].busy, memory_order_relaxed);
+        frames += atomic_load_explicit(&e->workers[i].frames, memory_order_relaxed);
+    }
+    if (frames > e->gov_frames)
+        e->gov_cost = (float) (busy - e->gov_busy) / (frames - e->gov_frames);
+    load = e->gov_cost * (arrived - e->gov_arrived) / ((now - e->gov_last) * e->nworkers);
+    e->gov_busy = busy;
+    e->gov_frames = frames;
+    e->gov_arrived = arrived;
+    e->gov_last = now;
+    atomic_store(&e->load, (int) (load * 1000));
+    atomic_store(&e->gov_next, now + e->period);
+
+    pthread_mutex_lock(&e->lock);
+    for (i = 0; i < e->max_streams; i++)
+        nstreams += e->streams[i].used && !atomic_load(&e->streams[i].closing);
+    low = e->budget - e->hysteresis;
+    if (load > e->budget) {
+        down = 1;
+        steps = (int) (nstreams * GOVERNOR_GAIN * (load - e->budget) / load) + 1;
+        e->gov_calm = 0;
+    } else if (load < low && ++e->gov_calm >= GOVERNOR_HOLD) {
+        steps = IMAX(1, (int) (nstreams * (low - load) / (low * GOVERNOR_GAIN)));
+        e->gov_calm = 0;
+    } else if (load >= low) {
+        e->gov_calm = 0;
+    }
+    for (i = 0; i < steps; i++) {
+        int id = pick_stream(e, down);
+        if (id < 0)
+            break;
+        atomic_fetch_add_explicit(&e->streams[id].tier, down ? 1 : -1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&e->tier_changes, 1, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&e->lock);
+    pthread_mutex_unlock(&e->gov_lock);
+}
+
+static void *worker_main(void *arg) {
+    EngineWorker *w = arg;
+    RNNoiseEngine *e = w->engine;
+    pin_worker(w->index);
+    while (!atomic_load(&e->quit)) {
+        long long start, end, cost;
+        int n;
+        int id = next_stream(e, w->index);
+        if (id < 0 && w->nbatch == 0) {
+            worker_sleep(e, 0);
+            continue;
+        }
+        if (id >= 0 && e->max_batch <= 1) {
+            start = now_ns();
+            run_stream(w, id);
+            end = now_ns();
+            atomic_fetch_add_explicit(&w->busy, end - start, memory_order_relaxed);
+            if (end >= atomic_load_explicit(&e->gov_next, memory_order_relaxed))
+                govern(e, end);
+            continue;
+        }
+        // 批处理: 在时间窗口内收集各路流的帧, 凑满一批, 或者窗口结束, 或者最早的帧快到期限时处理
+        if (id >= 0)
+            batch_add(w, id);
+        if (w->nbatch < e->max_batch) {
+            long long window_end = w->collect_start + e->window;
+            // 与 TCP 估计重传超时一样用 平均值 + 4 倍平均偏差, 处理时间偶尔变长时也不会错过期限
+            long long latest = w->oldest + e->deadline - (w->frame_cost + 4 * w->frame_dev) * w->nbatch;
+            if (id >= 0)
+                continue;
+            if (now_ns() < (latest < window_end ? latest : window_end)) {
+                worker_sleep(e, latest < window_end ? latest : window_end);
+                continue;
+            }
+            if (latest < window_end)
+                atomic_fetch_add_explicit(&w->early_flushes, 1, memory_order_relaxed);
+        }
+        n = w->nbatch;
+        start = now_ns();
+        run_batch(w);
+        end = now_ns();
+        atomic_fetch_add_explicit(&w->busy, end - start, memory_order_relaxed);
+        if (end >= atomic_load_explicit(&e->gov_next, memory_order_relaxed))
+            govern(e, end);
+        cost = (end - start) / n;
+        w->frame_dev += (llabs(cost - w->frame_cost) - w->frame_dev) / 4;
+        w->frame_cost += (cost - w->frame_cost) / 8;
+    }
+    return NULL;
+}
+
+static void free_worker_batch(EngineWorker *w) {
+    if (w->batch)
+        rnnoise_batch_destroy(w->batch);
+    free(w->ids);
+    free(w->sts);
+    free(w->ins);
+    free(w->outs);
+    free(w->vads);
+    free(w->batch_out);
+    w->batch = NULL;
+    w->ids = NULL;
+    w->sts = NULL;
+    w->ins = NULL;
+    w->outs = NULL;
+    w->vads = w->batch_out = NULL;
+}
+
+/* 让每个 worker 的 batch 放得下 model 的流, worker 处理时不再分配 */
+static int reserve_batches(RNNoiseEngine *e, RNNModel *model) {
+    int i, ret = 0;
+    if (e->max_batch <= 1)
+        return 0;
+    for (i = 0; i < e->nworkers; i++) {
+        EngineWorker *w = &e->workers[i];
+        pthread_mutex_lock(&w->batch_lock);
+        if (rnnoise_batch_reserve(w->batch, model) != 0)
+            ret = -1;
+        pthread_mutex_unlock(&w->batch_lock);
+    }
+    return ret;
+}
+
+static void free_stream(EngineStream *s) {
+    if (s->st)
+        rnnoise_destroy(s->st);
+    if (s->in)
+        rnnoise_ring_destroy(s->in);
+    free(s->out);
+    free(s->vad);
+    free(s->arrival);
+    s->arrival = NULL;
+    s->st = NULL;
+    s->in = NULL;
+    s->out = s->vad = NULL;
+}
+
+RNNoiseEngine *rnnoise_engine_create(int nthreads, int max_streams, int queue_frames,
+                                     rnnoise_engine_callback callback, void *user) {
+    int i;
+    RNNoiseEngine *e;
+    if (max_streams <= 0 || queue_frames <= 0)
+        return NULL;
+    if (nthreads <= 0)
+        nthreads = IMAX(1, (int) sysconf(_SC_NPROCESSORS_ONLN));
+    e = calloc(1, sizeof(*e));
+    if (!e)
+        return NULL;
+    e->nworkers = nthreads;
+    e->max_streams = max_streams;
+    for (e->queue_frames = 1; e->queue_frames < queue_frames; e->queue_frames *= 2);
+    e->callback = callback;
+    e->user = user;
+    e->max_batch = 1;
+    e->deadline = ENGINE_DEFAULT_DEADLINE;
+    pthread_mutex_init(&e->lock, NULL);
+    pthread_cond_init(&e->wake, NULL);
+    pthread_cond_init(&e->idle, NULL);
+    pthread_mutex_init(&e->gov_lock, NULL);
+    atomic_init(&e->gov_next, LLONG_MAX);
+    e->streams = calloc(max_streams, sizeof(*e->streams));
+    e->deques = calloc(nthreads, sizeof(*e->deques));
+    e->workers = calloc(nthreads, sizeof(*e->workers));
+    e->threads = calloc(nthreads, sizeof(*e->threads));
+    if (!e->streams || !e->deques || !e->workers || !e->threads) {
+        rnnoise_engine_destroy(e);
+        return NULL;
+    }
+    for (i = 0; i < max_streams; i++)
+        atomic_store(&e->streams[i].scheduled, 1); // 空闲的槽位不会被调度
+    for (i = 0; i < nthreads; i++) {
+        pthread_mutex_init(&e->deques[i].lock, NULL);
+        e->deques[i].ids = malloc(max_streams * sizeof(int));
+        if (!e->deques[i].ids) {
+            rnnoise_engine_destroy(e);
+            return NULL;
+        }
+    }
+    for (i = 0; i < nthreads; i++) {
+        e->workers[i].engine = e;
+        e->workers[i].index = i;
+        pthread_mutex_init(&e->workers[i].batch_lock, NULL);
+        atomic_store(&e->workers[i].min_slack, ENGINE_DEFAULT_DEADLINE);
+        if (pthread_create(&e->threads[i], NULL, worker_main, &e->workers[i]) != 0) {
+            rnnoise_engine_destroy(e);
+            return NULL;
+        }
+        e->nthreads++;
+    }
+    return e;
+}
+
+void rnnoise_engine_destroy(RNNoiseEngine *e) {
+    int i;
+    pthread_mutex_lock(&e->lock);
+    atomic_store(&e->quit, 1);
+    pthread_cond_broadcast(&e->wake);
+    pthread_mutex_unlock(&e->lock);
+    for (i = 0; i < e->nthreads; i++)
+        pthread_join(e->threads[i], NULL);
+    if (e->streams) {
+        for (i = 0; i < e->max_streams; i++)
+            free_stream(&e->streams[i]);
+    }
+    if (e->workers) {
+        for (i = 0; i < e->nworkers; i++) {
+            free_worker_batch(&e->workers[i]);
+            if (e->workers[i].engine)
+                pthread_mutex_destroy(&e->workers[i].batch_lock);
+        }
+    }
+    if (e->deques) {
+        for (i = 0; i < e->nworkers; i++) {
+            if (e->deques[i].ids)
+                pthread_mutex_destroy(&e->deques[i].lock);
+            free(e->deques[i].ids);
+        }
+    }
+    pthread_cond_destroy(&e->idle);
+    pthread_cond_destroy(&e->wake);
+    pthread_mutex_destroy(&e->lock);
+    pthread_mutex_destroy(&e->gov_lock);
+    free(e->streams);
+    free(e->deques);
+    free(e->workers);
+    free(e->threads);
+    free(e);
+}
+
+int rnnoise_engine_add_stream(RNNoiseEngine *e, RNNModel *model) {
+    int id;
+    EngineStream *s;
+    pthread_mutex_lock(&e->lock);
+    for (id = 0; id < e->max_streams && e->streams[id].used; id++);
+    if (id < e->max_streams)
+        e->streams[id].used = 1;
+    pthread_mutex_unlock(&e->lock);
+    if (id == e->max_streams)
+        return -1;
+    s = &e->streams[id];
+    s->st = rnnoise_create(model);
+    s->in = rnnoise_ring_create(RNNOISE_RING_FLOAT, e->queue_frames);
+    s->arrival = malloc(e->queue_frames * sizeof(long long));
+    if (!e->callback) {
+        s->out = malloc(e->queue_frames * FRAME_SIZE * sizeof(float));
+        s->vad = malloc(e->queue_frames * sizeof(float));
+    }
+    if (!s->st || !s->in || !s->arrival || (!e->callback && (!s->out || !s->vad)) ||
+        reserve_batches(e, model) != 0) {
+        free_stream(s);
+        pthread_mutex_lock(&e->lock);
+        s->used = 0;
+        pthread_mutex_unlock(&e->lock);
+        return -1;
+    }
+    s->pushed = s->popped = 0;
+    atomic_store(&s->out_head, 0);
+    atomic_store(&s->out_tail, 0);
+    atomic_store(&s->closing, 0);
+    atomic_store(&s->retired, 0);
+    atomic_store(&s->tier, RNNOISE_TIER_FULL);
+    atomic_store(&s->priority, 0);
+    s->home = id % e->nworkers;
+    pthread_mutex_lock(&e->lock);
+    s->ready = 1;
+    pthread_mutex_unlock(&e->lock);
+    // 最后才清除 scheduled, 之前这路流不会被调度
+    atomic_store(&s->scheduled, 0);
+    return id;
+}
+
+void rnnoise_engine_remove_stream(RNNoiseEngine *e, int id) {
+    EngineStream *s = &e->streams[id];
+    pthread_mutex_lock(&e->lock);
+    s->ready = 0;
+    pthread_mutex_unlock(&e->lock);
+    atomic_store(&s->closing, 1);
+    // 调度一次, 由 worker 丢弃剩下的帧; 已经在队列里或正在处理的流会在下一次处理时看到 closing
+    schedule_stream(e, id, s->home);
+    pthread_mutex_lock(&e->lock);
+    while (!atomic_load(&s->retired))
+        pthread_cond_wait(&e->idle, &e->lock);
+    pthread_mutex_unlock(&e->lock);
+    free_stream(s);
+    pthread_mutex_lock(&e->lock);
+    s->used = 0;
+    pthread_mutex_unlock(&e->lock);
+}
+
+int rnnoise_engine_push(RNNoiseEngine *e, int id, const float *in) {
+    EngineStream *s = &e->streams[id];
+    // 先确认有空位再记下到达时间, 满的时候这个位置还属于最早的那一帧
+    if (rnnoise_ring_available(s->in) >= e->queue_frames * FRAME_SIZE)
+        return -1;
+    s->arrival[s->pushed & (e->queue_frames - 1)] = now_ns();
+    // 环形缓冲里总是整数帧, 有空位就能写入整帧
+    rnnoise_ring_write(s->in, in, FRAME_SIZE);
+    s->pushed++;
+    atomic_fetch_add(&e->queued, 1);
+    atomic_fetch_add_explicit(&e->arrived, 1, memory_order_relaxed);
+    // 输出队列满的流不调度, 由 rnnoise_engine_pull 取走输出后再调度
+    if (stream_ready(e, s))
+        schedule_stream(e, id, s->home);
+    return 0;
+}
+
+int rnnoise_engine_pull(RNNoiseEngine *e, int id, float *out, float *vad) {
+    EngineStream *s = &e->streams[id];
+    int mask = e->queue_frames - 1;
+    unsigned tail = atomic_load_explicit(&s->out_tail, memory_order_relaxed);
+    if (e->callback || tail == atomic_load_explicit(&s->out_head, memory_order_acquire))
+        return 0;
+    memcpy(out, &s->out[(tail & mask) * FRAME_SIZE], FRAME_SIZE * sizeof(float));
+    if (vad)
+        *vad = s->vad[tail & mask];
+    atomic_store(&s->out_tail, tail + 1);
+    // 输出队列满时 worker 会停下这路流, 取走一帧后重新调度
+    if (stream_ready(e, s))
+        schedule_stream(e, id, s->home);
+    return 1;
+}
+
+void rnnoise_engine_flush(RNNoiseEngine *e) {
+    pthread_mutex_lock(&e->lock);
+    atomic_fetch_add(&e->waiters, 1);
+    while (atomic_load(&e->queued) > 0)
+        pthread_cond_wait(&e->idle, &e->lock);
+    atomic_fetch_sub(&e->waiters, 1);
+    pthread_mutex_unlock(&e->lock);
+}
+
+int rnnoise_engine_set_batching(RNNoiseEngine *e, int max_batch, int window_us, int deadline_us) {
+    int i;
+    if (max_batch <= 0 || window_us < 0 || deadline_us <= 0)
+        return -1;
+    // 只能在添加流之前调用: 没有流时 worker 不会访问批处理的缓冲, 持有 lock 期间也不会有新的流加进来
+    pthread_mutex_lock(&e->lock);
+    for (i = 0; i < e->max_streams; i++) {
+        if (e->streams[i].used) {
+            pthread_mutex_unlock(&e->lock);
+            return -1;
+        }
+    }
+    // 先回到逐帧处理, 所有缓冲都分配成功后才设置新的 max_batch; 失败时保持逐帧处理
+    e->max_batch = 1;
+    for (i = 0; i < e->nworkers; i++)
+        free_worker_batch(&e->workers[i]);
+    for (i = 0; i < e->nworkers && max_batch > 1; i++) {
+        EngineWorker *w = &e->workers[i];
+        w->batch = rnnoise_batch_create(max_batch);
+        w->ids = malloc(max_batch * sizeof(int));
+        w->sts = malloc(max_batch * sizeof(DenoiseState *));
+        w->ins = malloc(max_batch * sizeof(float *));
+        w->outs = malloc(max_batch * sizeof(float *));
+        w->vads = malloc(max_batch * sizeof(float));
+        w->batch_out = malloc(max_batch * FRAME_SIZE * sizeof(float));
+        if (!w->batch || !w->ids || !w->sts || !w->ins || !w->outs || !w->vads || !w->batch_out) {
+            for (; i >= 0; i--)
+                free_worker_batch(&e->workers[i]);
+            pthread_mutex_unlock(&e->lock);
+            return -1;
+        }
+    }
+    e->window = window_us * 1000LL;
+    e->deadline = deadline_us * 1000LL;
+    for (i = 0; i < e->nworkers; i++)
+        atomic_store(&e->workers[i].min_slack, e->deadline);
+    e->max_batch = max_batch;
+    pthread_mutex_unlock(&e->lock);
+    return 0;
+}
+
+void rnnoise_engine_get_stats(RNNoiseEngine *e, RNNoiseEngineStats *stats) {
+    int i;
+    long long slack_sum = 0;
+    long long busy = 0;
+    long long min_slack = e->deadline;
+    memset(stats, 0, sizeof(*stats));
+    for (i = 0; i < e->nworkers; i++) {
+        EngineWorker *w = &e->workers[i];
+        long long slack = atomic_load_explicit(&w->min_slack, memory_order_relaxed);
+        stats->batches += atomic_load_explicit(&w->batches, memory_order_relaxed);
+        stats->frames += atomic_load_explicit(&w->frames, memory_order_relaxed);
+        stats->early_flushes += atomic_load_explicit(&w->early_flushes, memory_order_relaxed);
+        stats->deadline_misses += atomic_load_explicit(&w->misses, memory_order_relaxed);
+        slack_sum += atomic_load_explicit(&w->slack_sum, memory_order_relaxed);
+        busy += atomic_load_explicit(&w->busy, memory_order_relaxed);
+        if (slack < min_slack)
+            min_slack = slack;
+    }
+    if (stats->batches)
+        stats->occupancy = (float) stats->frames / stats->batches / e->max_batch;
+    if (stats->frames)
+        stats->mean_slack_ms = slack_sum / 1e6f / stats->frames;
+    stats->min_slack_ms = min_slack / 1e6f;
+    if (stats->frames)
+        stats->mean_frame_us = busy / 1e3f / stats->frames;
+    stats->load = atomic_load(&e->load) / 1000.f;
+    stats->tier_changes = atomic_load_explicit(&e->tier_changes, memory_order_relaxed);
+    pthread_mutex_lock(&e->lock);
+    for (i = 0; i < e->max_streams; i++) {
+        if (e->streams[i].used)
+            stats->tier_streams[atomic_load_explicit(&e->streams[i].tier, memory_order_relaxed)]++;
+    }
+    pthread_mutex_unlock(&e->lock);
+}
+
+int rnnoise_engine_set_governor(RNNoiseEngine *e, float budget, float hysteresis, int period_ms) {
+    int i;
+    if (!(budget >= 0) || !(hysteresis >= 0) || hysteresis > budget || (budget > 0 && period_ms <= 0))
+        return -1;
+    pthread_mutex_lock(&e->gov_lock);
+    e->budget = budget;
+    e->hysteresis = hysteresis;
+    e->period = period_ms * 1000000LL;
+    e->gov_calm = 0;
+    e->gov_last = now_ns();
+    e->gov_busy = 0;
+    e->gov_frames = 0;
+    for (i = 0; i < e->nworkers; i++) {
+        e->gov_busy += atomic_load_explicit(&e->workers[i].busy, memory_order_relaxed);
+        e->gov_frames += atomic_load_explicit(&e->workers[i].frames, memory_order_relaxed);
+    }
+    e->gov_arrived = atomic_load(&e->arrived);
+    if (budget > 0) {
+        atomic_store(&e->gov_next, e->gov_last + e->period);
+    } else {
+        atomic_store(&e->gov_next, LLONG_MAX);
+        for (i = 0; i < e->max_streams; i++)
+            atomic_store(&e->streams[i].tier, RNNOISE_TIER_FULL);
+    }
+    pthread_mutex_unlock(&e->gov_lock);
+    return 0;
+}
+
+void rnnoise_engine_set_priority(RNNoiseEngine *e, int id, int priority) {
+    atomic_store(&e->streams[id].priority, priority);
+}
+
+int rnnoise_engine_get_tier(RNNoiseEngine *e, int id) {
+    return atomic_load(&e->streams[id].tier);
+}
+
+int rnnoise_engine_set_model(RNNoiseEngine *e, int id, RNNModel *model) {
+    int i, ret = 0;
+    // 新状态在这里分配, worker 在这路流的下一帧之前换上, 不用等流处理完
+    pthread_mutex_lock(&e->lock);
+    if (reserve_batches(e, model) != 0) {
+        pthread_mutex_unlock(&e->lock);
+        return -1;
+    }
+    for (i = id < 0 ? 0 : id; i < (id < 0 ? e->max_streams : id + 1); i++) {
+        if (e->streams[i].ready && rnnoise_set_model(e->streams[i].st, model) != 0)
+            ret = -1;
+    }
+    pthread_mutex_unlock(&e->lock);
+    return ret;
+}
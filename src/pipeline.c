@@ -0,0 +1,176 @@
+//
+// 单路流的两级流水线: 专门的线程做下一帧的特征提取, 调用 pull 的线程同时做这一帧的网络和合成
+//
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // pthread_setaffinity_np
+#endif
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include "rnnoise.h"
+#include "denoise.h"
+
+/* 特征提取最多领先的帧数 */
+#define PIPELINE_SLOTS 4
+
+/* 等待另一段之前先自旋的次数, 两段交接通常只要几微秒, 睡眠再唤醒要慢得多; 只有一个核时自旋只会占住另一段的时间, 不自旋 */
+#define PIPELINE_SPIN 20000
+
+/*
+    输入是单生产者单消费者的 RNNoiseRing; 两段之间的中间结果放在 PIPELINE_SLOTS 个槽里,
+    slot_head 只由特征线程写, slot_tail 只由 pull 的线程写, 同样是单生产者单消费者, 不用加锁.
+    只有一方要等待时才用到 lock/cond, 与引擎一样用 sleepers 保证不会漏掉唤醒
+*/
+struct RNNoisePipeline {
+    DenoiseState *st;
+    RNNoiseRing *in;
+    char *slots;
+    int slot_bytes;
+    atomic_uint slot_head;
+    atomic_uint slot_tail;
+    atomic_uint pushed;  // 只由 push 的线程修改
+    unsigned pulled;     // 只由 pull 的线程修改
+    int cpu;             // 特征线程绑定的 CPU, 负数表示不绑定
+    int spin;
+    pthread_t thread;
+    int started;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    atomic_int sleepers;
+    atomic_int quit;
+};
+
+static int front_ready(RNNoisePipeline *p) {
+    return atomic_load(&p->quit) || (rnnoise_ring_available(p->in) >= rnnoise_get_frame_size() &&
+                                     atomic_load(&p->slot_head) - atomic_load(&p->slot_tail) < PIPELINE_SLOTS);
+}
+
+static int back_ready(RNNoisePipeline *p) {
+    return atomic_load(&p->slot_head) != atomic_load(&p->slot_tail);
+}
+
+/* 等到 ready(p) 成立: 先自旋, 再在条件变量上睡眠 */
+static void pipeline_wait(RNNoisePipeline *p, int (*ready)(RNNoisePipeline *)) {
+    int i;
+    for (i = 0; i < p->spin; i++) {
+        if (ready(p))
+            return;
+    }
+    pthread_mutex_lock(&p->lock);
+    // 与 pipeline_wake 先修改状态再检查 sleepers 相对应, 两边都是 seq_cst
+    atomic_fetch_add(&p->sleepers, 1);
+    while (!ready(p))
+        pthread_cond_wait(&p->cond, &p->lock);
+    atomic_fetch_sub(&p->sleepers, 1);
+    pthread_mutex_unlock(&p->lock);
+}
+
+static void pipeline_wake(RNNoisePipeline *p) {
+    if (atomic_load(&p->sleepers)) {
+        pthread_mutex_lock(&p->lock);
+        pthread_cond_broadcast(&p->cond);
+        pthread_mutex_unlock(&p->lock);
+    }
+}
+
+static void pin_thread(int cpu) {
+#ifdef __linux__
+    cpu_set_t set;
+    if (cpu < 0)
+        return;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+    (void) cpu;
+#endif
+}
+
+static void *front_main(void *arg) {
+    RNNoisePipeline *p = arg;
+    pin_thread(p->cpu);
+    for (;;) {
+        unsigned head;
+        pipeline_wait(p, front_ready);
+        if (atomic_load(&p->quit))
+            break;
+        head = atomic_load_explicit(&p->slot_head, memory_order_relaxed);
+        denoise_frame_front(p->st, p->slots + (size_t) (head % PIPELINE_SLOTS) * p->slot_bytes,
+                            rnnoise_ring_read_peek(p->in));
+        rnnoise_ring_read_commit(p->in);
+        atomic_store(&p->slot_head, head + 1);
+        pipeline_wake(p);
+    }
+    return NULL;
+}
+
+RNNoisePipeline *rnnoise_pipeline_create(DenoiseState *st, int queue_frames, int cpu) {
+    RNNoisePipeline *p;
+    if (queue_frames <= 0)
+        return NULL;
+    p = calloc(1, sizeof(*p));
+    if (!p)
+        return NULL;
+    p->st = st;
+    p->slot_bytes = denoise_frame_size();
+    p->in = rnnoise_ring_create(RNNOISE_RING_FLOAT, queue_frames);
+    p->slots = malloc((size_t) PIPELINE_SLOTS * p->slot_bytes);
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    p->cpu = cpu;
+    p->spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? PIPELINE_SPIN : 0;
+    if (!p->in || !p->slots || pthread_create(&p->thread, NULL, front_main, p) != 0) {
+        rnnoise_pipeline_destroy(p);
+        return NULL;
+    }
+    p->started = 1;
+    return p;
+}
+
+void rnnoise_pipeline_destroy(RNNoisePipeline *p) {
+    if (p->started) {
+        pthread_mutex_lock(&p->lock);
+        atomic_store(&p->quit, 1);
+        pthread_cond_broadcast(&p->cond);
+        pthread_mutex_unlock(&p->lock);
+        pthread_join(p->thread, NULL);
+    }
+    if (p->in)
+        rnnoise_ring_destroy(p->in);
+    pthread_cond_destroy(&p->cond);
+    pthread_mutex_destroy(&p->lock);
+    free(p->slots);
+    free(p);
+}
+
+int rnnoise_pipeline_push(RNNoisePipeline *p, const float *in) {
+    if (rnnoise_ring_write(p->in, in, rnnoise_get_frame_size()) == 0)
+        return -1;
+    atomic_fetch_add(&p->pushed, 1);
+    pipeline_wake(p);
+    return 0;
+}
+
+int rnnoise_pipeline_pull(RNNoisePipeline *p, float *out, float *vad) {
+    unsigned tail;
+    float v;
+    if (p->pulled == atomic_load(&p->pushed))
+        return 0;
+    pipeline_wait(p, back_ready);
+    tail = atomic_load_explicit(&p->slot_tail, memory_order_relaxed);
+    v = denoise_frame_back(p->st, p->slots + (size_t) (tail % PIPELINE_SLOTS) * p->slot_bytes, out);
+    atomic_store(&p->slot_tail, tail + 1);
+    pipeline_wake(p);
+    p->pulled++;
+    if (vad)
+        *vad = v;
+    return 1;
+}
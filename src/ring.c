@@ -0,0 +1,116 @@
+//
+// 单生产者单消费者的无锁环形缓冲, 容量为整数帧, 读端总是按帧对齐, 所以可读的一帧在内存中总是连续的
+//
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "rnnoise.h"
+
+#define FRAME_SIZE 480
+
+/* head/tail 分开放在不同的 cache line, 生产者和消费者不会互相争用 */
+#define RING_CACHE_LINE 64
+
+/*
+    head 只由生产者写, tail 只由消费者写, 取值范围为 [0, 2*size), 这样 head == tail 表示空,
+    相差 size 表示满, 不需要浪费一个位置; 数据写完之后才更新 head, 读完之后才更新 tail
+*/
+struct RNNoiseRing {
+    atomic_uint head;
+    char pad0[RING_CACHE_LINE - sizeof(atomic_uint)];
+    atomic_uint tail;
+    char pad1[RING_CACHE_LINE - sizeof(atomic_uint)];
+    unsigned size; // 样点数, FRAME_SIZE 的整数倍
+    int sample_bytes;
+    char *data;
+};
+
+static unsigned ring_used(const RNNoiseRing *r, unsigned head, unsigned tail) {
+    return head >= tail ? head - tail : head + 2 * r->size - tail;
+}
+
+static unsigned ring_index(const RNNoiseRing *r, unsigned pos) {
+    return pos >= r->size ? pos - r->size : pos;
+}
+
+static unsigned ring_advance(const RNNoiseRing *r, unsigned pos, unsigned n) {
+    pos += n;
+    return pos >= 2 * r->size ? pos - 2 * r->size : pos;
+}
+
+RNNoiseRing *rnnoise_ring_create(int format, int nframes) {
+    RNNoiseRing *r;
+    if (nframes <= 0 || (format != RNNOISE_RING_FLOAT && format != RNNOISE_RING_INT16))
+        return NULL;
+    r = calloc(1, sizeof(*r));
+    if (!r)
+        return NULL;
+    r->size = (unsigned) nframes * FRAME_SIZE;
+    r->sample_bytes = format == RNNOISE_RING_FLOAT ? sizeof(float) : sizeof(short);
+    r->data = malloc((size_t) r->size * r->sample_bytes);
+    if (!r->data) {
+        free(r);
+        return NULL;
+    }
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    return r;
+}
+
+void rnnoise_ring_destroy(RNNoiseRing *r) {
+    free(r->data);
+    free(r);
+}
+
+int rnnoise_ring_available(RNNoiseRing *r) {
+    return ring_used(r, atomic_load(&r->head), atomic_load(&r->tail));
+}
+
+int rnnoise_ring_write(RNNoiseRing *r, const void *samples, int n) {
+    unsigned head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    unsigned free_samples = r->size - ring_used(r, head, atomic_load(&r->tail));
+    unsigned start = ring_index(r, head);
+    unsigned first;
+    if (n <= 0)
+        return 0;
+    if ((unsigned) n > free_samples)
+        n = free_samples;
+    // 可能绕回开头, 分两段拷贝
+    first = r->size - start < (unsigned) n ? r->size - start : (unsigned) n;
+    memcpy(r->data + (size_t) start * r->sample_bytes, samples, (size_t) first * r->sample_bytes);
+    memcpy(r->data, (const char *) samples + (size_t) first * r->sample_bytes, (size_t) (n - first) * r->sample_bytes);
+    atomic_store(&r->head, ring_advance(r, head, n));
+    return n;
+}
+
+void *rnnoise_ring_write_peek(RNNoiseRing *r, int *n) {
+    unsigned head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    unsigned free_samples = r->size - ring_used(r, head, atomic_load(&r->tail));
+    unsigned start = ring_index(r, head);
+    unsigned contiguous = r->size - start;
+    *n = (int) (contiguous < free_samples ? contiguous : free_samples);
+    return *n ? r->data + (size_t) start * r->sample_bytes : NULL;
+}
+
+void rnnoise_ring_write_commit(RNNoiseRing *r, int n) {
+    unsigned head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    atomic_store(&r->head, ring_advance(r, head, n));
+}
+
+const void *rnnoise_ring_read_peek(RNNoiseRing *r) {
+    unsigned tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    if (ring_used(r, atomic_load(&r->head), tail) < FRAME_SIZE)
+        return NULL;
+    // 读端每次前进一帧且容量是整数帧, tail 总是帧对齐的, 这一帧不会跨过缓冲的结尾
+    return r->data + (size_t) ring_index(r, tail) * r->sample_bytes;
+}
+
+void rnnoise_ring_read_commit(RNNoiseRing *r) {
+    unsigned tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    atomic_store(&r->tail, ring_advance(r, tail, FRAME_SIZE));
+}
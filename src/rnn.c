@@ -9,73 +9,25 @@
 #include <math.h>
 #include "common.h"
 #include "arch.h"
-#include "tansig_table.h"
+#include "vec.h"
 #include "rnn.h"
 #include "rnn_data.h"
 
-/*
-    tansig(matlab的称呼)就是tanh(pytorch称呼)： 双曲正切S型传输函数
-    这里提前将tansig的值保存下来, 然后直接查表近似, 而不是每次都去算
-
-    e^x - e^(-x)
-    ------------
-    e^x + e^(-x)
-
-*/
-static OPUS_INLINE float tansig_approx(float x) {
+/*!
+ * dense 层在累加完 bias 和加权输入之后的部分: 缩放和激活函数
+ * @param layer dense层
+ * @param output 输入为累加结果, 输出为激活值
+ */
+static void dense_finish(const DenseLayer *layer, float *output) {
     int i;
-    float y, dy;
-    float sign = 1;
-    /* Tests are reversed to catch NaNs */
-    if (!(x < 8)) return 1;
-    if (!(x > -8)) return -1;
-#ifndef FIXED_POINT
-    /* Another check in case of -ffast-math*/ // 浮点优化选项 -ffast-math：极大地提高浮点运算速度
-    if (celt_isnan(x)) return 0;
-#endif
-    if (x < 0) {
-        x = -x;
-        sign = -1;
-    }
-    i = (int) floor(.5f + 25 * x);
-    x -= .04f * i;
-    y = tansig_table[i];
-    dy = 1 - y * y;
-    y = y + x * dy * (1 - y * x);
-    return sign * y;
-}
-
-
-/*
-    sigmoid activation function
-                1           e^(x)
-    S(x) = ----------- = -----------
-            1 + e^(-x)    e^(x) + 1
-*/
-static OPUS_INLINE float sigmoid_approx(float x) {
-    return .5 + .5 * tansig_approx(.5 * x);
-}
-/*
-    f(x) = max{0, x}
-*/
-static OPUS_INLINE float relu(float x) {
-    return x < 0 ? 0 : x;
-}
-
-void compute_dense(const DenseLayer *layer, float *output, const float *input) {
-    int i, j;  /* 用于for循环 */
-    int N, M;
-    int stride;
-    M = layer->nb_inputs;  /* M 表示 输入维度*/
-    N = layer->nb_neurons; /* N 表示 神经元数*/
-    stride = N;
-    for (i = 0; i < N; i++) {
-        /* compute update gate  */
-        float sum = layer->bias[i];
-        for (j = 0; j < M; j++) {
-            sum += layer->input_weights[j * stride + i] * input[j];
-        }
-        output[i] = WEIGHTS_SCALE * sum;
+    int N = layer->nb_neurons;
+    float scale = weights_scale(layer->weights_type);
+    if (layer->scales) {
+        for (i = 0; i < N; i++)
+            output[i] *= layer->scales[i];
+    } else {
+        for (i = 0; i < N; i++)
+            output[i] *= scale;
     }
     if (layer->activation == ACTIVATION_SIGMOID) {
         for (i = 0; i < N; i++)
@@ -91,52 +43,395 @@ void compute_dense(const DenseLayer *layer, float *output, const float *input) {
     }
 }
 
-void compute_gru(const GRULayer *gru, float *state, const float *input) {
-    int i, j;
+void compute_dense(const DenseLayer *layer, float *output, const float *input) {
     int N, M;
+    M = layer->nb_inputs;  /* M 表示 输入维度*/
+    N = layer->nb_neurons; /* N 表示 神经元数*/
+    load_bias(output, layer->bias, layer->weights_type, N);
+    sgemv_accum(output, layer->input_weights, layer->weights_type, layer->codebook, N, N, M, input);
+    dense_finish(layer, output);
+}
+
+/*!
+ * 低秩分解的矩阵向量乘累加: out += (u . v)^T x, 先算 t = u^T x (rank维), 再算 out += v^T t
+ * t 先乘上 scale, 这样 out 与未分解时一样仍是放大了256倍的结果
+ * @param out 输出 长度 rows
+ * @param u cols x rank 的矩阵
+ * @param v rank x col_stride 的矩阵, 只取前 rows 列
+ * @param tmp 长度 rank 的缓存
+ */
+static void sgemv_accum_lowrank(float *out, const void *u, const void *v, int type, const rnn_weight *codebook,
+                                int rank, int col_stride, int rows, int cols, const float *x, float *tmp, float scale) {
+    int k;
+    RNN_CLEAR(tmp, rank);
+    sgemv_accum(tmp, u, type, codebook, rank, rank, cols, x);
+    for (k = 0; k < rank; k++)
+        tmp[k] *= scale;
+    sgemv_accum(out, v, type, codebook, col_stride, rows, rank, tmp);
+}
+
+/*
+    GRU 输入部分的累加器: 未分解时就是三个门的 sum (初值为 bias),
+    输入权重低秩分解时是 u^T x (rank维, 初值为0), 放在 scratch 的 tmp 中
+*/
+static int gru_acc_size(const GRULayer *gru) {
+    return gru->input_rank > 0 ? gru->input_rank : 3 * gru->nb_neurons;
+}
+
+static float *gru_acc(const GRULayer *gru, float *scratch) {
+    return gru->input_rank > 0 ? &scratch[6 * gru->nb_neurons] : scratch;
+}
+
+static void gru_acc_init(const GRULayer *gru, float *acc) {
+    if (gru->input_rank > 0)
+        RNN_CLEAR(acc, gru->input_rank);
+    else
+        load_bias(acc, gru->bias, gru->weights_type, 3 * gru->nb_neurons);
+}
+
+/*!
+ * GRU 在输入部分累加完之后的计算: 循环权重, 三个门和状态更新
+ * @param gru GRU层
+ * @param state 上一帧的状态, 计算完后更新为这一帧的输出
+ * @param scratch 中间结果的缓存, 输入部分的累加结果已经在 gru_acc(gru, scratch) 中
+ */
+static void gru_update(const GRULayer *gru, float *state, float *scratch) {
+    int i;
+    int N;
     int stride;
-    float z[MAX_NEURONS];
-    float r[MAX_NEURONS];
-    float h[MAX_NEURONS];
-    M = gru->nb_inputs;  /* M 表示 输入维度*/
+    int type;
+    float scale;
+    float *sum, *z, *r, *sr, *tmp;
+    const float *scales = gru->scales;
     N = gru->nb_neurons; /* N 表示 神经元数*/
     stride = 3 * N;
-    for (i = 0; i < N; i++) {
-        /* Compute update gate. */
-        float sum = gru->bias[i];
-        for (j = 0; j < M; j++)
-            sum += gru->input_weights[j * stride + i] * input[j];  /*加权求和*/
-        for (j = 0; j < N; j++)
-            sum += gru->recurrent_weights[j * stride + i] * state[j];
-        z[i] = sigmoid_approx(WEIGHTS_SCALE * sum);
+    sum = scratch;
+    z = &scratch[3 * N];
+    r = &scratch[4 * N];
+    sr = &scratch[5 * N];
+    tmp = &scratch[6 * N];
+    type = gru->weights_type;
+    scale = weights_scale(type);
+    /* 三个门的输入部分一起算: sum[0,N) update gate, sum[N,2N) reset gate, sum[2N,3N) output */
+    if (gru->input_rank > 0) {
+        load_bias(sum, gru->bias, type, stride);
+        for (i = 0; i < gru->input_rank; i++)
+            tmp[i] *= scale;
+        sgemv_accum(sum, gru->input_weights_v, type, gru->codebook, stride, stride, gru->input_rank, tmp);
     }
+    if (gru->recurrent_rank > 0)
+        sgemv_accum_lowrank(sum, gru->recurrent_weights, gru->recurrent_weights_v, type, gru->codebook,
+                            gru->recurrent_rank, stride, 2 * N, N, state, tmp, scale);
+    else
+        sgemv_accum(sum, gru->recurrent_weights, type, gru->codebook, stride, 2 * N, N, state);
+    /* 每行各自的缩放只在这里和下面的输出部分每个神经元乘一次 (有 scales 的层没有低秩分解) */
     for (i = 0; i < N; i++) {
-        /* Compute reset gate. */
-        float sum = gru->bias[N + i];
-        for (j = 0; j < M; j++)
-            sum += gru->input_weights[N + j * stride + i] * input[j];
-        for (j = 0; j < N; j++)
-            sum += gru->recurrent_weights[N + j * stride + i] * state[j];
-        r[i] = sigmoid_approx(WEIGHTS_SCALE * sum);
+        /* Compute update gate and reset gate. */
+        z[i] = sigmoid_approx((scales ? scales[i] : scale) * sum[i]);
+        r[i] = sigmoid_approx((scales ? scales[N + i] : scale) * sum[N + i]);
+        sr[i] = state[i] * r[i];
     }
+    /* Compute output. int8 的权重与 state, r 逐个相乘, 与特化代码和原来的结果逐位相同 */
+    if (gru->recurrent_rank > 0)
+        sgemv_accum_lowrank(&sum[2 * N], gru->recurrent_weights,
+                            weights_offset(gru->recurrent_weights_v, type, 2 * N), type, gru->codebook,
+                            gru->recurrent_rank, stride, N, N, sr, tmp, scale);
+    else if (type == WEIGHTS_INT8)
+        sgemv_accum_int8_gated(&sum[2 * N], (const rnn_weight *) gru->recurrent_weights + 2 * N, stride, N, N,
+                               state, r);
+    else
+        sgemv_accum(&sum[2 * N], weights_offset(gru->recurrent_weights, type, 2 * N), type, gru->codebook,
+                    stride, N, N, sr);
     for (i = 0; i < N; i++) {
-        /* Compute output. */
-        float sum = gru->bias[2 * N + i];
-        for (j = 0; j < M; j++)
-            sum += gru->input_weights[2 * N + j * stride + i] * input[j];
-        for (j = 0; j < N; j++)
-            sum += gru->recurrent_weights[2 * N + j * stride + i] * state[j] * r[j];
-        if (gru->activation == ACTIVATION_SIGMOID) sum = sigmoid_approx(WEIGHTS_SCALE * sum);
-        else if (gru->activation == ACTIVATION_TANH) sum = tansig_approx(WEIGHTS_SCALE * sum);
-        else if (gru->activation == ACTIVATION_RELU) sum = relu(WEIGHTS_SCALE * sum);
+        float h = (scales ? scales[2 * N + i] : scale) * sum[2 * N + i];
+        if (gru->activation == ACTIVATION_SIGMOID) h = sigmoid_approx(h);
+        else if (gru->activation == ACTIVATION_TANH) h = tansig_approx(h);
+        else if (gru->activation == ACTIVATION_RELU) h = relu(h);
         else *(int *) 0 = 0;   /* 向地址0000处写入一个0，从而触发一个访问违例异常 */
-        h[i] = z[i] * state[i] + (1 - z[i]) * sum;
+        state[i] = z[i] * state[i] + (1 - z[i]) * h;
+    }
+}
+
+/*!
+ * GRU 前向计算一帧
+ * @param gru GRU层
+ * @param state 上一帧的状态, 计算完后更新为这一帧的输出
+ * @param input 输入
+ * @param scratch 中间结果的缓存, 至少 6 * nb_neurons + max(input_rank, recurrent_rank)
+ */
+void compute_gru(const GRULayer *gru, float *state, const float *input, float *scratch) {
+    float *acc = gru_acc(gru, scratch);
+    int size = gru_acc_size(gru);
+    gru_acc_init(gru, acc);
+    sgemv_accum(acc, gru->input_weights, gru->weights_type, gru->codebook, size, size, gru->nb_inputs, input);
+    gru_update(gru, state, scratch);
+}
+
+/*!
+ * 按 RNNoise 的拓扑连接各层 (对应 rnn_train.py 中的模型)
+ *   slot 1: input_dense(features)
+ *   slot 2: vad_gru(slot 1)
+ *   slot 3: vad_output(slot 2) -> vad
+ *   slot 4: noise_gru(slot 1, slot 2, features)
+ *   slot 5: denoise_gru(slot 2, slot 4, features)
+ *   slot 6: denoise_output(slot 5) -> gains
+ * @param model 模型
+ * @param nodes 输出 RNN_DEFAULT_NODES 个节点
+ */
+void rnn_default_graph(const RNNModel *model, RNNNode *nodes) {
+    static const RNNNode graph[RNN_DEFAULT_NODES] = {
+            {RNN_NODE_DENSE, NULL, NULL, 1, {0},       RNN_OUTPUT_NONE},
+            {RNN_NODE_GRU,   NULL, NULL, 1, {1},       RNN_OUTPUT_NONE},
+            {RNN_NODE_DENSE, NULL, NULL, 1, {2},       RNN_OUTPUT_VAD},
+            {RNN_NODE_GRU,   NULL, NULL, 3, {1, 2, 0}, RNN_OUTPUT_NONE},
+            {RNN_NODE_GRU,   NULL, NULL, 3, {2, 4, 0}, RNN_OUTPUT_NONE},
+            {RNN_NODE_DENSE, NULL, NULL, 1, {5},       RNN_OUTPUT_GAINS},
+    };
+    RNN_COPY(nodes, graph, RNN_DEFAULT_NODES);
+    nodes[0].dense = model->input_dense;
+    nodes[1].gru = model->vad_gru;
+    nodes[2].dense = model->vad_output;
+    nodes[3].gru = model->noise_gru;
+    nodes[4].gru = model->denoise_gru;
+    nodes[5].dense = model->denoise_output;
+}
+
+static int node_size(const RNNNode *node) {
+    return node->type == RNN_NODE_GRU ? node->gru->nb_neurons : node->dense->nb_neurons;
+}
+
+/* 节点输入部分的累加器大小: dense 层就是输出本身 */
+static int node_acc_size(const RNNNode *node) {
+    return node->type == RNN_NODE_GRU ? gru_acc_size(node->gru) : node->dense->nb_neurons;
+}
+
+static void node_acc_init(const RNNNode *node, float *acc) {
+    if (node->type == RNN_NODE_GRU)
+        gru_acc_init(node->gru, acc);
+    else
+        load_bias(acc, node->dense->bias, node->dense->weights_type, node->dense->nb_neurons);
+}
+
+/* 对 nframes 帧累加输入中的 [first, first + cols) 这几列 */
+static void node_acc_columns(const RNNNode *node, float *acc, int acc_stride, const float *x, int x_stride,
+                             int first, int cols, int nframes) {
+    int size = node_acc_size(node);
+    if (node->type == RNN_NODE_GRU)
+        sgemm_accum(acc, acc_stride, node->gru->input_weights, node->gru->weights_type, node->gru->codebook,
+                    size, size, first, cols, x, x_stride, nframes);
+    else
+        sgemm_accum(acc, acc_stride, node->dense->input_weights, node->dense->weights_type, node->dense->codebook,
+                    size, size, first, cols, x, x_stride, nframes);
+}
+
+/* compute_rnn_batch 对这个模型每帧输出的个数, 与 rnn_state_init 得到的 batch_size 相同, 不用为模型分配状态 */
+int rnn_model_batch_size(const RNNModel *model) {
+    RNNNode default_nodes[RNN_DEFAULT_NODES];
+    const RNNNode *nodes = model->nodes;
+    int nb_nodes = model->nb_nodes;
+    int k;
+    int size = 0;
+    if (!nodes) {
+        rnn_default_graph(model, default_nodes);
+        nodes = default_nodes;
+        nb_nodes = RNN_DEFAULT_NODES;
+    }
+    for (k = 0; k < nb_nodes; k++)
+        size += node_acc_size(&nodes[k]);
+    return size;
+}
+
+static int slot_size(const RNNState *rnn, int slot) {
+    return slot ? node_size(&rnn->nodes[slot - 1]) : RNN_INPUT_SIZE;
+}
+
+/*!
+ * 根据模型的计算图一次性分配所有的激活值和状态, 之后每帧的计算不再分配内存
+ * @param rnn RNNState结构体
+ * @param model 模型
+ * @return 0 成功, -1 内存不足
+ */
+int rnn_state_init(RNNState *rnn, const RNNModel *model) {
+    int k, i;
+    int arena_size;
+    int scratch_size = 0;
+    float *ptr;
+    memset(rnn, 0, sizeof(*rnn));
+    rnn->model = model;
+    rnn_model_retain(model); // 状态持有模型的一个引用, rnn_state_free 时释放
+    if (model->nodes) {
+        rnn->nodes = model->nodes;
+        rnn->nb_nodes = model->nb_nodes;
+    } else {
+        rnn_default_graph(model, rnn->default_nodes);
+        rnn->nodes = rnn->default_nodes;
+        rnn->nb_nodes = RNN_DEFAULT_NODES;
+    }
+    rnn->node_static = calloc(rnn->nb_nodes, sizeof(int));
+    rnn->batch_offset = calloc(rnn->nb_nodes, sizeof(int));
+    if (!rnn->node_static || !rnn->batch_offset) {
+        rnn_state_free(rnn);
+        return -1;
+    }
+    arena_size = 0;
+    for (k = 0; k < rnn->nb_nodes; k++) {
+        const RNNNode *node = &rnn->nodes[k];
+        arena_size += node_size(node);
+        /* 只依赖输入特征和其他无状态 dense 层的 dense 层与帧之间无关 */
+        rnn->node_static[k] = node->type == RNN_NODE_DENSE;
+        for (i = 0; i < node->nb_inputs; i++) {
+            if (node->inputs[i] && !rnn->node_static[node->inputs[i] - 1])
+                rnn->node_static[k] = 0;
+        }
+        rnn->batch_offset[k] = rnn->batch_size;
+        rnn->batch_size += node_acc_size(node);
+        if (node->type == RNN_NODE_GRU)
+            scratch_size = IMAX(scratch_size, 6 * node->gru->nb_neurons +
+                                              IMAX(node->gru->input_rank, node->gru->recurrent_rank));
+    }
+    rnn->slots = calloc(rnn->nb_nodes + 1, sizeof(float *));
+    rnn->arena = calloc(arena_size + rnn->batch_size + scratch_size, sizeof(float));
+    if (!rnn->slots || !rnn->arena) {
+        rnn_state_free(rnn);
+        return -1;
+    }
+    ptr = rnn->arena;
+    for (k = 0; k < rnn->nb_nodes; k++) {
+        rnn->slots[k + 1] = ptr;
+        ptr += node_size(&rnn->nodes[k]);
+    }
+    rnn->batch = ptr;
+    rnn->scratch = ptr + rnn->batch_size;
+    if (!model->nodes) {
+        rnn->vad_gru_state = rnn->slots[2];
+        rnn->noise_gru_state = rnn->slots[4];
+        rnn->denoise_gru_state = rnn->slots[5];
+    }
+    return 0;
+}
+
+void rnn_state_free(RNNState *rnn) {
+    free(rnn->slots);
+    free(rnn->arena);
+    free(rnn->node_static);
+    free(rnn->batch_offset);
+    rnn->slots = NULL;
+    rnn->arena = NULL;
+    rnn->node_static = NULL;
+    rnn->batch_offset = NULL;
+    if (rnn->model)
+        rnn_model_release(rnn->model);
+    rnn->model = NULL;
+}
+
+RNNState *rnn_state_create(const RNNModel *model) {
+    RNNState *rnn = malloc(sizeof(RNNState));
+    if (rnn && rnn_state_init(rnn, model) != 0) {
+        free(rnn);
+        return NULL;
+    }
+    return rnn;
+}
+
+void rnn_state_destroy(RNNState *rnn) {
+    if (rnn) {
+        rnn_state_free(rnn);
+        free(rnn);
+    }
+}
+
+/*!
+ * 换模型时接上原来的GRU状态: 两个计算图的节点类型和大小完全相同时复制各GRU的状态, 否则保留新状态(全0), 相当于流重新开始
+ * @param to 新模型的状态
+ * @param from 原来的状态
+ * @return 1 复制了状态, 0 重置
+ */
+int rnn_state_carry(RNNState *to, const RNNState *from) {
+    int k;
+    if (to->nb_nodes != from->nb_nodes)
+        return 0;
+    for (k = 0; k < to->nb_nodes; k++) {
+        if (to->nodes[k].type != from->nodes[k].type || node_size(&to->nodes[k]) != node_size(&from->nodes[k]))
+            return 0;
+    }
+    for (k = 0; k < to->nb_nodes; k++) {
+        if (to->nodes[k].type == RNN_NODE_GRU)
+            RNN_COPY(to->slots[k + 1], from->slots[k + 1], node_size(&to->nodes[k]));
+    }
+    return 1;
+}
+
+/*!
+ * 网络中与GRU状态无关的部分, 可以对多帧一起算:
+ * 无状态的 dense 层整层算完, 其余各层累加 bias 和来自无状态输入(输入特征和无状态 dense 层)的那几列
+ * @param rnn 结构体RNNState
+ * @param batch 输出 每帧 rnn->batch_size 个数, 交给 compute_rnn_frame 继续计算
+ * @param input 各帧的特征(每帧42维)
+ * @param nframes 帧数
+ */
+void compute_rnn_batch(RNNState *rnn, float *batch, const float *input, int nframes) {
+    int k, i, t;
+    int stride = rnn->batch_size;
+    for (k = 0; k < rnn->nb_nodes; k++) {
+        const RNNNode *node = &rnn->nodes[k];
+        float *acc = &batch[rnn->batch_offset[k]];
+        int first = 0;
+        for (t = 0; t < nframes; t++)
+            node_acc_init(node, &acc[t * stride]);
+        for (i = 0; i < node->nb_inputs; i++) {
+            int slot = node->inputs[i];
+            int size = slot_size(rnn, slot);
+            if (slot == 0)
+                node_acc_columns(node, acc, stride, input, RNN_INPUT_SIZE, first, size, nframes);
+            else if (rnn->node_static[slot - 1])
+                node_acc_columns(node, acc, stride, &batch[rnn->batch_offset[slot - 1]], stride, first, size, nframes);
+            first += size;
+        }
+        if (rnn->node_static[k]) {
+            for (t = 0; t < nframes; t++)
+                dense_finish(node->dense, &acc[t * stride]);
+        }
+    }
+}
+
+/*!
+ * 网络中依赖GRU状态的部分, 只能逐帧计算: 累加来自GRU(及依赖GRU的层)的输入, 然后完成各层的计算
+ * @param rnn 结构体RNNState
+ * @param gains 每个频带的增益
+ * @param vad 语音活动检测
+ * @param batch compute_rnn_batch 对这一帧的输出, 计算时会被修改
+ */
+void compute_rnn_frame(RNNState *rnn, float *gains, float *vad, float *batch) {
+    int k, i;
+    for (k = 0; k < rnn->nb_nodes; k++) {
+        const RNNNode *node = &rnn->nodes[k];
+        float *out = rnn->slots[k + 1];
+        float *acc = &batch[rnn->batch_offset[k]];
+        if (!rnn->node_static[k]) {
+            int first = 0;
+            for (i = 0; i < node->nb_inputs; i++) {
+                int slot = node->inputs[i];
+                int size = slot_size(rnn, slot);
+                if (slot != 0 && !rnn->node_static[slot - 1])
+                    node_acc_columns(node, acc, 0, rnn->slots[slot], 0, first, size, 1);
+                first += size;
+            }
+        }
+        if (node->type == RNN_NODE_GRU) {
+            RNN_COPY(gru_acc(node->gru, rnn->scratch), acc, gru_acc_size(node->gru));
+            gru_update(node->gru, out, rnn->scratch);
+        } else {
+            RNN_COPY(out, acc, node_size(node));
+            if (!rnn->node_static[k])
+                dense_finish(node->dense, out);
+        }
+        if (node->output == RNN_OUTPUT_GAINS)
+            RNN_COPY(gains, out, RNN_GAINS_SIZE);
+        else if (node->output == RNN_OUTPUT_VAD)
+            *vad = out[0];
     }
-    for (i = 0; i < N; i++)
-        state[i] = h[i];
 }
 
-#define INPUT_SIZE 42
 /*!
  *
  * @param rnn 结构体RNNState
@@ -145,29 +440,15 @@ void compute_gru(const GRULayer *gru, float *state, const float *input) {
  * @param input 特征(42维)
  */
 void compute_rnn(RNNState *rnn, float *gains, float *vad, const float *input) {
-    int i;
-    float dense_out[MAX_NEURONS];
-    float noise_input[MAX_NEURONS * 3];
-    float denoise_input[MAX_NEURONS * 3];
-
-    // 获得 vad output
-    compute_dense(rnn->model->input_dense, dense_out, input);
-    compute_gru(rnn->model->vad_gru, rnn->vad_gru_state, dense_out);
-    compute_dense(rnn->model->vad_output, vad, rnn->vad_gru_state);
-
-    // noise_input[0, 24) = dense_out 对应Architecture左侧的Dense tanh(24)
-    for (i = 0; i < rnn->model->input_dense_size; i++) noise_input[i] = dense_out[i];
-    for (i = 0; i < rnn->model->vad_gru_size; i++)
-        noise_input[i + rnn->model->input_dense_size] = rnn->vad_gru_state[i];
-    for (i = 0; i < INPUT_SIZE; i++)
-        noise_input[i + rnn->model->input_dense_size + rnn->model->vad_gru_size] = input[i];
-    compute_gru(rnn->model->noise_gru, rnn->noise_gru_state, noise_input);
-
-    for (i = 0; i < rnn->model->vad_gru_size; i++) denoise_input[i] = rnn->vad_gru_state[i];
-    for (i = 0; i < rnn->model->noise_gru_size; i++)
-        denoise_input[i + rnn->model->vad_gru_size] = rnn->noise_gru_state[i];
-    for (i = 0; i < INPUT_SIZE; i++)
-        denoise_input[i + rnn->model->vad_gru_size + rnn->model->noise_gru_size] = input[i];
-    compute_gru(rnn->model->denoise_gru, rnn->denoise_gru_state, denoise_input);
-    compute_dense(rnn->model->denoise_output, gains, rnn->denoise_gru_state);
+    // 由 training/rnn_codegen.py 生成的特化推理代码 (内置模型), 从文件载入的模型走下面的通用路径
+    if (rnn->model->compute) {
+        rnn->model->compute(rnn, gains, vad, input);
+        return;
+    }
+
+    // 按计算图的顺序依次计算各层. 每层先累加无状态的输入, 再累加依赖GRU状态的输入,
+    // 例如默认拓扑中 noise_gru 的输入 [dense_out, vad_gru_state, input] 按 dense_out, input, vad_gru_state 的顺序累加,
+    // 这样与 rnnoise_process_buffer 多帧一起算的结果完全一致
+    compute_rnn_batch(rnn, rnn->batch, input, 1);
+    compute_rnn_frame(rnn, gains, vad, rnn->batch);
 }
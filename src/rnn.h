@@ -10,38 +10,128 @@
 
 #define WEIGHTS_SCALE (1.f/256)
 
-#define MAX_NEURONS 128
+/* 网络的输入特征维度和输出的频带增益个数, 由 denoise.c 的特征提取决定 */
+#define RNN_INPUT_SIZE 42
+#define RNN_GAINS_SIZE 22
+
+/* 计算图中一个节点最多可以拼接的输入个数 */
+#define RNN_MAX_NODE_INPUTS 8
+
+/* 默认的 RNNoise 拓扑的节点数: input_dense, vad_gru, vad_output, noise_gru, denoise_gru, denoise_output */
+#define RNN_DEFAULT_NODES 6
 
 #define ACTIVATION_TANH    0
 #define ACTIVATION_SIGMOID 1
 #define ACTIVATION_RELU    2
 
+/* 权重的存储类型(按层选择): int8 为放大256倍后的定点值, fp16/bf16 直接存储浮点原值
+ * q4 为4bit的码本索引(每字节两个, 低4位在前), 码本是16个int8值, bias 仍为int8 */
+#define WEIGHTS_INT8 0
+#define WEIGHTS_FP16 1
+#define WEIGHTS_BF16 2
+#define WEIGHTS_Q4   3
+
+#define Q4_CODEBOOK_SIZE 16
+
 typedef signed char rnn_weight;
+typedef opus_uint16 rnn_weight16; /* IEEE half 或 bfloat16 的位模式 */
 
+/* bias/input_weights 的实际类型由 weights_type 决定, 0 (WEIGHTS_INT8) 时为 rnn_weight
+ * scales: int8 权重每个输出(神经元)各自的缩放, 代替 WEIGHTS_SCALE, 在累加完之后每个神经元乘一次, 不增加乘加的开销;
+ * 该输出的 bias 按同样的缩放量化. NULL 时为 WEIGHTS_SCALE. 只用于不做低秩分解的 int8 层 */
 typedef struct {
-    const rnn_weight *bias;
-    const rnn_weight *input_weights;
+    const void *bias;
+    const void *input_weights;
     int nb_inputs;
     int nb_neurons;
     int activation;
+    int weights_type;
+    const rnn_weight *codebook;   /* WEIGHTS_Q4 的码本 */
+    const float *scales;          /* nb_neurons 个 */
 } DenseLayer;
 
 typedef struct {
-    const rnn_weight *bias;
-    const rnn_weight *input_weights;
-    const rnn_weight *recurrent_weights;
+    const void *bias;
+    const void *input_weights;
+    const void *recurrent_weights;
     int nb_inputs;
     int nb_neurons;
     int activation;
+    int weights_type;
+    const rnn_weight *codebook;   /* WEIGHTS_Q4 的码本, 输入和循环权重共用 */
+    /* 低秩分解: rank > 0 时 input_weights 为 nb_inputs x rank 的 u, input_weights_v 为 rank x 3*nb_neurons 的 v,
+       W ~= u . v; 循环权重同理. rank 为 0 时不分解 */
+    int input_rank;
+    const void *input_weights_v;
+    int recurrent_rank;
+    const void *recurrent_weights_v;
+    const float *scales;          /* 3 * nb_neurons 个, 与 bias 的顺序相同; 输入和循环权重的同一列共用 */
 } GRULayer;
 
+#define RNN_NODE_DENSE 0
+#define RNN_NODE_GRU   1
+
+#define RNN_OUTPUT_NONE  0
+#define RNN_OUTPUT_GAINS 1
+#define RNN_OUTPUT_VAD   2
+
+/*
+    计算图中的一个节点(一层)
+    各层的输出存放在 slot 中: slot 0 为输入特征, slot k (k >= 1) 为第 k 个节点(nodes[k-1])的输出
+    节点的输入是 inputs[] 中各个 slot 依次拼接起来的向量, 只能引用前面节点的输出
+    GRU 节点的输出 slot 同时也是它的状态, 跨帧保留
+*/
+typedef struct {
+    int type;                          /* RNN_NODE_DENSE / RNN_NODE_GRU */
+    const DenseLayer *dense;
+    const GRULayer *gru;
+    int nb_inputs;
+    int inputs[RNN_MAX_NODE_INPUTS];
+    int output;                        /* RNN_OUTPUT_NONE / RNN_OUTPUT_GAINS / RNN_OUTPUT_VAD */
+} RNNNode;
+
 typedef struct RNNState RNNState;
 
+/* 整个网络一帧的前向计算, 与 compute_rnn 签名相同 */
+typedef void (*rnn_compute_func)(RNNState *rnn, float *gains, float *vad, const float *input);
+
 void compute_dense(const DenseLayer *layer, float *output, const float *input);
 
-void compute_gru(const GRULayer *gru, float *state, const float *input);
+void compute_gru(const GRULayer *gru, float *state, const float *input, float *scratch);
 
 void compute_rnn(RNNState *rnn, float *gains, float *vad, const float *input);
 
+void compute_rnn_batch(RNNState *rnn, float *batch, const float *input, int nframes);
+
+void compute_rnn_frame(RNNState *rnn, float *gains, float *vad, float *batch);
+
+void rnn_default_graph(const RNNModel *model, RNNNode *nodes);
+
+int rnn_model_batch_size(const RNNModel *model);
+
+/* 检查计算图的连接和各层的维度, 合法时返回 0 */
+int rnn_check_graph(const RNNNode *nodes, int nb_nodes);
+
+/* 二进制模型 (rnn_binary.c): 从已打开的文件读入整个二进制模型; 释放模型时释放 blob */
+RNNModel *rnn_model_from_binary_file(FILE *f);
+
+void rnn_model_release_blob(RNNModel *model);
+
+int rnn_state_init(RNNState *rnn, const RNNModel *model);
+
+void rnn_state_free(RNNState *rnn);
+
+/* 在堆上分配并初始化一个 RNNState, 失败时返回 NULL */
+RNNState *rnn_state_create(const RNNModel *model);
+
+void rnn_state_destroy(RNNState *rnn);
+
+int rnn_state_carry(RNNState *to, const RNNState *from);
+
+/* 模型的引用计数 (rnn_reader.c): 只对 rnnoise_model_from_* 载入的模型计数, 编译进程序的模型不受影响 */
+void rnn_model_retain(const RNNModel *model);
+
+void rnn_model_release(const RNNModel *model);
+
 
 #endif //RNNOISE_TOYS_RNN_H
@@ -0,0 +1,485 @@
+//
+// 二进制模型格式: 载入时不解析文本, 权重直接使用文件(或映射的内存)中的数据, 多个进程映射同一个文件时共享一份物理内存
+//
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "rnn.h"
+#include "rnn_data.h"
+#include "rnnoise.h"
+
+/*
+    文件布局, 所有整数都是小端:
+      [0, 64)   文件头: "RNNOISEB", u32 版本, u32 节点数, u32 张量数, u32 CRC-32 (文件头之后的全部字节), u64 文件大小, 其余为 0
+      [64, ...) 每个节点 BIN_NODE_SIZE 字节, 全部为 u32:
+                type output nb_inputs inputs[8] 层的输入数 神经元数 激活函数 权重类型 输入的秩 循环的秩 张量[7]
+                张量按 BIN_TENSOR_* 的顺序给出在张量表中的序号, 没有的为 BIN_NONE
+      之后 64 字节对齐处是张量表, 每个张量 u64 偏移 u64 字节数; 各张量的偏移都是 64 的倍数
+    激活函数和权重类型的取值与 .rnnn 文件相同 (每行缩放的 int8 层权重类型仍为 0, 另有 float32 的 scales 张量).
+    版本 1 没有 scales, 最后一个字为保留的 0; 只有用到 scales 的模型才写成版本 2
+*/
+#define BIN_MAGIC "RNNOISEB"
+#define BIN_VERSION 2
+#define BIN_HEADER_SIZE 64
+#define BIN_ALIGN 64
+#define BIN_NODE_WORDS 24
+#define BIN_NODE_SIZE (BIN_NODE_WORDS * 4)
+#define BIN_NONE 0xffffffffu
+
+#define BIN_TENSOR_BIAS 0
+#define BIN_TENSOR_INPUT 1
+#define BIN_TENSOR_INPUT_V 2
+#define BIN_TENSOR_RECURRENT 3
+#define BIN_TENSOR_RECURRENT_V 4
+#define BIN_TENSOR_CODEBOOK 5
+#define BIN_TENSOR_SCALES 6
+#define BIN_TENSORS 7
+
+/* 节点中各字段的位置(以 u32 计) */
+#define BIN_NODE_TYPE 0
+#define BIN_NODE_OUTPUT 1
+#define BIN_NODE_NB_INPUTS 2
+#define BIN_NODE_INPUTS 3
+#define BIN_NODE_LAYER (BIN_NODE_INPUTS + RNN_MAX_NODE_INPUTS)
+#define BIN_NODE_TENSORS (BIN_NODE_LAYER + 6)
+
+/* 与 rnn_reader.c 相同的上限, 保证下面的大小计算不会溢出 */
+#define BIN_MAX_DIM 16384
+#define BIN_MAX_NODES 1024
+
+/* model->blob_owner 的取值 */
+#define BLOB_CALLER 0
+#define BLOB_MALLOC 1
+#define BLOB_MMAP 2
+
+extern const struct RNNModel rnnoise_model_orig;
+
+static opus_uint32 rd32(const unsigned char *p) {
+    return p[0] | (opus_uint32) p[1] << 8 | (opus_uint32) p[2] << 16 | (opus_uint32) p[3] << 24;
+}
+
+static opus_uint64 rd64(const unsigned char *p) {
+    return rd32(p) | (opus_uint64) rd32(p + 4) << 32;
+}
+
+static void wr32(unsigned char *p, opus_uint32 v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static void wr64(unsigned char *p, opus_uint64 v) {
+    wr32(p, (opus_uint32) v);
+    wr32(p + 4, (opus_uint32) (v >> 32));
+}
+
+/* CRC-32 (IEEE 802.3, 与 zlib 相同) */
+static opus_uint32 crc32(const unsigned char *data, size_t len) {
+    opus_uint32 table[256];
+    opus_uint32 crc = 0xffffffffu;
+    size_t i;
+    int k;
+    for (i = 0; i < 256; i++) {
+        opus_uint32 c = (opus_uint32) i;
+        for (k = 0; k < 8; k++)
+            c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        table[i] = c;
+    }
+    for (i = 0; i < len; i++)
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return crc ^ 0xffffffffu;
+}
+
+static size_t align_up(size_t n) {
+    return (n + BIN_ALIGN - 1) & ~(size_t) (BIN_ALIGN - 1);
+}
+
+/* n 个权重按 type 存储所占的字节数 */
+static size_t weights_bytes(int n, int type) {
+    if (type == WEIGHTS_Q4)
+        return (n + 1) / 2;
+    return type == WEIGHTS_INT8 ? (size_t) n : n * sizeof(rnn_weight16);
+}
+
+static int bias_type(int type) {
+    return type == WEIGHTS_Q4 ? WEIGHTS_INT8 : type;
+}
+
+/* 层的各个张量的指针和由维度决定的字节数, 层没有的张量字节数为 0 */
+static void layer_tensors(const RNNNode *node, const void **ptr, size_t *bytes) {
+    memset(ptr, 0, BIN_TENSORS * sizeof(*ptr));
+    memset(bytes, 0, BIN_TENSORS * sizeof(*bytes));
+    if (node->type == RNN_NODE_GRU) {
+        const GRULayer *g = node->gru;
+        int n3 = 3 * g->nb_neurons;
+        if (g->scales) {
+            ptr[BIN_TENSOR_SCALES] = g->scales;
+            bytes[BIN_TENSOR_SCALES] = n3 * sizeof(float);
+        }
+        ptr[BIN_TENSOR_BIAS] = g->bias;
+        bytes[BIN_TENSOR_BIAS] = weights_bytes(n3, bias_type(g->weights_type));
+        ptr[BIN_TENSOR_INPUT] = g->input_weights;
+        ptr[BIN_TENSOR_RECURRENT] = g->recurrent_weights;
+        if (g->input_rank > 0) {
+            bytes[BIN_TENSOR_INPUT] = weights_bytes(g->nb_inputs * g->input_rank, g->weights_type);
+            ptr[BIN_TENSOR_INPUT_V] = g->input_weights_v;
+            bytes[BIN_TENSOR_INPUT_V] = weights_bytes(g->input_rank * n3, g->weights_type);
+        } else {
+            bytes[BIN_TENSOR_INPUT] = weights_bytes(g->nb_inputs * n3, g->weights_type);
+        }
+        if (g->recurrent_rank > 0) {
+            bytes[BIN_TENSOR_RECURRENT] = weights_bytes(g->nb_neurons * g->recurrent_rank, g->weights_type);
+            ptr[BIN_TENSOR_RECURRENT_V] = g->recurrent_weights_v;
+            bytes[BIN_TENSOR_RECURRENT_V] = weights_bytes(g->recurrent_rank * n3, g->weights_type);
+        } else {
+            bytes[BIN_TENSOR_RECURRENT] = weights_bytes(g->nb_neurons * n3, g->weights_type);
+        }
+        if (g->weights_type == WEIGHTS_Q4) {
+            ptr[BIN_TENSOR_CODEBOOK] = g->codebook;
+            bytes[BIN_TENSOR_CODEBOOK] = Q4_CODEBOOK_SIZE;
+        }
+    } else {
+        const DenseLayer *d = node->dense;
+        if (d->scales) {
+            ptr[BIN_TENSOR_SCALES] = d->scales;
+            bytes[BIN_TENSOR_SCALES] = d->nb_neurons * sizeof(float);
+        }
+        ptr[BIN_TENSOR_BIAS] = d->bias;
+        bytes[BIN_TENSOR_BIAS] = weights_bytes(d->nb_neurons, bias_type(d->weights_type));
+        ptr[BIN_TENSOR_INPUT] = d->input_weights;
+        bytes[BIN_TENSOR_INPUT] = weights_bytes(d->nb_inputs * d->nb_neurons, d->weights_type);
+        if (d->weights_type == WEIGHTS_Q4) {
+            ptr[BIN_TENSOR_CODEBOOK] = d->codebook;
+            bytes[BIN_TENSOR_CODEBOOK] = Q4_CODEBOOK_SIZE;
+        }
+    }
+}
+
+static const RNNNode *model_nodes(const RNNModel *model, RNNNode *graph, int *nb_nodes) {
+    if (model->nodes) {
+        *nb_nodes = model->nb_nodes;
+        return model->nodes;
+    }
+    rnn_default_graph(model, graph);
+    *nb_nodes = RNN_DEFAULT_NODES;
+    return graph;
+}
+
+int rnnoise_model_write_binary(const RNNModel *model, FILE *f) {
+    RNNNode graph[RNN_DEFAULT_NODES];
+    const RNNNode *nodes;
+    int nb_nodes, nb_tensors = 0;
+    int version = 1;
+    int k, i;
+    size_t table, data, size;
+    unsigned char *buf;
+    int ret;
+    if (!model)
+        model = &rnnoise_model_orig;
+    nodes = model_nodes(model, graph, &nb_nodes);
+
+    // 先算出各张量的位置, 再一次性写到内存里算校验和
+    for (k = 0; k < nb_nodes; k++) {
+        const void *ptr[BIN_TENSORS];
+        size_t bytes[BIN_TENSORS];
+        layer_tensors(&nodes[k], ptr, bytes);
+        for (i = 0; i < BIN_TENSORS; i++)
+            nb_tensors += bytes[i] != 0;
+        if (bytes[BIN_TENSOR_SCALES])
+            version = BIN_VERSION;
+    }
+    table = align_up(BIN_HEADER_SIZE + (size_t) nb_nodes * BIN_NODE_SIZE);
+    data = align_up(table + (size_t) nb_tensors * 16);
+    size = data;
+    for (k = 0; k < nb_nodes; k++) {
+        const void *ptr[BIN_TENSORS];
+        size_t bytes[BIN_TENSORS];
+        layer_tensors(&nodes[k], ptr, bytes);
+        for (i = 0; i < BIN_TENSORS; i++)
+            size = bytes[i] ? align_up(size + bytes[i]) : size;
+    }
+    buf = calloc(1, size);
+    if (!buf)
+        return -1;
+
+    memcpy(buf, BIN_MAGIC, 8);
+    wr32(buf + 8, version);
+    wr32(buf + 12, nb_nodes);
+    wr32(buf + 16, nb_tensors);
+    wr64(buf + 24, size);
+    nb_tensors = 0;
+    size = data;
+    for (k = 0; k < nb_nodes; k++) {
+        const RNNNode *node = &nodes[k];
+        unsigned char *rec = buf + BIN_HEADER_SIZE + (size_t) k * BIN_NODE_SIZE;
+        const void *ptr[BIN_TENSORS];
+        size_t bytes[BIN_TENSORS];
+        wr32(rec + 4 * BIN_NODE_TYPE, node->type);
+        wr32(rec + 4 * BIN_NODE_OUTPUT, node->output);
+        wr32(rec + 4 * BIN_NODE_NB_INPUTS, node->nb_inputs);
+        for (i = 0; i < node->nb_inputs; i++)
+            wr32(rec + 4 * (BIN_NODE_INPUTS + i), node->inputs[i]);
+        if (node->type == RNN_NODE_GRU) {
+            wr32(rec + 4 * BIN_NODE_LAYER, node->gru->nb_inputs);
+            wr32(rec + 4 * (BIN_NODE_LAYER + 1), node->gru->nb_neurons);
+            wr32(rec + 4 * (BIN_NODE_LAYER + 2), node->gru->activation);
+            wr32(rec + 4 * (BIN_NODE_LAYER + 3), node->gru->weights_type);
+            wr32(rec + 4 * (BIN_NODE_LAYER + 4), node->gru->input_rank);
+            wr32(rec + 4 * (BIN_NODE_LAYER + 5), node->gru->recurrent_rank);
+        } else {
+            wr32(rec + 4 * BIN_NODE_LAYER, node->dense->nb_inputs);
+            wr32(rec + 4 * (BIN_NODE_LAYER + 1), node->dense->nb_neurons);
+            wr32(rec + 4 * (BIN_NODE_LAYER + 2), node->dense->activation);
+            wr32(rec + 4 * (BIN_NODE_LAYER + 3), node->dense->weights_type);
+        }
+        layer_tensors(node, ptr, bytes);
+        for (i = 0; i < BIN_TENSORS; i++) {
+            if (!bytes[i]) {
+                // 版本 1 中 scales 的位置是保留的 0
+                if (i != BIN_TENSOR_SCALES || version >= 2)
+                    wr32(rec + 4 * (BIN_NODE_TENSORS + i), BIN_NONE);
+                continue;
+            }
+            wr32(rec + 4 * (BIN_NODE_TENSORS + i), nb_tensors);
+            wr64(buf + table + (size_t) nb_tensors * 16, size);
+            wr64(buf + table + (size_t) nb_tensors * 16 + 8, bytes[i]);
+            memcpy(buf + size, ptr[i], bytes[i]);
+            size = align_up(size + bytes[i]);
+            nb_tensors++;
+        }
+    }
+    wr32(buf + 20, crc32(buf + BIN_HEADER_SIZE, size - BIN_HEADER_SIZE));
+    ret = fwrite(buf, 1, size, f) == size ? 0 : -1;
+    free(buf);
+    return ret;
+}
+
+/* 把节点中序号为 idx 的张量解析为 blob 中的指针, 并检查字节数 */
+static int get_tensor(const unsigned char *blob, size_t table, int nb_tensors, opus_uint32 idx, size_t bytes,
+                      const void **ptr) {
+    const unsigned char *entry;
+    if (bytes == 0) {
+        *ptr = NULL;
+        return idx == BIN_NONE ? 0 : -1;
+    }
+    if (idx == BIN_NONE || idx >= (opus_uint32) nb_tensors)
+        return -1;
+    entry = blob + table + (size_t) idx * 16;
+    if (rd64(entry + 8) != bytes)
+        return -1;
+    *ptr = blob + rd64(entry);
+    return 0;
+}
+
+static int is_little_endian(void) {
+    const opus_uint16 one = 1;
+    return *(const unsigned char *) &one == 1;
+}
+
+RNNModel *rnnoise_model_from_buffer(const void *data, size_t size) {
+    const unsigned char *blob = data;
+    int nb_nodes, nb_tensors, version, nb_slots;
+    size_t table;
+    int k, i;
+    RNNModel *ret;
+    RNNNode *nodes;
+    // 权重按原样使用: 要求小端, 且缓冲的对齐足以直接读取 16 位的权重
+    if (!is_little_endian() || ((uintptr_t) data & 15) || size < BIN_HEADER_SIZE)
+        return NULL;
+    version = (int) rd32(blob + 8);
+    if (memcmp(blob, BIN_MAGIC, 8) != 0 || version < 1 || version > BIN_VERSION || rd64(blob + 24) != size)
+        return NULL;
+    nb_slots = version >= 2 ? BIN_TENSORS : BIN_TENSOR_SCALES;
+    nb_nodes = rd32(blob + 12);
+    nb_tensors = rd32(blob + 16);
+    if (nb_nodes <= 0 || nb_nodes > BIN_MAX_NODES || nb_tensors < 0 || nb_tensors > nb_nodes * BIN_TENSORS)
+        return NULL;
+    table = align_up(BIN_HEADER_SIZE + (size_t) nb_nodes * BIN_NODE_SIZE);
+    if (table + (size_t) nb_tensors * 16 > size)
+        return NULL;
+    if (crc32(blob + BIN_HEADER_SIZE, size - BIN_HEADER_SIZE) != rd32(blob + 20))
+        return NULL;
+    for (i = 0; i < nb_tensors; i++) {
+        opus_uint64 offset = rd64(blob + table + (size_t) i * 16);
+        opus_uint64 bytes = rd64(blob + table + (size_t) i * 16 + 8);
+        if (offset % BIN_ALIGN || offset > size || bytes > size - offset)
+            return NULL;
+    }
+
+    ret = calloc(1, sizeof(RNNModel));
+    nodes = calloc(nb_nodes, sizeof(RNNNode));
+    if (!ret || !nodes) {
+        free(ret);
+        free(nodes);
+        return NULL;
+    }
+    // 从这里开始 rnnoise_model_free 只释放层的结构体, 不释放 blob 里的权重
+    ret->blob = data;
+    ret->blob_size = size;
+    ret->blob_owner = BLOB_CALLER;
+    ret->nodes = nodes;
+    ret->nb_nodes = nb_nodes;
+    for (k = 0; k < nb_nodes; k++) {
+        const unsigned char *rec = blob + BIN_HEADER_SIZE + (size_t) k * BIN_NODE_SIZE;
+        RNNNode *node = &nodes[k];
+        const void *ptr[BIN_TENSORS];
+        size_t bytes[BIN_TENSORS];
+        opus_uint32 layer[6];
+        for (i = 0; i < 6; i++) {
+            layer[i] = rd32(rec + 4 * (BIN_NODE_LAYER + i));
+            if (layer[i] > BIN_MAX_DIM)
+                goto fail;
+        }
+        node->type = rd32(rec + 4 * BIN_NODE_TYPE);
+        node->output = rd32(rec + 4 * BIN_NODE_OUTPUT);
+        node->nb_inputs = rd32(rec + 4 * BIN_NODE_NB_INPUTS);
+        if (node->nb_inputs < 1 || node->nb_inputs > RNN_MAX_NODE_INPUTS)
+            goto fail;
+        for (i = 0; i < node->nb_inputs; i++)
+            node->inputs[i] = rd32(rec + 4 * (BIN_NODE_INPUTS + i));
+        if (layer[2] > ACTIVATION_RELU || layer[3] > WEIGHTS_Q4)
+            goto fail;
+        if (node->type == RNN_NODE_GRU) {
+            GRULayer *g = calloc(1, sizeof(GRULayer));
+            if (!g)
+                goto fail;
+            node->gru = g;
+            g->nb_inputs = layer[0];
+            g->nb_neurons = layer[1];
+            g->activation = layer[2];
+            g->weights_type = layer[3];
+            g->input_rank = layer[4];
+            g->recurrent_rank = layer[5];
+        } else if (node->type == RNN_NODE_DENSE) {
+            DenseLayer *d = calloc(1, sizeof(DenseLayer));
+            if (!d)
+                goto fail;
+            node->dense = d;
+            d->nb_inputs = layer[0];
+            d->nb_neurons = layer[1];
+            d->activation = layer[2];
+            d->weights_type = layer[3];
+        } else {
+            goto fail;
+        }
+        // 维度填好后即可算出各张量应有的大小; 有没有 scales 由节点中的序号决定
+        layer_tensors(node, ptr, bytes);
+        if (nb_slots > BIN_TENSOR_SCALES && rd32(rec + 4 * (BIN_NODE_TENSORS + BIN_TENSOR_SCALES)) != BIN_NONE)
+            bytes[BIN_TENSOR_SCALES] = (size_t) (node->type == RNN_NODE_GRU ? 3 * layer[1] : layer[1]) * sizeof(float);
+        for (i = 0; i < nb_slots; i++) {
+            if (get_tensor(blob, table, nb_tensors, rd32(rec + 4 * (BIN_NODE_TENSORS + i)), bytes[i], &ptr[i]) != 0)
+                goto fail;
+        }
+        if (node->type == RNN_NODE_GRU) {
+            GRULayer *g = (GRULayer *) node->gru;
+            g->bias = ptr[BIN_TENSOR_BIAS];
+            g->input_weights = ptr[BIN_TENSOR_INPUT];
+            g->input_weights_v = ptr[BIN_TENSOR_INPUT_V];
+            g->recurrent_weights = ptr[BIN_TENSOR_RECURRENT];
+            g->recurrent_weights_v = ptr[BIN_TENSOR_RECURRENT_V];
+            g->codebook = ptr[BIN_TENSOR_CODEBOOK];
+            g->scales = ptr[BIN_TENSOR_SCALES];
+        } else {
+            DenseLayer *d = (DenseLayer *) node->dense;
+            d->bias = ptr[BIN_TENSOR_BIAS];
+            d->input_weights = ptr[BIN_TENSOR_INPUT];
+            d->codebook = ptr[BIN_TENSOR_CODEBOOK];
+            d->scales = ptr[BIN_TENSOR_SCALES];
+        }
+    }
+    if (rnn_check_graph(nodes, nb_nodes) != 0)
+        goto fail;
+    ret->refcounted = 1;
+    return ret;
+
+fail:
+    rnnoise_model_free(ret);
+    return NULL;
+}
+
+RNNModel *rnn_model_from_binary_file(FILE *f) {
+    size_t size = 0, cap = 1 << 16;
+    unsigned char *buf = NULL;
+    RNNModel *ret;
+    // 读到文件结尾; malloc 的对齐已满足 rnnoise_model_from_buffer 的要求
+    for (;;) {
+        unsigned char *grown = realloc(buf, cap);
+        if (!grown) {
+            free(buf);
+            return NULL;
+        }
+        buf = grown;
+        size += fread(buf + size, 1, cap - size, f);
+        if (size < cap)
+            break;
+        cap *= 2;
+    }
+    ret = rnnoise_model_from_buffer(buf, size);
+    if (!ret) {
+        free(buf);
+        return NULL;
+    }
+    ret->blob_owner = BLOB_MALLOC;
+    return ret;
+}
+
+RNNModel *rnnoise_model_mmap(const char *path) {
+#ifdef _WIN32
+    RNNModel *ret;
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return NULL;
+    ret = rnn_model_from_binary_file(f);
+    fclose(f);
+    return ret;
+#else
+    struct stat sb;
+    void *map;
+    RNNModel *ret;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &sb) != 0 || sb.st_size < BIN_HEADER_SIZE) {
+        close(fd);
+        return NULL;
+    }
+    // MAP_SHARED 只读映射: 映射同一个文件的进程共享页缓存中的同一份权重
+    map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+    ret = rnnoise_model_from_buffer(map, sb.st_size);
+    if (!ret) {
+        munmap(map, sb.st_size);
+        return NULL;
+    }
+    ret->blob_owner = BLOB_MMAP;
+    return ret;
+#endif
+}
+
+void rnn_model_release_blob(RNNModel *model) {
+    if (model->blob_owner == BLOB_MALLOC) {
+        free((void *) model->blob);
+#ifndef _WIN32
+    } else if (model->blob_owner == BLOB_MMAP) {
+        munmap((void *) model->blob, model->blob_size);
+#endif
+    }
+    model->blob = NULL;
+}
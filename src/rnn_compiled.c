@@ -0,0 +1,160 @@
+/*This file is automatically generated by rnn_codegen.py*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "vec.h"
+#include "rnn.h"
+#include "rnn_data.h"
+
+static void compute_input_dense(const DenseLayer *layer, float *output, const float *input) {
+    int i, j;
+    float sum[24];
+    const rnn_weight *b = layer->bias;
+    const rnn_weight *w = layer->input_weights;
+    for (i = 0; i < 24; i++) sum[i] = b[i];
+    for (j = 0; j < 42; j++) {
+        for (i = 0; i < 24; i++) sum[i] += w[j * 24 + i] * input[j];
+    }
+    for (i = 0; i < 24; i++) output[i] = tansig_approx(WEIGHTS_SCALE * sum[i]);
+}
+
+static void compute_vad_gru(const GRULayer *gru, float *state, const float *input) {
+    int i, j;
+    float sum[72];
+    float z[24];
+    float r[24];
+    const rnn_weight *b = gru->bias;
+    const rnn_weight *w = gru->input_weights;
+    const rnn_weight *u = gru->recurrent_weights;
+    for (i = 0; i < 72; i++) sum[i] = b[i];
+    for (j = 0; j < 24; j++) {
+        for (i = 0; i < 72; i++) sum[i] += w[j * 72 + i] * input[j];
+    }
+    /* update gate 和 reset gate 只依赖上一帧的 state */
+    for (j = 0; j < 24; j++) {
+        for (i = 0; i < 48; i++) sum[i] += u[j * 72 + i] * state[j];
+    }
+    for (i = 0; i < 24; i++) {
+        z[i] = sigmoid_approx(WEIGHTS_SCALE * sum[i]);
+        r[i] = sigmoid_approx(WEIGHTS_SCALE * sum[24 + i]);
+    }
+    for (j = 0; j < 24; j++) {
+        for (i = 0; i < 24; i++) sum[48 + i] += u[48 + j * 72 + i] * state[j] * r[j];
+    }
+    for (i = 0; i < 24; i++)
+        state[i] = z[i] * state[i] + (1 - z[i]) * relu(WEIGHTS_SCALE * sum[48 + i]);
+}
+
+static void compute_noise_gru(const GRULayer *gru, float *state, const float *input) {
+    int i, j;
+    float sum[144];
+    float z[48];
+    float r[48];
+    const rnn_weight *b = gru->bias;
+    const rnn_weight *w = gru->input_weights;
+    const rnn_weight *u = gru->recurrent_weights;
+    for (i = 0; i < 144; i++) sum[i] = b[i];
+    for (j = 0; j < 24; j++) {
+        for (i = 0; i < 144; i++) sum[i] += w[j * 144 + i] * input[j];
+    }
+    for (j = 48; j < 90; j++) {
+        for (i = 0; i < 144; i++) sum[i] += w[j * 144 + i] * input[j];
+    }
+    for (j = 24; j < 48; j++) {
+        for (i = 0; i < 144; i++) sum[i] += w[j * 144 + i] * input[j];
+    }
+    /* update gate 和 reset gate 只依赖上一帧的 state */
+    for (j = 0; j < 48; j++) {
+        for (i = 0; i < 96; i++) sum[i] += u[j * 144 + i] * state[j];
+    }
+    for (i = 0; i < 48; i++) {
+        z[i] = sigmoid_approx(WEIGHTS_SCALE * sum[i]);
+        r[i] = sigmoid_approx(WEIGHTS_SCALE * sum[48 + i]);
+    }
+    for (j = 0; j < 48; j++) {
+        for (i = 0; i < 48; i++) sum[96 + i] += u[96 + j * 144 + i] * state[j] * r[j];
+    }
+    for (i = 0; i < 48; i++)
+        state[i] = z[i] * state[i] + (1 - z[i]) * relu(WEIGHTS_SCALE * sum[96 + i]);
+}
+
+static void compute_denoise_gru(const GRULayer *gru, float *state, const float *input) {
+    int i, j;
+    float sum[288];
+    float z[96];
+    float r[96];
+    const rnn_weight *b = gru->bias;
+    const rnn_weight *w = gru->input_weights;
+    const rnn_weight *u = gru->recurrent_weights;
+    for (i = 0; i < 288; i++) sum[i] = b[i];
+    for (j = 72; j < 114; j++) {
+        for (i = 0; i < 288; i++) sum[i] += w[j * 288 + i] * input[j];
+    }
+    for (j = 0; j < 24; j++) {
+        for (i = 0; i < 288; i++) sum[i] += w[j * 288 + i] * input[j];
+    }
+    for (j = 24; j < 72; j++) {
+        for (i = 0; i < 288; i++) sum[i] += w[j * 288 + i] * input[j];
+    }
+    /* update gate 和 reset gate 只依赖上一帧的 state */
+    for (j = 0; j < 96; j++) {
+        for (i = 0; i < 192; i++) sum[i] += u[j * 288 + i] * state[j];
+    }
+    for (i = 0; i < 96; i++) {
+        z[i] = sigmoid_approx(WEIGHTS_SCALE * sum[i]);
+        r[i] = sigmoid_approx(WEIGHTS_SCALE * sum[96 + i]);
+    }
+    for (j = 0; j < 96; j++) {
+        for (i = 0; i < 96; i++) sum[192 + i] += u[192 + j * 288 + i] * state[j] * r[j];
+    }
+    for (i = 0; i < 96; i++)
+        state[i] = z[i] * state[i] + (1 - z[i]) * relu(WEIGHTS_SCALE * sum[192 + i]);
+}
+
+static void compute_denoise_output(const DenseLayer *layer, float *output, const float *input) {
+    int i, j;
+    float sum[22];
+    const rnn_weight *b = layer->bias;
+    const rnn_weight *w = layer->input_weights;
+    for (i = 0; i < 22; i++) sum[i] = b[i];
+    for (j = 0; j < 96; j++) {
+        for (i = 0; i < 22; i++) sum[i] += w[j * 22 + i] * input[j];
+    }
+    for (i = 0; i < 22; i++) output[i] = sigmoid_approx(WEIGHTS_SCALE * sum[i]);
+}
+
+static void compute_vad_output(const DenseLayer *layer, float *output, const float *input) {
+    int i, j;
+    float sum[1];
+    const rnn_weight *b = layer->bias;
+    const rnn_weight *w = layer->input_weights;
+    for (i = 0; i < 1; i++) sum[i] = b[i];
+    for (j = 0; j < 24; j++) {
+        for (i = 0; i < 1; i++) sum[i] += w[j * 1 + i] * input[j];
+    }
+    for (i = 0; i < 1; i++) output[i] = sigmoid_approx(WEIGHTS_SCALE * sum[i]);
+}
+
+void compute_rnn_orig(RNNState *rnn, float *gains, float *vad, const float *input) {
+    float dense_out[24];
+    float noise_input[90];
+    float denoise_input[114];
+    const RNNModel *model = rnn->model;
+
+    compute_input_dense(model->input_dense, dense_out, input);
+    compute_vad_gru(model->vad_gru, rnn->vad_gru_state, dense_out);
+    compute_vad_output(model->vad_output, vad, rnn->vad_gru_state);
+
+    RNN_COPY(noise_input, dense_out, 24);
+    RNN_COPY(&noise_input[24], rnn->vad_gru_state, 24);
+    RNN_COPY(&noise_input[48], input, 42);
+    compute_noise_gru(model->noise_gru, rnn->noise_gru_state, noise_input);
+
+    RNN_COPY(denoise_input, rnn->vad_gru_state, 24);
+    RNN_COPY(&denoise_input[24], rnn->noise_gru_state, 48);
+    RNN_COPY(&denoise_input[72], input, 42);
+    compute_denoise_gru(model->denoise_gru, rnn->denoise_gru_state, denoise_input);
+    compute_denoise_output(model->denoise_output, gains, rnn->denoise_gru_state);
+}
@@ -145,7 +145,7 @@ static const rnn_weight input_dense_bias[24] = {
 static const DenseLayer input_dense = {
    input_dense_bias,
    input_dense_weights,
-   42, 24, ACTIVATION_TANH
+   42, 24, ACTIVATION_TANH, WEIGHTS_INT8, NULL, NULL
 };
 
 static const rnn_weight vad_gru_weights[1728] = {
@@ -602,7 +602,7 @@ static const GRULayer vad_gru = {
    vad_gru_bias,
    vad_gru_weights,
    vad_gru_recurrent_weights,
-   24, 24, ACTIVATION_RELU
+   24, 24, ACTIVATION_RELU, WEIGHTS_INT8, NULL, 0, NULL, 0, NULL, NULL
 };
 
 static const rnn_weight noise_gru_weights[12960] = {
@@ -3120,7 +3120,7 @@ static const GRULayer noise_gru = {
    noise_gru_bias,
    noise_gru_weights,
    noise_gru_recurrent_weights,
-   90, 48, ACTIVATION_RELU
+   90, 48, ACTIVATION_RELU, WEIGHTS_INT8, NULL, 0, NULL, 0, NULL, NULL
 };
 
 static const rnn_weight denoise_gru_weights[32832] = {
@@ -10732,7 +10732,7 @@ static const GRULayer denoise_gru = {
    denoise_gru_bias,
    denoise_gru_weights,
    denoise_gru_recurrent_weights,
-   114, 96, ACTIVATION_RELU
+   114, 96, ACTIVATION_RELU, WEIGHTS_INT8, NULL, 0, NULL, 0, NULL, NULL
 };
 
 static const rnn_weight denoise_output_weights[2112] = {
@@ -11011,7 +11011,7 @@ static const rnn_weight denoise_output_bias[22] = {
 static const DenseLayer denoise_output = {
    denoise_output_bias,
    denoise_output_weights,
-   96, 22, ACTIVATION_SIGMOID
+   96, 22, ACTIVATION_SIGMOID, WEIGHTS_INT8, NULL, NULL
 };
 
 static const rnn_weight vad_output_weights[24] = {
@@ -11027,9 +11027,11 @@ static const rnn_weight vad_output_bias[1] = {
 static const DenseLayer vad_output = {
    vad_output_bias,
    vad_output_weights,
-   24, 1, ACTIVATION_SIGMOID
+   24, 1, ACTIVATION_SIGMOID, WEIGHTS_INT8, NULL, NULL
 };
 
+void compute_rnn_orig(RNNState *rnn, float *gains, float *vad, const float *input);
+
 const struct RNNModel rnnoise_model_orig = {
     24,
     &input_dense,
@@ -11047,5 +11049,17 @@ const struct RNNModel rnnoise_model_orig = {
     &denoise_output,
 
     1,
-    &vad_output
+    &vad_output,
+
+    compute_rnn_orig,
+
+    0,
+    NULL,
+
+    NULL,
+    0,
+    0,
+
+    0,
+    0
 };
@@ -5,6 +5,7 @@
 #ifndef RNNOISE_TOYS_RNN_DATA_H
 #define RNNOISE_TOYS_RNN_DATA_H
 
+#include <stdatomic.h>
 #include "rnn.h"
 
 struct RNNModel {
@@ -25,13 +26,42 @@ struct RNNModel {
 
     int vad_output_size;
     const DenseLayer *vad_output;
+
+    /* 特化的前向计算(由 rnn_codegen.py 生成), 为 NULL 时使用通用的 compute_dense/compute_gru */
+    rnn_compute_func compute;
+
+    /* 计算图, 为 NULL 时按上面各层的默认 RNNoise 拓扑连接 (rnn_default_graph) */
+    int nb_nodes;
+    const RNNNode *nodes;
+
+    /* 二进制模型的权重直接指向 blob 中的数据 (rnn_binary.c); 文本模型为 NULL */
+    const void *blob;
+    size_t blob_size;
+    int blob_owner;  /* blob 由谁释放: 0 调用者, 1 free, 2 munmap */
+
+    /* 载入的模型由创建者和使用它的各个 RNNState 共同持有, refs 为创建者以外的引用数, 最后一个释放的负责释放模型 */
+    int refcounted;
+    atomic_int refs;
 };
 
 struct RNNState {
     const RNNModel *model;
+    /* 默认拓扑下指向三个GRU节点的输出 slot, 供 rnn_compiled.c 使用; 自定义的计算图为 NULL */
     float *vad_gru_state;
     float *noise_gru_state;
     float *denoise_gru_state;
+
+    int nb_nodes;
+    const RNNNode *nodes;
+    RNNNode default_nodes[RNN_DEFAULT_NODES];
+    float **slots;   /* slots[k] 为第 k 个节点的输出, slots[0] 不使用(输入特征直接传入) */
+    int *node_static;   /* 节点是否与GRU状态无关 (只依赖输入特征的 dense 层) */
+    int *batch_offset;  /* 各节点在 compute_rnn_batch 输出中的位置 */
+    int batch_size;     /* compute_rnn_batch 每帧输出的大小 */
+    float *batch;    /* 逐帧计算时 compute_rnn_batch 的输出 */
+    float *scratch;  /* compute_gru 的中间结果 */
+    float *arena;    /* 以上所有 float 缓存都从这里分配, 在 rnn_state_init 时根据模型一次性分配 */
+    struct RNNState *retired_next; /* 换模型后换下来的状态在 denoise.c 里串成待释放的链表 */
 };
 
 #endif //RNNOISE_TOYS_RNN_DATA_H
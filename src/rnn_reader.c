@@ -35,6 +35,7 @@
 #include "rnn.h"
 #include "rnn_data.h"
 #include "rnnoise.h"
+#include "vec.h"
 
 /* Although these values are the same as in rnn.h, we make them separate to
  * avoid accidentally burning internal values into a file format */
@@ -42,10 +43,161 @@
 #define F_ACTIVATION_SIGMOID    1
 #define F_ACTIVATION_RELU       2
 
+/* Weight storage types, version 2 and later. Version 1 files are all int8. */
+#define F_WEIGHTS_INT8          0
+#define F_WEIGHTS_FP16          1
+#define F_WEIGHTS_BF16          2
+#define F_WEIGHTS_Q4            3
+/* int8 with one scale per output (neuron) instead of the fixed 1/256: the
+ * header is followed by the scales, then the weights and the bias as int8
+ * values quantized with the scale of their output */
+#define F_WEIGHTS_INT8_ROW      4
+
+/* int8 values are stored as integers, fp16/bf16 values as plain floats that
+ * are rounded to the target precision at load time, q4 values as codebook
+ * indices that are packed two per byte */
+static void *read_weights(FILE *f, int len, int type) {
+    int i;
+    if (type == WEIGHTS_Q4) {
+        unsigned char *values = calloc((len + 1) / 2, 1);
+        if (!values)
+            return NULL;
+        for (i = 0; i < len; i++) {
+            int in;
+            if (fscanf(f, "%d", &in) != 1 || in < 0 || in >= Q4_CODEBOOK_SIZE) {
+                free(values);
+                return NULL;
+            }
+            values[i >> 1] |= in << ((i & 1) << 2);
+        }
+        return values;
+    } else if (type == WEIGHTS_INT8) {
+        rnn_weight *values = malloc(len * sizeof(rnn_weight));
+        if (!values)
+            return NULL;
+        for (i = 0; i < len; i++) {
+            int in;
+            if (fscanf(f, "%d", &in) != 1 || in < -128 || in > 127) {
+                free(values);
+                return NULL;
+            }
+            values[i] = in;
+        }
+        return values;
+    } else {
+        rnn_weight16 *values = malloc(len * sizeof(rnn_weight16));
+        if (!values)
+            return NULL;
+        for (i = 0; i < len; i++) {
+            float in;
+            if (fscanf(f, "%f", &in) != 1) {
+                free(values);
+                return NULL;
+            }
+            values[i] = type == WEIGHTS_FP16 ? float_to_half(in) : float_to_bf16(in);
+        }
+        return values;
+    }
+}
+
+/* Per-row scales are plain floats */
+static float *read_scales(FILE *f, int len) {
+    int i;
+    float *values = malloc(len * sizeof(float));
+    if (!values)
+        return NULL;
+    for (i = 0; i < len; i++) {
+        if (fscanf(f, "%f", &values[i]) != 1) {
+            free(values);
+            return NULL;
+        }
+    }
+    return values;
+}
+
+/* Per-row scales must be positive and finite, and only apply to full-rank
+ * int8 layers: compute_dense/compute_gru apply them once per output */
+static int check_scales(const float *scales, int n, int type, int ranks) {
+    int i;
+    if (!scales)
+        return 0;
+    if (type != WEIGHTS_INT8 || ranks != 0)
+        return -1;
+    for (i = 0; i < n; i++) {
+        if (!(scales[i] > 0 && scales[i] < 1e30f))
+            return -1;
+    }
+    return 0;
+}
+
+/* Sanity bound on dimensions so that the array sizes below cannot overflow */
+#define F_MAX_DIM 16384
+
+/* Check that every node only reads earlier slots, that the concatenated
+ * input sizes match the layers, that per-row scales are usable and that
+ * there is a gains output */
+int rnn_check_graph(const RNNNode *nodes, int nb_nodes) {
+    int k, i;
+    int nb_gains = 0, nb_vad = 0;
+    for (k = 0; k < nb_nodes; k++) {
+        const RNNNode *node = &nodes[k];
+        int nb_inputs, nb_neurons, size = 0;
+        if (node->type == RNN_NODE_GRU) {
+            const GRULayer *gru = node->gru;
+            nb_inputs = gru->nb_inputs;
+            nb_neurons = gru->nb_neurons;
+            if (check_scales(gru->scales, 3 * nb_neurons, gru->weights_type,
+                             gru->input_rank + gru->recurrent_rank) != 0)
+                return -1;
+        } else {
+            nb_inputs = node->dense->nb_inputs;
+            nb_neurons = node->dense->nb_neurons;
+            if (check_scales(node->dense->scales, nb_neurons, node->dense->weights_type, 0) != 0)
+                return -1;
+        }
+        if (nb_neurons == 0 || node->nb_inputs < 1 || node->nb_inputs > RNN_MAX_NODE_INPUTS)
+            return -1;
+        for (i = 0; i < node->nb_inputs; i++) {
+            int slot = node->inputs[i];
+            if (slot < 0 || slot > k)
+                return -1;
+            if (slot == 0)
+                size += RNN_INPUT_SIZE;
+            else if (nodes[slot - 1].type == RNN_NODE_GRU)
+                size += nodes[slot - 1].gru->nb_neurons;
+            else
+                size += nodes[slot - 1].dense->nb_neurons;
+        }
+        if (size != nb_inputs)
+            return -1;
+        if (node->output == RNN_OUTPUT_GAINS) {
+            if (nb_neurons != RNN_GAINS_SIZE)
+                return -1;
+            nb_gains++;
+        } else if (node->output == RNN_OUTPUT_VAD) {
+            if (nb_neurons != 1)
+                return -1;
+            nb_vad++;
+        } else if (node->output != RNN_OUTPUT_NONE) {
+            return -1;
+        }
+    }
+    return nb_gains == 1 && nb_vad <= 1 ? 0 : -1;
+}
+
 RNNModel *rnnoise_model_from_file(FILE *f) {
-    int i, in;
+    int in, version;
+    int row_scales = 0;
 
-    if (fscanf(f, "rnnoise-nu model file version %d\n", &in) != 1 || in != 1)
+    /* Binary models (rnn_binary.c) start with "RNNOISEB" */
+    in = getc(f);
+    if (in == EOF)
+        return NULL;
+    ungetc(in, f);
+    if (in == 'R')
+        return rnn_model_from_binary_file(f);
+
+    if (fscanf(f, "rnnoise-nu model file version %d\n", &version) != 1 || version < 1 || version > 4)
         return NULL;
 
     RNNModel *ret = calloc(1, sizeof(RNNModel));
@@ -61,15 +213,8 @@ RNNModel *rnnoise_model_from_file(FILE *f) {
     } \
     ret->name = name
 
-    ALLOC_LAYER(DenseLayer, input_dense);
-    ALLOC_LAYER(GRULayer, vad_gru);
-    ALLOC_LAYER(GRULayer, noise_gru);
-    ALLOC_LAYER(GRULayer, denoise_gru);
-    ALLOC_LAYER(DenseLayer, denoise_output);
-    ALLOC_LAYER(DenseLayer, vad_output);
-
 #define INPUT_VAL(name) do { \
-    if (fscanf(f, "%d", &in) != 1 || in < 0 || in > 128) { \
+    if (fscanf(f, "%d", &in) != 1 || in < 0 || in > F_MAX_DIM) { \
         rnnoise_model_free(ret); \
         return NULL; \
     } \
@@ -91,76 +236,253 @@ RNNModel *rnnoise_model_from_file(FILE *f) {
     } \
     } while (0)
 
-#define INPUT_ARRAY(name, len) do { \
-    rnn_weight *values = malloc((len) * sizeof(rnn_weight)); \
+#define INPUT_WEIGHTS_TYPE(name) do { \
+    int type = F_WEIGHTS_INT8; \
+    if (version >= 2) \
+        INPUT_VAL(type); \
+    row_scales = type == F_WEIGHTS_INT8_ROW; \
+    switch (type) { \
+        case F_WEIGHTS_INT8: \
+        case F_WEIGHTS_INT8_ROW: \
+            name = WEIGHTS_INT8; \
+            break; \
+        case F_WEIGHTS_FP16: \
+            name = WEIGHTS_FP16; \
+            break; \
+        case F_WEIGHTS_BF16: \
+            name = WEIGHTS_BF16; \
+            break; \
+        case F_WEIGHTS_Q4: \
+            name = WEIGHTS_Q4; \
+            break; \
+        default: \
+            rnnoise_model_free(ret); \
+            return NULL; \
+    } \
+    } while (0)
+
+#define INPUT_ARRAY(name, len, type) do { \
+    void *values = read_weights(f, (len), (type)); \
     if (!values) { \
         rnnoise_model_free(ret); \
         return NULL; \
     } \
     name = values; \
-    for (i = 0; i < (len); i++) { \
-        if (fscanf(f, "%d", &in) != 1) { \
+    } while (0)
+
+/* q4 layers start with their codebook and keep an int8 bias */
+#define INPUT_CODEBOOK(name) do { \
+    if (name->weights_type == WEIGHTS_Q4) \
+        INPUT_ARRAY(name->codebook, Q4_CODEBOOK_SIZE, WEIGHTS_INT8); \
+    } while (0)
+
+#define INPUT_SCALES(name, len) do { \
+    if (row_scales) { \
+        name->scales = read_scales(f, (len)); \
+        if (!name->scales) { \
             rnnoise_model_free(ret); \
             return NULL; \
         } \
-        values[i] = in; \
     } \
     } while (0)
 
+#define BIAS_TYPE(type) ((type) == WEIGHTS_Q4 ? WEIGHTS_INT8 : (type))
+
 #define INPUT_DENSE(name) do { \
     INPUT_VAL(name->nb_inputs); \
     INPUT_VAL(name->nb_neurons); \
-    ret->name ## _size = name->nb_neurons; \
     INPUT_ACTIVATION(name->activation); \
-    INPUT_ARRAY(name->input_weights, name->nb_inputs * name->nb_neurons); \
-    INPUT_ARRAY(name->bias, name->nb_neurons); \
+    INPUT_WEIGHTS_TYPE(name->weights_type); \
+    INPUT_CODEBOOK(name); \
+    INPUT_SCALES(name, name->nb_neurons); \
+    INPUT_ARRAY(name->input_weights, name->nb_inputs * name->nb_neurons, name->weights_type); \
+    INPUT_ARRAY(name->bias, name->nb_neurons, BIAS_TYPE(name->weights_type)); \
+    } while (0)
+
+/* Version 4 adds the ranks of the input and recurrent weights to the GRU
+ * header. A non-zero rank means the matrix is stored as its two low-rank
+ * factors, u (inputs x rank) followed by v (rank x 3*neurons). */
+#define INPUT_MATRIX(name, v, rank, nb_inputs, nb_outputs, type) do { \
+    if ((rank) > 0) { \
+        INPUT_ARRAY(name, (nb_inputs) * (rank), (type)); \
+        INPUT_ARRAY(v, (rank) * (nb_outputs), (type)); \
+    } else { \
+        INPUT_ARRAY(name, (nb_inputs) * (nb_outputs), (type)); \
+    } \
     } while (0)
 
 #define INPUT_GRU(name) do { \
     INPUT_VAL(name->nb_inputs); \
     INPUT_VAL(name->nb_neurons); \
-    ret->name ## _size = name->nb_neurons; \
     INPUT_ACTIVATION(name->activation); \
-    INPUT_ARRAY(name->input_weights, name->nb_inputs * name->nb_neurons * 3); \
-    INPUT_ARRAY(name->recurrent_weights, name->nb_neurons * name->nb_neurons * 3); \
-    INPUT_ARRAY(name->bias, name->nb_neurons * 3); \
+    INPUT_WEIGHTS_TYPE(name->weights_type); \
+    if (version >= 4) { \
+        INPUT_VAL(name->input_rank); \
+        INPUT_VAL(name->recurrent_rank); \
+    } \
+    INPUT_CODEBOOK(name); \
+    INPUT_SCALES(name, name->nb_neurons * 3); \
+    INPUT_MATRIX(name->input_weights, name->input_weights_v, name->input_rank, \
+                 name->nb_inputs, name->nb_neurons * 3, name->weights_type); \
+    INPUT_MATRIX(name->recurrent_weights, name->recurrent_weights_v, name->recurrent_rank, \
+                 name->nb_neurons, name->nb_neurons * 3, name->weights_type); \
+    INPUT_ARRAY(name->bias, name->nb_neurons * 3, BIAS_TYPE(name->weights_type)); \
     } while (0)
 
-    INPUT_DENSE(input_dense);
-    INPUT_GRU(vad_gru);
-    INPUT_GRU(noise_gru);
-    INPUT_GRU(denoise_gru);
-    INPUT_DENSE(denoise_output);
-    INPUT_DENSE(vad_output);
+    if (version < 3) {
+        /* Fixed RNNoise topology */
+        RNNNode graph[RNN_DEFAULT_NODES];
+
+        ALLOC_LAYER(DenseLayer, input_dense);
+        ALLOC_LAYER(GRULayer, vad_gru);
+        ALLOC_LAYER(GRULayer, noise_gru);
+        ALLOC_LAYER(GRULayer, denoise_gru);
+        ALLOC_LAYER(DenseLayer, denoise_output);
+        ALLOC_LAYER(DenseLayer, vad_output);
+
+        INPUT_DENSE(input_dense);
+        INPUT_GRU(vad_gru);
+        INPUT_GRU(noise_gru);
+        INPUT_GRU(denoise_gru);
+        INPUT_DENSE(denoise_output);
+        INPUT_DENSE(vad_output);
 
+        ret->input_dense_size = input_dense->nb_neurons;
+        ret->vad_gru_size = vad_gru->nb_neurons;
+        ret->noise_gru_size = noise_gru->nb_neurons;
+        ret->denoise_gru_size = denoise_gru->nb_neurons;
+        ret->denoise_output_size = denoise_output->nb_neurons;
+        ret->vad_output_size = vad_output->nb_neurons;
+
+        rnn_default_graph(ret, graph);
+        if (rnn_check_graph(graph, RNN_DEFAULT_NODES) != 0) {
+            rnnoise_model_free(ret);
+            return NULL;
+        }
+    } else {
+        /* Explicit layer graph (version 3 and later): the node count, then for each node
+         * "type output nb_inputs slot..." followed by the layer itself */
+        int k, i;
+        RNNNode *nodes;
+
+        INPUT_VAL(ret->nb_nodes);
+        nodes = calloc(ret->nb_nodes, sizeof(RNNNode));
+        if (!nodes || ret->nb_nodes == 0) {
+            free(nodes);
+            rnnoise_model_free(ret);
+            return NULL;
+        }
+        ret->nodes = nodes;
+        for (k = 0; k < ret->nb_nodes; k++) {
+            RNNNode *node = &nodes[k];
+            INPUT_VAL(node->type);
+            INPUT_VAL(node->output);
+            INPUT_VAL(node->nb_inputs);
+            if (node->nb_inputs > RNN_MAX_NODE_INPUTS) {
+                rnnoise_model_free(ret);
+                return NULL;
+            }
+            for (i = 0; i < node->nb_inputs; i++)
+                INPUT_VAL(node->inputs[i]);
+            if (node->type == RNN_NODE_GRU) {
+                GRULayer *layer = calloc(1, sizeof(GRULayer));
+                node->gru = layer;
+                if (!layer) {
+                    rnnoise_model_free(ret);
+                    return NULL;
+                }
+                INPUT_GRU(layer);
+            } else if (node->type == RNN_NODE_DENSE) {
+                DenseLayer *layer = calloc(1, sizeof(DenseLayer));
+                node->dense = layer;
+                if (!layer) {
+                    rnnoise_model_free(ret);
+                    return NULL;
+                }
+                INPUT_DENSE(layer);
+            } else {
+                rnnoise_model_free(ret);
+                return NULL;
+            }
+        }
+        if (rnn_check_graph(nodes, ret->nb_nodes) != 0) {
+            rnnoise_model_free(ret);
+            return NULL;
+        }
+    }
+
+    ret->refcounted = 1;
     return ret;
 }
 
-void rnnoise_model_free(RNNModel *model) {
-#define FREE_MAYBE(ptr) do { if (ptr) free(ptr); } while (0)
-#define FREE_DENSE(name) do { \
-    if (model->name) { \
-        free((void *) model->name->input_weights); \
-        free((void *) model->name->bias); \
-        free((void *) model->name); \
-    } \
-    } while (0)
-#define FREE_GRU(name) do { \
-    if (model->name) { \
-        free((void *) model->name->input_weights); \
-        free((void *) model->name->recurrent_weights); \
-        free((void *) model->name->bias); \
-        free((void *) model->name); \
-    } \
-    } while (0)
+/* The weights of binary models live in the blob and are not freed here */
+static void free_dense(const DenseLayer *layer, int weights) {
+    if (layer) {
+        if (weights) {
+            free((void *) layer->input_weights);
+            free((void *) layer->bias);
+            free((void *) layer->codebook);
+            free((void *) layer->scales);
+        }
+        free((void *) layer);
+    }
+}
+
+static void free_gru(const GRULayer *layer, int weights) {
+    if (layer) {
+        if (weights) {
+            free((void *) layer->input_weights);
+            free((void *) layer->recurrent_weights);
+            free((void *) layer->input_weights_v);
+            free((void *) layer->recurrent_weights_v);
+            free((void *) layer->bias);
+            free((void *) layer->codebook);
+            free((void *) layer->scales);
+        }
+        free((void *) layer);
+    }
+}
+
+static void destroy_model(RNNModel *model) {
+    int k, weights;
+
+    weights = model->blob == NULL;
+    free_dense(model->input_dense, weights);
+    free_gru(model->vad_gru, weights);
+    free_gru(model->noise_gru, weights);
+    free_gru(model->denoise_gru, weights);
+    free_dense(model->denoise_output, weights);
+    free_dense(model->vad_output, weights);
+    if (model->nodes) {
+        for (k = 0; k < model->nb_nodes; k++) {
+            free_dense(model->nodes[k].dense, weights);
+            free_gru(model->nodes[k].gru, weights);
+        }
+        free((void *) model->nodes);
+    }
+    if (model->blob)
+        rnn_model_release_blob(model);
+    free(model);
+}
+
+/* Loaded models are shared between their creator and every RNNState using
+ * them (rnnoise_set_model() may switch states while the creator frees the
+ * model); refs counts the holders besides the creator */
+void rnn_model_retain(const RNNModel *model) {
+    if (model->refcounted)
+        atomic_fetch_add(&((RNNModel *) model)->refs, 1);
+}
 
+void rnn_model_release(const RNNModel *model) {
+    if (model->refcounted && atomic_fetch_sub(&((RNNModel *) model)->refs, 1) == 0)
+        destroy_model((RNNModel *) model);
+}
+
+void rnnoise_model_free(RNNModel *model) {
     if (!model)
         return;
-    FREE_DENSE(input_dense);
-    FREE_GRU(vad_gru);
-    FREE_GRU(noise_gru);
-    FREE_GRU(denoise_gru);
-    FREE_DENSE(denoise_output);
-    FREE_DENSE(vad_output);
-    free(model);
+    if (model->refcounted)
+        rnn_model_release(model);
+    else
+        destroy_model(model);
 }
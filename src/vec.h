@@ -0,0 +1,403 @@
+//
+// Created by aone on 2021/5/10.
+//
+
+#ifndef RNNOISE_TOYS_VEC_H
+#define RNNOISE_TOYS_VEC_H
+
+#include <math.h>
+#include "common.h"
+#include "arch.h"
+#include "tansig_table.h"
+#include "rnn.h"
+
+#if defined(__F16C__) && defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE4_1__)
+#include <smmintrin.h>
+#endif
+
+/*
+    tansig(matlab的称呼)就是tanh(pytorch称呼)： 双曲正切S型传输函数
+    这里提前将tansig的值保存下来, 然后直接查表近似, 而不是每次都去算
+
+    e^x - e^(-x)
+    ------------
+    e^x + e^(-x)
+
+*/
+static OPUS_INLINE float tansig_approx(float x) {
+    int i;
+    float y, dy;
+    float sign = 1;
+    /* Tests are reversed to catch NaNs */
+    if (!(x < 8)) return 1;
+    if (!(x > -8)) return -1;
+#ifndef FIXED_POINT
+    /* Another check in case of -ffast-math*/ // 浮点优化选项 -ffast-math：极大地提高浮点运算速度
+    if (celt_isnan(x)) return 0;
+#endif
+    if (x < 0) {
+        x = -x;
+        sign = -1;
+    }
+    i = (int) floor(.5f + 25 * x);
+    x -= .04f * i;
+    y = tansig_table[i];
+    dy = 1 - y * y;
+    y = y + x * dy * (1 - y * x);
+    return sign * y;
+}
+
+
+/*
+    sigmoid activation function
+                1           e^(x)
+    S(x) = ----------- = -----------
+            1 + e^(-x)    e^(x) + 1
+*/
+static OPUS_INLINE float sigmoid_approx(float x) {
+    return .5 + .5 * tansig_approx(.5 * x);
+}
+/*
+    f(x) = max{0, x}
+*/
+static OPUS_INLINE float relu(float x) {
+    return x < 0 ? 0 : x;
+}
+
+/*
+    fp16 / bf16 与 float 之间的转换 (与 F16C 指令的舍入方式一致: 就近舍入, 偶数优先)
+*/
+static OPUS_INLINE float half_to_float(rnn_weight16 h) {
+    union {float f; opus_uint32 i;} out;
+    opus_uint32 sign = (opus_uint32) (h & 0x8000) << 16;
+    opus_uint32 exp = (h >> 10) & 0x1f;
+    opus_uint32 mant = h & 0x3ff;
+    if (exp == 0x1f) {
+        out.i = sign | 0x7f800000 | (mant << 13);
+    } else if (exp != 0) {
+        out.i = sign | ((exp + 112) << 23) | (mant << 13);
+    } else if (mant != 0) {
+        /* 非规格化数 */
+        exp = 113;
+        while (!(mant & 0x400)) {
+            mant <<= 1;
+            exp--;
+        }
+        out.i = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+    } else {
+        out.i = sign;
+    }
+    return out.f;
+}
+
+static OPUS_INLINE rnn_weight16 float_to_half(float x) {
+    union {float f; opus_uint32 i;} in;
+    opus_uint32 sign, mant;
+    int exp;
+    in.f = x;
+    sign = (in.i >> 16) & 0x8000;
+    exp = (int) ((in.i >> 23) & 0xff) - 112;
+    mant = in.i & 0x7fffff;
+    if (exp >= 0x1f) {
+        if (((in.i >> 23) & 0xff) == 0xff && mant) return sign | 0x7e00; /* NaN */
+        return sign | 0x7c00; /* 溢出为 inf */
+    }
+    if (exp <= 0) {
+        /* 非规格化数或下溢为0 */
+        int shift;
+        if (exp < -10) return sign;
+        mant |= 0x800000;
+        shift = 14 - exp;
+        {
+            opus_uint32 half = 1u << (shift - 1);
+            opus_uint32 rem = mant & ((1u << shift) - 1);
+            mant >>= shift;
+            if (rem > half || (rem == half && (mant & 1))) mant++;
+        }
+        return sign | mant;
+    }
+    {
+        opus_uint32 rem = mant & 0x1fff;
+        opus_uint32 h = sign | (exp << 10) | (mant >> 13);
+        /* 进位可能溢出到指数位, 结果依然正确(最大为inf) */
+        if (rem > 0x1000 || (rem == 0x1000 && (h & 1))) h++;
+        return h;
+    }
+}
+
+static OPUS_INLINE float bf16_to_float(rnn_weight16 h) {
+    union {float f; opus_uint32 i;} out;
+    out.i = (opus_uint32) h << 16;
+    return out.f;
+}
+
+static OPUS_INLINE rnn_weight16 float_to_bf16(float x) {
+    union {float f; opus_uint32 i;} in;
+    in.f = x;
+    if (celt_isnan(x)) return (in.i >> 16) | 0x40;
+    return (in.i + 0x7fff + ((in.i >> 16) & 1)) >> 16;
+}
+
+/* int8 (以及q4的码本) 放大了256倍, 需要再乘 WEIGHTS_SCALE; fp16/bf16 存的就是原值 */
+static OPUS_INLINE float weights_scale(int type) {
+    return type == WEIGHTS_FP16 || type == WEIGHTS_BF16 ? 1.f : WEIGHTS_SCALE;
+}
+
+/* 跳过 offset 个权重, q4 时 offset 必须是偶数 */
+static OPUS_INLINE const void *weights_offset(const void *weights, int type, int offset) {
+    if (type == WEIGHTS_INT8) return (const rnn_weight *) weights + offset;
+    if (type == WEIGHTS_Q4) return (const unsigned char *) weights + (offset >> 1);
+    return (const rnn_weight16 *) weights + offset;
+}
+
+/*!
+ * 将 bias 转换为 float 作为累加的初值
+ * @param out 输出 长度N
+ * @param bias 偏置, 类型由 type 决定
+ * @param type WEIGHTS_INT8 / WEIGHTS_FP16 / WEIGHTS_BF16 (q4 的 bias 为 int8)
+ * @param N 长度
+ */
+static OPUS_INLINE void load_bias(float *out, const void *bias, int type, int N) {
+    int i;
+    if (type == WEIGHTS_FP16) {
+        for (i = 0; i < N; i++) out[i] = half_to_float(((const rnn_weight16 *) bias)[i]);
+    } else if (type == WEIGHTS_BF16) {
+        for (i = 0; i < N; i++) out[i] = bf16_to_float(((const rnn_weight16 *) bias)[i]);
+    } else {
+        for (i = 0; i < N; i++) out[i] = ((const rnn_weight *) bias)[i];
+    }
+}
+
+/*
+    矩阵向量乘累加 out[i] += sum_j W[j * col_stride + i] * x[j], 0 <= i < rows, 0 <= j < cols
+    权重按列存储(Keras的布局), 所以内层循环沿 i 方向是连续访存, 可以直接向量化
+    每个 out[i] 都是按 j 从小到大的顺序累加的, 各实现之间结果完全一致
+*/
+static OPUS_INLINE void sgemv_accum_int8(float *out, const rnn_weight *weights, int col_stride, int rows, int cols,
+                                         const float *x) {
+    int i, j, k;
+    /* 每次8行, 累加在局部数组中, 循环次数固定, 编译器在 -O2 下也能向量化 */
+    for (i = 0; i + 8 <= rows; i += 8) {
+        float acc[8];
+        for (k = 0; k < 8; k++) acc[k] = out[i + k];
+        for (j = 0; j < cols; j++) {
+            const rnn_weight *w = &weights[j * col_stride + i];
+            for (k = 0; k < 8; k++)
+                acc[k] += w[k] * x[j];
+        }
+        for (k = 0; k < 8; k++) out[i + k] = acc[k];
+    }
+    for (j = 0; j < cols; j++) {
+        const rnn_weight *w = &weights[j * col_stride];
+        for (k = i; k < rows; k++)
+            out[k] += w[k] * x[j];
+    }
+}
+
+/*
+    GRU 输出部分的循环权重: out[i] += W[j * col_stride + i] * x[j] * g[j], 按 (W * x) * g 的顺序乘,
+    与原来逐元素计算的结果一致 (先算 x * g 会差最低位)
+*/
+static OPUS_INLINE void sgemv_accum_int8_gated(float *out, const rnn_weight *weights, int col_stride, int rows,
+                                               int cols, const float *x, const float *g) {
+    int i, j, k;
+    for (i = 0; i + 8 <= rows; i += 8) {
+        float acc[8];
+        for (k = 0; k < 8; k++) acc[k] = out[i + k];
+        for (j = 0; j < cols; j++) {
+            const rnn_weight *w = &weights[j * col_stride + i];
+            for (k = 0; k < 8; k++)
+                acc[k] += w[k] * x[j] * g[j];
+        }
+        for (k = 0; k < 8; k++) out[i + k] = acc[k];
+    }
+    for (j = 0; j < cols; j++) {
+        const rnn_weight *w = &weights[j * col_stride];
+        for (k = i; k < rows; k++)
+            out[k] += w[k] * x[j] * g[j];
+    }
+}
+
+static OPUS_INLINE void sgemv_accum_fp16(float *out, const rnn_weight16 *weights, int col_stride, int rows, int cols,
+                                         const float *x) {
+    int i, j;
+    i = 0;
+#if defined(__F16C__) && defined(__AVX__)
+    for (; i + 8 <= rows; i += 8) {
+        __m256 acc = _mm256_loadu_ps(&out[i]);
+        for (j = 0; j < cols; j++) {
+            __m256 w = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *) &weights[j * col_stride + i]));
+            acc = _mm256_add_ps(acc, _mm256_mul_ps(w, _mm256_set1_ps(x[j])));
+        }
+        _mm256_storeu_ps(&out[i], acc);
+    }
+#endif
+    for (; i < rows; i++) {
+        float sum = out[i];
+        for (j = 0; j < cols; j++)
+            sum += half_to_float(weights[j * col_stride + i]) * x[j];
+        out[i] = sum;
+    }
+}
+
+static OPUS_INLINE void sgemv_accum_bf16(float *out, const rnn_weight16 *weights, int col_stride, int rows, int cols,
+                                         const float *x) {
+    int i, j;
+    for (j = 0; j < cols; j++) {
+        const rnn_weight16 *w = &weights[j * col_stride];
+        for (i = 0; i < rows; i++)
+            out[i] += bf16_to_float(w[i]) * x[j];
+    }
+}
+
+/*
+    q4: 先查码本得到int8权重再累加
+    SSE4.1 时每次处理16行: 把8个字节拆成16个4bit索引, 用 pshufb 在16字节的码本里并行查表
+*/
+static OPUS_INLINE int q4_index(const unsigned char *weights, int k) {
+    return (weights[k >> 1] >> ((k & 1) << 2)) & 0xf;
+}
+
+static OPUS_INLINE void sgemv_accum_q4(float *out, const unsigned char *weights, const rnn_weight *codebook,
+                                       int col_stride, int rows, int first, int cols, const float *x) {
+    int i, j;
+    i = 0;
+    /* 两个索引共用一个字节, 起始列不一定落在字节边界上, 所以不能像其他类型那样直接偏移指针 */
+    weights += (first * col_stride) >> 1;
+    if ((first * col_stride) & 1) {
+        for (; i < rows; i++) {
+            float sum = out[i];
+            for (j = 0; j < cols; j++)
+                sum += codebook[q4_index(weights, j * col_stride + i + 1)] * x[j];
+            out[i] = sum;
+        }
+        return;
+    }
+#if defined(__SSE4_1__)
+    if ((col_stride & 1) == 0) {
+        const __m128i cb = _mm_loadu_si128((const __m128i *) codebook);
+        const __m128i mask = _mm_set1_epi8(0x0f);
+        for (; i + 16 <= rows; i += 16) {
+            __m128 acc0 = _mm_loadu_ps(&out[i]);
+            __m128 acc1 = _mm_loadu_ps(&out[i + 4]);
+            __m128 acc2 = _mm_loadu_ps(&out[i + 8]);
+            __m128 acc3 = _mm_loadu_ps(&out[i + 12]);
+            for (j = 0; j < cols; j++) {
+                __m128i packed = _mm_loadl_epi64((const __m128i *) &weights[(j * col_stride + i) >> 1]);
+                __m128i idx = _mm_unpacklo_epi8(_mm_and_si128(packed, mask),
+                                                _mm_and_si128(_mm_srli_epi16(packed, 4), mask));
+                __m128i w = _mm_shuffle_epi8(cb, idx);
+                __m128 xj = _mm_set1_ps(x[j]);
+                acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_cvtepi32_ps(_mm_cvtepi8_epi32(w)), xj));
+                acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_cvtepi32_ps(_mm_cvtepi8_epi32(_mm_srli_si128(w, 4))), xj));
+                acc2 = _mm_add_ps(acc2, _mm_mul_ps(_mm_cvtepi32_ps(_mm_cvtepi8_epi32(_mm_srli_si128(w, 8))), xj));
+                acc3 = _mm_add_ps(acc3, _mm_mul_ps(_mm_cvtepi32_ps(_mm_cvtepi8_epi32(_mm_srli_si128(w, 12))), xj));
+            }
+            _mm_storeu_ps(&out[i], acc0);
+            _mm_storeu_ps(&out[i + 4], acc1);
+            _mm_storeu_ps(&out[i + 8], acc2);
+            _mm_storeu_ps(&out[i + 12], acc3);
+        }
+    }
+#endif
+    for (; i < rows; i++) {
+        float sum = out[i];
+        for (j = 0; j < cols; j++)
+            sum += codebook[q4_index(weights, j * col_stride + i)] * x[j];
+        out[i] = sum;
+    }
+}
+
+static OPUS_INLINE void sgemv_accum(float *out, const void *weights, int type, const rnn_weight *codebook,
+                                    int col_stride, int rows, int cols, const float *x) {
+    if (type == WEIGHTS_Q4)
+        sgemv_accum_q4(out, (const unsigned char *) weights, codebook, col_stride, rows, 0, cols, x);
+    else if (type == WEIGHTS_FP16)
+        sgemv_accum_fp16(out, (const rnn_weight16 *) weights, col_stride, rows, cols, x);
+    else if (type == WEIGHTS_BF16)
+        sgemv_accum_bf16(out, (const rnn_weight16 *) weights, col_stride, rows, cols, x);
+    else
+        sgemv_accum_int8(out, (const rnn_weight *) weights, col_stride, rows, cols, x);
+}
+
+/* 只累加 [first, first + cols) 这几列, x 为这几列对应的输入 */
+static OPUS_INLINE void sgemv_accum_columns(float *out, const void *weights, int type, const rnn_weight *codebook,
+                                            int col_stride, int rows, int first, int cols, const float *x) {
+    if (type == WEIGHTS_Q4)
+        sgemv_accum_q4(out, (const unsigned char *) weights, codebook, col_stride, rows, first, cols, x);
+    else
+        sgemv_accum(out, weights_offset(weights, type, first * col_stride), type, codebook, col_stride, rows, cols, x);
+}
+
+/*
+    int8 权重的多帧矩阵乘累加: 每次取4帧, 权重的每一列读进来后同时乘到4帧上, 权重只读一遍;
+    每个输出仍按 j 从小到大累加, 与逐帧的 sgemv_accum_int8 结果完全一致. 不足4帧的部分逐帧计算
+*/
+static OPUS_INLINE void sgemm_accum_int8(float *out, int out_stride, const rnn_weight *weights, int col_stride,
+                                         int rows, int cols, const float *x, int x_stride, int nframes) {
+    int i, j, k, t;
+    for (t = 0; t + 4 <= nframes; t += 4) {
+        float *o0 = &out[t * out_stride], *o1 = o0 + out_stride, *o2 = o1 + out_stride, *o3 = o2 + out_stride;
+        const float *x0 = &x[t * x_stride], *x1 = x0 + x_stride, *x2 = x1 + x_stride, *x3 = x2 + x_stride;
+        for (i = 0; i + 8 <= rows; i += 8) {
+            float a0[8], a1[8], a2[8], a3[8];
+            for (k = 0; k < 8; k++) {
+                a0[k] = o0[i + k];
+                a1[k] = o1[i + k];
+                a2[k] = o2[i + k];
+                a3[k] = o3[i + k];
+            }
+            for (j = 0; j < cols; j++) {
+                const rnn_weight *w = &weights[j * col_stride + i];
+                for (k = 0; k < 8; k++) {
+                    float wk = w[k];
+                    a0[k] += wk * x0[j];
+                    a1[k] += wk * x1[j];
+                    a2[k] += wk * x2[j];
+                    a3[k] += wk * x3[j];
+                }
+            }
+            for (k = 0; k < 8; k++) {
+                o0[i + k] = a0[k];
+                o1[i + k] = a1[k];
+                o2[i + k] = a2[k];
+                o3[i + k] = a3[k];
+            }
+        }
+        for (j = 0; j < cols; j++) {
+            const rnn_weight *w = &weights[j * col_stride];
+            for (k = i; k < rows; k++) {
+                float wk = w[k];
+                o0[k] += wk * x0[j];
+                o1[k] += wk * x1[j];
+                o2[k] += wk * x2[j];
+                o3[k] += wk * x3[j];
+            }
+        }
+    }
+    for (; t < nframes; t++)
+        sgemv_accum_int8(&out[t * out_stride], weights, col_stride, rows, cols, &x[t * x_stride]);
+}
+
+/*
+    多帧一起算的矩阵乘累加 out[t * out_stride + i] += sum_j W[(first + j) * col_stride + i] * x[t * x_stride + j]
+    int8 权重由 sgemm_accum_int8 对多帧同时计算; 其他类型逐帧计算, 同一层的权重对所有帧连续使用, 第一帧之后都在缓存中.
+    每个输出的累加顺序都与逐帧计算相同
+*/
+static OPUS_INLINE void sgemm_accum(float *out, int out_stride, const void *weights, int type,
+                                    const rnn_weight *codebook, int col_stride, int rows, int first, int cols,
+                                    const float *x, int x_stride, int nframes) {
+    int t;
+    if (type == WEIGHTS_INT8) {
+        sgemm_accum_int8(out, out_stride, (const rnn_weight *) weights + first * col_stride, col_stride, rows, cols,
+                         x, x_stride, nframes);
+        return;
+    }
+    for (t = 0; t < nframes; t++)
+        sgemv_accum_columns(&out[t * out_stride], weights, type, codebook, col_stride, rows, first, cols,
+                            &x[t * x_stride]);
+}
+
+#endif //RNNOISE_TOYS_VEC_H
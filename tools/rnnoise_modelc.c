@@ -0,0 +1,687 @@
+//
+// 模型编译器: 把 .rnnn 或二进制模型转换为指定权重类型的二进制模型或 C 源文件, 部署时不再需要 Python/Keras
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "rnnoise.h"
+#include "rnn.h"
+#include "rnn_data.h"
+#include "vec.h"
+
+/* 不转换, 保留原来的权重类型 */
+#define KEEP_TYPE (-1)
+
+#define MAX_NODES 1024
+
+/* 每行缩放的 int8: 层的 weights_type 仍为 WEIGHTS_INT8, 另有每个输出的 scales */
+#define TYPE_INT8_ROW 4
+
+static const char *type_names[] = {"int8", "fp16", "bf16", "q4", "int8row"};
+
+/* 一层的各个权重张量, 与 GRULayer 的字段对应; dense 层只有 input */
+#define T_INPUT 0
+#define T_INPUT_V 1
+#define T_RECURRENT 2
+#define T_RECURRENT_V 3
+#define T_WEIGHTS 4
+
+typedef struct {
+    const void *ptr[T_WEIGHTS];
+    int n[T_WEIGHTS];
+    const void *bias;
+    int nb_bias;
+    int type;
+    const rnn_weight *codebook;
+    const float *scales;    /* nb_bias 个, 只有 TYPE_INT8_ROW 有 */
+} LayerWeights;
+
+static const char *tensor_names[] = {"weights", "weights_v", "recurrent_weights", "recurrent_weights_v"};
+
+static void layer_weights(const RNNNode *node, LayerWeights *lw) {
+    memset(lw, 0, sizeof(*lw));
+    if (node->type == RNN_NODE_GRU) {
+        const GRULayer *g = node->gru;
+        int n3 = 3 * g->nb_neurons;
+        lw->ptr[T_INPUT] = g->input_weights;
+        lw->ptr[T_RECURRENT] = g->recurrent_weights;
+        if (g->input_rank > 0) {
+            lw->n[T_INPUT] = g->nb_inputs * g->input_rank;
+            lw->ptr[T_INPUT_V] = g->input_weights_v;
+            lw->n[T_INPUT_V] = g->input_rank * n3;
+        } else {
+            lw->n[T_INPUT] = g->nb_inputs * n3;
+        }
+        if (g->recurrent_rank > 0) {
+            lw->n[T_RECURRENT] = g->nb_neurons * g->recurrent_rank;
+            lw->ptr[T_RECURRENT_V] = g->recurrent_weights_v;
+            lw->n[T_RECURRENT_V] = g->recurrent_rank * n3;
+        } else {
+            lw->n[T_RECURRENT] = g->nb_neurons * n3;
+        }
+        lw->bias = g->bias;
+        lw->nb_bias = n3;
+        lw->type = g->scales ? TYPE_INT8_ROW : g->weights_type;
+        lw->codebook = g->codebook;
+        lw->scales = g->scales;
+    } else {
+        const DenseLayer *d = node->dense;
+        lw->ptr[T_INPUT] = d->input_weights;
+        lw->n[T_INPUT] = d->nb_inputs * d->nb_neurons;
+        lw->bias = d->bias;
+        lw->nb_bias = d->nb_neurons;
+        lw->type = d->scales ? TYPE_INT8_ROW : d->weights_type;
+        lw->codebook = d->codebook;
+        lw->scales = d->scales;
+    }
+}
+
+static int bias_type(int type) {
+    return type == WEIGHTS_Q4 ? WEIGHTS_INT8 : type;
+}
+
+/* 权重在内存中的类型 */
+static int storage_type(int type) {
+    return type == TYPE_INT8_ROW ? WEIGHTS_INT8 : type;
+}
+
+static size_t tensor_bytes(int n, int type) {
+    if (type == WEIGHTS_Q4)
+        return (n + 1) / 2;
+    return storage_type(type) == WEIGHTS_INT8 ? (size_t) n : n * sizeof(rnn_weight16);
+}
+
+/*!
+ * 第 k 个权重的实际值 (int8 和码本已除以256)
+ * @param scales TYPE_INT8_ROW 时每个输出的缩放; 权重按输入优先存放, 第 k 个的输出为 k % nb_outputs
+ */
+static float weight_value(const void *w, int type, const rnn_weight *codebook, const float *scales, int nb_outputs,
+                          int k) {
+    switch (type) {
+        case TYPE_INT8_ROW:
+            return ((const rnn_weight *) w)[k] * scales[k % nb_outputs];
+        case WEIGHTS_FP16:
+            return half_to_float(((const rnn_weight16 *) w)[k]);
+        case WEIGHTS_BF16:
+            return bf16_to_float(((const rnn_weight16 *) w)[k]);
+        case WEIGHTS_Q4:
+            return codebook[q4_index(w, k)] * WEIGHTS_SCALE;
+        default:
+            return ((const rnn_weight *) w)[k] * WEIGHTS_SCALE;
+    }
+}
+
+static int quantize_int8(float v) {
+    return (int) IMAX(-128, IMIN(127, (int) floor(.5 + 256 * v)));
+}
+
+/*!
+ * 每个输出的缩放: 该输出的所有权重和 bias 的最大绝对值对应 127.
+ * 只用于不分解的层, 各张量都是 行数 x nb_outputs; 全为0的输出用 WEIGHTS_SCALE
+ */
+static float *row_scales(const LayerWeights *src) {
+    int i, k, n = src->nb_bias;
+    float *scales = malloc(n * sizeof(float));
+    if (!scales)
+        return NULL;
+    for (k = 0; k < n; k++)
+        scales[k] = fabsf(weight_value(src->bias, bias_type(src->type), src->codebook, src->scales, n, k));
+    for (i = 0; i < T_WEIGHTS; i++) {
+        for (k = 0; k < src->n[i]; k++) {
+            float v = fabsf(weight_value(src->ptr[i], src->type, src->codebook, src->scales, n, k));
+            scales[k % n] = MAX32(scales[k % n], v);
+        }
+    }
+    for (k = 0; k < n; k++)
+        scales[k] = scales[k] > 0 ? scales[k] / 127 : WEIGHTS_SCALE;
+    return scales;
+}
+
+static int nearest(const int *centers, int x) {
+    int k, best = 0;
+    for (k = 1; k < Q4_CODEBOOK_SIZE; k++) {
+        if (abs(x - centers[k]) < abs(x - centers[best]))
+            best = k;
+    }
+    return best;
+}
+
+/* 直方图 hist 表示的有序序列中的第 idx 个量化值 */
+static int sorted_value(const int *hist, int idx) {
+    int x;
+    for (x = 0; x < 255 && idx >= hist[x]; x++)
+        idx -= hist[x];
+    return x - 128;
+}
+
+/*!
+ * q4 的码本: 与 dump_rnn.py 相同, 在 int8 量化值上做 k-means, 以分位数为初始中心.
+ * 量化值只有256种, 在直方图上迭代
+ */
+static void kmeans_codebook(rnn_weight *codebook, const int *hist, int total) {
+    int centers[Q4_CODEBOOK_SIZE];
+    int k, x, it, n = 0;
+    for (k = 0; k < Q4_CODEBOOK_SIZE; k++) {
+        // 第 k/15 分位数, 与 np.percentile 一样在相邻两个值之间线性插值
+        double pos = (double) k * (total - 1) / (Q4_CODEBOOK_SIZE - 1);
+        int lo = (int) pos;
+        int a = sorted_value(hist, lo), b = sorted_value(hist, IMIN(lo + 1, total - 1));
+        int c = (int) floor(.5 + a + (b - a) * (pos - lo));
+        // np.unique: 去掉重复的中心, 不足16个的补0
+        if (n == 0 || c != centers[n - 1])
+            centers[n++] = c;
+    }
+    while (n < Q4_CODEBOOK_SIZE)
+        centers[n++] = 0;
+    for (it = 0; it < 50; it++) {
+        double sum[Q4_CODEBOOK_SIZE] = {0};
+        int count[Q4_CODEBOOK_SIZE] = {0};
+        for (x = 0; x < 256; x++) {
+            if (hist[x]) {
+                k = nearest(centers, x - 128);
+                sum[k] += (double) hist[x] * (x - 128);
+                count[k] += hist[x];
+            }
+        }
+        for (k = 0; k < Q4_CODEBOOK_SIZE; k++) {
+            if (count[k])
+                centers[k] = IMAX(-128, IMIN(127, (int) floor(.5 + sum[k] / count[k])));
+        }
+    }
+    for (k = 0; k < Q4_CODEBOOK_SIZE; k++)
+        codebook[k] = centers[k];
+}
+
+/* 把 n 个实际值编码为 type, q4 时按 codebook 取最近的中心, TYPE_INT8_ROW 时除以各输出的 scales */
+static void *encode(const float *v, int n, int type, const rnn_weight *codebook, const float *scales,
+                    int nb_outputs) {
+    int k;
+    void *out = calloc(1, tensor_bytes(n, type) + 1);
+    if (!out)
+        return NULL;
+    for (k = 0; k < n; k++) {
+        if (type == WEIGHTS_FP16) {
+            ((rnn_weight16 *) out)[k] = float_to_half(v[k]);
+        } else if (type == WEIGHTS_BF16) {
+            ((rnn_weight16 *) out)[k] = float_to_bf16(v[k]);
+        } else if (type == WEIGHTS_Q4) {
+            int centers[Q4_CODEBOOK_SIZE], i;
+            for (i = 0; i < Q4_CODEBOOK_SIZE; i++)
+                centers[i] = codebook[i];
+            ((unsigned char *) out)[k >> 1] |= nearest(centers, quantize_int8(v[k])) << ((k & 1) << 2);
+        } else if (type == TYPE_INT8_ROW) {
+            ((rnn_weight *) out)[k] = IMAX(-127, IMIN(127, (int) floor(.5 + v[k] / scales[k % nb_outputs])));
+        } else {
+            ((rnn_weight *) out)[k] = quantize_int8(v[k]);
+        }
+    }
+    return out;
+}
+
+static void *copy_bytes(const void *p, size_t n) {
+    void *out = malloc(n ? n : 1);
+    if (out)
+        memcpy(out, p, n);
+    return out;
+}
+
+/*!
+ * 把一层的权重转换为 type, 类型不变时原样复制
+ * @param err 输出 与原来的实际值相比的最大误差
+ * @return 0 成功, -1 内存不足
+ */
+static int convert_layer(const LayerWeights *src, int type, void **ptr, void **bias, rnn_weight **codebook,
+                         float **scales, float *err) {
+    int i, k;
+    int hist[256] = {0}, total = 0;
+    rnn_weight cb[Q4_CODEBOOK_SIZE];
+    *err = 0;
+    *codebook = NULL;
+    *scales = NULL;
+    if (type == src->type) {
+        for (i = 0; i < T_WEIGHTS; i++)
+            ptr[i] = src->ptr[i] ? copy_bytes(src->ptr[i], tensor_bytes(src->n[i], type)) : NULL;
+        *bias = copy_bytes(src->bias, tensor_bytes(src->nb_bias, bias_type(type)));
+        if (src->codebook)
+            *codebook = copy_bytes(src->codebook, Q4_CODEBOOK_SIZE);
+        if (src->scales)
+            *scales = copy_bytes(src->scales, src->nb_bias * sizeof(float));
+        return *bias ? 0 : -1;
+    }
+    if (type == TYPE_INT8_ROW) {
+        *scales = row_scales(src);
+        if (!*scales)
+            return -1;
+    }
+    if (type == WEIGHTS_Q4) {
+        // 码本由这一层所有的权重(不含 bias)共同决定
+        for (i = 0; i < T_WEIGHTS; i++) {
+            for (k = 0; k < src->n[i]; k++)
+                hist[quantize_int8(weight_value(src->ptr[i], src->type, src->codebook, src->scales, src->nb_bias,
+                                                k)) + 128]++;
+            total += src->n[i];
+        }
+        kmeans_codebook(cb, hist, total);
+        *codebook = copy_bytes(cb, Q4_CODEBOOK_SIZE);
+        if (!*codebook)
+            return -1;
+    }
+    for (i = 0; i <= T_WEIGHTS; i++) {
+        // i == T_WEIGHTS 为 bias
+        const void *w = i < T_WEIGHTS ? src->ptr[i] : src->bias;
+        int n = i < T_WEIGHTS ? src->n[i] : src->nb_bias;
+        int from = i < T_WEIGHTS ? src->type : bias_type(src->type);
+        int to = i < T_WEIGHTS ? type : bias_type(type);
+        float *v;
+        void *out;
+        if (!w)
+            continue;
+        v = malloc((n ? n : 1) * sizeof(float));
+        if (!v)
+            return -1;
+        for (k = 0; k < n; k++)
+            v[k] = weight_value(w, from, src->codebook, src->scales, src->nb_bias, k);
+        out = encode(v, n, to, *codebook, *scales, src->nb_bias);
+        if (!out) {
+            free(v);
+            return -1;
+        }
+        for (k = 0; k < n; k++)
+            *err = MAX32(*err, fabsf(weight_value(out, to, *codebook, *scales, src->nb_bias, k) - v[k]));
+        free(v);
+        if (i < T_WEIGHTS)
+            ptr[i] = out;
+        else
+            *bias = out;
+    }
+    return 0;
+}
+
+/* 读入模型, 统一为带计算图的形式 (经过一次二进制格式): 没有计算图的模型按默认拓扑展开 */
+static RNNModel *load_model(const char *path) {
+    RNNModel *model = NULL;
+    FILE *f;
+    if (strcmp(path, "default") != 0) {
+        f = fopen(path, "rb");
+        if (!f)
+            return NULL;
+        model = rnnoise_model_from_file(f);
+        fclose(f);
+        if (!model || model->nodes)
+            return model;
+    }
+    f = tmpfile();
+    if (!f || rnnoise_model_write_binary(model, f) != 0) {
+        if (f)
+            fclose(f);
+        rnnoise_model_free(model);
+        return NULL;
+    }
+    rnnoise_model_free(model);
+    rewind(f);
+    model = rnnoise_model_from_file(f);
+    fclose(f);
+    return model;
+}
+
+/* 按 types[k] 转换第 k 个节点, 返回新分配的模型, 由 rnnoise_model_free 释放 */
+static RNNModel *convert_model(const RNNModel *src, const int *types, float *err) {
+    int k;
+    RNNModel *dst = calloc(1, sizeof(RNNModel));
+    RNNNode *nodes = calloc((size_t) src->nb_nodes, sizeof(RNNNode));
+    if (!dst || !nodes) {
+        free(dst);
+        free(nodes);
+        return NULL;
+    }
+    dst->nodes = nodes;
+    dst->nb_nodes = src->nb_nodes;
+    for (k = 0; k < src->nb_nodes; k++) {
+        LayerWeights lw;
+        void *ptr[T_WEIGHTS], *bias = NULL;
+        rnn_weight *codebook = NULL;
+        float *scales = NULL;
+        int type;
+        layer_weights(&src->nodes[k], &lw);
+        type = types[k] == KEEP_TYPE ? lw.type : types[k];
+        nodes[k] = src->nodes[k];
+        nodes[k].dense = NULL;
+        nodes[k].gru = NULL;
+        memset(ptr, 0, sizeof(ptr));
+        if (convert_layer(&lw, type, ptr, &bias, &codebook, &scales, &err[k]) != 0) {
+            rnnoise_model_free(dst);
+            return NULL;
+        }
+        if (src->nodes[k].type == RNN_NODE_GRU) {
+            GRULayer *g = malloc(sizeof(GRULayer));
+            if (g) {
+                *g = *src->nodes[k].gru;
+                g->input_weights = ptr[T_INPUT];
+                g->input_weights_v = ptr[T_INPUT_V];
+                g->recurrent_weights = ptr[T_RECURRENT];
+                g->recurrent_weights_v = ptr[T_RECURRENT_V];
+                g->bias = bias;
+                g->codebook = codebook;
+                g->scales = scales;
+                g->weights_type = storage_type(type);
+            }
+            nodes[k].gru = g;
+        } else {
+            DenseLayer *d = malloc(sizeof(DenseLayer));
+            if (d) {
+                *d = *src->nodes[k].dense;
+                d->input_weights = ptr[T_INPUT];
+                d->bias = bias;
+                d->codebook = codebook;
+                d->scales = scales;
+                d->weights_type = storage_type(type);
+            }
+            nodes[k].dense = d;
+        }
+        if (!nodes[k].gru && !nodes[k].dense) {
+            free(ptr[T_INPUT]);
+            free(ptr[T_INPUT_V]);
+            free(ptr[T_RECURRENT]);
+            free(ptr[T_RECURRENT_V]);
+            free(bias);
+            free(codebook);
+            free(scales);
+            rnnoise_model_free(dst);
+            return NULL;
+        }
+    }
+    return dst;
+}
+
+/* 每层的内存占用: 权重 (含 bias, 码本和 scales) 和每路流的激活值/状态 */
+static void print_footprint(const RNNModel *model, const float *err) {
+    int k;
+    size_t total = 0, state = 0;
+    printf("node  type   inputs  neurons  ranks    type     weight bytes  state bytes  max error\n");
+    for (k = 0; k < model->nb_nodes; k++) {
+        const RNNNode *node = &model->nodes[k];
+        LayerWeights lw;
+        size_t bytes;
+        int i, neurons;
+        char ranks[32] = "-";
+        layer_weights(node, &lw);
+        bytes = tensor_bytes(lw.nb_bias, bias_type(lw.type)) + (lw.codebook ? Q4_CODEBOOK_SIZE : 0) +
+                (lw.scales ? lw.nb_bias * sizeof(float) : 0);
+        for (i = 0; i < T_WEIGHTS; i++)
+            bytes += lw.ptr[i] ? tensor_bytes(lw.n[i], lw.type) : 0;
+        if (node->type == RNN_NODE_GRU) {
+            neurons = node->gru->nb_neurons;
+            if (node->gru->input_rank || node->gru->recurrent_rank)
+                snprintf(ranks, sizeof(ranks), "%d:%d", node->gru->input_rank, node->gru->recurrent_rank);
+        } else {
+            neurons = node->dense->nb_neurons;
+        }
+        printf("%4d  %-5s  %6d  %7d  %-7s  %-7s  %12zu  %11zu  %9.3g\n", k, node->type == RNN_NODE_GRU ? "gru" : "dense",
+               node->type == RNN_NODE_GRU ? node->gru->nb_inputs : node->dense->nb_inputs, neurons, ranks,
+               type_names[lw.type], bytes, neurons * sizeof(float), err[k]);
+        total += bytes;
+        state += neurons * sizeof(float);
+    }
+    printf("total %zu weight bytes (shared), %zu state bytes per stream\n", total, state);
+}
+
+static void write_array(FILE *f, const char *ctype, const char *name, const void *w, int n, int type) {
+    int i;
+    int count = type == WEIGHTS_Q4 ? (n + 1) / 2 : n;
+    fprintf(f, "static _Alignas(64) const %s %s[%d] = {\n   ", ctype, name, count);
+    for (i = 0; i < count; i++) {
+        if (type == WEIGHTS_INT8)
+            fprintf(f, "%d", ((const rnn_weight *) w)[i]);
+        else if (type == WEIGHTS_Q4)
+            fprintf(f, "0x%02x", ((const unsigned char *) w)[i]);
+        else
+            fprintf(f, "0x%04x", ((const rnn_weight16 *) w)[i]);
+        if (i == count - 1)
+            break;
+        fprintf(f, i % 8 == 7 ? ",\n   " : ", ");
+    }
+    fprintf(f, "\n};\n\n");
+}
+
+static void write_floats(FILE *f, const char *name, const float *v, int n) {
+    int i;
+    fprintf(f, "static _Alignas(64) const float %s[%d] = {\n   ", name, n);
+    for (i = 0; i < n; i++)
+        fprintf(f, i == n - 1 ? "%.9g" : i % 8 == 7 ? "%.9g,\n   " : "%.9g, ", v[i]);
+    fprintf(f, "\n};\n\n");
+}
+
+static const char *ctype_of(int type) {
+    if (type == WEIGHTS_Q4)
+        return "unsigned char";
+    return type == WEIGHTS_INT8 ? "rnn_weight" : "rnn_weight16";
+}
+
+static const char *macro_of(int type) {
+    static const char *names[] = {"WEIGHTS_INT8", "WEIGHTS_FP16", "WEIGHTS_BF16", "WEIGHTS_Q4"};
+    return names[type];
+}
+
+static const char *activation_of(int activation) {
+    static const char *names[] = {"ACTIVATION_TANH", "ACTIVATION_SIGMOID", "ACTIVATION_RELU"};
+    return names[activation];
+}
+
+/* 与 dump_rnn.py 输出的 rnn_data.c 相同的形式, 数组按64字节对齐, 模型以计算图给出 */
+static void write_c(FILE *f, const RNNModel *model, const char *name) {
+    int k, i;
+    char buf[256];
+    fprintf(f, "/*This file is automatically generated by rnnoise-modelc*/\n\n");
+    fprintf(f, "#ifdef HAVE_CONFIG_H\n#include \"config.h\"\n#endif\n\n#include \"rnn.h\"\n#include \"rnn_data.h\"\n\n");
+    for (k = 0; k < model->nb_nodes; k++) {
+        const RNNNode *node = &model->nodes[k];
+        LayerWeights lw;
+        layer_weights(node, &lw);
+        for (i = 0; i < T_WEIGHTS; i++) {
+            if (lw.ptr[i]) {
+                snprintf(buf, sizeof(buf), "%s_%d_%s", name, k, tensor_names[i]);
+                write_array(f, ctype_of(storage_type(lw.type)), buf, lw.ptr[i], lw.n[i], storage_type(lw.type));
+            }
+        }
+        snprintf(buf, sizeof(buf), "%s_%d_bias", name, k);
+        write_array(f, ctype_of(storage_type(bias_type(lw.type))), buf, lw.bias, lw.nb_bias,
+                    storage_type(bias_type(lw.type)));
+        if (lw.codebook) {
+            snprintf(buf, sizeof(buf), "%s_%d_codebook", name, k);
+            write_array(f, "rnn_weight", buf, lw.codebook, Q4_CODEBOOK_SIZE, WEIGHTS_INT8);
+        }
+        if (lw.scales) {
+            snprintf(buf, sizeof(buf), "%s_%d_scales", name, k);
+            write_floats(f, buf, lw.scales, lw.nb_bias);
+        }
+        if (node->type == RNN_NODE_GRU) {
+            const GRULayer *g = node->gru;
+            fprintf(f, "static const GRULayer %s_%d = {\n   %s_%d_bias,\n   %s_%d_weights,\n   %s_%d_recurrent_weights,\n",
+                    name, k, name, k, name, k, name, k);
+            fprintf(f, "   %d, %d, %s, %s, ", g->nb_inputs, g->nb_neurons, activation_of(g->activation),
+                    macro_of(g->weights_type));
+            if (g->codebook)
+                fprintf(f, "%s_%d_codebook,\n", name, k);
+            else
+                fprintf(f, "NULL,\n");
+            fprintf(f, "   %d, ", g->input_rank);
+            if (g->input_rank)
+                fprintf(f, "%s_%d_weights_v, ", name, k);
+            else
+                fprintf(f, "NULL, ");
+            fprintf(f, "%d, ", g->recurrent_rank);
+            if (g->recurrent_rank)
+                fprintf(f, "%s_%d_recurrent_weights_v", name, k);
+            else
+                fprintf(f, "NULL");
+            if (g->scales)
+                fprintf(f, ",\n   %s_%d_scales", name, k);
+            else
+                fprintf(f, ",\n   NULL");
+            fprintf(f, "\n};\n\n");
+        } else {
+            const DenseLayer *d = node->dense;
+            fprintf(f, "static const DenseLayer %s_%d = {\n   %s_%d_bias,\n   %s_%d_weights,\n", name, k, name, k,
+                    name, k);
+            fprintf(f, "   %d, %d, %s, %s, ", d->nb_inputs, d->nb_neurons, activation_of(d->activation),
+                    macro_of(d->weights_type));
+            if (d->codebook)
+                fprintf(f, "%s_%d_codebook", name, k);
+            else
+                fprintf(f, "NULL");
+            if (d->scales)
+                fprintf(f, ", %s_%d_scales", name, k);
+            else
+                fprintf(f, ", NULL");
+            fprintf(f, "\n};\n\n");
+        }
+    }
+    fprintf(f, "static const RNNNode %s_nodes[%d] = {\n", name, model->nb_nodes);
+    for (k = 0; k < model->nb_nodes; k++) {
+        const RNNNode *node = &model->nodes[k];
+        static const char *outputs[] = {"RNN_OUTPUT_NONE", "RNN_OUTPUT_GAINS", "RNN_OUTPUT_VAD"};
+        if (node->type == RNN_NODE_GRU)
+            fprintf(f, "   {RNN_NODE_GRU, NULL, &%s_%d, %d, {", name, k, node->nb_inputs);
+        else
+            fprintf(f, "   {RNN_NODE_DENSE, &%s_%d, NULL, %d, {", name, k, node->nb_inputs);
+        for (i = 0; i < node->nb_inputs; i++)
+            fprintf(f, i ? ", %d" : "%d", node->inputs[i]);
+        fprintf(f, "}, %s}%s\n", outputs[node->output], k < model->nb_nodes - 1 ? "," : "");
+    }
+    fprintf(f, "};\n\n");
+    fprintf(f, "const struct RNNModel rnnoise_model_%s = {\n    .nb_nodes = %d,\n    .nodes = %s_nodes\n};\n", name,
+            model->nb_nodes, name);
+}
+
+static int parse_type(const char *s, int len) {
+    int i;
+    for (i = 0; i < 5; i++) {
+        if ((int) strlen(type_names[i]) == len && strncmp(s, type_names[i], len) == 0)
+            return i;
+    }
+    return -2;
+}
+
+/* -t <type> 或 -t <type>=<node>,<node>... */
+static int parse_types(int *types, const char *arg) {
+    const char *eq = strchr(arg, '=');
+    int type = parse_type(arg, eq ? (int) (eq - arg) : (int) strlen(arg));
+    int k;
+    if (type < 0)
+        return -1;
+    if (!eq) {
+        for (k = 0; k < MAX_NODES; k++)
+            types[k] = type;
+        return 0;
+    }
+    for (arg = eq + 1; *arg;) {
+        char *end;
+        k = (int) strtol(arg, &end, 10);
+        if (end == arg || k < 0 || k >= MAX_NODES)
+            return -1;
+        types[k] = type;
+        arg = *end == ',' ? end + 1 : end;
+    }
+    return 0;
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "usage: %s [-t <type>[=<node>,...]] [-a <isa>] [-n <name>] <input model> [<output>]\n", argv0);
+    fprintf(stderr, "  <input model>  .rnnn text or binary model, \"default\" for the built-in model\n");
+    fprintf(stderr, "  <output>       C source if it ends in .c, binary model otherwise; omit to only check the model\n");
+    fprintf(stderr, "  -t  weights type int8, fp16, bf16, q4 or int8row (int8 with a scale per output, full-rank\n");
+    fprintf(stderr, "      layers only), for all nodes or the listed ones (default: keep)\n");
+    fprintf(stderr, "  -a  target: generic (keep), f16c (fp16 for all nodes), sse4.1 (q4 for GRU nodes);\n");
+    fprintf(stderr, "      -t takes precedence for the nodes it names\n");
+    fprintf(stderr, "  -n  name of the C model, rnnoise_model_<name> (default: custom)\n");
+}
+
+int main(int argc, char **argv) {
+    static int types[MAX_NODES], isa_types[MAX_NODES];
+    const char *name = "custom", *isa = "generic";
+    const char *argv0 = argv[0];
+    RNNModel *src, *dst;
+    float err[MAX_NODES];
+    int k, ret = 0;
+    for (k = 0; k < MAX_NODES; k++)
+        types[k] = KEEP_TYPE;
+    while (argc > 2 && argv[1][0] == '-') {
+        if (strcmp(argv[1], "-t") == 0) {
+            if (parse_types(types, argv[2]) != 0) {
+                fprintf(stderr, "invalid weights type %s\n", argv[2]);
+                return 1;
+            }
+        } else if (strcmp(argv[1], "-a") == 0) isa = argv[2];
+        else if (strcmp(argv[1], "-n") == 0) name = argv[2];
+        else {
+            usage(argv0);
+            return 1;
+        }
+        argc -= 2;
+        argv += 2;
+    }
+    if (argc != 2 && argc != 3) {
+        usage(argv0);
+        return 1;
+    }
+    src = load_model(argv[1]);
+    if (!src) {
+        fprintf(stderr, "cannot load %s: missing file, malformed model or inconsistent dimensions\n", argv[1]);
+        return 1;
+    }
+    if (src->nb_nodes <= 0 || src->nb_nodes > MAX_NODES) {
+        fprintf(stderr, "unsupported number of nodes: %d\n", src->nb_nodes);
+        rnnoise_model_free(src);
+        return 1;
+    }
+    // 各目标的计算路径: f16c 有 fp16 的向量化实现, sse4.1 有 q4 的查表实现, 其余类型走标量代码
+    for (k = 0; k < src->nb_nodes; k++) {
+        if (strcmp(isa, "f16c") == 0)
+            isa_types[k] = WEIGHTS_FP16;
+        else if (strcmp(isa, "sse4.1") == 0)
+            isa_types[k] = src->nodes[k].type == RNN_NODE_GRU ? WEIGHTS_Q4 : KEEP_TYPE;
+        else if (strcmp(isa, "generic") == 0)
+            isa_types[k] = KEEP_TYPE;
+        else {
+            fprintf(stderr, "unknown target %s\n", isa);
+            rnnoise_model_free(src);
+            return 1;
+        }
+        if (types[k] == KEEP_TYPE)
+            types[k] = isa_types[k];
+        if (types[k] == TYPE_INT8_ROW && src->nodes[k].type == RNN_NODE_GRU &&
+            (src->nodes[k].gru->input_rank || src->nodes[k].gru->recurrent_rank)) {
+            fprintf(stderr, "node %d: int8row needs a full-rank layer\n", k);
+            rnnoise_model_free(src);
+            return 1;
+        }
+    }
+    dst = convert_model(src, types, err);
+    rnnoise_model_free(src);
+    if (!dst) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    print_footprint(dst, err);
+    if (argc == 3) {
+        size_t len = strlen(argv[2]);
+        FILE *f = fopen(argv[2], "wb");
+        if (!f) {
+            fprintf(stderr, "cannot open %s\n", argv[2]);
+            rnnoise_model_free(dst);
+            return 1;
+        }
+        if (len > 2 && strcmp(&argv[2][len - 2], ".c") == 0)
+            write_c(f, dst, name);
+        else
+            ret = rnnoise_model_write_binary(dst, f);
+        if (fclose(f) != 0 || ret != 0) {
+            fprintf(stderr, "cannot write %s\n", argv[2]);
+            ret = 1;
+        }
+    }
+    rnnoise_model_free(dst);
+    return ret;
+}
@@ -1,5 +1,8 @@
 """
-将得到的 training.f32
+将得到的 training.f32 (或 denoise_training -f rnnd 生成的 .rnnd) 转换为 hdf5,
+逐块读写, 占用的内存与数据集大小无关
+python bin2hdf5.py training.f32 500000 87 training.h5
+python bin2hdf5.py training-0.rnnd training-1.rnnd ... training.h5
 """
 
 from __future__ import print_function
@@ -8,8 +11,26 @@ import numpy as np
 import h5py
 import sys
 
-data = np.fromfile(sys.argv[1], dtype='float32')
-data = np.reshape(data, (int(sys.argv[2]), int(sys.argv[3])))
-h5f = h5py.File(sys.argv[4], 'w')
-h5f.create_dataset('data', data=data)
+import rnnd
+
+# 行数限制只属于原来的 training.f32 rows cols out 形式, 多个 .rnnd 时第二个参数是输入文件
+limit = None
+if sys.argv[1].endswith('.rnnd'):
+    inputs = sys.argv[1:-1]
+else:
+    inputs = [sys.argv[1]]
+    if len(sys.argv) == 5:
+        limit = int(sys.argv[2])
+h5f = h5py.File(sys.argv[-1], 'w')
+dset = h5f.create_dataset('data', shape=(0, rnnd.DIM), maxshape=(None, rnnd.DIM), dtype='float32',
+                          chunks=(8192, rnnd.DIM))
+rows = 0
+for path in inputs:
+    for chunk in rnnd.chunks(path):
+        if limit is not None and rows + len(chunk) > limit:
+            chunk = chunk[:limit - rows]
+        dset.resize(rows + len(chunk), axis=0)
+        dset[rows:rows + len(chunk)] = chunk.astype(np.float32)
+        rows += len(chunk)
 h5f.close()
+print(rows, 'x', rnnd.DIM)
@@ -0,0 +1,3 @@
+#!/bin/sh
+
+gcc -Wall -W -O3 -march=native -g -I../include -I../src rnn_train.c -o rnn_train -lm -lpthread
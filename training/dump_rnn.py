@@ -6,6 +6,27 @@ ft.write() 上不明确要将文件写入到何处 以及有什么用处 所以
 用法:
 python dump_rnn.py weights.hdf5 ../src/rnn_data.c ../src/rnn_data_tmp.h orig
 # 将模型参数写入到rnn_data.c和rnn_data_tmp.h中 最后一个参数 orig 是rnn_data.c 最后的结构体名字
+
+python dump_rnn.py weights.hdf5 ../src/rnn_data.c ../src/rnn_data.rnnn orig ../src/rnn_compiled.c
+# 额外生成特化的前向计算代码 rnn_compiled.c (见 rnn_codegen.py), 内置模型会使用它
+
+python dump_rnn.py --fp16=noise_gru,denoise_gru weights.hdf5 ../src/rnn_data.c ../src/rnn_data.rnnn orig
+# 指定的层以 fp16 (或 --bf16=) 存储权重, 不受 int8 [-128,127] 截断的限制
+
+python dump_rnn.py --graph weights.hdf5 ../src/rnn_data.c model.rnnn orig
+# .rnnn 按模型的实际连接写出计算图(version 3), 可以用 rnnoise_model_from_file 载入更宽或更深的模型
+# (rnn_data.c 中的内置模型仍然只支持默认的 RNNoise 拓扑)
+
+python dump_rnn.py --q4=vad_gru,noise_gru,denoise_gru weights.hdf5 ../src/rnn_data.c ../src/rnn_data.rnnn orig
+# 指定的层以4bit码本索引存储(每层一个16项的k-means码本), 权重的内存和带宽再减半
+
+python dump_rnn.py --lowrank=noise_gru:16,denoise_gru:32:24 weights.hdf5 ../src/rnn_data.c model.rnnn orig
+# GRU 的输入和循环权重用 SVD 分解为 u . v 两个低秩矩阵 (layer:rank 两者同秩, layer:in_rank:rec_rank 分别指定, 0 为不分解)
+# 每帧的计算量随秩下降, 可以在同一个模型结构上权衡速度和效果; 导出 version 4 的 .rnnn (隐含 --graph)
+
+python dump_rnn.py --int8row=noise_gru,denoise_gru weights.hdf5 ../src/rnn_data.c ../src/rnn_data.rnnn orig
+# 指定的层仍以 int8 存储, 但每个输出(神经元)有自己的缩放 (最大绝对值对应 127), 代替固定的 1/256:
+# 权重小的神经元不损失精度, 大的也不被截断. 只能用于不做低秩分解的层
 """
 from __future__ import print_function
 
@@ -18,61 +39,201 @@ from keras import backend as K
 import sys
 import re
 import numpy as np
+import rnn_codegen
 
-def printVector(f, ft, vector, name):
-    v = np.reshape(vector, (-1));
-    #print('static const float ', name, '[', len(v), '] = \n', file=f)
-    f.write('static const rnn_weight {}[{}] = {{\n   '.format(name, len(v)))
-    for i in range(0, len(v)):
-        f.write('{}'.format(min(127, int(round(256*v[i])))))
-        ft.write('{}'.format(min(127, int(round(256*v[i])))))
-        if (i!=len(v)-1):
+def kmeans_codebook(v, iterations=50):
+    """q4: 在int8的量化值上做 k-means, 得到16个int8中心(码本), 返回码本和每个权重的索引"""
+    x = np.clip(np.round(256*v), -128, 127)
+    centers = np.unique(np.percentile(x, np.linspace(0, 100, 16)))
+    centers = np.concatenate([centers, np.zeros(16 - len(centers))])
+    for _ in range(iterations):
+        idx = np.argmin(np.abs(x[:, None] - centers[None, :]), axis=1)
+        for k in range(16):
+            if np.any(idx == k):
+                centers[k] = np.mean(x[idx == k])
+    centers = np.clip(np.round(centers), -128, 127)
+    idx = np.argmin(np.abs(x[:, None] - centers[None, :]), axis=1)
+    return centers.astype(np.int32), idx.astype(np.int32)
+
+def quantize(v, wtype):
+    """返回写入 rnn_data.c 的C类型, 每个元素的字符串, 以及写入 .rnnn 的字符串"""
+    if wtype == 'int8':
+        q = np.clip(np.round(256*v), -128, 127).astype(np.int32)
+        values = ['{}'.format(x) for x in q]
+        return 'rnn_weight', values, values
+    if wtype == 'fp16':
+        q = v.astype(np.float16).view(np.uint16)
+    else:
+        # bf16: 就近舍入, 偶数优先
+        u = v.astype(np.float32).view(np.uint32).astype(np.uint64)
+        q = ((u + 0x7fff + ((u >> 16) & 1)) >> 16).astype(np.uint16)
+    return 'rnn_weight16', ['0x{:04x}'.format(x) for x in q], ['{:.9g}'.format(x) for x in v]
+
+def quantize_q4(idx):
+    """q4: 索引两个一组打包成一个字节, 低4位在前"""
+    packed = np.zeros((len(idx) + 1)//2, dtype=np.int32)
+    packed |= idx[0::2]
+    packed[:len(idx)//2] |= idx[1::2] << 4
+    return 'unsigned char', ['0x{:02x}'.format(x) for x in packed], ['{}'.format(x) for x in idx]
+
+def writeArray(f, ctype, name, values):
+    f.write('static const {} {}[{}] = {{\n   '.format(ctype, name, len(values)))
+    for i in range(0, len(values)):
+        f.write(values[i])
+        if (i!=len(values)-1):
             f.write(',')
         else:
             break;
-        ft.write(" ")
         if (i%8==7):
             f.write("\n   ")
         else:
             f.write(" ")
-    #print(v, file=f)
     f.write('\n};\n\n')
+
+def printVector(f, ft, vector, name, wtype='int8'):
+    v = np.reshape(vector, (-1));
+    #print('static const float ', name, '[', len(v), '] = \n', file=f)
+    ctype, values, text = quantize(v, wtype)
+    writeArray(f, ctype, name, values)
+    ft.write(' '.join(text))
     ft.write("\n")
     return;
 
-def printLayer(f, ft, layer):
+def printIndices(f, ft, idx, name):
+    ctype, values, text = quantize_q4(idx)
+    writeArray(f, ctype, name, values)
+    ft.write(' '.join(text))
+    ft.write("\n")
+
+WEIGHTS_TYPES = {'int8': (0, 'WEIGHTS_INT8'), 'fp16': (1, 'WEIGHTS_FP16'), 'bf16': (2, 'WEIGHTS_BF16'),
+                 'q4': (3, 'WEIGHTS_Q4'), 'int8row': (4, 'WEIGHTS_INT8')}
+
+def rowScales(matrices, bias):
+    """int8row: 每个输出(列)的缩放, 该列所有权重和 bias 的最大绝对值对应 127; 全为0的列用 1/256"""
+    m = np.abs(bias)
+    for _, w in matrices:
+        m = np.maximum(m, np.max(np.abs(w), axis=0))
+    return np.where(m > 0, m/127., 1./256)
+
+def printScaled(f, ft, w, scales, name):
+    """int8row: 按列除以 scales 后量化, 与 int8 一样按行优先写出"""
+    q = np.clip(np.round(w/scales), -127, 127).astype(np.int32)
+    values = ['{}'.format(x) for x in np.reshape(q, (-1))]
+    writeArray(f, 'rnn_weight', name, values)
+    ft.write(' '.join(values))
+    ft.write("\n")
+
+def lowRank(w, rank):
+    """
+    SVD 截断: w (M x K) ~= u (M x rank) . v (rank x K)
+    每个秩1分量在 u, v 之间重新分配幅度, 使两边的最大值相同, 尽量不超出 int8 的范围
+    """
+    U, S, Vt = np.linalg.svd(w, full_matrices=False)
+    u = U[:, :rank] * np.sqrt(S[:rank])
+    v = np.sqrt(S[:rank])[:, None] * Vt[:rank]
+    c = np.sqrt(np.max(np.abs(v), axis=1) / np.maximum(np.max(np.abs(u), axis=0), 1e-9))
+    return u * c, v / c[:, None]
+
+def printLayer(f, ft, layer, wtype='int8', ranks=None):
+    """ranks: GRU 层 (输入权重的秩, 循环权重的秩), 0 表示不分解; 不为 None 时 .rnnn 的 GRU 头部写出这两个值 (version 4)"""
     weights = layer.get_weights()
     activation = re.search('function (.*) at', str(layer.activation)).group(1).upper()
     if len(weights) > 2:
-        ft.write('{} {} '.format(weights[0].shape[0], weights[0].shape[1]/3))
+        ft.write('{} {} '.format(weights[0].shape[0], weights[0].shape[1]//3))
     else:
         ft.write('{} {} '.format(weights[0].shape[0], weights[0].shape[1]))
     if activation == 'SIGMOID':
-        ft.write('1\n')
+        ft.write('1 ')
     elif activation == 'RELU':
-        ft.write('2\n')
+        ft.write('2 ')
     else:
-        ft.write('0\n')
-    printVector(f, ft, weights[0], layer.name + '_weights')
-    if len(weights) > 2:
-        printVector(f, ft, weights[1], layer.name + '_recurrent_weights')
-    printVector(f, ft, weights[-1], layer.name + '_bias')
+        ft.write('0 ')
+    ft.write('{}'.format(WEIGHTS_TYPES[wtype][0]))
+    if len(weights) > 2 and ranks is not None:
+        ft.write(' {} {}'.format(ranks[0], ranks[1]))
+    ft.write('\n')
     name = layer.name
+    # 要写出的矩阵, 低秩分解的矩阵拆成 u (沿用原来的名字) 和 v (_v 后缀)
+    matrices = []
+    for k, suffix in enumerate(['_weights', '_recurrent_weights'][:len(weights) - 1]):
+        rank = ranks[k] if ranks is not None and len(weights) > 2 else 0
+        if rank > 0:
+            u, v = lowRank(weights[k], rank)
+            matrices += [(suffix, u), (suffix + '_v', v)]
+        else:
+            matrices.append((suffix, weights[k]))
+    if wtype == 'q4':
+        # 整层(输入和循环权重)共用一个码本, bias 仍为 int8
+        flat = [np.reshape(w, (-1)) for _, w in matrices]
+        codebook, idx = kmeans_codebook(np.concatenate(flat))
+        writeArray(f, 'rnn_weight', name + '_codebook', ['{}'.format(x) for x in codebook])
+        ft.write(' '.join('{}'.format(x) for x in codebook))
+        ft.write('\n')
+        pos = 0
+        for (suffix, _), w in zip(matrices, flat):
+            printIndices(f, ft, idx[pos:pos + len(w)], name + suffix)
+            pos += len(w)
+        printVector(f, ft, weights[-1], name + '_bias')
+    elif wtype == 'int8row':
+        # 头部之后先是 scales, 其后与 int8 相同
+        scales = rowScales(matrices, weights[-1]).astype(np.float32)
+        text = ['{:.9g}'.format(x) for x in scales]
+        writeArray(f, 'float', name + '_scales', text)
+        ft.write(' '.join(text))
+        ft.write('\n')
+        for suffix, w in matrices:
+            printScaled(f, ft, w, scales, name + suffix)
+        printScaled(f, ft, weights[-1], scales, name + '_bias')
+    else:
+        for suffix, w in matrices:
+            printVector(f, ft, w, name + suffix, wtype)
+        printVector(f, ft, weights[-1], name + '_bias', wtype)
+    # 结构体的字段全部写出 (类型, 码本, GRU 的低秩字段, scales), 没有的为 NULL/0
+    type_field = ', {}, {}'.format(WEIGHTS_TYPES[wtype][1], name + '_codebook' if wtype == 'q4' else 'NULL')
     if len(weights) > 2:
-        f.write('static const GRULayer {} = {{\n   {}_bias,\n   {}_weights,\n   {}_recurrent_weights,\n   {}, {}, ACTIVATION_{}\n}};\n\n'
-                .format(name, name, name, name, weights[0].shape[0], weights[0].shape[1]/3, activation))
+        for rank, suffix in zip(ranks or (0, 0), ['_weights_v', '_recurrent_weights_v']):
+            type_field += ', {}, {}'.format(rank, name + suffix if rank > 0 else 'NULL')
+    type_field += ', {}'.format(name + '_scales' if wtype == 'int8row' else 'NULL')
+    if len(weights) > 2:
+        f.write('static const GRULayer {} = {{\n   {}_bias,\n   {}_weights,\n   {}_recurrent_weights,\n   {}, {}, ACTIVATION_{}{}\n}};\n\n'
+                .format(name, name, name, name, weights[0].shape[0], weights[0].shape[1]//3, activation, type_field))
     else:
-        f.write('static const DenseLayer {} = {{\n   {}_bias,\n   {}_weights,\n   {}, {}, ACTIVATION_{}\n}};\n\n'
-                .format(name, name, name, weights[0].shape[0], weights[0].shape[1], activation))
+        f.write('static const DenseLayer {} = {{\n   {}_bias,\n   {}_weights,\n   {}, {}, ACTIVATION_{}{}\n}};\n\n'
+                .format(name, name, name, weights[0].shape[0], weights[0].shape[1], activation, type_field))
 
 def structLayer(f, layer):
     weights = layer.get_weights()
     name = layer.name
     if len(weights) > 2:
-        f.write('    {},\n'.format(weights[0].shape[1]/3))
+        f.write('    {},\n'.format(weights[0].shape[1]//3))
     else:
         f.write('    {},\n'.format(weights[0].shape[1]))
-    f.write('    &{},\n'.format(name))
+    f.write('    &{},\n\n'.format(name))
+
+
+def layerInfo(layer):
+    weights = layer.get_weights()
+    activation = re.search('function (.*) at', str(layer.activation)).group(1).upper()
+    if len(weights) > 2:
+        return ('gru', weights[0].shape[0], weights[0].shape[1]//3, activation)
+    return ('dense', weights[0].shape[0], weights[0].shape[1], activation)
+
+
+def graphInputs(layer, slots):
+    """layer 的输入对应的 slot 列表, Concatenate 层展开为其各个输入"""
+    node = layer._inbound_nodes[0]
+    parents = node.inbound_layers if isinstance(node.inbound_layers, list) else [node.inbound_layers]
+    inputs = []
+    for p in parents:
+        inputs += slots[p.name]
+    return inputs
+
+def printGraphNode(ft, layer, slots, outputs):
+    """version 3: 每层之前写出 "type output nb_inputs slot..." """
+    weights = layer.get_weights()
+    inputs = graphInputs(layer, slots)
+    ft.write('{} {} {} {}\n'.format(1 if len(weights) > 2 else 0, outputs.get(layer.name, 0),
+                                    len(inputs), ' '.join(str(x) for x in inputs)))
 
 
 def foo(c, name):
@@ -81,6 +242,39 @@ def foo(c, name):
 def mean_squared_sqrt_error(y_true, y_pred):
     return K.mean(K.square(K.sqrt(y_pred) - K.sqrt(y_true)), axis=-1)
 
+# 可选参数 --fp16=layer1,layer2 / --bf16=layer1,layer2 指定某些层的权重以 fp16/bf16 存储, 其余层为 int8
+# 可选参数 --graph 导出 version 3 的 .rnnn, 按 Keras 模型中各层的实际连接写出计算图, 不限于默认的 RNNoise 拓扑
+# 可选参数 --lowrank=layer:rank,layer:in_rank:rec_rank 将 GRU 的输入/循环权重做 SVD 低秩分解, 导出 version 4 (同 version 3, GRU 头部多两个秩)
+# 可选参数 --int8row=layer1,layer2 指定的层以每个输出各自缩放的 int8 存储 (.rnnn 中类型为 4)
+layer_types = {}
+layer_ranks = {}
+graph = False
+args = []
+for arg in sys.argv:
+    if arg == '--graph':
+        graph = True
+    elif arg.startswith('--fp16=') or arg.startswith('--bf16='):
+        for name in arg[7:].split(','):
+            layer_types[name] = arg[2:6]
+    elif arg.startswith('--q4='):
+        for name in arg[5:].split(','):
+            layer_types[name] = 'q4'
+    elif arg.startswith('--int8row='):
+        for name in arg[10:].split(','):
+            layer_types[name] = 'int8row'
+    elif arg.startswith('--lowrank='):
+        for item in arg[10:].split(','):
+            fields = item.split(':')
+            layer_ranks[fields[0]] = (int(fields[1]), int(fields[-1]))
+        graph = True
+    else:
+        args.append(arg)
+sys.argv = args
+for name, ranks in layer_ranks.items():
+    if layer_types.get(name) == 'int8row' and (ranks[0] > 0 or ranks[1] > 0):
+        print('int8row needs a full-rank layer:', name, file=sys.stderr)
+        sys.exit(1)
+
 # 载入模型 weights.h5
 model = load_model(sys.argv[1], custom_objects={'msse': mean_squared_sqrt_error, 'mean_squared_sqrt_error': mean_squared_sqrt_error, 'my_crossentropy': mean_squared_sqrt_error, 'mycost': mean_squared_sqrt_error, 'WeightClip': foo})
 
@@ -91,21 +285,64 @@ ft = open(sys.argv[3], 'w') # 写入到 src/rnn_data.h
 
 f.write('/*This file is automatically generated from a Keras model*/\n\n')
 f.write('#ifdef HAVE_CONFIG_H\n#include "config.h"\n#endif\n\n#include "rnn.h"\n#include "rnn_data.h"\n\n')
-ft.write('rnnoise-nu model file version 1\n')
+if graph:
+    # 输出顺序与 rnn_train.py 一致: [denoise_output, vad_output]
+    outputs = {model.output_names[0]: 1}
+    if len(model.output_names) > 1:
+        outputs[model.output_names[1]] = 2
+    slots = {}
+    ft.write('rnnoise-nu model file version {}\n'.format(4 if layer_ranks else 3))
+    ft.write('{}\n'.format(len([l for l in model.layers if len(l.get_weights()) > 0])))
+else:
+    ft.write('rnnoise-nu model file version 2\n')
 
 layer_list = []
+next_slot = 1
 for i, layer in enumerate(model.layers):
+    if graph:
+        if len(layer.get_weights()) > 0:
+            printGraphNode(ft, layer, slots, outputs)
+            slots[layer.name] = [next_slot]
+            next_slot += 1
+        elif layer.__class__.__name__ == 'InputLayer':
+            slots[layer.name] = [0]
+        else:
+            # Concatenate 等没有权重的层直接透传它的输入
+            slots[layer.name] = graphInputs(layer, slots)
     if len(layer.get_weights()) > 0:
-        printLayer(f, ft, layer)
+        printLayer(f, ft, layer, layer_types.get(layer.name, 'int8'),
+                   layer_ranks.get(layer.name, (0, 0)) if layer_ranks else None)
     if len(layer.get_weights()) > 2:
         layer_list.append(layer.name)
 
+compiled = len(sys.argv) > 5
+if compiled and (len(layer_types) > 0 or len(layer_ranks) > 0):
+    # 特化代码只支持未分解且按 1/256 缩放的 int8 权重, 其他情况走通用的计算路径
+    print('fp16/bf16/q4/int8row/low-rank layers present, not generating', sys.argv[5], file=sys.stderr)
+    compiled = False
+if compiled:
+    f.write('void compute_rnn_{}(RNNState *rnn, float *gains, float *vad, const float *input);\n\n'.format(sys.argv[4]))
+
 f.write('const struct RNNModel rnnoise_model_{} = {{\n'.format(sys.argv[4]))
 for i, layer in enumerate(model.layers):
     if len(layer.get_weights()) > 0:
         structLayer(f, layer)
+if compiled:
+    f.write('    compute_rnn_{},\n\n'.format(sys.argv[4]))
+else:
+    f.write('    NULL,\n\n')
+# 计算图, blob 和引用计数只用于载入的模型, 这里全部为 NULL/0
+f.write('    0,\n    NULL,\n\n    NULL,\n    0,\n    0,\n\n    0,\n    0\n')
 f.write('};\n')
 
+if compiled:
+    layers = {}
+    for i, layer in enumerate(model.layers):
+        if len(layer.get_weights()) > 0:
+            layers[layer.name] = layerInfo(layer)
+    with open(sys.argv[5], 'w') as fc:
+        rnn_codegen.write_compiled_model(fc, sys.argv[4], layers)
+
 #hf.write('struct RNNState {\n')
 #for i, name in enumerate(layer_list):
 #    hf.write('  float {}_state[{}_SIZE];\n'.format(name, name.upper()))
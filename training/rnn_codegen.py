@@ -0,0 +1,161 @@
+"""
+根据模型各层的维度和激活函数, 生成特化的前向计算代码 (src/rnn_compiled.c)
+循环次数全部是编译期常量, 激活函数在生成时就确定, 编译器可以直接展开和向量化
+
+dump_rnn.py 在导出 rnn_data.c 时会调用这里的 write_compiled_model()
+也可以不依赖 Keras, 直接从已有的 rnn_data.c 中解析出各层的结构重新生成:
+python rnn_codegen.py ../src/rnn_data.c ../src/rnn_compiled.c
+"""
+from __future__ import print_function
+
+import re
+import sys
+
+# RNNModel 中各层的顺序, 与 compute_rnn() 的连接方式一致
+LAYER_ORDER = ['input_dense', 'vad_gru', 'noise_gru', 'denoise_gru', 'denoise_output', 'vad_output']
+
+ACTIVATIONS = {
+    'TANH': 'tansig_approx',
+    'SIGMOID': 'sigmoid_approx',
+    'RELU': 'relu',
+}
+
+
+def write_dense(f, name, nb_inputs, nb_neurons, activation):
+    f.write('static void compute_{}(const DenseLayer *layer, float *output, const float *input) {{\n'.format(name))
+    f.write('    int i, j;\n')
+    f.write('    float sum[{}];\n'.format(nb_neurons))
+    f.write('    const rnn_weight *b = layer->bias;\n')
+    f.write('    const rnn_weight *w = layer->input_weights;\n')
+    f.write('    for (i = 0; i < {}; i++) sum[i] = b[i];\n'.format(nb_neurons))
+    f.write('    for (j = 0; j < {}; j++) {{\n'.format(nb_inputs))
+    f.write('        for (i = 0; i < {}; i++) sum[i] += w[j * {} + i] * input[j];\n'.format(nb_neurons, nb_neurons))
+    f.write('    }\n')
+    f.write('    for (i = 0; i < {}; i++) output[i] = {}(WEIGHTS_SCALE * sum[i]);\n'
+            .format(nb_neurons, ACTIVATIONS[activation]))
+    f.write('}\n\n')
+
+
+def write_gru(f, name, nb_inputs, nb_neurons, activation, ranges=None):
+    """ranges: 输入各列的累加顺序 [(start, end), ...], 与 compute_rnn 的通用路径一致(先累加与GRU状态无关的输入)"""
+    N = nb_neurons
+    stride = 3 * N
+    f.write('static void compute_{}(const GRULayer *gru, float *state, const float *input) {{\n'.format(name))
+    f.write('    int i, j;\n')
+    f.write('    float sum[{}];\n'.format(stride))
+    f.write('    float z[{}];\n'.format(N))
+    f.write('    float r[{}];\n'.format(N))
+    f.write('    const rnn_weight *b = gru->bias;\n')
+    f.write('    const rnn_weight *w = gru->input_weights;\n')
+    f.write('    const rnn_weight *u = gru->recurrent_weights;\n')
+    f.write('    for (i = 0; i < {}; i++) sum[i] = b[i];\n'.format(stride))
+    for start, end in ranges or [(0, nb_inputs)]:
+        if start == 0:
+            f.write('    for (j = 0; j < {}; j++) {{\n'.format(end))
+        else:
+            f.write('    for (j = {}; j < {}; j++) {{\n'.format(start, end))
+        f.write('        for (i = 0; i < {}; i++) sum[i] += w[j * {} + i] * input[j];\n'.format(stride, stride))
+        f.write('    }\n')
+    f.write('    /* update gate 和 reset gate 只依赖上一帧的 state */\n')
+    f.write('    for (j = 0; j < {}; j++) {{\n'.format(N))
+    f.write('        for (i = 0; i < {}; i++) sum[i] += u[j * {} + i] * state[j];\n'.format(2 * N, stride))
+    f.write('    }\n')
+    f.write('    for (i = 0; i < {}; i++) {{\n'.format(N))
+    f.write('        z[i] = sigmoid_approx(WEIGHTS_SCALE * sum[i]);\n')
+    f.write('        r[i] = sigmoid_approx(WEIGHTS_SCALE * sum[{} + i]);\n'.format(N))
+    f.write('    }\n')
+    f.write('    for (j = 0; j < {}; j++) {{\n'.format(N))
+    f.write('        for (i = 0; i < {}; i++) sum[{} + i] += u[{} + j * {} + i] * state[j] * r[j];\n'
+            .format(N, 2 * N, 2 * N, stride))
+    f.write('    }\n')
+    f.write('    for (i = 0; i < {}; i++)\n'.format(N))
+    f.write('        state[i] = z[i] * state[i] + (1 - z[i]) * {}(WEIGHTS_SCALE * sum[{} + i]);\n'
+            .format(ACTIVATIONS[activation], 2 * N))
+    f.write('}\n\n')
+
+
+def write_compiled_model(f, model_name, layers):
+    """
+    layers: {name: (kind, nb_inputs, nb_neurons, activation)}, kind 为 'dense' 或 'gru', activation 为 'TANH'/'SIGMOID'/'RELU'
+    只支持 int8 权重(WEIGHTS_INT8)的层
+    """
+    for name in LAYER_ORDER:
+        if name not in layers:
+            raise ValueError('missing layer {}'.format(name))
+    input_size = layers['input_dense'][1]
+    dense_size = layers['input_dense'][2]
+    vad_size = layers['vad_gru'][2]
+    noise_size = layers['noise_gru'][2]
+    denoise_size = layers['denoise_gru'][2]
+    if layers['noise_gru'][1] != dense_size + vad_size + input_size or \
+            layers['denoise_gru'][1] != vad_size + noise_size + input_size:
+        raise ValueError('layer sizes do not match the RNNoise topology')
+
+    f.write('/*This file is automatically generated by rnn_codegen.py*/\n\n')
+    f.write('#ifdef HAVE_CONFIG_H\n#include "config.h"\n#endif\n\n')
+    f.write('#include "vec.h"\n#include "rnn.h"\n#include "rnn_data.h"\n\n')
+    # noise_input = [dense_out, vad_gru_state, input], denoise_input = [vad_gru_state, noise_gru_state, input]
+    # 先累加与GRU状态无关的 dense_out 和 input, 再累加GRU的状态
+    ranges = {
+        'noise_gru': [(0, dense_size), (dense_size + vad_size, dense_size + vad_size + input_size),
+                      (dense_size, dense_size + vad_size)],
+        'denoise_gru': [(vad_size + noise_size, vad_size + noise_size + input_size), (0, vad_size),
+                        (vad_size, vad_size + noise_size)],
+    }
+    for name in LAYER_ORDER:
+        kind, nb_inputs, nb_neurons, activation = layers[name]
+        if kind == 'gru':
+            write_gru(f, name, nb_inputs, nb_neurons, activation, ranges.get(name))
+        else:
+            write_dense(f, name, nb_inputs, nb_neurons, activation)
+
+    f.write('void compute_rnn_{}(RNNState *rnn, float *gains, float *vad, const float *input) {{\n'.format(model_name))
+    f.write('    float dense_out[{}];\n'.format(dense_size))
+    f.write('    float noise_input[{}];\n'.format(dense_size + vad_size + input_size))
+    f.write('    float denoise_input[{}];\n'.format(vad_size + noise_size + input_size))
+    f.write('    const RNNModel *model = rnn->model;\n\n')
+    f.write('    compute_input_dense(model->input_dense, dense_out, input);\n')
+    f.write('    compute_vad_gru(model->vad_gru, rnn->vad_gru_state, dense_out);\n')
+    f.write('    compute_vad_output(model->vad_output, vad, rnn->vad_gru_state);\n\n')
+    f.write('    RNN_COPY(noise_input, dense_out, {});\n'.format(dense_size))
+    f.write('    RNN_COPY(&noise_input[{}], rnn->vad_gru_state, {});\n'.format(dense_size, vad_size))
+    f.write('    RNN_COPY(&noise_input[{}], input, {});\n'.format(dense_size + vad_size, input_size))
+    f.write('    compute_noise_gru(model->noise_gru, rnn->noise_gru_state, noise_input);\n\n')
+    f.write('    RNN_COPY(denoise_input, rnn->vad_gru_state, {});\n'.format(vad_size))
+    f.write('    RNN_COPY(&denoise_input[{}], rnn->noise_gru_state, {});\n'.format(vad_size, noise_size))
+    f.write('    RNN_COPY(&denoise_input[{}], input, {});\n'.format(vad_size + noise_size, input_size))
+    f.write('    compute_denoise_gru(model->denoise_gru, rnn->denoise_gru_state, denoise_input);\n')
+    f.write('    compute_denoise_output(model->denoise_output, gains, rnn->denoise_gru_state);\n')
+    f.write('}\n')
+
+
+def parse_rnn_data(text):
+    """从 dump_rnn.py 生成的 rnn_data.c 中解析各层结构"""
+    layers = {}
+    for m in re.finditer(r'static const (DenseLayer|GRULayer) (\w+) = \{([^}]*)\}', text):
+        fields = [x.strip() for x in m.group(3).split(',')]
+        types = [x for x in fields if x.startswith('WEIGHTS_')]
+        if types:
+            # q4 层在类型后面还跟着码本
+            if types[0] != 'WEIGHTS_INT8':
+                raise ValueError('layer {} is not int8, cannot generate compiled code'.format(m.group(2)))
+            # 低秩分解的层在类型后面还有秩和 v 矩阵, int8row 的层最后还有 scales
+            if any(x not in ('NULL', '0') for x in fields[fields.index(types[0]) + 1:]):
+                raise ValueError('layer {} is low-rank or has per-row scales, cannot generate compiled code'
+                                 .format(m.group(2)))
+            fields = fields[:fields.index(types[0])]
+        kind = 'gru' if m.group(1) == 'GRULayer' else 'dense'
+        nb_inputs, nb_neurons = int(float(fields[-3])), int(float(fields[-2]))
+        activation = fields[-1].replace('ACTIVATION_', '')
+        layers[m.group(2)] = (kind, nb_inputs, nb_neurons, activation)
+    model_name = re.search(r'const struct RNNModel rnnoise_model_(\w+)', text).group(1)
+    return model_name, layers
+
+
+if __name__ == '__main__':
+    if len(sys.argv) != 3:
+        print('usage: {} <rnn_data.c> <rnn_compiled.c>'.format(sys.argv[0]), file=sys.stderr)
+        sys.exit(1)
+    model_name, layers = parse_rnn_data(open(sys.argv[1]).read())
+    with open(sys.argv[2], 'w') as f:
+        write_compiled_model(f, model_name, layers)
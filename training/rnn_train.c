@@ -0,0 +1,1087 @@
+//
+// 原生的 RNNoise 训练程序: 与 rnn_train.py 相同的网络结构, 损失函数, 约束和 Adam, 不依赖 Keras/TensorFlow.
+// 读入 denoise_training 生成的 .f32/.rnnd, 训练后直接写出 .rnnn 和 rnn_data.c (与 dump_rnn.py 的默认输出格式相同).
+//
+//     sh compile.sh
+//     ./rnn_train -j 8 -e 120 -c ../src/rnn_data.c ../src/rnn_data.rnnn ../src/training-*.rnnd
+//
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "vec.h"
+
+#if defined(__AVX__) && defined(__FMA__)
+#include <immintrin.h>
+#endif
+
+#define NB_FEATURES 42
+#define NB_BANDS 22
+#define NB_TRAIN (NB_FEATURES + 2*NB_BANDS + 1)
+
+/* 各层的大小, 与 rnn_train.py 一致 */
+#define INPUT_DENSE_SIZE 24
+#define VAD_GRU_SIZE 24
+#define NOISE_GRU_SIZE 48
+#define DENOISE_GRU_SIZE 96
+
+#define WEIGHT_CLIP 0.499f   /* WeightClip(0.499), 每次更新后对所有权重和 bias 生效 */
+#define L2_REG 0.000001f     /* GRU 的输入和循环权重的 L2 正则 */
+#define GAINS_WEIGHT 10.f    /* loss_weights=[10, 0.5] */
+#define VAD_WEIGHT 0.5f
+#define BCE_EPSILON 1e-7f    /* K.epsilon() */
+#define ADAM_EPSILON 1e-7f   /* Adam(epsilon=1e-7), Keras 的默认值 */
+
+/*
+    一层的参数在整个参数向量中的偏移 (权重的布局与 Keras 和 .rnnn 相同: nb_inputs x nb_outputs, 按行存放),
+    梯度和 Adam 的状态使用同样的布局
+*/
+typedef struct {
+    const char *name;
+    int gru;
+    int nb_inputs;
+    int nb_neurons;
+    int activation;
+    size_t w;
+    size_t u;   /* 循环权重, 只有 GRU 有 */
+    size_t b;
+} Layer;
+
+/* 按 .rnnn 中的顺序 */
+enum {INPUT_DENSE, VAD_GRU, NOISE_GRU, DENOISE_GRU, DENOISE_OUTPUT, VAD_OUTPUT, NB_LAYERS};
+
+static Layer layers[NB_LAYERS] = {
+        {"input_dense",    0, NB_FEATURES,                                       INPUT_DENSE_SIZE, ACTIVATION_TANH, 0, 0, 0},
+        {"vad_gru",        1, INPUT_DENSE_SIZE,                                  VAD_GRU_SIZE,     ACTIVATION_TANH, 0, 0, 0},
+        {"noise_gru",      1, INPUT_DENSE_SIZE + VAD_GRU_SIZE + NB_FEATURES,     NOISE_GRU_SIZE,   ACTIVATION_RELU, 0, 0, 0},
+        {"denoise_gru",    1, VAD_GRU_SIZE + NOISE_GRU_SIZE + NB_FEATURES,       DENOISE_GRU_SIZE, ACTIVATION_TANH, 0, 0, 0},
+        {"denoise_output", 0, DENOISE_GRU_SIZE,                                  NB_BANDS,         ACTIVATION_SIGMOID, 0, 0, 0},
+        {"vad_output",     0, VAD_GRU_SIZE,                                      1,                ACTIVATION_SIGMOID, 0, 0, 0},
+};
+
+static size_t nb_params;
+
+static void layers_init(void) {
+    int k;
+    size_t pos = 0;
+    for (k = 0; k < NB_LAYERS; k++) {
+        Layer *l = &layers[k];
+        int outputs = l->gru ? 3 * l->nb_neurons : l->nb_neurons;
+        l->w = pos;
+        pos += (size_t) l->nb_inputs * outputs;
+        if (l->gru) {
+            l->u = pos;
+            pos += (size_t) l->nb_neurons * outputs;
+        }
+        l->b = pos;
+        pos += outputs;
+    }
+    nb_params = pos;
+}
+
+/* ---------------------------------------------------------------- 矩阵运算 */
+
+/*
+    所有的乘法都归结为两种内核: c += a0*b0 + a1*b1 + a2*b2 + a3*b3 (四行一起累加, c 只读写一次) 和点积.
+    输入部分在整段序列上一次算完 (GEMM), 只有循环部分需要逐帧计算
+*/
+#if defined(__AVX__) && defined(__FMA__)
+static OPUS_INLINE void axpy4(float *c, const float *a, const float *b0, const float *b1, const float *b2,
+                              const float *b3, int n) {
+    int j = 0;
+    __m256 a0 = _mm256_set1_ps(a[0]), a1 = _mm256_set1_ps(a[1]);
+    __m256 a2 = _mm256_set1_ps(a[2]), a3 = _mm256_set1_ps(a[3]);
+    for (; j + 8 <= n; j += 8) {
+        __m256 acc = _mm256_loadu_ps(&c[j]);
+        acc = _mm256_fmadd_ps(a0, _mm256_loadu_ps(&b0[j]), acc);
+        acc = _mm256_fmadd_ps(a1, _mm256_loadu_ps(&b1[j]), acc);
+        acc = _mm256_fmadd_ps(a2, _mm256_loadu_ps(&b2[j]), acc);
+        acc = _mm256_fmadd_ps(a3, _mm256_loadu_ps(&b3[j]), acc);
+        _mm256_storeu_ps(&c[j], acc);
+    }
+    for (; j < n; j++)
+        c[j] += a[0] * b0[j] + a[1] * b1[j] + a[2] * b2[j] + a[3] * b3[j];
+}
+
+static OPUS_INLINE float dot(const float *x, const float *y, int n) {
+    int j = 0;
+    float sum;
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+    __m128 s;
+    for (; j + 16 <= n; j += 16) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(&x[j]), _mm256_loadu_ps(&y[j]), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(&x[j + 8]), _mm256_loadu_ps(&y[j + 8]), acc1);
+    }
+    for (; j + 8 <= n; j += 8)
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(&x[j]), _mm256_loadu_ps(&y[j]), acc0);
+    acc0 = _mm256_add_ps(acc0, acc1);
+    s = _mm_add_ps(_mm256_castps256_ps128(acc0), _mm256_extractf128_ps(acc0, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_movehdup_ps(s));
+    sum = _mm_cvtss_f32(s);
+    for (; j < n; j++)
+        sum += x[j] * y[j];
+    return sum;
+}
+#else
+static OPUS_INLINE void axpy4(float *c, const float *a, const float *b0, const float *b1, const float *b2,
+                              const float *b3, int n) {
+    int j;
+    for (j = 0; j < n; j++)
+        c[j] += a[0] * b0[j] + a[1] * b1[j] + a[2] * b2[j] + a[3] * b3[j];
+}
+
+static OPUS_INLINE float dot(const float *x, const float *y, int n) {
+    int j;
+    float s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    for (j = 0; j + 4 <= n; j += 4) {
+        s0 += x[j] * y[j];
+        s1 += x[j + 1] * y[j + 1];
+        s2 += x[j + 2] * y[j + 2];
+        s3 += x[j + 3] * y[j + 3];
+    }
+    for (; j < n; j++)
+        s0 += x[j] * y[j];
+    return (s0 + s1) + (s2 + s3);
+}
+#endif
+
+static OPUS_INLINE void axpy(float *c, float a, const float *b, int n) {
+    int j;
+    for (j = 0; j < n; j++)
+        c[j] += a * b[j];
+}
+
+/* C (M x N) += A (M x K) . B (K x N) */
+static void gemm_nn(int M, int N, int K, const float *A, int lda, const float *B, int ldb, float *C, int ldc) {
+    int i, k;
+    for (i = 0; i < M; i++) {
+        const float *a = &A[(size_t) i * lda];
+        float *c = &C[(size_t) i * ldc];
+        for (k = 0; k + 4 <= K; k += 4)
+            axpy4(c, &a[k], &B[(size_t) k * ldb], &B[(size_t) (k + 1) * ldb], &B[(size_t) (k + 2) * ldb],
+                  &B[(size_t) (k + 3) * ldb], N);
+        for (; k < K; k++)
+            axpy(c, a[k], &B[(size_t) k * ldb], N);
+    }
+}
+
+/* C (M x N) += A^T . B, A 为 K x M (权重的梯度: K 为帧数) */
+static void gemm_tn(int M, int N, int K, const float *A, int lda, const float *B, int ldb, float *C, int ldc) {
+    int i, k;
+    for (k = 0; k + 4 <= K; k += 4) {
+        const float *b0 = &B[(size_t) k * ldb], *b1 = b0 + ldb, *b2 = b1 + ldb, *b3 = b2 + ldb;
+        const float *a0 = &A[(size_t) k * lda], *a1 = a0 + lda, *a2 = a1 + lda, *a3 = a2 + lda;
+        for (i = 0; i < M; i++) {
+            float a[4];
+            a[0] = a0[i];
+            a[1] = a1[i];
+            a[2] = a2[i];
+            a[3] = a3[i];
+            axpy4(&C[(size_t) i * ldc], a, b0, b1, b2, b3, N);
+        }
+    }
+    for (; k < K; k++)
+        for (i = 0; i < M; i++)
+            axpy(&C[(size_t) i * ldc], A[(size_t) k * lda + i], &B[(size_t) k * ldb], N);
+}
+
+/* C (M x N) += A . B^T, B 为 N x K (输入的梯度) */
+static void gemm_nt(int M, int N, int K, const float *A, int lda, const float *B, int ldb, float *C, int ldc) {
+    int i, j;
+    for (i = 0; i < M; i++)
+        for (j = 0; j < N; j++)
+            C[(size_t) i * ldc + j] += dot(&A[(size_t) i * lda], &B[(size_t) j * ldb], K);
+}
+
+/* ---------------------------------------------------------------- 前向和反向 */
+
+/* 一层的一个输入: T 帧, 每帧 size 个值, 行距 stride; 多个输入依次拼接. dx 为对应的梯度, NULL 时不需要 */
+typedef struct {
+    const float *x;
+    float *dx;
+    int size;
+    int stride;
+} Input;
+
+/* 一段序列上一层的中间结果 */
+typedef struct {
+    float *y;     /* T x N 输出 (GRU 的状态) */
+    float *dy;    /* T x N 输出的梯度, 由后面各层累加 */
+    /* 只有 GRU 有: a 前向时为输入部分的累加 (含 bias), 反向时改写为三个门在激活之前的梯度 */
+    float *a;     /* T x 3N */
+    float *z;
+    float *r;
+    float *h;     /* 候选状态 */
+    float *rh;    /* r * 上一帧的状态 */
+} Tape;
+
+static float activate(int activation, float x) {
+    if (activation == ACTIVATION_SIGMOID) return 1.f / (1.f + expf(-x));
+    if (activation == ACTIVATION_TANH) return tanhf(x);
+    return x > 0 ? x : 0;
+}
+
+/* 激活函数的导数, 用激活后的值表示 */
+static float activate_grad(int activation, float y) {
+    if (activation == ACTIVATION_SIGMOID) return y * (1 - y);
+    if (activation == ACTIVATION_TANH) return 1 - y * y;
+    return y > 0 ? 1.f : 0.f;
+}
+
+static void load_bias_rows(float *a, const float *b, int n, int T) {
+    int t;
+    for (t = 0; t < T; t++)
+        RNN_COPY(&a[(size_t) t * n], b, n);
+}
+
+/* 各个输入乘以权重中对应的行, 累加到 a (T x n) */
+static void input_forward(const float *w, const Input *in, int nb_in, float *a, int n, int T) {
+    int k, row = 0;
+    for (k = 0; k < nb_in; k++) {
+        gemm_nn(T, n, in[k].size, in[k].x, in[k].stride, &w[(size_t) row * n], n, a, n);
+        row += in[k].size;
+    }
+}
+
+/* 由激活之前的梯度 g (T x n) 得到权重和 bias 的梯度, 以及各个输入的梯度 */
+static void input_backward(const float *w, float *dw, float *db, const Input *in, int nb_in, const float *g, int n,
+                           int T) {
+    int k, t, row = 0;
+    for (t = 0; t < T; t++)
+        axpy(db, 1.f, &g[(size_t) t * n], n);
+    for (k = 0; k < nb_in; k++) {
+        gemm_tn(in[k].size, n, T, in[k].x, in[k].stride, g, n, &dw[(size_t) row * n], n);
+        if (in[k].dx)
+            gemm_nt(T, in[k].size, n, g, n, &w[(size_t) row * n], n, in[k].dx, in[k].stride);
+        row += in[k].size;
+    }
+}
+
+static void dense_forward(const Layer *l, const float *P, const Input *in, int nb_in, Tape *tp, int T) {
+    size_t i, n = (size_t) T * l->nb_neurons;
+    load_bias_rows(tp->y, &P[l->b], l->nb_neurons, T);
+    input_forward(&P[l->w], in, nb_in, tp->y, l->nb_neurons, T);
+    for (i = 0; i < n; i++)
+        tp->y[i] = activate(l->activation, tp->y[i]);
+}
+
+/* tp->dy 已经是激活之前的梯度 */
+static void dense_backward(const Layer *l, const float *P, float *G, const Input *in, int nb_in, Tape *tp, int T) {
+    input_backward(&P[l->w], &G[l->w], &G[l->b], in, nb_in, tp->dy, l->nb_neurons, T);
+}
+
+/*
+    Keras 的 GRU (reset_after=False), 初始状态为0:
+        z = sigmoid(x Wz + s Uz + bz), r = sigmoid(x Wr + s Ur + br)
+        h = act(x Wh + (r*s) Uh + bh), s' = z*s + (1-z)*h
+*/
+static void gru_forward(const Layer *l, const float *P, const Input *in, int nb_in, Tape *tp, int T) {
+    int t, i;
+    int N = l->nb_neurons, M = 3 * N;
+    const float *U = &P[l->u];
+    load_bias_rows(tp->a, &P[l->b], M, T);
+    input_forward(&P[l->w], in, nb_in, tp->a, M, T);
+    for (t = 0; t < T; t++) {
+        float *a = &tp->a[(size_t) t * M];
+        float *z = &tp->z[(size_t) t * N], *r = &tp->r[(size_t) t * N], *h = &tp->h[(size_t) t * N];
+        float *rh = &tp->rh[(size_t) t * N], *s = &tp->y[(size_t) t * N];
+        const float *prev = t > 0 ? &tp->y[(size_t) (t - 1) * N] : NULL;
+        float sum[3 * DENOISE_GRU_SIZE];
+        RNN_COPY(sum, a, M);
+        if (prev)
+            gemm_nn(1, 2 * N, N, prev, N, U, M, sum, M);
+        for (i = 0; i < N; i++) {
+            z[i] = activate(ACTIVATION_SIGMOID, sum[i]);
+            r[i] = activate(ACTIVATION_SIGMOID, sum[N + i]);
+            rh[i] = prev ? r[i] * prev[i] : 0;
+        }
+        if (prev)
+            gemm_nn(1, N, N, rh, N, &U[2 * N], M, &sum[2 * N], M);
+        for (i = 0; i < N; i++) {
+            h[i] = activate(l->activation, sum[2 * N + i]);
+            s[i] = z[i] * (prev ? prev[i] : 0) + (1 - z[i]) * h[i];
+        }
+    }
+}
+
+static void gru_backward(const Layer *l, const float *P, float *G, const Input *in, int nb_in, Tape *tp, int T) {
+    int t, i;
+    int N = l->nb_neurons, M = 3 * N;
+    const float *U = &P[l->u];
+    float ds[DENOISE_GRU_SIZE], next[DENOISE_GRU_SIZE], drh[DENOISE_GRU_SIZE];
+    RNN_CLEAR(next, N);
+    for (t = T - 1; t >= 0; t--) {
+        float *g = &tp->a[(size_t) t * M];
+        const float *z = &tp->z[(size_t) t * N], *r = &tp->r[(size_t) t * N], *h = &tp->h[(size_t) t * N];
+        const float *dy = &tp->dy[(size_t) t * N];
+        const float *prev = t > 0 ? &tp->y[(size_t) (t - 1) * N] : NULL;
+        for (i = 0; i < N; i++) {
+            float d = dy[i] + next[i];
+            float p = prev ? prev[i] : 0;
+            g[i] = d * (p - h[i]) * z[i] * (1 - z[i]);
+            g[2 * N + i] = d * (1 - z[i]) * activate_grad(l->activation, h[i]);
+            ds[i] = d * z[i];
+        }
+        if (prev) {
+            RNN_CLEAR(drh, N);
+            gemm_nt(1, N, N, &g[2 * N], M, &U[2 * N], M, drh, N);
+            for (i = 0; i < N; i++) {
+                g[N + i] = drh[i] * prev[i] * r[i] * (1 - r[i]);
+                ds[i] += drh[i] * r[i];
+            }
+            gemm_nt(1, N, 2 * N, g, M, U, M, ds, N);
+        } else {
+            RNN_CLEAR(&g[N], N);
+        }
+        RNN_COPY(next, ds, N);
+    }
+    /* 循环权重的梯度: update/reset 两个门乘上一帧的状态, 输出部分乘 r*s */
+    if (T > 1)
+        gemm_tn(N, 2 * N, T - 1, tp->y, N, &tp->a[M], M, &G[l->u], M);
+    gemm_tn(N, N, T, tp->rh, N, &tp->a[2 * N], M, &G[l->u + 2 * N], M);
+    input_backward(&P[l->w], &G[l->w], &G[l->b], in, nb_in, tp->a, M, T);
+}
+
+/* ---------------------------------------------------------------- 损失函数 */
+
+/*
+    与 rnn_train.py 相同, 包括其中 K.binary_crossentropy(y_pred, y_true) 参数顺序颠倒的写法
+    (以预测值为目标, 以截断到 [eps, 1-eps] 的真实值为输出), 这样训练出的模型与原来的行为一致:
+        增益 mycost = mask(y) * (10 (sqrt(p) - sqrt(y))^4 + (sqrt(p) - sqrt(y))^2 + 0.01 bce(p, y)), mask(y) = min(y+1, 1)
+        VAD  my_crossentropy = 2 |y - 0.5| * bce(p, y)
+    两个输出都是 sigmoid, 梯度直接对激活之前的值求, 避免 p 接近0时 1/sqrt(p) 溢出
+*/
+static float bce_grad(float y) {
+    float c = MIN32(MAX32(y, BCE_EPSILON), 1 - BCE_EPSILON);
+    return logf((1 - c) / c);
+}
+
+static float bce(float p, float y) {
+    float c = MIN32(MAX32(y, BCE_EPSILON), 1 - BCE_EPSILON);
+    return -(p * logf(c) + (1 - p) * logf(1 - c));
+}
+
+/* 返回一帧的增益损失 (对频带求平均之前), scale 为这一帧对总损失的权重, 梯度写到 g */
+static float gains_loss(const float *p, const float *y, float *g, float scale) {
+    int i;
+    float loss = 0;
+    for (i = 0; i < NB_BANDS; i++) {
+        float mask = MIN32(y[i] + 1, 1);
+        float sp = sqrtf(p[i]);
+        float d = sp - sqrtf(MAX32(y[i], 0));
+        loss += mask * (10 * d * d * d * d + d * d + .01f * bce(p[i], y[i]));
+        if (g)
+            g[i] = scale * mask * ((40 * d * d * d + 2 * d) * .5f * sp * (1 - p[i])
+                                   + .01f * bce_grad(y[i]) * p[i] * (1 - p[i]));
+    }
+    return loss;
+}
+
+static float vad_loss(float p, float y, float *g, float scale) {
+    float w = 2 * fabsf(y - .5f);
+    if (g)
+        *g = scale * w * bce_grad(y) * p * (1 - p);
+    return w * bce(p, y);
+}
+
+/* ---------------------------------------------------------------- 数据 */
+
+/* mmap 的 .f32 或 .rnnd (格式见 src/denoise.c), 不把整个文件读进内存 */
+typedef struct {
+    void *map;
+    size_t map_size;
+    const unsigned char *data;
+    int half;
+    long frames;
+} Dataset;
+
+static unsigned int get_le32(const unsigned char *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (unsigned int) p[3] << 24;
+}
+
+static unsigned long long get_le64(const unsigned char *p) {
+    return get_le32(p) | (unsigned long long) get_le32(p + 4) << 32;
+}
+
+static int dataset_open(Dataset *d, const char *path) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    const unsigned char *p;
+    size_t len = strlen(path);
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    d->map_size = st.st_size;
+    d->map = mmap(NULL, d->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (d->map == MAP_FAILED)
+        return -1;
+    p = d->map;
+    if (len > 5 && strcmp(path + len - 5, ".rnnd") == 0) {
+        unsigned long long nb_chunks, index;
+        if (d->map_size < 56 || memcmp(p, "RNNOISED", 8) != 0 || get_le32(p + 8) != 1 || get_le32(p + 16) != NB_TRAIN)
+            goto fail;
+        d->half = get_le32(p + 12) == 1;
+        d->frames = (long) get_le64(p + 32);
+        nb_chunks = get_le64(p + 40);
+        index = get_le64(p + 48);
+        if (d->frames == 0 || index + 16 * nb_chunks > d->map_size)
+            goto fail;
+        /* 各块连续存放, 从第一块开始 */
+        d->data = p + get_le64(p + index);
+        if ((size_t) (d->data - p) + (size_t) d->frames * NB_TRAIN * (d->half ? 2 : 4) > d->map_size)
+            goto fail;
+    } else {
+        d->half = 0;
+        d->data = p;
+        d->frames = (long) (d->map_size / (NB_TRAIN * sizeof(float)));
+    }
+    madvise(d->map, d->map_size, MADV_RANDOM);
+    return 0;
+fail:
+    munmap(d->map, d->map_size);
+    return -1;
+}
+
+static void dataset_row(const Dataset *d, long i, float *row) {
+    int k;
+    if (d->half) {
+        const rnn_weight16 *h = (const rnn_weight16 *) d->data + (size_t) i * NB_TRAIN;
+        for (k = 0; k < NB_TRAIN; k++)
+            row[k] = half_to_float(h[k]);
+    } else {
+        memcpy(row, (const float *) d->data + (size_t) i * NB_TRAIN, NB_TRAIN * sizeof(float));
+    }
+}
+
+typedef struct {
+    int dataset;
+    long start;
+} Window;
+
+/* ---------------------------------------------------------------- 训练 */
+
+/* xorshift64*, 与 denoise_training 相同 */
+static unsigned int rng_next(unsigned long long *rng) {
+    *rng ^= *rng >> 12;
+    *rng ^= *rng << 25;
+    *rng ^= *rng >> 27;
+    return (unsigned int) ((*rng * 2685821657736338717ULL) >> 33);
+}
+
+static float rng_uniform(unsigned long long *rng) {
+    return (rng_next(rng) + .5f) / 2147483648.f;
+}
+
+static float rng_normal(unsigned long long *rng) {
+    return sqrtf(-2 * logf(rng_uniform(rng))) * cosf(2 * (float) M_PI * rng_uniform(rng));
+}
+
+/* Keras 的默认初始化: 输入权重 glorot_uniform, 循环权重 orthogonal (各行正交), bias 为0 */
+static void init_params(float *P, unsigned long long *rng) {
+    int k, i, j, m;
+    RNN_CLEAR(P, nb_params);
+    for (k = 0; k < NB_LAYERS; k++) {
+        const Layer *l = &layers[k];
+        int outputs = l->gru ? 3 * l->nb_neurons : l->nb_neurons;
+        float limit = sqrtf(6.f / (l->nb_inputs + outputs));
+        for (i = 0; i < l->nb_inputs * outputs; i++)
+            P[l->w + i] = limit * (2 * rng_uniform(rng) - 1);
+        if (l->gru) {
+            float *U = &P[l->u];
+            for (i = 0; i < l->nb_neurons; i++) {
+                float *row = &U[(size_t) i * outputs];
+                float norm = 0;
+                for (j = 0; j < outputs; j++)
+                    row[j] = rng_normal(rng);
+                for (m = 0; m < i; m++) {
+                    const float *q = &U[(size_t) m * outputs];
+                    axpy(row, -dot(row, q, outputs), q, outputs);
+                }
+                for (j = 0; j < outputs; j++)
+                    norm += row[j] * row[j];
+                norm = 1.f / sqrtf(norm);
+                for (j = 0; j < outputs; j++)
+                    row[j] *= norm;
+            }
+        }
+    }
+}
+
+typedef struct Trainer Trainer;
+
+/* 每个线程的工作区: 一段序列的输入, 目标和各层的中间结果, 以及这个线程的梯度 */
+typedef struct {
+    Trainer *tr;
+    int index;
+    float *x;       /* T x NB_FEATURES */
+    float *gains;   /* T x NB_BANDS */
+    float *vad;     /* T */
+    Tape tape[NB_LAYERS];
+    float *grad;
+    double loss[2];
+    float *arena;
+} Worker;
+
+struct Trainer {
+    int window;
+    int nb_threads;
+    const Dataset *datasets;
+    const float *params;
+    const Window *batch;   /* 这一批的窗口 */
+    int batch_size;
+    long offset;           /* 各窗口的起点整体错开的帧数 */
+    int backward;
+    Worker *workers;
+};
+
+static int worker_init(Worker *w, Trainer *tr, int index) {
+    int k;
+    size_t T = tr->window, size = T * (NB_FEATURES + NB_BANDS + 1);
+    float *p;
+    for (k = 0; k < NB_LAYERS; k++) {
+        size_t N = layers[k].nb_neurons;
+        size += 2 * T * N + (layers[k].gru ? T * 7 * N : 0);
+    }
+    w->tr = tr;
+    w->index = index;
+    w->arena = p = malloc(size * sizeof(float));
+    w->grad = malloc(nb_params * sizeof(float));
+    if (!w->arena || !w->grad)
+        return -1;
+    w->x = p; p += T * NB_FEATURES;
+    w->gains = p; p += T * NB_BANDS;
+    w->vad = p; p += T;
+    for (k = 0; k < NB_LAYERS; k++) {
+        size_t N = layers[k].nb_neurons;
+        Tape *tp = &w->tape[k];
+        tp->y = p; p += T * N;
+        tp->dy = p; p += T * N;
+        if (layers[k].gru) {
+            tp->a = p; p += T * 3 * N;
+            tp->z = p; p += T * N;
+            tp->r = p; p += T * N;
+            tp->h = p; p += T * N;
+            tp->rh = p; p += T * N;
+        }
+    }
+    return 0;
+}
+
+static void worker_free(Worker *w) {
+    free(w->arena);
+    free(w->grad);
+}
+
+/* 一段序列的前向计算和损失, backward 时再反向传播, 梯度累加到 w->grad */
+static void train_sequence(Worker *w, const Window *win) {
+    Trainer *tr = w->tr;
+    const float *P = tr->params;
+    float *G = w->grad;
+    int T = tr->window, t, k;
+    Tape *tp = w->tape;
+    float row[NB_TRAIN];
+    /* 每帧在总损失中的权重: Keras 对 batch 和时间求平均, 增益还对频带求平均 */
+    float scale = 1.f / ((float) tr->batch_size * T);
+    const Dataset *d = &tr->datasets[win->dataset];
+    float *dgains = tr->backward ? tp[DENOISE_OUTPUT].dy : NULL, *dvad = tr->backward ? tp[VAD_OUTPUT].dy : NULL;
+
+    Input feat = {w->x, NULL, NB_FEATURES, NB_FEATURES};
+    Input in_dense = {tp[INPUT_DENSE].y, tp[INPUT_DENSE].dy, INPUT_DENSE_SIZE, INPUT_DENSE_SIZE};
+    Input in_vad = {tp[VAD_GRU].y, tp[VAD_GRU].dy, VAD_GRU_SIZE, VAD_GRU_SIZE};
+    Input in_noise = {tp[NOISE_GRU].y, tp[NOISE_GRU].dy, NOISE_GRU_SIZE, NOISE_GRU_SIZE};
+    Input in_denoise = {tp[DENOISE_GRU].y, tp[DENOISE_GRU].dy, DENOISE_GRU_SIZE, DENOISE_GRU_SIZE};
+    /* 与 rnn_train.py 中 concatenate 的顺序相同 */
+    Input noise_inputs[3], denoise_inputs[3];
+    noise_inputs[0] = in_dense;
+    noise_inputs[1] = in_vad;
+    noise_inputs[2] = feat;
+    denoise_inputs[0] = in_vad;
+    denoise_inputs[1] = in_noise;
+    denoise_inputs[2] = feat;
+
+    for (t = 0; t < T; t++) {
+        dataset_row(d, win->start + tr->offset + t, row);
+        RNN_COPY(&w->x[(size_t) t * NB_FEATURES], row, NB_FEATURES);
+        RNN_COPY(&w->gains[(size_t) t * NB_BANDS], &row[NB_FEATURES], NB_BANDS);
+        w->vad[t] = row[NB_TRAIN - 1];
+    }
+
+    dense_forward(&layers[INPUT_DENSE], P, &feat, 1, &tp[INPUT_DENSE], T);
+    gru_forward(&layers[VAD_GRU], P, &in_dense, 1, &tp[VAD_GRU], T);
+    dense_forward(&layers[VAD_OUTPUT], P, &in_vad, 1, &tp[VAD_OUTPUT], T);
+    gru_forward(&layers[NOISE_GRU], P, noise_inputs, 3, &tp[NOISE_GRU], T);
+    gru_forward(&layers[DENOISE_GRU], P, denoise_inputs, 3, &tp[DENOISE_GRU], T);
+    dense_forward(&layers[DENOISE_OUTPUT], P, &in_denoise, 1, &tp[DENOISE_OUTPUT], T);
+
+    for (t = 0; t < T; t++) {
+        w->loss[0] += gains_loss(&tp[DENOISE_OUTPUT].y[(size_t) t * NB_BANDS], &w->gains[(size_t) t * NB_BANDS],
+                                 dgains ? &dgains[(size_t) t * NB_BANDS] : NULL, GAINS_WEIGHT * scale / NB_BANDS)
+                      / NB_BANDS;
+        w->loss[1] += vad_loss(tp[VAD_OUTPUT].y[t], w->vad[t], dvad ? &dvad[t] : NULL, VAD_WEIGHT * scale);
+    }
+    if (!tr->backward)
+        return;
+
+    for (k = 0; k < NB_LAYERS; k++)
+        if (k != DENOISE_OUTPUT && k != VAD_OUTPUT)
+            RNN_CLEAR(tp[k].dy, (size_t) T * layers[k].nb_neurons);
+    dense_backward(&layers[DENOISE_OUTPUT], P, G, &in_denoise, 1, &tp[DENOISE_OUTPUT], T);
+    gru_backward(&layers[DENOISE_GRU], P, G, denoise_inputs, 3, &tp[DENOISE_GRU], T);
+    gru_backward(&layers[NOISE_GRU], P, G, noise_inputs, 3, &tp[NOISE_GRU], T);
+    dense_backward(&layers[VAD_OUTPUT], P, G, &in_vad, 1, &tp[VAD_OUTPUT], T);
+    gru_backward(&layers[VAD_GRU], P, G, &in_dense, 1, &tp[VAD_GRU], T);
+    for (t = 0; t < T * INPUT_DENSE_SIZE; t++)
+        tp[INPUT_DENSE].dy[t] *= activate_grad(ACTIVATION_TANH, tp[INPUT_DENSE].y[t]);
+    dense_backward(&layers[INPUT_DENSE], P, G, &feat, 1, &tp[INPUT_DENSE], T);
+}
+
+/* 第 k 个线程处理这一批中的第 k, k+threads, ... 个窗口, 与调度无关, 结果只取决于线程数 */
+static void *worker_run(void *arg) {
+    Worker *w = arg;
+    Trainer *tr = w->tr;
+    int i;
+    w->loss[0] = w->loss[1] = 0;
+    if (tr->backward)
+        RNN_CLEAR(w->grad, nb_params);
+    for (i = w->index; i < tr->batch_size; i += tr->nb_threads)
+        train_sequence(w, &tr->batch[i]);
+    return NULL;
+}
+
+/* 计算一批窗口的损失 (backward 时还有梯度, 求和到 workers[0].grad), 返回 0 表示成功 */
+static int run_batch(Trainer *tr, const Window *batch, int batch_size, int backward, double *loss) {
+    int k, nb_started;
+    size_t i;
+    int ret = 0;
+    pthread_t *threads = calloc(tr->nb_threads, sizeof(pthread_t));
+    if (!threads)
+        return -1;
+    tr->batch = batch;
+    tr->batch_size = batch_size;
+    tr->backward = backward;
+    /* pthread_t 没有表示"未创建"的值, 只 join 前 nb_started 个已创建的线程 */
+    for (nb_started = 1; nb_started < tr->nb_threads; nb_started++) {
+        if (pthread_create(&threads[nb_started], NULL, worker_run, &tr->workers[nb_started]) != 0) {
+            ret = -1;
+            break;
+        }
+    }
+    worker_run(&tr->workers[0]);
+    for (k = 1; k < nb_started; k++)
+        pthread_join(threads[k], NULL);
+    free(threads);
+    for (k = 0; k < tr->nb_threads; k++) {
+        loss[0] += tr->workers[k].loss[0];
+        loss[1] += tr->workers[k].loss[1];
+        if (backward && k > 0)
+            for (i = 0; i < nb_params; i++)
+                tr->workers[0].grad[i] += tr->workers[k].grad[i];
+    }
+    return ret;
+}
+
+/* 加上 L2 正则的梯度, Adam (与 Keras 相同的偏差修正, epsilon 为 ADAM_EPSILON) 更新后截断到 [-0.499, 0.499], 返回正则项 */
+static double adam_step(float *P, float *G, float *m, float *v, long step, float lr) {
+    const float b1 = .9f, b2 = .999f;
+    float lr_t = lr * sqrtf(1 - powf(b2, step)) / (1 - powf(b1, step));
+    double reg = 0;
+    size_t i;
+    int k;
+    for (k = 0; k < NB_LAYERS; k++) {
+        const Layer *l = &layers[k];
+        if (l->gru) {
+            /* 输入和循环权重连续存放 */
+            size_t n = l->b - l->w;
+            for (i = l->w; i < l->w + n; i++) {
+                reg += L2_REG * P[i] * P[i];
+                G[i] += 2 * L2_REG * P[i];
+            }
+        }
+    }
+    for (i = 0; i < nb_params; i++) {
+        m[i] = b1 * m[i] + (1 - b1) * G[i];
+        v[i] = b2 * v[i] + (1 - b2) * G[i] * G[i];
+        P[i] -= lr_t * m[i] / (sqrtf(v[i]) + ADAM_EPSILON);
+        P[i] = MIN32(MAX32(P[i], -WEIGHT_CLIP), WEIGHT_CLIP);
+    }
+    return reg;
+}
+
+/* ---------------------------------------------------------------- 模型的读写 */
+
+#define MODEL_INT8 0
+#define MODEL_FP16 1
+#define MODEL_BF16 2
+#define MODEL_INT8_ROW 4    /* int8, 每个输出有自己的缩放 */
+
+/* 最宽的一层的输出数 */
+#define MAX_OUTPUTS (3 * DENOISE_GRU_SIZE)
+
+static const char *activation_names[] = {"TANH", "SIGMOID", "RELU"};
+
+static int layer_outputs(const Layer *l) {
+    return l->gru ? 3 * l->nb_neurons : l->nb_neurons;
+}
+
+static int quantize_int8(float x) {
+    return (int) MIN32(MAX32(rintf(256 * x), -128), 127);
+}
+
+/* int8 的量化值; int8row 时第 i 个值属于输出 i % outputs, 除以该输出的缩放 */
+static int quantize_value(float x, int type, const float *scales, size_t i, int outputs) {
+    if (type == MODEL_INT8_ROW)
+        return (int) MIN32(MAX32(rintf(x / scales[i % outputs]), -127), 127);
+    return quantize_int8(x);
+}
+
+/* 与 dump_rnn.py --int8row 相同: 每个输出的权重和 bias 的最大绝对值对应 127, 全为0时为 1/256 */
+static void row_scales(const Layer *l, const float *P, float *scales) {
+    int outputs = layer_outputs(l);
+    size_t i;
+    for (i = 0; i < (size_t) outputs; i++)
+        scales[i] = fabsf(P[l->b + i]);
+    for (i = 0; i < (size_t) l->nb_inputs * outputs; i++)
+        scales[i % outputs] = MAX32(scales[i % outputs], fabsf(P[l->w + i]));
+    if (l->gru) {
+        for (i = 0; i < (size_t) l->nb_neurons * outputs; i++)
+            scales[i % outputs] = MAX32(scales[i % outputs], fabsf(P[l->u + i]));
+    }
+    for (i = 0; i < (size_t) outputs; i++)
+        scales[i] = scales[i] > 0 ? scales[i] / 127 : WEIGHTS_SCALE;
+}
+
+/* 与 dump_rnn.py 相同: int8 为放大256倍后的整数, int8row 为除以各输出缩放后的整数, fp16/bf16 写出浮点原值 */
+static void write_rnnn_values(FILE *f, const float *x, size_t n, int type, const float *scales, int outputs) {
+    size_t i;
+    for (i = 0; i < n; i++) {
+        if (type == MODEL_INT8 || type == MODEL_INT8_ROW)
+            fprintf(f, i ? " %d" : "%d", quantize_value(x[i], type, scales, i, outputs));
+        else
+            fprintf(f, i ? " %.9g" : "%.9g", x[i]);
+    }
+    fprintf(f, "\n");
+}
+
+static int write_rnnn(const char *path, const float *P, int type) {
+    int k;
+    FILE *f = fopen(path, "w");
+    if (!f)
+        return -1;
+    fprintf(f, "rnnoise-nu model file version 2\n");
+    for (k = 0; k < NB_LAYERS; k++) {
+        const Layer *l = &layers[k];
+        int outputs = layer_outputs(l);
+        float scales[MAX_OUTPUTS];
+        fprintf(f, "%d %d %d %d\n", l->nb_inputs, l->nb_neurons, l->activation, type);
+        if (type == MODEL_INT8_ROW) {
+            // 头部之后先是 scales
+            row_scales(l, P, scales);
+            write_rnnn_values(f, scales, outputs, MODEL_FP16, NULL, 0);
+        }
+        write_rnnn_values(f, &P[l->w], (size_t) l->nb_inputs * outputs, type, scales, outputs);
+        if (l->gru)
+            write_rnnn_values(f, &P[l->u], (size_t) l->nb_neurons * outputs, type, scales, outputs);
+        write_rnnn_values(f, &P[l->b], outputs, type, scales, outputs);
+    }
+    return fclose(f);
+}
+
+static void write_array(FILE *f, const char *name, const char *suffix, const float *x, size_t n, int type,
+                        const float *scales, int outputs) {
+    static const char *ctypes[] = {"rnn_weight", "rnn_weight16", "rnn_weight16", "", "rnn_weight"};
+    size_t i;
+    fprintf(f, "static const %s %s%s[%zu] = {\n   ", ctypes[type], name, suffix, n);
+    for (i = 0; i < n; i++) {
+        if (type == MODEL_INT8 || type == MODEL_INT8_ROW)
+            fprintf(f, "%d", quantize_value(x[i], type, scales, i, outputs));
+        else
+            fprintf(f, "0x%04x", type == MODEL_FP16 ? float_to_half(x[i]) : float_to_bf16(x[i]));
+        if (i == n - 1)
+            break;
+        fprintf(f, i % 8 == 7 ? ",\n   " : ", ");
+    }
+    fprintf(f, "\n};\n\n");
+}
+
+/* 与 dump_rnn.py 不加 --graph 时的 rnn_data.c 相同, 使用通用的前向计算 (compute 为 NULL) */
+static int write_c(const char *path, const float *P, int type, const char *model_name) {
+    static const char *type_macros[] = {"WEIGHTS_INT8", "WEIGHTS_FP16", "WEIGHTS_BF16", "", "WEIGHTS_INT8"};
+    int k, i;
+    FILE *f = fopen(path, "w");
+    if (!f)
+        return -1;
+    fprintf(f, "/*This file is automatically generated by rnn_train*/\n\n");
+    fprintf(f, "#ifdef HAVE_CONFIG_H\n#include \"config.h\"\n#endif\n\n#include \"rnn.h\"\n#include \"rnn_data.h\"\n\n");
+    for (k = 0; k < NB_LAYERS; k++) {
+        const Layer *l = &layers[k];
+        int outputs = layer_outputs(l);
+        float scales[MAX_OUTPUTS];
+        char scales_field[64] = "NULL";
+        if (type == MODEL_INT8_ROW) {
+            row_scales(l, P, scales);
+            fprintf(f, "static const float %s_scales[%d] = {\n   ", l->name, outputs);
+            for (i = 0; i < outputs; i++)
+                fprintf(f, i == outputs - 1 ? "%.9g" : i % 8 == 7 ? "%.9g,\n   " : "%.9g, ", scales[i]);
+            fprintf(f, "\n};\n\n");
+            snprintf(scales_field, sizeof(scales_field), "%s_scales", l->name);
+        }
+        write_array(f, l->name, "_weights", &P[l->w], (size_t) l->nb_inputs * outputs, type, scales, outputs);
+        if (l->gru)
+            write_array(f, l->name, "_recurrent_weights", &P[l->u], (size_t) l->nb_neurons * outputs, type, scales,
+                        outputs);
+        write_array(f, l->name, "_bias", &P[l->b], outputs, type, scales, outputs);
+        // 结构体的字段全部写出: 没有码本, GRU 没有低秩分解, 只有 int8row 有 scales
+        if (l->gru)
+            fprintf(f, "static const GRULayer %s = {\n   %s_bias,\n   %s_weights,\n   %s_recurrent_weights,\n"
+                       "   %d, %d, ACTIVATION_%s, %s, NULL, 0, NULL, 0, NULL, %s\n};\n\n", l->name, l->name, l->name,
+                    l->name, l->nb_inputs, l->nb_neurons, activation_names[l->activation], type_macros[type],
+                    scales_field);
+        else
+            fprintf(f, "static const DenseLayer %s = {\n   %s_bias,\n   %s_weights,\n"
+                       "   %d, %d, ACTIVATION_%s, %s, NULL, %s\n};\n\n", l->name, l->name, l->name,
+                    l->nb_inputs, l->nb_neurons, activation_names[l->activation], type_macros[type], scales_field);
+    }
+    fprintf(f, "const struct RNNModel rnnoise_model_%s = {\n", model_name);
+    for (k = 0; k < NB_LAYERS; k++)
+        fprintf(f, "    %d,\n    &%s,\n\n", layers[k].nb_neurons, layers[k].name);
+    fprintf(f, "    NULL,\n\n    0,\n    NULL,\n\n    NULL,\n    0,\n    0,\n\n    0,\n    0\n};\n");
+    return fclose(f);
+}
+
+/* 从默认拓扑的 .rnnn (version 1/2, int8/fp16/bf16/int8row) 读入初始参数, 用于在已有模型上继续训练 */
+static int read_values(FILE *f, float *x, size_t n, int type, const float *scales, int outputs) {
+    size_t i;
+    for (i = 0; i < n; i++) {
+        if (type == MODEL_INT8 || type == MODEL_INT8_ROW) {
+            int in;
+            if (fscanf(f, "%d", &in) != 1)
+                return -1;
+            x[i] = in * (type == MODEL_INT8_ROW ? scales[i % outputs] : WEIGHTS_SCALE);
+        } else if (fscanf(f, "%f", &x[i]) != 1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int read_rnnn(const char *path, float *P) {
+    int version, k;
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return -1;
+    if (fscanf(f, "rnnoise-nu model file version %d\n", &version) != 1 || version < 1 || version > 2)
+        goto fail;
+    for (k = 0; k < NB_LAYERS; k++) {
+        const Layer *l = &layers[k];
+        int outputs = layer_outputs(l);
+        int nb_inputs, nb_neurons, activation, type = MODEL_INT8;
+        float scales[MAX_OUTPUTS];
+        if (fscanf(f, "%d %d %d", &nb_inputs, &nb_neurons, &activation) != 3
+            || (version >= 2 && fscanf(f, "%d", &type) != 1))
+            goto fail;
+        if (nb_inputs != l->nb_inputs || nb_neurons != l->nb_neurons || type < MODEL_INT8
+            || (type > MODEL_BF16 && type != MODEL_INT8_ROW))
+            goto fail;
+        if ((type == MODEL_INT8_ROW && read_values(f, scales, outputs, MODEL_FP16, NULL, 0) != 0)
+            || read_values(f, &P[l->w], (size_t) l->nb_inputs * outputs, type, scales, outputs) != 0
+            || (l->gru && read_values(f, &P[l->u], (size_t) l->nb_neurons * outputs, type, scales, outputs) != 0)
+            || read_values(f, &P[l->b], outputs, type, scales, outputs) != 0)
+            goto fail;
+    }
+    fclose(f);
+    return 0;
+fail:
+    fclose(f);
+    return -1;
+}
+
+/* ---------------------------------------------------------------- main */
+
+static void shuffle(Window *w, int n, unsigned long long *rng) {
+    int i;
+    for (i = n - 1; i > 0; i--) {
+        int j = rng_next(rng) % (i + 1);
+        Window tmp = w[i];
+        w[i] = w[j];
+        w[j] = tmp;
+    }
+}
+
+int main(int argc, char **argv) {
+    int nb_threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    int epochs = 120, batch_size = 32, window = 2000, type = MODEL_INT8;
+    float lr = .001f;
+    unsigned long long seed = 0, rng;
+    const char *init = NULL, *c_path = NULL, *model_name = "orig", *rnnn_path;
+    Dataset *datasets;
+    int nb_datasets, nb_windows = 0, nb_val, nb_train, epoch, i, k;
+    Window *windows;
+    float *P, *m, *v;
+    long step = 0;
+    Trainer tr;
+    while (argc > 3 && argv[1][0] == '-') {
+        if (strcmp(argv[1], "-j") == 0) nb_threads = atoi(argv[2]);
+        else if (strcmp(argv[1], "-e") == 0) epochs = atoi(argv[2]);
+        else if (strcmp(argv[1], "-b") == 0) batch_size = atoi(argv[2]);
+        else if (strcmp(argv[1], "-w") == 0) window = atoi(argv[2]);
+        else if (strcmp(argv[1], "-l") == 0) lr = (float) atof(argv[2]);
+        else if (strcmp(argv[1], "-s") == 0) seed = strtoull(argv[2], NULL, 10);
+        else if (strcmp(argv[1], "-i") == 0) init = argv[2];
+        else if (strcmp(argv[1], "-c") == 0) c_path = argv[2];
+        else if (strcmp(argv[1], "-n") == 0) model_name = argv[2];
+        else if (strcmp(argv[1], "-t") == 0) {
+            if (strcmp(argv[2], "int8") == 0) type = MODEL_INT8;
+            else if (strcmp(argv[2], "fp16") == 0) type = MODEL_FP16;
+            else if (strcmp(argv[2], "bf16") == 0) type = MODEL_BF16;
+            else if (strcmp(argv[2], "int8row") == 0) type = MODEL_INT8_ROW;
+            else break;
+        }
+        else break;
+        argc -= 2;
+        argv += 2;
+    }
+    if (argc < 3 || argv[1][0] == '-' || nb_threads < 1 || epochs < 0 || batch_size < 1 || window < 2 || lr <= 0) {
+        fprintf(stderr, "usage: %s [options] <model.rnnn> <data.f32|data.rnnd>...\n", argv[0]);
+        fprintf(stderr, "  -j  threads (default: number of CPUs); the result depends on the thread count only\n");
+        fprintf(stderr, "  -e  epochs (default 120)\n");
+        fprintf(stderr, "  -b  sequences per batch (default 32)\n");
+        fprintf(stderr, "  -w  frames per sequence (default 2000)\n");
+        fprintf(stderr, "  -l  Adam learning rate (default 0.001)\n");
+        fprintf(stderr, "  -s  random seed for the initialization and the shuffling\n");
+        fprintf(stderr, "  -i  start from a version 1/2 .rnnn model instead of a random initialization\n");
+        fprintf(stderr, "  -c  also write the model as rnn_data.c, named rnnoise_model_<name> (-n, default orig)\n");
+        fprintf(stderr, "  -t  int8 (default), fp16, bf16 or int8row (int8 with a scale per output) weights;\n");
+        fprintf(stderr, "      fp16/bf16 .rnnn keep the exact values for -i\n");
+        return 1;
+    }
+    rnnn_path = argv[1];
+    layers_init();
+
+    nb_datasets = argc - 2;
+    datasets = calloc(nb_datasets, sizeof(Dataset));
+    if (!datasets)
+        return 1;
+    for (k = 0; k < nb_datasets; k++) {
+        if (dataset_open(&datasets[k], argv[k + 2]) != 0) {
+            fprintf(stderr, "cannot read %s\n", argv[k + 2]);
+            return 1;
+        }
+        /* 与 rnn_train.py 相同, 每个窗口多留出 window 帧, 供每个 epoch 错开起点 */
+        if (datasets[k].frames / window > 1)
+            nb_windows += (int) (datasets[k].frames / window - 1);
+    }
+    windows = malloc(MAX32(nb_windows, 1) * sizeof(Window));
+    if (!windows)
+        return 1;
+    nb_windows = 0;
+    for (k = 0; k < nb_datasets; k++) {
+        long n;
+        for (n = 0; n + 1 < datasets[k].frames / window; n++) {
+            windows[nb_windows].dataset = k;
+            windows[nb_windows].start = n * window;
+            nb_windows++;
+        }
+    }
+    /* 最后10%的窗口用于验证 */
+    nb_val = nb_windows / 10;
+    nb_train = nb_windows - nb_val;
+    if (nb_train < batch_size) {
+        fprintf(stderr, "not enough data: %d sequences of %d frames, need at least %d for training\n",
+                nb_train, window, batch_size);
+        return 1;
+    }
+    fprintf(stderr, "%d sequences of %d frames, %d for validation; %zu parameters, %d threads\n",
+            nb_windows, window, nb_val, nb_params, nb_threads);
+
+    rng = seed * 0x9E3779B97F4A7C15ULL + 0x2545F4914F6CDD1DULL;
+    P = malloc(nb_params * sizeof(float));
+    m = calloc(nb_params, sizeof(float));
+    v = calloc(nb_params, sizeof(float));
+    if (!P || !m || !v)
+        return 1;
+    init_params(P, &rng);
+    if (init && read_rnnn(init, P) != 0) {
+        fprintf(stderr, "cannot read %s (a version 1/2 int8/fp16/bf16/int8row model with the default topology)\n", init);
+        return 1;
+    }
+
+    tr.window = window;
+    tr.nb_threads = nb_threads;
+    tr.datasets = datasets;
+    tr.params = P;
+    tr.workers = calloc(nb_threads, sizeof(Worker));
+    if (!tr.workers)
+        return 1;
+    for (k = 0; k < nb_threads; k++) {
+        if (worker_init(&tr.workers[k], &tr, k) != 0) {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+    }
+
+    for (epoch = 0; epoch < epochs; epoch++) {
+        double loss[2] = {0, 0}, val[2] = {0, 0}, reg = 0;
+        int nb_batches = nb_train / batch_size;
+        shuffle(windows, nb_train, &rng);
+        tr.offset = rng_next(&rng) % window;
+        for (i = 0; i < nb_batches; i++) {
+            double batch_loss[2] = {0, 0};
+            if (run_batch(&tr, &windows[i * batch_size], batch_size, 1, batch_loss) != 0) {
+                fprintf(stderr, "cannot start the training threads\n");
+                return 1;
+            }
+            reg += adam_step(P, tr.workers[0].grad, m, v, ++step, lr);
+            loss[0] += batch_loss[0] / ((double) batch_size * window);
+            loss[1] += batch_loss[1] / ((double) batch_size * window);
+        }
+        tr.offset = 0;
+        for (i = 0; i < nb_val; i += batch_size) {
+            if (run_batch(&tr, &windows[nb_train + i], MIN32(batch_size, nb_val - i), 0, val) != 0) {
+                fprintf(stderr, "cannot start the training threads\n");
+                return 1;
+            }
+        }
+        /* 与 Keras 的输出对应: loss = 10 * denoise_output_loss + 0.5 * vad_output_loss + 正则项 */
+        loss[0] /= nb_batches;
+        loss[1] /= nb_batches;
+        fprintf(stderr, "epoch %d/%d: loss %.5f (gains %.5f, vad %.5f)", epoch + 1, epochs,
+                GAINS_WEIGHT * loss[0] + VAD_WEIGHT * loss[1] + reg / nb_batches, loss[0], loss[1]);
+        if (nb_val > 0) {
+            val[0] /= (double) nb_val * window;
+            val[1] /= (double) nb_val * window;
+            fprintf(stderr, ", val_loss %.5f (gains %.5f, vad %.5f)", GAINS_WEIGHT * val[0] + VAD_WEIGHT * val[1],
+                    val[0], val[1]);
+        }
+        fprintf(stderr, "\n");
+        /* 每个 epoch 都写出模型, 中断时保留已有的结果 */
+        if (write_rnnn(rnnn_path, P, type) != 0 || (c_path && write_c(c_path, P, type, model_name) != 0)) {
+            fprintf(stderr, "cannot write the model\n");
+            return 1;
+        }
+    }
+    if (epochs == 0 && (write_rnnn(rnnn_path, P, type) != 0 || (c_path && write_c(c_path, P, type, model_name) != 0))) {
+        fprintf(stderr, "cannot write the model\n");
+        return 1;
+    }
+
+    for (k = 0; k < nb_threads; k++)
+        worker_free(&tr.workers[k]);
+    free(tr.workers);
+    for (k = 0; k < nb_datasets; k++)
+        munmap(datasets[k].map, datasets[k].map_size);
+    free(datasets);
+    free(windows);
+    free(P);
+    free(m);
+    free(v);
+    return 0;
+}
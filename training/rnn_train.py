@@ -15,10 +15,12 @@ from keras import losses
 from keras import regularizers
 from keras.constraints import min_max_norm
 import h5py
+import sys
 
 from keras.constraints import Constraint
 from keras import backend as K
 import numpy as np
+import rnnd
 
 #import tensorflow as tf
 #from keras.backend.tensorflow_backend import set_session
@@ -79,37 +81,116 @@ model.compile(loss=[mycost, my_crossentropy],
 
 
 batch_size = 32
-
-print('Loading data...')
-with h5py.File('training.h5', 'r') as hf:
-    all_data = hf['data'][:]
-print('done.')
-
 window_size = 2000
 
-nb_sequences = len(all_data)//window_size
-print(nb_sequences, ' sequences')
-x_train = all_data[:nb_sequences*window_size, :42]
-x_train = np.reshape(x_train, (nb_sequences, window_size, 42))
-
-y_train = np.copy(all_data[:nb_sequences*window_size, 42:64])
-y_train = np.reshape(y_train, (nb_sequences, window_size, 22))
+class WindowSequence(keras.utils.Sequence):
+    """
+    按需从 mmap 的数据集中取出 window_size 帧的窗口组成 batch, 不把整个数据集读进内存.
+    每个 epoch 结束后重新打乱窗口的顺序, 并把窗口的起点整体错开一个随机的偏移 (shuffle=False 时不变, 用于验证)
+    """
+    def __init__(self, datasets, windows, shuffle=True, seed=0):
+        self.datasets = datasets
+        self.windows = windows
+        self.shuffle = shuffle
+        self.rng = np.random.RandomState(seed)
+        self.offset = 0
+        self.order = np.arange(len(windows))
+        self.on_epoch_end()
+
+    def __len__(self):
+        return len(self.windows)//batch_size
+
+    def __getitem__(self, idx):
+        x = np.empty((batch_size, window_size, 42), dtype='float32')
+        y = np.empty((batch_size, window_size, 22), dtype='float32')
+        vad = np.empty((batch_size, window_size, 1), dtype='float32')
+        for b, w in enumerate(self.order[idx*batch_size:(idx+1)*batch_size]):
+            d, start = self.windows[w]
+            start += self.offset
+            frames = self.datasets[d][start:start+window_size]
+            x[b] = frames[:, :42]
+            y[b] = frames[:, 42:64]
+            vad[b] = frames[:, 86:87]
+        return x, [y, vad]
+
+    def on_epoch_end(self):
+        if self.shuffle:
+            self.rng.shuffle(self.order)
+            self.offset = self.rng.randint(window_size)
+
+
+def open_data(path):
+    if path.endswith('.h5'):
+        return h5py.File(path, 'r')['data']
+    return rnnd.open_dataset(path)
+
+
+def online_batches(gen):
+    """rnnoise_features.Generator 给出的 batch 直接拆成输入和两个目标, 不经过磁盘"""
+    for batch in gen:
+        a = np.asarray(batch)
+        yield a[..., :42], [a[..., 42:64], a[..., 86:87]]
+
+
+if len(sys.argv) > 1 and sys.argv[1] == '--online':
+    # python rnn_train.py --online [--noises=N] [--val=speech,noise] speech noise [rirs]: 由 C 线程在训练的同时生成数据
+    # --noises 每段最多叠加的噪声数 (1-4, 默认 1), 与 denoise_training -n 相同, 与是否给出 rirs 无关
+    # --val 验证用的语音和噪声语料, 应与训练语料不重叠; 不给出时不做验证 (同一语料上的验证结果没有意义)
+    import rnnoise_features
+    noises = 1
+    val = None
+    args = sys.argv[2:]
+    while args and args[0].startswith('--'):
+        if args[0].startswith('--noises='):
+            noises = int(args[0][len('--noises='):])
+        elif args[0].startswith('--val='):
+            val = args[0][len('--val='):].split(',')
+            if len(val) != 2:
+                raise ValueError('--val needs <speech>,<noise>')
+        else:
+            raise ValueError('unknown option ' + args[0])
+        args = args[1:]
+    if len(args) not in (2, 3):
+        print('usage: {} --online [--noises=N] [--val=<speech>,<noise>] <speech> <noise> [<rirs>]'.format(sys.argv[0]),
+              file=sys.stderr)
+        sys.exit(1)
+    rirs = args[2] if len(args) > 2 else None
+    train_gen = rnnoise_features.Generator(args[0], args[1], rirs=rirs, noises=noises,
+                                           threads=4, seed=0, batch_size=batch_size, window=window_size)
+    val_gen = None
+    if val:
+        val_gen = rnnoise_features.Generator(val[0], val[1], rirs=rirs, noises=noises,
+                                             threads=1, seed=1, batch_size=batch_size, window=window_size)
+    else:
+        print('no --val corpora given, training without validation', file=sys.stderr)
+    print('Train...')
+    # 并行在扩展内部完成, Python 生成器本身只能单线程读取
+    model.fit_generator(online_batches(train_gen),
+                        steps_per_epoch=100,
+                        epochs=120,
+                        validation_data=online_batches(val_gen) if val_gen else None,
+                        validation_steps=10 if val_gen else None,
+                        workers=1,
+                        max_queue_size=4)
+    model.save("weights.hdf5")
+    sys.exit(0)
 
-noise_train = np.copy(all_data[:nb_sequences*window_size, 64:86])
-noise_train = np.reshape(noise_train, (nb_sequences, window_size, 22))
-
-vad_train = np.copy(all_data[:nb_sequences*window_size, 86:87])
-vad_train = np.reshape(vad_train, (nb_sequences, window_size, 1))
-
-all_data = 0;
-#x_train = x_train.astype('float32')
-#y_train = y_train.astype('float32')
+print('Loading data...')
+# 可以给出多个 .h5/.rnnd/.f32 文件, 例如 denoise_training 各分片的输出
+datasets = [open_data(path) for path in (sys.argv[1:] or ['training.h5'])]
+# 每个窗口多留出 window_size 帧, 供每个 epoch 错开起点
+windows = [(d, i*window_size) for d in range(len(datasets)) for i in range(len(datasets[d])//window_size - 1)]
+nb_val = len(windows)//10
+train_seq = WindowSequence(datasets, windows[:len(windows)-nb_val])
+val_seq = WindowSequence(datasets, windows[len(windows)-nb_val:], shuffle=False)
+print('done.')
 
-print(len(x_train), 'train sequences. x shape =', x_train.shape, 'y shape = ', y_train.shape)
+print(len(windows), 'sequences of', window_size, 'frames')
 
 print('Train...')
-model.fit(x_train, [y_train, vad_train],
-          batch_size=batch_size,
-          epochs=120,
-          validation_split=0.1)
+model.fit_generator(train_seq,
+                    epochs=120,
+                    validation_data=val_seq,
+                    workers=4,
+                    max_queue_size=16)
 model.save("weights.hdf5")
@@ -0,0 +1,57 @@
+"""
+读取 denoise_training 生成的训练数据, 不把整个文件读进内存:
+.rnnd (-f rnnd / rnnd16) 为分块带索引的格式, 文件头和块的布局见 src/denoise.c;
+.f32 为每帧 87 个 float32 首尾相接的原始格式.
+open_dataset 返回 np.memmap, 形状为 (帧数, 87), 按需从磁盘读取
+"""
+
+from __future__ import print_function
+
+import struct
+import numpy as np
+
+MAGIC = b'RNNOISED'
+HEADER = struct.Struct('<8sIIIIIIQQQ')
+NB_FEATURES = 42
+NB_BANDS = 22
+DIM = NB_FEATURES + 2*NB_BANDS + 1
+
+
+def read_header(path):
+    with open(path, 'rb') as f:
+        (magic, version, dtype, dim, nb_features, nb_bands, chunk_frames,
+         frames, nb_chunks, index_offset) = HEADER.unpack(f.read(HEADER.size))
+        if magic != MAGIC or version != 1:
+            raise ValueError('%s: not an rnnd dataset' % path)
+        f.seek(index_offset)
+        index = np.frombuffer(f.read(16*nb_chunks), dtype='<u8').reshape(nb_chunks, 2)
+    return {'dtype': np.float16 if dtype == 1 else np.float32, 'dim': dim,
+            'nb_features': nb_features, 'nb_bands': nb_bands,
+            'chunk_frames': chunk_frames, 'frames': frames, 'index': index}
+
+
+def open_dataset(path):
+    if not path.endswith('.rnnd'):
+        data = np.memmap(path, dtype=np.float32, mode='r')
+        return data[:len(data)//DIM*DIM].reshape(-1, DIM)
+    h = read_header(path)
+    if h['frames'] == 0:
+        raise ValueError('%s: empty or incomplete dataset' % path)
+    # 各块在文件中连续存放, 整体映射后去掉最后一块补的0
+    first = int(h['index'][0][0])
+    data = np.memmap(path, dtype=h['dtype'], mode='r', offset=first,
+                     shape=(len(h['index'])*h['chunk_frames'], h['dim']))
+    return data[:h['frames']]
+
+
+def chunks(path):
+    """依次给出各块中的有效帧, 每次只映射一块"""
+    if not path.endswith('.rnnd'):
+        data = open_dataset(path)
+        for i in range(0, len(data), 8192):
+            yield data[i:i+8192]
+        return
+    h = read_header(path)
+    for offset, frames in h['index']:
+        yield np.memmap(path, dtype=h['dtype'], mode='r', offset=int(offset),
+                        shape=(int(frames), h['dim']))
@@ -0,0 +1,313 @@
+//
+// Python 扩展: 在后台 C 线程里直接生成训练数据 (与 denoise_training 相同的特征, 增益, 噪声能量和 VAD),
+// 按 batch 交给 Keras, 不需要先写出训练集. 编译: python setup.py build_ext --inplace
+//
+//     import numpy as np, rnnoise_features
+//     gen = rnnoise_features.Generator('speech/', 'noise.list', rirs=None, noises=1,
+//                                      threads=4, seed=0, batch_size=32, window=2000, queue=8)
+//     a = np.asarray(next(gen))   # (batch_size, window, 87) float32, 不复制
+//
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include "denoise.h"
+
+/*
+    每个线程一个 TrainGenerator (分片 k / threads), 生成整个 batch 后放进容量为 queue 的队列, 队列满时等待.
+    每个线程产生的 batch 序列只取决于种子和线程数, 但各线程的 batch 交给 Python 的先后顺序与调度有关
+*/
+typedef struct {
+    PyObject_HEAD
+    Corpus *speech;
+    Corpus *noise;
+    Corpus *rirs;
+    TrainGenerator **gens;
+    pthread_t *threads;
+    int nb_threads;
+    int started;
+    int batch_size;
+    int window;
+    float **queue;          // 环形队列, 存放已生成的 batch
+    int queue_size;
+    int head;
+    int count;
+    int running;            // 还在运行的线程数, 都退出了(内存不足)时 next 不再等待
+    atomic_int quit;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} GeneratorObject;
+
+/* 一个 batch 的数据, 通过 buffer protocol 交给 numpy, 释放时才释放内存 */
+typedef struct {
+    PyObject_HEAD
+    float *data;
+    Py_ssize_t shape[3];
+    Py_ssize_t strides[3];
+} BatchObject;
+
+typedef struct {
+    GeneratorObject *g;
+    int index;
+} WorkerArg;
+
+static void *generator_worker(void *arg) {
+    GeneratorObject *g = ((WorkerArg *) arg)->g;
+    TrainGenerator *gen = g->gens[((WorkerArg *) arg)->index];
+    size_t frames = (size_t) g->batch_size * g->window;
+    free(arg);
+    for (;;) {
+        size_t i;
+        float *buf = malloc(frames * NB_TRAIN * sizeof(float));
+        if (!buf)
+            break;
+        for (i = 0; i < frames && !atomic_load_explicit(&g->quit, memory_order_relaxed); i++)
+            train_generator_next(gen, buf + i * NB_TRAIN);
+        pthread_mutex_lock(&g->lock);
+        while (g->count == g->queue_size && !g->quit)
+            pthread_cond_wait(&g->not_full, &g->lock);
+        if (g->quit) {
+            pthread_mutex_unlock(&g->lock);
+            free(buf);
+            break;
+        }
+        g->queue[(g->head + g->count) % g->queue_size] = buf;
+        g->count++;
+        pthread_cond_signal(&g->not_empty);
+        pthread_mutex_unlock(&g->lock);
+    }
+    pthread_mutex_lock(&g->lock);
+    g->running--;
+    pthread_cond_broadcast(&g->not_empty);
+    pthread_mutex_unlock(&g->lock);
+    return NULL;
+}
+
+static void batch_dealloc(BatchObject *self) {
+    free(self->data);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+/* 不要求 format 时按字节给出一维的 buffer (itemsize 为 1), 要求时才是 (batch_size, window, 87) 的 float32 */
+static int batch_getbuffer(BatchObject *self, Py_buffer *view, int flags) {
+    if (PyBuffer_FillInfo(view, (PyObject *) self, self->data,
+                          self->shape[0] * self->strides[0], 1, flags) != 0)
+        return -1;
+    if (!(flags & PyBUF_FORMAT))
+        return 0;
+    view->itemsize = sizeof(float);
+    view->format = "f";
+    if (flags & PyBUF_ND) {
+        view->ndim = 3;
+        view->shape = self->shape;
+    }
+    if (flags & PyBUF_STRIDES)
+        view->strides = self->strides;
+    return 0;
+}
+
+static PyBufferProcs batch_as_buffer = {
+    (getbufferproc) batch_getbuffer,
+    NULL,
+};
+
+static PyTypeObject BatchType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "rnnoise_features.Batch",
+    .tp_doc = "One batch of training frames, shape (batch_size, window, 87) float32; use numpy.asarray",
+    .tp_basicsize = sizeof(BatchObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_dealloc = (destructor) batch_dealloc,
+    .tp_as_buffer = &batch_as_buffer,
+};
+
+static void generator_stop(GeneratorObject *g) {
+    int i;
+    if (g->started) {
+        pthread_mutex_lock(&g->lock);
+        atomic_store(&g->quit, 1);
+        pthread_cond_broadcast(&g->not_full);
+        pthread_mutex_unlock(&g->lock);
+        Py_BEGIN_ALLOW_THREADS
+        for (i = 0; i < g->started; i++)
+            pthread_join(g->threads[i], NULL);
+        Py_END_ALLOW_THREADS
+        g->started = 0;
+    }
+    for (i = 0; i < g->count; i++)
+        free(g->queue[(g->head + i) % g->queue_size]);
+    g->count = 0;
+}
+
+static void generator_dealloc(GeneratorObject *self) {
+    int i;
+    generator_stop(self);
+    if (self->gens) {
+        for (i = 0; i < self->nb_threads; i++)
+            if (self->gens[i])
+                train_generator_destroy(self->gens[i]);
+    }
+    if (self->speech)
+        train_corpus_free(self->speech);
+    if (self->noise)
+        train_corpus_free(self->noise);
+    if (self->rirs)
+        train_corpus_free(self->rirs);
+    free(self->gens);
+    free(self->threads);
+    free(self->queue);
+    pthread_cond_destroy(&self->not_empty);
+    pthread_cond_destroy(&self->not_full);
+    pthread_mutex_destroy(&self->lock);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static Corpus *open_corpus(const char *path) {
+    Corpus *c = train_corpus_open(path);
+    if (!c)
+        PyErr_Format(PyExc_OSError, "cannot open corpus %s", path);
+    return c;
+}
+
+static PyObject *generator_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"speech", "noise", "rirs", "noises", "threads", "seed", "batch_size", "window", "queue", NULL};
+    const char *speech, *noise, *rirs = NULL;
+    int noises = 1, threads = 4, batch_size = 32, window = 2000, queue = 8;
+    unsigned long long seed = 0;
+    GeneratorObject *g;
+    int i;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "ss|ziiKiii", kwlist, &speech, &noise, &rirs, &noises, &threads,
+                                     &seed, &batch_size, &window, &queue))
+        return NULL;
+    if (noises < 1 || threads < 1 || batch_size < 1 || window < 1 || queue < 1) {
+        PyErr_SetString(PyExc_ValueError, "noises, threads, batch_size, window and queue must be positive");
+        return NULL;
+    }
+    g = (GeneratorObject *) type->tp_alloc(type, 0);
+    if (!g)
+        return NULL;
+    pthread_mutex_init(&g->lock, NULL);
+    pthread_cond_init(&g->not_empty, NULL);
+    pthread_cond_init(&g->not_full, NULL);
+    g->nb_threads = threads;
+    g->batch_size = batch_size;
+    g->window = window;
+    g->queue_size = queue;
+    g->gens = calloc(threads, sizeof(*g->gens));
+    g->threads = calloc(threads, sizeof(*g->threads));
+    g->queue = calloc(queue, sizeof(*g->queue));
+    if (!g->gens || !g->threads || !g->queue) {
+        Py_DECREF(g);
+        return PyErr_NoMemory();
+    }
+    if (!(g->speech = open_corpus(speech)) || !(g->noise = open_corpus(noise)) || (rirs && !(g->rirs = open_corpus(rirs)))) {
+        Py_DECREF(g);
+        return NULL;
+    }
+    // 在启动线程之前创建所有的生成器, 共享的初始化只在这里做一次
+    for (i = 0; i < threads; i++) {
+        g->gens[i] = train_generator_create(g->speech, g->noise, g->rirs, noises, i, threads, seed);
+        if (!g->gens[i]) {
+            Py_DECREF(g);
+            PyErr_SetString(PyExc_ValueError, "cannot create the generator (noises must be 1-4)");
+            return NULL;
+        }
+    }
+    for (i = 0; i < threads; i++) {
+        WorkerArg *arg = malloc(sizeof(*arg));
+        // 已经启动的线程可能正在退出, running 也要在锁里修改
+        pthread_mutex_lock(&g->lock);
+        g->running++;
+        pthread_mutex_unlock(&g->lock);
+        if (!arg || (arg->g = g, arg->index = i, pthread_create(&g->threads[i], NULL, generator_worker, arg) != 0)) {
+            free(arg);
+            Py_DECREF(g);
+            PyErr_SetString(PyExc_RuntimeError, "cannot start the generator threads");
+            return NULL;
+        }
+        g->started++;
+    }
+    return (PyObject *) g;
+}
+
+static PyObject *generator_iter(PyObject *self) {
+    Py_INCREF(self);
+    return self;
+}
+
+static PyObject *generator_next(GeneratorObject *g) {
+    BatchObject *b;
+    float *data;
+    b = PyObject_New(BatchObject, &BatchType);
+    if (!b)
+        return NULL;
+    b->data = NULL;
+    Py_BEGIN_ALLOW_THREADS
+    pthread_mutex_lock(&g->lock);
+    while (g->count == 0 && g->running > 0)
+        pthread_cond_wait(&g->not_empty, &g->lock);
+    data = NULL;
+    if (g->count > 0) {
+        data = g->queue[g->head];
+        g->head = (g->head + 1) % g->queue_size;
+        g->count--;
+        pthread_cond_signal(&g->not_full);
+    }
+    pthread_mutex_unlock(&g->lock);
+    Py_END_ALLOW_THREADS
+    if (!data) {
+        // 队列空了而且所有线程都已退出, 等下去不会再有新的 batch
+        Py_DECREF(b);
+        PyErr_SetString(PyExc_MemoryError, "all generator threads have stopped");
+        return NULL;
+    }
+    b->data = data;
+    b->shape[0] = g->batch_size;
+    b->shape[1] = g->window;
+    b->shape[2] = NB_TRAIN;
+    b->strides[2] = sizeof(float);
+    b->strides[1] = NB_TRAIN * sizeof(float);
+    b->strides[0] = (Py_ssize_t) g->window * NB_TRAIN * sizeof(float);
+    return (PyObject *) b;
+}
+
+static PyTypeObject GeneratorType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "rnnoise_features.Generator",
+    .tp_doc = "Generator(speech, noise, rirs=None, noises=1, threads=4, seed=0, batch_size=32, window=2000, queue=8)\n\n"
+              "Endless iterator of training batches produced by background threads; speech, noise and rirs\n"
+              "take the same forms as denoise_training (raw/WAV file, directory or list file).",
+    .tp_basicsize = sizeof(GeneratorObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = generator_new,
+    .tp_dealloc = (destructor) generator_dealloc,
+    .tp_iter = generator_iter,
+    .tp_iternext = (iternextfunc) generator_next,
+};
+
+static struct PyModuleDef rnnoise_features_module = {
+    PyModuleDef_HEAD_INIT,
+    .m_name = "rnnoise_features",
+    .m_doc = "On-the-fly RNNoise training data",
+    .m_size = -1,
+};
+
+PyMODINIT_FUNC PyInit_rnnoise_features(void) {
+    PyObject *m;
+    if (PyType_Ready(&BatchType) < 0 || PyType_Ready(&GeneratorType) < 0)
+        return NULL;
+    m = PyModule_Create(&rnnoise_features_module);
+    if (!m)
+        return NULL;
+    Py_INCREF(&GeneratorType);
+    if (PyModule_AddObject(m, "Generator", (PyObject *) &GeneratorType) < 0) {
+        Py_DECREF(&GeneratorType);
+        Py_DECREF(m);
+        return NULL;
+    }
+    PyModule_AddIntConstant(m, "NB_TRAIN", NB_TRAIN);
+    return m;
+}
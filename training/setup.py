@@ -0,0 +1,17 @@
+"""
+编译在线生成训练数据的 Python 扩展 rnnoise_features (见 rnnoise_features.c)
+python setup.py build_ext --inplace
+"""
+
+from setuptools import setup, Extension
+
+sources = ['denoise.c', 'kiss_fft.c', 'pitch.c', 'celt_lpc.c', 'rnn.c', 'rnn_reader.c', 'rnn_binary.c',
+           'rnn_data.c', 'rnn_compiled.c']
+
+setup(name='rnnoise_features',
+      ext_modules=[Extension('rnnoise_features',
+                             sources=['rnnoise_features.c'] + ['../src/' + f for f in sources],
+                             include_dirs=['../include', '../src'],
+                             define_macros=[('TRAINING', '1'), ('RNNOISE_TRAINING_MODULE', '1')],
+                             extra_compile_args=['-O3'],
+                             libraries=['m', 'pthread'])])